@@ -0,0 +1,294 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * Defines the binary access log.
+ *
+ * The current file is mapped into memory at its full size, so logging a
+ * request is a copy into the mapping and the kernel writes it back. Paths are
+ * interned in a hash table so each one is written to a file only once.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "access_log.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "utils.h"
+
+// The number of paths remembered. Must be a power of two.
+#define PATH_TABLE_SIZE (4096)
+// The table is forgotten and paths defined again once it's this full.
+#define PATH_TABLE_MAX (PATH_TABLE_SIZE / 4 * 3)
+// Longer paths are cut short.
+#define MAX_LOGGED_PATH (1024)
+// Every file has to have room for a request with the longest path.
+#define MIN_FILE_SIZE (64 * KIBIBYTE)
+
+static_assert(sizeof(struct access_request) == 64,
+	"The access_request layout changed, update ACCESS_LOG_VERSION");
+static_assert(sizeof(struct access_path) % 8 == 0, "Entries must be aligned");
+
+struct path_slot {
+	uint64_t hash;
+	uint32_t id;
+	uint32_t len;
+	char *path;
+};
+
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static char s_log_path[PATH_MAX];
+static int s_fd = -1;
+static char *s_map = NULL;
+static uint64_t s_size = 0;
+static uint64_t s_used = 0;
+static unsigned s_keep = 0;
+static struct path_slot s_paths[PATH_TABLE_SIZE];
+static uint32_t s_path_count = 0;
+static uint32_t s_next_path_id = 1;
+
+static uint64_t hash_path(const char *s, size_t len)
+{
+	// FNV-1a
+	uint64_t hash = 14695981039346656037ull;
+	for (size_t i = 0; i < len; ++i) {
+		hash ^= (unsigned char)s[i];
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
+static void forget_paths(void)
+{
+	for (size_t i = 0; i < LEN(s_paths); ++i) free(s_paths[i].path);
+	memset(s_paths, 0, sizeof(s_paths));
+	s_path_count = 0;
+}
+
+/*
+ * Find the slot for a path, which is empty if the path hasn't been seen.
+ */
+static struct path_slot *find_path(const char *path, size_t len,
+	uint64_t hash)
+{
+	size_t i = (size_t)hash & (PATH_TABLE_SIZE - 1);
+	while (s_paths[i].path && ((s_paths[i].hash != hash) ||
+		(s_paths[i].len != len) || memcmp(s_paths[i].path, path, len)))
+	{
+		i = (i + 1) & (PATH_TABLE_SIZE - 1);
+	}
+	return s_paths + i;
+}
+
+static int start_file(void)
+{
+	s_fd = open(s_log_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+	if (s_fd == -1) {
+		const int err = errno;
+		LOG_ERROR("Failed to open access log %s: %i", s_log_path, err);
+		return err;
+	}
+	if (ftruncate(s_fd, (off_t)s_size) != 0) {
+		const int err = errno;
+		LOG_ERROR("Failed to size access log %s: %i", s_log_path, err);
+		close(s_fd);
+		s_fd = -1;
+		return err;
+	}
+	void *map = mmap(NULL, (size_t)s_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, s_fd, 0);
+	if (map == MAP_FAILED) {
+		const int err = errno;
+		LOG_ERROR("Failed to map access log %s: %i", s_log_path, err);
+		close(s_fd);
+		s_fd = -1;
+		return err;
+	}
+	s_map = map;
+
+	struct access_log_header header = {0};
+	memcpy(header.magic, ACCESS_LOG_MAGIC, sizeof(ACCESS_LOG_MAGIC));
+	header.version = ACCESS_LOG_VERSION;
+	header.start_ns = realtime_ns();
+	memcpy(s_map, &header, sizeof(header));
+	s_used = sizeof(header);
+	forget_paths();
+	s_next_path_id = 1;
+	return 0;
+}
+
+static void finish_file(void)
+{
+	if (s_fd == -1) return;
+	(void)munmap(s_map, (size_t)s_size);
+	s_map = NULL;
+	if (ftruncate(s_fd, (off_t)s_used) != 0) {
+		LOG_WARN("Failed to trim access log %s: %i", s_log_path, errno);
+	}
+	close(s_fd);
+	s_fd = -1;
+}
+
+/*
+ * Move the full file out of the way, path to path.1 to path.2 ..., and start
+ * a new one.
+ */
+static int rotate(void)
+{
+	char from[PATH_MAX + 16];
+	char to[PATH_MAX + 16];
+
+	finish_file();
+	for (unsigned i = s_keep; i > 0; --i) {
+		(void)snprintf(to, sizeof(to), "%s.%u", s_log_path, i);
+		if (i == 1) {
+			(void)snprintf(from, sizeof(from), "%s", s_log_path);
+		} else {
+			(void)snprintf(from, sizeof(from), "%s.%u", s_log_path,
+				i - 1);
+		}
+		if ((rename(from, to) != 0) && (errno != ENOENT)) {
+			LOG_WARN("Failed to rotate %s to %s: %i", from, to, errno);
+		}
+	}
+	return start_file();
+}
+
+static uint32_t saturate32(uint64_t value)
+{
+	return (value > UINT32_MAX) ? UINT32_MAX : (uint32_t)value;
+}
+
+static size_t path_entry_size(size_t len)
+{
+	return (sizeof(struct access_path) + len + 7) & ~(size_t)7;
+}
+
+int access_log_open(const char *path, uint64_t max_bytes, unsigned keep)
+{
+	if (!path || (strlen(path) >= sizeof(s_log_path))) return EINVAL;
+	if (max_bytes < MIN_FILE_SIZE) return EINVAL;
+
+	pthread_mutex_lock(&s_lock);
+	finish_file();
+	strcpy(s_log_path, path);
+	s_size = max_bytes & ~(uint64_t)7;
+	s_keep = keep;
+	const int err = start_file();
+	pthread_mutex_unlock(&s_lock);
+	if (!err) LOG_INFO("Logging requests to %s.", path);
+	return err;
+}
+
+int access_log_enabled(void)
+{
+	return s_map != NULL;
+}
+
+int access_log_request(const struct access_info *info)
+{
+	if (!s_map) return 0;
+	if (!info) return EINVAL;
+
+	const char *path = NULL;
+	size_t path_len = 0;
+	uint64_t hash = 0;
+	if (info->path && (info->path->len > 0)) {
+		path = info->path->s;
+		path_len = (size_t)info->path->len;
+		if (path_len > MAX_LOGGED_PATH) path_len = MAX_LOGGED_PATH;
+		hash = hash_path(path, path_len);
+	}
+
+	int err = 0;
+	pthread_mutex_lock(&s_lock);
+	if (!s_map) {
+		pthread_mutex_unlock(&s_lock);
+		return 0;
+	}
+	struct path_slot *slot = path ? find_path(path, path_len, hash) : NULL;
+	size_t needed = sizeof(struct access_request);
+	if (slot && !slot->path) needed += path_entry_size(path_len);
+	if (s_used + needed > s_size) {
+		err = rotate();
+		if (err) goto out;
+		// The new file has to define the path again.
+		if (path) {
+			slot = find_path(path, path_len, hash);
+			needed = sizeof(struct access_request) +
+				path_entry_size(path_len);
+		}
+	}
+
+	if (slot && !slot->path) {
+		if (s_path_count >= PATH_TABLE_MAX) {
+			forget_paths();
+			slot = find_path(path, path_len, hash);
+		}
+		char *copy = malloc(path_len);
+		if (!copy) {
+			err = ENOMEM;
+			goto out;
+		}
+		memcpy(copy, path, path_len);
+		slot->hash = hash;
+		slot->id = s_next_path_id++;
+		slot->len = (uint32_t)path_len;
+		slot->path = copy;
+		s_path_count++;
+
+		struct access_path def = {0};
+		def.type = ACCESS_PATH;
+		def.size = (uint16_t)path_entry_size(path_len);
+		def.path_id = slot->id;
+		def.len = (uint32_t)path_len;
+		memcpy(s_map + s_used, &def, sizeof(def));
+		memcpy(s_map + s_used + sizeof(def), path, path_len);
+		s_used += def.size;
+	}
+
+	struct access_request rec = {0};
+	rec.type = ACCESS_REQUEST;
+	rec.size = sizeof(rec);
+	rec.path_id = slot ? slot->id : 0;
+	rec.time_ns = info->time_ns;
+	rec.peer_addr = info->peer_addr;
+	rec.peer_port = info->peer_port;
+	rec.method = (uint8_t)info->method;
+	rec.status = (info->status > 0) && (info->status <= UINT16_MAX) ?
+		(uint16_t)info->status : 0;
+	rec.bytes_in = saturate32(info->bytes_in);
+	rec.bytes_out = info->bytes_out;
+	rec.recv_ns = saturate32(info->recv_ns);
+	rec.parse_ns = saturate32(info->parse_ns);
+	rec.handle_ns = saturate32(info->handle_ns);
+	rec.write_ns = saturate32(info->write_ns);
+	rec.total_ns = info->total_ns;
+	memcpy(s_map + s_used, &rec, sizeof(rec));
+	s_used += sizeof(rec);
+
+out:
+	if (err) {
+		LOG_ERROR("Failed to log request, access logging stopped: %i",
+			err);
+		finish_file();
+	}
+	pthread_mutex_unlock(&s_lock);
+	return err;
+}
+
+void access_log_close(void)
+{
+	pthread_mutex_lock(&s_lock);
+	finish_file();
+	forget_paths();
+	pthread_mutex_unlock(&s_lock);
+}
@@ -0,0 +1,167 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file declares the binary access log and the layout of its files, which
+ * crvr-logcat decodes.
+ *
+ * An access log file starts with an access_log_header. Entries follow it back
+ * to back, each a multiple of 8 bytes long and starting with its type and
+ * size. An entry with type ACCESS_END, which is what the unused, zeroed part
+ * of the file reads as, ends the file.
+ *
+ * Requests name their path by id rather than carrying it. The first time a
+ * path is seen in a file an ACCESS_PATH entry defining its id is written
+ * before the request. Ids are only meaningful within the file that defines
+ * them, so every file can be decoded on its own.
+ *
+ * Everything is in the byte order of the machine that wrote the log.
+ */
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <stdint.h>
+
+#include "str.h"
+
+// The magic bytes at the start of an access log file.
+#define ACCESS_LOG_MAGIC "CRVRACC"
+// The version of the access log file layout.
+#define ACCESS_LOG_VERSION 1
+
+/*
+ * The types of entries in an access log file.
+ */
+enum access_entry_type {
+	ACCESS_END,
+	ACCESS_PATH,
+	ACCESS_REQUEST,
+};
+
+/*
+ * The methods in an access_request. ACCESS_METHOD_NONE is logged for requests
+ * that couldn't be parsed.
+ */
+enum access_method {
+	ACCESS_METHOD_NONE,
+	ACCESS_METHOD_GET,
+	ACCESS_METHOD_POST,
+};
+
+/*
+ * The header at the start of an access log file.
+ */
+struct access_log_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	// When the file was started, in nanoseconds since the epoch.
+	uint64_t start_ns;
+};
+
+/*
+ * The start of every entry.
+ */
+struct access_entry {
+	uint16_t type;
+	// The bytes in the entry, including this. A multiple of 8.
+	uint16_t size;
+};
+
+/*
+ * Defines the id of a path. The path follows it, padded to 8 bytes.
+ */
+struct access_path {
+	uint16_t type;
+	uint16_t size;
+	uint32_t path_id;
+	uint32_t len;
+	uint32_t reserved;
+};
+
+/*
+ * One request.
+ */
+struct access_request {
+	uint16_t type;
+	uint16_t size;
+	// The id of the request's path, 0 if the request couldn't be parsed.
+	uint32_t path_id;
+	// When the request arrived, in nanoseconds since the epoch.
+	uint64_t time_ns;
+	// The client's IPv4 address, in network byte order.
+	uint32_t peer_addr;
+	uint16_t peer_port;
+	uint8_t method;
+	uint8_t reserved;
+	// The status crvr responded with, or 0 if it didn't respond.
+	uint16_t status;
+	uint16_t reserved2;
+	uint32_t bytes_in;
+	uint64_t bytes_out;
+	// How long each phase of the request took, in nanoseconds, saturating:
+	// reading the request, parsing it, handling it (not counting writes),
+	// and writing the response.
+	uint32_t recv_ns;
+	uint32_t parse_ns;
+	uint32_t handle_ns;
+	uint32_t write_ns;
+	// From arrival until the response was sent.
+	uint64_t total_ns;
+};
+
+/*
+ * What access_log_request records about a request.
+ */
+struct access_info {
+	uint64_t time_ns;
+	uint32_t peer_addr;
+	uint16_t peer_port;
+	enum access_method method;
+	// The path, or NULL if the request couldn't be parsed.
+	const struct str *path;
+	int status;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+	uint64_t recv_ns;
+	uint64_t parse_ns;
+	uint64_t handle_ns;
+	uint64_t write_ns;
+	uint64_t total_ns;
+};
+
+/*
+ * Start logging requests to a file. The file is truncated.
+ *
+ * When the file reaches max_bytes it is renamed to path.1, any older files
+ * move up one, path.3 to path.4 and so on, and a new file is started. The
+ * oldest files beyond keep are deleted.
+ *
+ * path - The path to the log file.
+ * max_bytes - The size of each file.
+ * keep - The number of rotated files to keep.
+ *
+ * Returns 0 if the log was opened. Otherwise returns an error code.
+ */
+int access_log_open(const char *path, uint64_t max_bytes, unsigned keep);
+
+/*
+ * Returns nonzero if requests are being logged.
+ */
+int access_log_enabled(void);
+
+/*
+ * Append a request to the access log.
+ *
+ * info - What to log about the request.
+ *
+ * Returns 0 if the request was logged or logging is off. Otherwise returns an
+ * error code, and logging is turned off.
+ */
+int access_log_request(const struct access_info *info);
+
+/*
+ * Close the access log, trimming the unused end of the file.
+ */
+void access_log_close(void);
+
+#endif // ACCESS_LOG_H
@@ -6,448 +6,1689 @@
  */
 #include "asl.h"
 
+#include <assert.h>
 #include <errno.h>
-#include <dirent.h>
+#include <pthread.h>
+#include <stdarg.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <string.h>
 #include <stdlib.h>
-#include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include "catalog.h"
+#include "iobuf.h"
+#include "log.h"
+#include "metrics.h"
+#include "module.h"
+#include "session.h"
+#include "snapshot.h"
+#include "store.h"
+#include "template.h"
+#include "timing.h"
 #include "utils.h"
+#include "websocket.h"
 
 // Indicates if a user's confidence level has been tested or not
 #define NOT_TESTED 1
+// How often idle sessions are looked for.
+#define SESSION_SWEEP_S 60
+// The most sides of cards in one quiz. Bigger decks are sampled.
+#define ASL_QUIZ_MAX 200
+// The due cards sent for a batch unless the client asks for a number.
+#define ASL_BATCH_DEFAULT 10
+// The most due cards sent, or grades taken, in one batch.
+#define ASL_BATCH_MAX 64
+// The due cards a socket message is answered with unless it asks for a
+// number: the current card, and the next so its image can be loaded early.
+#define ASL_SOCKET_DEFAULT 2
+// Room for the Link headers that preload the card images.
+#define ASL_LINKS_MAX 1024
+// Room for the Set-Cookie headers of a new session and learner.
+#define ASL_COOKIES_MAX 256
+// The cookie naming the learner, whose progress is saved across sessions.
+#define ASL_LEARNER_COOKIE "crvr_learner"
+// How long a browser keeps the learner cookie.
+#define ASL_LEARNER_MAX_AGE_S (365 * 24 * 60 * 60)
+// The most of the pool a request uses: a batch of grades too big for the
+// first read of the request is read into it.
+#define ASL_ARENA_HINT (4 * KIBIBYTE)
 
-static size_t card_count = 0;
-static struct card cards[100];
-static size_t s_cards_remaining = 0;
-static time_t s_quiz_start = 0;
-static size_t quiz_len = 0;
-static struct quiz_item quiz[LEN(cards) * 2];
-static size_t current_quiz_item = 0;
-static const char asl_file[] = "asl.html";
+// Every image under the web root. Each card has two sides, side * 2 + front.
+// Only the thread holding s_catalog_lock uses it; requests read the copy
+// published in s_cards, which is replaced whenever it changes.
+static struct catalog s_catalog = {0};
+static pthread_mutex_t s_catalog_lock = PTHREAD_MUTEX_INITIALIZER;
+// Set if s_catalog changed but there wasn't memory to publish it.
+static int s_catalog_unpublished = 0;
+static time_t s_last_sweep = 0;
+
+struct published_catalog {
+	struct snapshot_item base;
+	struct catalog cards;
+};
+static struct snapshot s_cards = {0};
+// What requests see before the catalog is published.
+static const struct catalog s_no_cards = {0};
 
 /*
- * Scan the current directory looking for image files.
- *
- * The image files will be used to build up the cards and quiz_items.
- *
- * Returns 0 if the images were loaded successfully. Otherwise returns an
- * error.
+ * A side of a card in a session's quiz.
  */
-static int find_image_files(void);
+struct asl_item {
+	uint32_t card_id;
+	uint8_t front;
+	// The times it was shown this quiz, up to UINT8_MAX.
+	uint8_t shown;
+	int32_t confidence;
+	int64_t next_review;
+};
+
+static_assert(ASL_QUIZ_MAX <= UINT16_MAX, "Quiz lengths must fit a session");
 
 /*
- * Checks the extension on the file to see if it is an image.
- *
- * Hmmm... maybe in the future check the file type on unix too?
- *
- * file - The file path to check.
- *
- * Returns nonzero if the file is a supported image type. Otherwise returns
- * an error code.
+ * A page as it was last rendered for a session, sent again while the session's
+ * quiz and the page's template are as they were.
  */
-static int is_image(const char *file);
+struct rendered_page {
+	// NULL if nothing has been rendered.
+	const struct page *page;
+	// The session's version and the template's it was rendered for.
+	uint64_t version;
+	unsigned long template;
+	char *body;
+	size_t len;
+	size_t cap;
+};
+
+/*
+ * A learner's quiz. The items are a min-heap in the order they should be
+ * shown: due before not, then those shown fewer times this quiz, then the
+ * most overdue. The root is the current card, and the quiz is done once it
+ * isn't due.
+ */
+struct asl_session {
+	struct session base;
+	// Who the saved progress is kept for. It outlives the session: it's
+	// the id of the session the learner first had, kept in a cookie of
+	// its own.
+	char learner[SESSION_ID_LEN + 1];
+	// Set if the learner was new with this session, and needs the cookie.
+	uint8_t new_learner;
+	time_t quiz_start;
+	// The cards in the catalog the quiz was started from. A request that
+	// read an older copy of the catalog, without some of them, reads it
+	// again.
+	uint32_t catalog_count;
+	// Bumped whenever anything the pages show changes.
+	uint64_t version;
+	// Answering a POST renders the next page here, so a reload after it
+	// is sent without rendering it again.
+	struct rendered_page rendered;
+	// The number of items due.
+	uint16_t remaining;
+	uint16_t len;
+	struct asl_item items[];
+};
+
+// The variables the pages can use, each written $name.
+enum asl_var {
+	ASL_VAR_CARDS,
+	ASL_VAR_FRONT,
+	ASL_VAR_BACK,
+	ASL_VAR_CARD_COUNT,
+	ASL_VARS
+};
+static const char *const s_var_names[ASL_VARS] = {
+	"cards", "front", "back", "card_count"
+};
+
+/*
+ * A page's file and its compiled template, published for requests to render
+ * and replaced by the first request to find the file changed.
+ */
+struct page {
+	const char *path;
+	struct snapshot published;
+};
+struct published_page {
+	struct snapshot_item base;
+	struct template t;
+};
+static struct page s_asl_page = {"asl.html", {0}};
+static struct page s_done_page = {"asl_done.html", {0}};
 
 /*
  * Sends the done page to the client.
  *
  * The done page is the page shown when all ASL cards have been practiced.
  *
+ * r - The request the page is for.
  * client - The client to send the page to.
+ * s - The session whose quiz is done.
+ * created - Nonzero if the session was created for this request.
  *
  * Returns 0 if the page was successfully sent to the client. Otherwise an
  * error code is returned.
  */
-static int show_done_page(int client);
+static int show_done_page(const struct catalog *cards,
+	const struct request *r, int client, struct asl_session *s,
+	int created);
 
 /*
- * Load the file in and replace variables in it. Then send the file to the
- * client. This routine only supports reading in a 4k file. And it allocates
- * enough room to add 2k of parameter data to that file.
+ * Send a page with its variables replaced by the session's values. A GET
+ * whose If-None-Match has the page's ETag is answered with 304 Not Modified
+ * without rendering it. Otherwise the page is only rendered if the session's
+ * last rendered copy isn't of it as it is now. A new session's cookie is set.
  *
- * It returns 0 on success or an errno on failure.
+ * page - The page. It is compiled again if its file changed.
+ * cards - The catalog the session's cards are in.
+ * r - The request the page is for.
+ * client - The client to send the page to.
+ * s - The session to show.
+ * created - Nonzero if the session was created for this request.
+ *
+ * Returns 0 if the page was sent. Otherwise returns an error code.
  */
-static int send_file_with_replaced_params(FILE *f, int client);
+static int send_page(struct page *page, const struct catalog *cards,
+	const struct request *r, int client, struct asl_session *s,
+	int created);
 
 /*
- * Shuffle the global deck of cards.
+ * Find the request's session, or start a new quiz in a new session if it has
+ * none. The session's shard is locked until it is released.
+ *
+ * r - The request.
+ * cards - The catalog read for the request. If the session's quiz has cards
+ *         it doesn't, it's read again.
+ * out - Set to the session.
+ * created - Set to nonzero if the session is new.
+ *
+ * Returns 0 if out is set. Otherwise returns an error code.
  */
-static void shuffle_cards(void);
+static int acquire_session(const struct request *r,
+	const struct catalog **cards, struct asl_session **out, int *created);
 
 /*
- * Replace the variables found in buf with their values.
- *
- * This function replaces application-specific parameters in the buffer.
- * The HTML file is loaded into the buffer and contains $variables. These
- * $variables will be replaced by their values in the application's memory
- * and, possibly, additional text.
+ * Find a session by its id and bring its quiz up to date with the catalog.
+ * The session's shard is locked until it is released.
  *
- * So the buffer should be large enough to store all of the application data
- * and text. That is why this function requests a buf_len and a buf_cap. The
- * buf_len is how big the HTML is before substituting the variables (how far
- * this function should scan to replace variables) and the buf_cap is the
- * maximum amount of data the buffer can hold.
+ * id - The session's id.
+ * cards - As for acquire_session.
  *
- * buf - The buffer to replace variables in.
- * buf_len - The length of the data in the buffer.
- * buf_cap - The maxium amount of data that can be stored in the buffer.
+ * Returns the session, or NULL if there isn't one with that id.
  */
-static int replace_in_buf(char *buf, size_t *buf_len, const size_t buf_cap);
+static struct asl_session *find_session(const struct str *id,
+	const struct catalog **cards);
 
 /*
- * Find all image files that we support, shuffle them and wait for the client
- * to connect.
+ * Shuffle a session's quiz.
  */
-int asl_init(void)
+static void shuffle_cards(struct asl_session *s);
+
+static void destroy_catalog(struct snapshot_item *item)
+{
+	struct published_catalog *p = (struct published_catalog*)item;
+	catalog_free(&p->cards);
+	free(p);
+}
+
+/*
+ * Publish a copy of the catalog for requests to read. Call with
+ * s_catalog_lock held.
+ */
+static int publish_catalog(void)
+{
+	struct published_catalog *p = calloc(1, sizeof(*p));
+	const int err = p ? catalog_copy(&s_catalog, &p->cards) : ENOMEM;
+	if (err) {
+		LOG_WARN("Failed to publish the changed cards: %i", err);
+		free(p);
+		s_catalog_unpublished = 1;
+		return err;
+	}
+	p->base.destroy = destroy_catalog;
+	// Handed over as the whole item, not &p->base, so -fanalyzer in
+	// optimized builds sees p itself escape and doesn't report it leaked.
+	snapshot_publish(&s_cards, (struct snapshot_item*)p);
+	s_catalog_unpublished = 0;
+	return 0;
+}
+
+/*
+ * Apply the changes to the web root's images and publish the result. If
+ * another thread already is, don't wait for it.
+ */
+static void refresh_catalog(void)
 {
-	s_quiz_start = time(NULL);
+	if (pthread_mutex_trylock(&s_catalog_lock) != 0) return;
+	if ((catalog_poll(&s_catalog) > 0) || s_catalog_unpublished) {
+		(void)publish_catalog();
+	}
+	pthread_mutex_unlock(&s_catalog_lock);
+}
 
-	if (find_image_files() != 0) {
-		fprintf(stderr, "Failed to find image files.\n");
+/*
+ * Start reading the published catalog. Call snapshot_done when done with it.
+ */
+static const struct catalog *read_catalog(void)
+{
+	const struct published_catalog *p =
+		(const struct published_catalog*)snapshot_read(&s_cards);
+	return p ? &p->cards : &s_no_cards;
+}
+
+/*
+ * Find all image files that we support, watch for more and wait for the
+ * client to connect.
+ */
+int asl_init(void)
+{
+	pthread_mutex_lock(&s_catalog_lock);
+	int err = catalog_scan(&s_catalog, ".", 0);
+	if (!err) err = publish_catalog();
+	if (err) {
+		pthread_mutex_unlock(&s_catalog_lock);
+		LOG_ERROR("Failed to find image files.");
 		return -1;
 	}
-	shuffle_cards();
+	err = catalog_watch(&s_catalog, ".");
+	pthread_mutex_unlock(&s_catalog_lock);
+	if (err) {
+		LOG_WARN("New images won't be noticed until a restart: %i",
+			err);
+	}
 	return 0;
 }
 
+int asl_load_progress(const char *name)
+{
+	// Each learner's progress is looked up as their quizzes start.
+	return store_open(name);
+}
+
+void asl_maintain(void)
+{
+	refresh_catalog();
+	(void)snapshot_reclaim();
+	const time_t now = time(NULL);
+	if (now - s_last_sweep < SESSION_SWEEP_S) return;
+	s_last_sweep = now;
+	(void)session_evict(now);
+}
+
+void asl_close(void)
+{
+	store_close();
+	session_free_all();
+	snapshot_publish(&s_asl_page.published, NULL);
+	snapshot_publish(&s_done_page.published, NULL);
+	snapshot_publish(&s_cards, NULL);
+	pthread_mutex_lock(&s_catalog_lock);
+	catalog_free(&s_catalog);
+	pthread_mutex_unlock(&s_catalog_lock);
+}
+
 /*
  * Load the ASL file, replace all the variables with their current values and
  * send data to the client.
  */
 int asl_get(struct request *r, int client)
 {
-	(void)r;
-
-	static char file_buf[MEGABYTE];
-	size_t file_len;
-	if (load_file(asl_file, file_buf, LEN(file_buf), &file_len)) {
-		fprintf(stderr, "Failed to load %s.\n", asl_file);
-		return send_404(client);
+	// Pick up images added or removed since the last request.
+	refresh_catalog();
+	const struct catalog *cards = read_catalog();
+	struct asl_session *s = NULL;
+	int created = 0;
+	int err = acquire_session(r, &cards, &s, &created);
+	if (!err) {
+		err = send_page(&s_asl_page, cards, r, client, s, created);
+		session_release(&s->base);
 	}
-	if (replace_in_buf(file_buf, &file_len, LEN(file_buf))) {
-		fprintf(stderr, "Failed to replace variables in file.\n");
+	snapshot_done();
+	if ((err != 0) && (response_stats_get()->status == 0)) {
 		return send_404(client);
 	}
-	return send_data(client, ok_header, file_buf, file_len);
+	return err;
+}
+
+static int is_due(const struct asl_session *s, const struct asl_item *c)
+{
+	return c->next_review <= s->quiz_start;
 }
 
 /*
- * Investigate the request to see which button they pressed. Then update their
- * card stats. Finally, see if the quiz is complete and, if so, send the done
- * page. Otherwise send the asl page again.
+ * Returns nonzero if a should be shown before b.
  */
-int asl_post(struct request *r, int client)
+static int shown_before(const struct asl_session *s, const struct asl_item *a,
+	const struct asl_item *b)
+{
+	const int a_due = is_due(s, a);
+	if (a_due != is_due(s, b)) return a_due;
+	if (a->shown != b->shown) return a->shown < b->shown;
+	return a->next_review < b->next_review;
+}
+
+/*
+ * Move the item at i down the heap to where it belongs.
+ */
+static void sift_down(struct asl_session *s, size_t i)
+{
+	const size_t len = s->len;
+	for (;;) {
+		size_t first = i;
+		const size_t left = 2 * i + 1;
+		const size_t right = left + 1;
+		if ((left < len) && shown_before(s, s->items + left,
+			s->items + first))
+		{
+			first = left;
+		}
+		if ((right < len) && shown_before(s, s->items + right,
+			s->items + first))
+		{
+			first = right;
+		}
+		if (first == i) return;
+		const struct asl_item tmp = s->items[i];
+		s->items[i] = s->items[first];
+		s->items[first] = tmp;
+		i = first;
+	}
+}
+
+/*
+ * Returns the card to show, or NULL if the quiz is done.
+ */
+static const struct asl_item *current_card(const struct asl_session *s)
+{
+	return (s->len && is_due(s, s->items)) ? s->items : NULL;
+}
+
+/*
+ * Put a session's items in heap order.
+ */
+static void heapify(struct asl_session *s)
 {
-	(void)client;
+	for (size_t i = s->len / 2; i-- > 0;) sift_down(s, i);
+}
 
+/*
+ * Update an item's stats from the button pressed. The heap is left for the
+ * caller to fix.
+ *
+ * Returns 0 if the item was graded, or EINVAL if the button isn't one.
+ */
+static int apply_grade(struct asl_session *s, struct asl_item *card,
+	const struct str *button)
+{
 	static const struct str poor_btn = STR("poor");
 	static const struct str good_btn = STR("good");
 	static const struct str great_btn = STR("great");
 
+	const int was_due = is_due(s, card);
+	if (str_cmp(&poor_btn, button) == 0) {
+		// Review this card again during this quiz and reduce the
+		// confidence by half.
+		card->confidence = (int32_t)((float)card->confidence * 0.5);
+	} else if (str_cmp(&good_btn, button) == 0) {
+		// Boost the confidence by 1 and review this card that many
+		// days in the future.
+		card->confidence += 1;
+		card->next_review = s->quiz_start + (SECONDS_PER_DAY *
+			card->confidence);
+	} else if (str_cmp(&great_btn, button) == 0) {
+		// Double the confidence and review the card that many days in
+		// the future. A poor grade can leave it 0, which would keep
+		// the card due forever.
+		card->confidence = ((card->confidence > 0) ? card->confidence :
+			1) * 2;
+		card->next_review = s->quiz_start + (SECONDS_PER_DAY *
+			card->confidence);
+	} else {
+		return EINVAL;
+	}
+	LOG_DEBUG("card confidence:%i review time:%ld", card->confidence,
+		(long)card->next_review);
+	if (card->shown < UINT8_MAX) card->shown++;
+	s->remaining = (uint16_t)(s->remaining - was_due + is_due(s, card));
+	LOG_DEBUG("cards remaining: %u", (unsigned)s->remaining);
+	return 0;
+}
+
+/*
+ * Update the current card's stats from the button pressed, save them and
+ * reschedule it.
+ */
+static void grade_card(const struct catalog *cards, struct asl_session *s,
+	const struct str *button)
+{
+	struct asl_item *card = s->items;
+	if (apply_grade(s, card, button) != 0) {
+		LOG_WARN("Unrecognized button value");
+		return;
+	}
+
+	// Remember the grade across restarts, a poor one included.
+	const struct store_review review = {card->confidence,
+		card->next_review};
+	const int err = store_record(s->learner, catalog_name(cards,
+		card->card_id), card->front, &review);
+	if (err && (err != EBADF)) {
+		LOG_WARN("Failed to save the review: %i", err);
+	}
+
+	sift_down(s, 0);
+	// The pages the client has are stale now.
+	++s->version;
+}
+
+/*
+ * Investigate the request to see which button they pressed. Then update their
+ * card stats. Finally, see if the quiz is complete and, if so, send the done
+ * page. Otherwise send the asl page again.
+ */
+int asl_post(struct request *r, int client)
+{
 	int err = parse_post_parameters(r);
 	if (err) {
-		fprintf(stderr, "%s> Failed to parse post params: %i\n",
-			__func__, err);
+		LOG_WARN("%s> Failed to parse post params: %i", __func__, err);
 		return err;
 	}
 
 	struct http_param button = {0};
 	if (find_post_param(r, "button", &button) != 0) {
 		// No button param!
-		perror("No button param in parameters.\n");
+		LOG_WARN("No button param in parameters.");
 		return EINVAL;
 	}
 
-	fputs("button param: ", stdout);
-	str_print(stdout, &button.key);
-	fputs(":", stdout);
-	str_print(stdout, &button.value);
-	fputs("\n", stdout);
+	LOG_DEBUG("button param: %.*s:%.*s", (int)button.key.len, button.key.s,
+		(int)button.value.len, button.value.s);
 
-	struct quiz_item *card = quiz + current_quiz_item;
-	if (str_cmp(&poor_btn, &button.value) == 0) {
-		// Review this card again during this quiz and reduce the
-		// confidence by half.
-		card->confidence = (int)((float)card->confidence * 0.5);
-	} else if (str_cmp(&good_btn, &button.value) == 0) {
-		// Boost the confidence by 1 and review this card that many
-		// days in the future.
-		card->confidence += 1;
-		card->next_review = s_quiz_start + (SECONDS_PER_DAY *
-			card->confidence);
-	} else if (str_cmp(&great_btn, &button.value) == 0) {
-		// Double the confidence and review the card that many days in
-		// the future.
-		card->confidence *= 2;
-		card->next_review = s_quiz_start + (SECONDS_PER_DAY *
-			card->confidence);
+	refresh_catalog();
+	const struct catalog *cards = read_catalog();
+	struct asl_session *s = NULL;
+	int created = 0;
+	err = acquire_session(r, &cards, &s, &created);
+	if (err) {
+		snapshot_done();
+		return err;
+	}
+	if (created) {
+		// There's no card to grade in a quiz that just started.
+		LOG_DEBUG("Graded a card without a session, starting a quiz.");
+		err = send_page(&s_asl_page, cards, r, client, s, created);
+	} else if (!current_card(s)) {
+		// The quiz is already over, there is no card to grade.
+		err = show_done_page(cards, r, client, s, created);
 	} else {
-		puts("Unrecognized button value");
-	}
-	printf("card confidence:%i review time:%lu\n", card->confidence,
-		card->next_review);
-
-	// Update cards remaining
-	s_cards_remaining = 0;
-	printf("quiz start time:%lu\n", s_quiz_start);
-	for (size_t i = 0; i < quiz_len; ++i) {
-		struct quiz_item *c = quiz + i;
-		printf("card %lu review time: %lu review:", i, c->next_review);
-		if (c->next_review <= s_quiz_start) {
-			printf("y\n");
-			s_cards_remaining++;
+		grade_card(cards, s, &button.value);
+		if (!current_card(s)) {
+			// Show done page and show score!
+			err = show_done_page(cards, r, client, s, created);
 		} else {
-			printf("n\n");
+			err = send_page(&s_asl_page, cards, r, client, s,
+				created);
 		}
 	}
-	printf("cards remaining: %lu\n", s_cards_remaining);
+	session_release(&s->base);
+	snapshot_done();
+	return err;
+}
 
-	current_quiz_item++;
-	if (current_quiz_item > quiz_len) {
-		// Show done page and show score!
-		show_done_page(client);
-	} else {
-		return asl_get(r, client);
+/*
+ * Add the header that sets a new session's cookie after the len characters
+ * already in header, and the learner's if they're new too.
+ */
+static void add_cookie(char *header, size_t cap, int len,
+	const struct asl_session *s)
+{
+	if ((len < 0) || ((size_t)len >= cap)) return;
+	len += snprintf(header + len, cap - (size_t)len,
+		"\r\nSet-Cookie: " SESSION_COOKIE "=%s; Path=/; "
+		"HttpOnly; SameSite=Lax", s->base.id);
+	if (!s->new_learner || (len < 0) || ((size_t)len >= cap)) return;
+	(void)snprintf(header + len, cap - (size_t)len,
+		"\r\nSet-Cookie: " ASL_LEARNER_COOKIE "=%s; Path=/; "
+		"Max-Age=%d; HttpOnly; SameSite=Lax", s->learner,
+		ASL_LEARNER_MAX_AGE_S);
+}
+
+/*
+ * A grade posted in a batch.
+ */
+struct asl_review {
+	// The card's id * 2 + front.
+	uint32_t side;
+	struct str grade;
+};
+
+static int is_json_space(char c)
+{
+	return (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n');
+}
+
+static void json_skip_space(struct str *j)
+{
+	while ((j->len > 0) && is_json_space(j->s[0])) {
+		++j->s;
+		--j->len;
 	}
+}
 
-	return 0;
+/*
+ * Skip any space, then take c if it's next. Returns nonzero if it was.
+ */
+static int json_take(struct str *j, char c)
+{
+	json_skip_space(j);
+	if ((j->len <= 0) || (j->s[0] != c)) return 0;
+	++j->s;
+	--j->len;
+	return 1;
 }
 
 /*
- * Create a new card entry, then create two quiz items in the quiz for the card.
- * One for the front of the card and one for the back of the card.
+ * Take a string. out is set to what's between the quotes, escapes and all.
  */
-static int found_image(char *image)
+static int json_string(struct str *j, struct str *out)
 {
-	if (card_count >= LEN(cards)) {
-		fprintf(stderr, "Out of cards: %lu/%lu\n", card_count,
-			LEN(cards));
-		return ENOBUFS;
-	}
-	// +1 because we need two spaces.
-	if (quiz_len + 1 >= LEN(quiz)) {
-		fprintf(stderr, "Out of quiz space: %lu/%lu\n", quiz_len,
-			LEN(quiz));
-		return ENOBUFS;
+	if (!json_take(j, '"')) return EINVAL;
+	for (long i = 0; i < j->len; ++i) {
+		if (j->s[i] == '\\') {
+			++i;
+		} else if (j->s[i] == '"') {
+			*out = (struct str){j->s, i};
+			j->s += i + 1;
+			j->len -= i + 1;
+			return 0;
+		}
 	}
-	strncpy(cards[card_count].file_name, image,
-		STRMAX(cards[card_count].file_name));
-	quiz[quiz_len].card_id = card_count;
-	quiz[quiz_len].front = 0;
-	quiz[quiz_len].confidence = NOT_TESTED;
-	quiz[quiz_len].next_review = s_quiz_start;
-	quiz_len++;
-	quiz[quiz_len].card_id = card_count;
-	quiz[quiz_len].front = 1;
-	quiz[quiz_len].confidence = NOT_TESTED;
-	quiz[quiz_len].next_review = s_quiz_start;
-	quiz_len++;
-	card_count++;
-
-	printf("Loaded image %s.\n", image);
+	return EINVAL;
+}
 
+/*
+ * Take a whole number that fits in 32 bits.
+ */
+static int json_uint(struct str *j, uint32_t *out)
+{
+	json_skip_space(j);
+	uint64_t value = 0;
+	long i = 0;
+	for (; (i < j->len) && (j->s[i] >= '0') && (j->s[i] <= '9'); ++i) {
+		value = value * 10 + (uint64_t)(j->s[i] - '0');
+		if (value > UINT32_MAX) return ERANGE;
+	}
+	if (i == 0) return EINVAL;
+	*out = (uint32_t)value;
+	j->s += i;
+	j->len -= i;
 	return 0;
 }
 
 /*
- * Scan all files in the current directory. Filter out directories and non
- * regular files. Then check if it is an image. If it is, add it to the
- * quiz.
+ * Take a value of any type, without looking at it.
+ */
+static int json_skip(struct str *j)
+{
+	struct str ignored;
+	json_skip_space(j);
+	if ((j->len > 0) && (j->s[0] == '"')) return json_string(j, &ignored);
+	int depth = 0;
+	while (j->len > 0) {
+		const char c = j->s[0];
+		if (c == '"') {
+			if (json_string(j, &ignored) != 0) return EINVAL;
+			continue;
+		}
+		if ((c == '{') || (c == '[')) {
+			++depth;
+		} else if ((c == '}') || (c == ']') || (c == ',')) {
+			if (depth == 0) return 0;
+			if (c != ',') --depth;
+		} else if (is_json_space(c) && (depth == 0)) {
+			return 0;
+		}
+		++j->s;
+		--j->len;
+	}
+	return (depth == 0) ? 0 : EINVAL;
+}
+
+/*
+ * Take one review, an object with the side and the grade.
  */
-static int find_image_files(void)
+static int parse_review(struct str *j, struct asl_review *review)
 {
-	DIR *cwd;
-	struct dirent *entry;
-	int result = 0;
-	struct stat stats;
+	static const struct str side_key = STR("side");
+	static const struct str grade_key = STR("grade");
 
-	cwd = opendir(".");
-	if (!cwd) {
-		perror("Failed to open current directory.");
-		return errno;
+	if (!json_take(j, '{')) return EINVAL;
+	int have_side = 0;
+	int have_grade = 0;
+	for (int first = 1; !json_take(j, '}'); first = 0) {
+		struct str key;
+		if ((!first && !json_take(j, ',')) ||
+			(json_string(j, &key) != 0) || !json_take(j, ':'))
+		{
+			return EINVAL;
+		}
+		int err = 0;
+		if (str_cmp(&key, &side_key) == 0) {
+			err = json_uint(j, &review->side);
+			have_side = 1;
+		} else if (str_cmp(&key, &grade_key) == 0) {
+			err = json_string(j, &review->grade);
+			have_grade = 1;
+		} else {
+			err = json_skip(j);
+		}
+		if (err) return err;
 	}
-	while ((entry = readdir(cwd))) {
-		if (stat(entry->d_name, &stats) != 0) {
-			fprintf(stderr, "Failed to stat %s: %i.\n",
-				entry->d_name, errno);
+	return (have_side && have_grade) ? 0 : EINVAL;
+}
+
+/*
+ * Parse a batch of reviews posted as {"reviews": [{"side": 3, "grade":
+ * "good"}, ...]}. Other members are ignored.
+ *
+ * body - The posted JSON.
+ * reviews - Set to the reviews. Room for ASL_BATCH_MAX.
+ * count - Set to the number of reviews.
+ *
+ * Returns 0 if the body was parsed. Otherwise returns EINVAL if it isn't
+ * a batch of reviews, or E2BIG if there are too many.
+ */
+static int parse_reviews(struct str body, struct asl_review *reviews,
+	size_t *count)
+{
+	static const struct str reviews_key = STR("reviews");
+
+	*count = 0;
+	if (!json_take(&body, '{')) return EINVAL;
+	for (int first = 1; !json_take(&body, '}'); first = 0) {
+		struct str key;
+		if ((!first && !json_take(&body, ',')) ||
+			(json_string(&body, &key) != 0) ||
+			!json_take(&body, ':'))
+		{
+			return EINVAL;
+		}
+		if (str_cmp(&key, &reviews_key) != 0) {
+			if (json_skip(&body) != 0) return EINVAL;
 			continue;
 		}
-		if (!S_ISREG(stats.st_mode)) {
-			printf("%s is not a regular file. Skipping.\n",
-				entry->d_name);
+		if (!json_take(&body, '[')) return EINVAL;
+		for (int first_review = 1; !json_take(&body, ']');
+			first_review = 0)
+		{
+			if (!first_review && !json_take(&body, ',')) {
+				return EINVAL;
+			}
+			if (*count >= ASL_BATCH_MAX) return E2BIG;
+			const int err = parse_review(&body, reviews + *count);
+			if (err) return err;
+			++*count;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Returns the item for a side of a card in a session's quiz, or NULL if the
+ * quiz doesn't have it.
+ */
+static struct asl_item *find_side(struct asl_session *s, uint32_t side)
+{
+	for (size_t i = 0; i < s->len; ++i) {
+		if ((s->items[i].card_id * 2u + s->items[i].front) == side) {
+			return s->items + i;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Grade the sides reviewed that are due, save them with one write and put
+ * the heap back in order with one pass, however many there were.
+ *
+ * Returns the number of reviews applied.
+ */
+static size_t grade_batch(const struct catalog *cards, struct asl_session *s,
+	const struct asl_review *reviews, size_t count)
+{
+	struct store_update updates[ASL_BATCH_MAX];
+	size_t applied = 0;
+	for (size_t i = 0; (i < count) && (applied < ASL_BATCH_MAX); ++i) {
+		struct asl_item *item = find_side(s, reviews[i].side);
+		if (!item || !is_due(s, item) ||
+			(apply_grade(s, item, &reviews[i].grade) != 0))
+		{
 			continue;
 		}
-		if (is_image(entry->d_name)) {
-			result = found_image(entry->d_name) != 0;
-			if (result != 0) {
-				fprintf(stderr, "Failed to add image.\n");
+		updates[applied++] = (struct store_update){
+			s->learner, catalog_name(cards, item->card_id),
+			item->front,
+			{item->confidence, item->next_review}
+		};
+	}
+	if (!applied) return 0;
+	heapify(s);
+	++s->version;
+	const int err = store_record_batch(updates, applied);
+	if (err && (err != EBADF)) {
+		LOG_WARN("Failed to save the reviews: %i", err);
+	}
+	return applied;
+}
+
+/*
+ * Find the next due items in the order they'd be shown, without changing
+ * the heap: the next is always the first of the children of those already
+ * taken, so there are never more than count + 1 to choose from.
+ *
+ * Returns the number of items found, up to count.
+ */
+static size_t next_due(const struct asl_session *s, size_t *due,
+	size_t count)
+{
+	size_t frontier[ASL_BATCH_MAX + 1];
+	size_t frontier_len = 0;
+	if (count > ASL_BATCH_MAX) count = ASL_BATCH_MAX;
+	if (current_card(s)) frontier[frontier_len++] = 0;
+	size_t found = 0;
+	while (frontier_len && (found < count)) {
+		size_t first = 0;
+		for (size_t i = 1; i < frontier_len; ++i) {
+			if (shown_before(s, s->items + frontier[i],
+				s->items + frontier[first]))
+			{
+				first = i;
+			}
+		}
+		const size_t item = frontier[first];
+		frontier[first] = frontier[--frontier_len];
+		due[found++] = item;
+		// Nothing under an item that isn't due is due.
+		for (size_t child = 2 * item + 1; (child <= 2 * item + 2) &&
+			(child < s->len); ++child)
+		{
+			if (is_due(s, s->items + child)) {
+				frontier[frontier_len++] = child;
 			}
+		}
+	}
+	return found;
+}
+
+/*
+ * Format text at the end of what's been written to buf.
+ */
+static int append(char *buf, size_t cap, size_t *used, const char *format,
+	...)
+{
+	va_list args;
+	va_start(args, format);
+	const int len = vsnprintf(buf + *used, cap - *used, format, args);
+	va_end(args);
+	if ((len < 0) || ((size_t)len >= cap - *used)) return ENOBUFS;
+	*used += (size_t)len;
+	return 0;
+}
+
+/*
+ * Write a string to the end of buf as a JSON string.
+ */
+static int append_json_string(char *buf, size_t cap, size_t *used,
+	const char *value)
+{
+	size_t at = *used;
+	if (at + 2 > cap) return ENOBUFS;
+	buf[at++] = '"';
+	for (const char *c = value; *c; ++c) {
+		char escaped[8] = {*c};
+		int len = 1;
+		if ((*c == '"') || (*c == '\\')) {
+			len = snprintf(escaped, sizeof(escaped), "\\%c", *c);
+		} else if ((unsigned char)*c < 0x20) {
+			len = snprintf(escaped, sizeof(escaped), "\\u%04x",
+				(unsigned)*c);
+		}
+		if (at + (size_t)len + 1 >= cap) return ENOBUFS;
+		memcpy(buf + at, escaped, (size_t)len);
+		at += (size_t)len;
+	}
+	buf[at++] = '"';
+	*used = at;
+	return 0;
+}
+
+/*
+ * Format the session's next due cards as JSON: {"version": 2, "cards": 8,
+ * "remaining": 5, "applied": 1, "due": [{"side": 3, "front": "image",
+ * "path": "cat.png"}, ...]}. front says which of the image and its path is
+ * shown first. As many cards as fit in buf are written.
+ *
+ * Returns 0 if buf is set, or ENOBUFS if not even the counts fit.
+ */
+static int format_batch(const struct catalog *cards,
+	const struct asl_session *s, size_t count, size_t applied, char *buf,
+	size_t buf_cap, size_t *out_len)
+{
+	const uint64_t start = monotonic_ns();
+	size_t used = 0;
+	// Room for the end of the array and object.
+	const size_t cap = buf_cap - 2;
+	int err = append(buf, cap, &used, "{\"version\":%lu,\"cards\":%u,"
+		"\"remaining\":%u,\"applied\":%zu,\"due\":[",
+		(unsigned long)s->version, (unsigned)s->len,
+		(unsigned)s->remaining, applied);
+	size_t due[ASL_BATCH_MAX];
+	const size_t found = err ? 0 : next_due(s, due, count);
+	for (size_t i = 0; i < found; ++i) {
+		const struct asl_item *item = s->items + due[i];
+		const size_t card_start = used;
+		int card_err = append(buf, cap, &used,
+			"%s{\"side\":%u,\"front\":\"%s\",\"path\":",
+			i ? "," : "", item->card_id * 2u + item->front,
+			item->front ? "image" : "path");
+		if (!card_err) {
+			card_err = append_json_string(buf, cap, &used,
+				catalog_name(cards, item->card_id));
+		}
+		if (!card_err) card_err = append(buf, cap, &used, "}");
+		if (card_err) {
+			// The client asks again for the rest.
+			used = card_start;
+			break;
+		}
+	}
+	if (!err) err = append(buf, buf_cap, &used, "]}");
+	timing_add(TIMING_RENDER, start);
+	if (err) LOG_ERROR("No room for the batch.");
+	*out_len = used;
+	return err;
+}
+
+/*
+ * Send the session's next due cards, formatted by format_batch.
+ */
+static int send_batch(const struct catalog *cards, int client,
+	const struct asl_session *s, int created, size_t count, size_t applied)
+{
+	char header[128 + ASL_COOKIES_MAX];
+	const int len = snprintf(header, sizeof(header), "%s\r\n"
+		"Content-Type: application/json\r\nCache-Control: no-store",
+		ok_header);
+	if (created) add_cookie(header, sizeof(header), len, s);
+
+	struct iobuf *io = iobuf_get();
+	if (!io) return ENOMEM;
+	size_t used = 0;
+	int err = format_batch(cards, s, count, applied, io->data, IOBUF_SIZE,
+		&used);
+	if (!err) err = send_data(client, header, io->data, used);
+	iobuf_put(io);
+	return err;
+}
+
+/*
+ * Returns the number of due cards a batch request asks for.
+ */
+static size_t batch_count(const struct request *r)
+{
+	struct http_param param = {0};
+	long count = ASL_BATCH_DEFAULT;
+	if ((find_query_param(r, "count", &param) == 0) &&
+		(str_to_long(&param.value, 10, &count) != 0))
+	{
+		count = ASL_BATCH_DEFAULT;
+	}
+	if (count < 1) return 1;
+	return (count > ASL_BATCH_MAX) ? ASL_BATCH_MAX : (size_t)count;
+}
+
+/*
+ * Apply a batch of reviews to the request's session, then send its next due
+ * cards.
+ */
+static int serve_batch(const struct request *r, int client,
+	const struct asl_review *reviews, size_t count)
+{
+	refresh_catalog();
+	const struct catalog *cards = read_catalog();
+	struct asl_session *s = NULL;
+	int created = 0;
+	int err = acquire_session(r, &cards, &s, &created);
+	if (!err) {
+		// A new quiz has nothing the client could have graded.
+		const size_t applied = created ? 0 : grade_batch(cards, s,
+			reviews, count);
+		err = send_batch(cards, client, s, created, batch_count(r),
+			applied);
+		session_release(&s->base);
+	}
+	snapshot_done();
+	if ((err != 0) && (response_stats_get()->status == 0)) {
+		return send_404(client);
+	}
+	return err;
+}
+
+int asl_get_batch(struct request *r, int client)
+{
+	return serve_batch(r, client, NULL, 0);
+}
+
+int asl_post_batch(struct request *r, int client)
+{
+	struct asl_review reviews[ASL_BATCH_MAX];
+	size_t count = 0;
+	const int err = parse_reviews(r->post_params_buffer, reviews, &count);
+	if (err) {
+		LOG_WARN("Failed to parse a batch of reviews: %i", err);
+		return send_data(client, "HTTP/1.1 400 Bad Request", "", 0);
+	}
+	return serve_batch(r, client, reviews, count);
+}
+
+/*
+ * A message from the quiz's page over its WebSocket.
+ */
+struct asl_message {
+	// Nonzero to grade review before answering.
+	int grade;
+	struct asl_review review;
+	// The due cards to answer with.
+	uint32_t count;
+};
+
+/*
+ * Parse a message: {"type": "next"} asks for the due cards, and {"type":
+ * "grade", "side": 3, "grade": "good"} grades one first. Either may have a
+ * "count" of due cards to answer with.
+ */
+static int parse_message(struct str j, struct asl_message *m)
+{
+	static const struct str type_key = STR("type");
+	static const struct str side_key = STR("side");
+	static const struct str grade_key = STR("grade");
+	static const struct str count_key = STR("count");
+	static const struct str next_type = STR("next");
+	static const struct str grade_type = STR("grade");
+
+	*m = (struct asl_message){0};
+	m->count = ASL_SOCKET_DEFAULT;
+	struct str type = {0};
+	int have_side = 0;
+	int have_grade = 0;
+	if (!json_take(&j, '{')) return EINVAL;
+	for (int first = 1; !json_take(&j, '}'); first = 0) {
+		struct str key;
+		if ((!first && !json_take(&j, ',')) ||
+			(json_string(&j, &key) != 0) || !json_take(&j, ':'))
+		{
+			return EINVAL;
+		}
+		int err = 0;
+		if (str_cmp(&key, &type_key) == 0) {
+			err = json_string(&j, &type);
+		} else if (str_cmp(&key, &side_key) == 0) {
+			err = json_uint(&j, &m->review.side);
+			have_side = 1;
+		} else if (str_cmp(&key, &grade_key) == 0) {
+			err = json_string(&j, &m->review.grade);
+			have_grade = 1;
+		} else if (str_cmp(&key, &count_key) == 0) {
+			err = json_uint(&j, &m->count);
 		} else {
-			printf("%s not an image.\n", entry->d_name);
+			err = json_skip(&j);
 		}
+		if (err) return err;
+	}
+	if (m->count < 1) m->count = 1;
+	if (m->count > ASL_BATCH_MAX) m->count = ASL_BATCH_MAX;
+	if (str_cmp(&type, &next_type) == 0) return 0;
+	if ((str_cmp(&type, &grade_type) != 0) || !have_side || !have_grade) {
+		return EINVAL;
+	}
+	m->grade = 1;
+	return 0;
+}
+
+/*
+ * Answer a message from the quiz's page with the due cards, in one frame.
+ */
+static int handle_message(struct websocket *ws, struct str *message)
+{
+	static const char bad_message[] = "{\"error\":\"bad message\"}";
+	static const char no_session[] = "{\"error\":\"no session\"}";
+
+	struct asl_message m;
+	if (parse_message(*message, &m) != 0) {
+		LOG_WARN("Failed to parse a quiz message.");
+		return websocket_send(ws, bad_message, STRMAX(bad_message));
 	}
-	(void)closedir(cwd);
+	refresh_catalog();
+	const struct catalog *cards = read_catalog();
+	const struct str id = {ws->context, SESSION_ID_LEN};
+	struct asl_session *s = find_session(&id, &cards);
+	if (!s) {
+		// Evicted. The page starts over with a new connection.
+		snapshot_done();
+		(void)websocket_send(ws, no_session, STRMAX(no_session));
+		return ENOENT;
+	}
+	const size_t applied = m.grade ? grade_batch(cards, s, &m.review, 1) :
+		0;
+	struct iobuf *io = iobuf_get();
+	size_t used = 0;
+	int err = io ? format_batch(cards, s, m.count, applied, io->data,
+		IOBUF_SIZE, &used) : ENOMEM;
+	session_release(&s->base);
+	snapshot_done();
+	if (!err) err = websocket_send(ws, io->data, used);
+	if (io) iobuf_put(io);
+	return err;
+}
 
-	printf("Loaded %lu/%lu cards, %lu/%lu quiz items.\n", card_count,
-		LEN(cards), quiz_len, LEN(quiz));
-	return result;
+int asl_open_socket(struct request *r, int client)
+{
+	refresh_catalog();
+	const struct catalog *cards = read_catalog();
+	struct asl_session *s = NULL;
+	int created = 0;
+	int err = acquire_session(r, &cards, &s, &created);
+	if (err) {
+		snapshot_done();
+		return send_404(client);
+	}
+	// The connection only keeps the id; the session is found again for
+	// each message, as it may be evicted in between.
+	char id[SESSION_ID_LEN + 1];
+	memcpy(id, s->base.id, sizeof(id));
+	char cookie[ASL_COOKIES_MAX] = "";
+	if (created) add_cookie(cookie, sizeof(cookie), 0, s);
+	session_release(&s->base);
+	snapshot_done();
+	return websocket_accept(client, r, cookie, handle_message, id,
+		sizeof(id));
 }
 
 /*
- * Look for certain extensions in the file name to figure out if it is an
- * image.
+ * Set the module up: find the cards, and load the saved progress unless arg
+ * is "-".
  */
-static int is_image(const char *file)
+static int init_module(const char *arg)
 {
-	char *file_types[] = {
-		".png",
-		".jpg",
-		".jpeg",
-	};
-	int match;
-	/*
-	 * Loop through every character in the file type looking for the first
-	 * character that doesn't match. If everything matched, return nonzero.
-	 */
-	const size_t name_len = strlen(file);
+	const int err = asl_init();
+	if (err) return err;
+	if (arg && (strcmp(arg, "-") != 0) && (asl_load_progress(arg) != 0)) {
+		LOG_WARN("Quiz progress won't be saved.");
+	}
+	return 0;
+}
 
-	for (size_t type = 0; type < LEN(file_types); ++type) {
-		const size_t type_len = strlen(file_types[type]);
-		if (name_len < type_len) {
-			// Not a match.
-			continue;
+static int handle_page(struct request *r, int client, struct pool *p)
+{
+	(void)p;
+	return (r->type == GET) ? asl_get(r, client) : asl_post(r, client);
+}
+
+static int handle_batch(struct request *r, int client, struct pool *p)
+{
+	(void)p;
+	return (r->type == GET) ? asl_get_batch(r, client) :
+		asl_post_batch(r, client);
+}
+
+static int handle_socket(struct request *r, int client, struct pool *p)
+{
+	(void)p;
+	return asl_open_socket(r, client);
+}
+
+static const struct module_route s_routes[] = {
+	{"asl.html", MODULE_GET | MODULE_POST, handle_page},
+	{"asl.json", MODULE_GET | MODULE_POST, handle_batch},
+	{"asl.ws", MODULE_UPGRADE, handle_socket}
+};
+
+// What crvr loads asl.so for.
+const struct module crvr_module = {
+	MODULE_ABI_VERSION, "asl", init_module, asl_maintain, asl_close,
+	s_routes, LEN(s_routes), ASL_ARENA_HINT
+};
+
+/*
+ * Load the done page, replace any variables, and send it off.
+ */
+static int show_done_page(const struct catalog *cards,
+	const struct request *r, int client, struct asl_session *s,
+	int created)
+{
+	return send_page(&s_done_page, cards, r, client, s, created);
+}
+
+/*
+ * Write a path to the end of buf as an absolute URL, percent encoding
+ * anything that can't be in one as it is.
+ */
+static int append_url(char *buf, size_t cap, size_t *used, const char *path)
+{
+	static const char hex[] = "0123456789ABCDEF";
+	size_t at = *used;
+	if (at + 1 >= cap) return ENOBUFS;
+	buf[at++] = '/';
+	for (const unsigned char *c = (const unsigned char*)path; *c; ++c) {
+		const int plain = ((*c >= 'a') && (*c <= 'z')) ||
+			((*c >= 'A') && (*c <= 'Z')) ||
+			((*c >= '0') && (*c <= '9')) || strchr("-._~/", *c);
+		if (at + (plain ? 1 : 3) >= cap) return ENOBUFS;
+		if (plain) {
+			buf[at++] = (char)*c;
+		} else {
+			buf[at++] = '%';
+			buf[at++] = hex[*c >> 4];
+			buf[at++] = hex[*c & 0xf];
 		}
-		match = 1;
-		const size_t ext_start = name_len - type_len;
-		for (size_t i = 0; (i <= type_len) && (match); ++i) {
-			if (file[ext_start + i] != file_types[type][i]) {
-				match = 0;
-			}
+	}
+	buf[at] = '\0';
+	*used = at;
+	return 0;
+}
+
+/*
+ * Write text to the end of buf with the characters HTML gives meaning to
+ * escaped, so it reads as itself in an element or a quoted attribute.
+ */
+static int append_html(char *buf, size_t cap, size_t *used, const char *text)
+{
+	size_t at = *used;
+	for (const char *c = text; *c; ++c) {
+		const char *escaped = NULL;
+		switch (*c) {
+		case '&': escaped = "&amp;"; break;
+		case '<': escaped = "&lt;"; break;
+		case '>': escaped = "&gt;"; break;
+		case '"': escaped = "&quot;"; break;
+		case '\'': escaped = "&#39;"; break;
+		default: break;
 		}
-		if (match) {
-			printf("%s matched %s.\n", file, file_types[type]);
-			return 1;
+		const size_t len = escaped ? strlen(escaped) : 1;
+		if (at + len >= cap) return ENOBUFS;
+		if (escaped) {
+			memcpy(buf + at, escaped, len);
+		} else {
+			buf[at] = *c;
 		}
+		at += len;
 	}
+	buf[at] = '\0';
+	*used = at;
 	return 0;
 }
 
+/*
+ * Format a variable's value at the end of what's been written to buf.
+ */
+static int put_value(char *buf, size_t cap, size_t *used, struct str *value,
+	const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	const int len = vsnprintf(buf + *used, cap - *used, format, args);
+	va_end(args);
+	if ((len < 0) || ((size_t)len >= cap - *used)) {
+		LOG_ERROR("No room for the value of a variable.");
+		return ENOBUFS;
+	}
+	*value = (struct str){buf + *used, len};
+	*used += (size_t)len;
+	return 0;
+}
 
 /*
- * Replace the variables found in buf with their values.
+ * Format a side of a card at the end of what's been written to buf: its image,
+ * or its name as text. The image's URL is percent encoded, which leaves
+ * nothing in it the attribute needs escaped.
  */
-static int replace_in_buf(char *buf, size_t *buf_len, const size_t buf_cap)
+static int put_side(char *buf, size_t cap, size_t *used, struct str *value,
+	int image, const char *name)
 {
-	size_t dst = 0;
-	int result = 0;
-	char *var_start;
-	struct quiz_item *card;
-	const char card_var[] = "$cards";
-	const char front_var[] = "$front";
-	const char back_var[] = "$back";
-	const char card_count_var[] = "$card_count";
+	const size_t start = *used;
+	int err = 0;
+	if (image) {
+		err = append(buf, cap, used, "<img src=\"");
+		if (!err) err = append_url(buf, cap, used, name);
+		if (!err) {
+			err = append(buf, cap, used,
+				"\" width=\"400\" height=\"400\">\n");
+		}
+	} else {
+		err = append(buf, cap, used, "<p>");
+		if (!err) err = append_html(buf, cap, used, name);
+		if (!err) err = append(buf, cap, used, "</p>\n");
+	}
+	if (err) {
+		LOG_ERROR("No room for the value of a variable.");
+		return err;
+	}
+	*value = (struct str){buf + start, (long)(*used - start)};
+	return 0;
+}
 
-	for (; (dst < *buf_len) && (*buf_len < buf_cap) && (result == 0);
-			++dst) {
-		if (buf[dst] != '$') {
-			continue;
+/*
+ * Format the variables' current values into buf.
+ */
+static int format_values(const struct catalog *cards,
+	const struct asl_session *s, char *buf, size_t cap, struct str *values)
+{
+	size_t used = 0;
+	int err = put_value(buf, cap, &used, values + ASL_VAR_CARDS, "%u",
+		(unsigned)s->len);
+	if (!err) {
+		err = put_value(buf, cap, &used, values + ASL_VAR_CARD_COUNT,
+			"%u", (unsigned)s->remaining);
+	}
+	// The done page has no current card.
+	values[ASL_VAR_FRONT] = values[ASL_VAR_BACK] = (struct str){buf, 0};
+	const struct asl_item *card = current_card(s);
+	if (!err && card) {
+		const char *name = catalog_name(cards, card->card_id);
+		err = put_side(buf, cap, &used, values + ASL_VAR_FRONT,
+			card->front, name);
+		if (!err) {
+			err = put_side(buf, cap, &used, values + ASL_VAR_BACK,
+				!card->front, name);
 		}
-		var_start = buf + dst;
-		printf("variable dst:%lu buf_len:%lu \"%.20s\"\n", dst,
-			*buf_len, var_start);
-		card = quiz + current_quiz_item;
-		if (memcmp(var_start, card_var, STRMAX(card_var)) == 0) {
-			printf("Found cards var.\n");
-			result = print_var_to(var_start, buf_len, buf_cap,
-				card_var, "%lu", quiz_len);
-		} else if (memcmp(var_start, front_var, STRMAX(front_var))
-			== 0)
-		{
-			if (card->front) {
-				result = print_var_to(var_start, buf_len,
-					buf_cap, front_var,
-					"<img src=\"%s\" width=\"400\" height=\"400\">\n",
-					cards[card->card_id].file_name);
-			} else {
-				result = print_var_to(var_start, buf_len,
-					buf_cap, front_var, "<p>%s</p>\n",
-					cards[card->card_id].file_name);
-			}
-		} else if (memcmp(var_start, back_var, STRMAX(back_var))
-			== 0)
+	}
+	return err;
+}
+
+/*
+ * Format the Link headers that preload the current card's image and the next
+ * card's, so they're fetched while the page is still on its way and cached
+ * before the learner moves on. Links that don't fit are left out.
+ */
+static void format_links(const struct catalog *cards,
+	const struct asl_session *s, char *buf, size_t cap)
+{
+	size_t due[2];
+	const size_t found = next_due(s, due, LEN(due));
+	size_t used = 0;
+	buf[0] = '\0';
+	for (size_t i = 0; i < found; ++i) {
+		const struct asl_item *item = s->items + due[i];
+		// Both sides of a card have the same image.
+		if (i && (item->card_id == s->items[due[0]].card_id)) continue;
+		const size_t link_start = used;
+		int err = append(buf, cap, &used, "%sLink: <",
+			used ? "\r\n" : "");
+		if (!err) {
+			err = append_url(buf, cap, &used, catalog_name(cards,
+				item->card_id));
+		}
+		if (!err) {
+			err = append(buf, cap, &used,
+				">; rel=preload; as=image");
+		}
+		if (err) {
+			used = link_start;
+			buf[used] = '\0';
+			break;
+		}
+	}
+}
+
+/*
+ * Returns nonzero if the client already has the page with this ETag.
+ */
+static int client_has_page(const struct request *r, const char *etag)
+{
+	struct http_param match = {0};
+	if (!r || (r->type != GET) ||
+		(find_param(r, "If-None-Match", &match) != 0))
+	{
+		return 0;
+	}
+	const struct str tag = {(char*)etag, (long)strlen(etag)};
+	return str_find_substr(&match.value, &tag) != -1;
+}
+
+static void destroy_page(struct snapshot_item *item)
+{
+	struct published_page *p = (struct published_page*)item;
+	template_free(&p->t);
+	free(p);
+}
+
+/*
+ * Start reading a page's template, compiling it again and publishing it
+ * first if its file changed. Call snapshot_done when done with it, even if
+ * this fails.
+ */
+static int read_page(struct page *page, const struct template **out)
+{
+	for (;;) {
+		struct published_page *p =
+			(struct published_page*)snapshot_read(&page->published);
+		if (p && !template_stale(&p->t, page->path)) {
+			*out = &p->t;
+			return 0;
+		}
+		struct published_page *fresh = calloc(1, sizeof(*fresh));
+		if (!fresh) return ENOMEM;
+		fresh->base.destroy = destroy_page;
+		// Keep counting, so the ETags of the old page don't match.
+		fresh->t.version = p ? p->t.version : 0;
+		const int err = template_load(&fresh->t, page->path,
+			s_var_names, ASL_VARS);
+		if (err) {
+			LOG_ERROR("Failed to load %s: %d", page->path, err);
+			free(fresh);
+			return err;
+		}
+		if (snapshot_replace(&page->published, p ? &p->base : NULL,
+			&fresh->base) != 0)
 		{
-			if (!card->front) {
-				result = print_var_to(var_start, buf_len,
-					buf_cap, back_var,
-					"<img src=\"%s\" width=\"400\" height=\"400\">\n",
-					cards[card->card_id].file_name);
-			} else {
-				result = print_var_to(var_start, buf_len,
-					buf_cap, back_var, "<p>%s</p>\n",
-					cards[card->card_id].file_name);
-			}
-		} else if (memcmp(var_start, card_count_var,
-				STRMAX(card_count_var)) == 0) {
-			result = print_var_to(var_start, buf_len, buf_cap,
-				card_count_var, "%lu", s_cards_remaining);
+			// Another request compiled it first, use theirs.
+			destroy_page(&fresh->base);
 		}
+		snapshot_done();
 	}
-	return result;
 }
 
 /*
- * Load the done page, replace any variables, and send it off.
+ * Bring the session's rendered copy of a page up to date, rendering it again
+ * unless it's of the page for the session's version and the template's
+ * already.
  */
-static int show_done_page(int client)
+static int update_rendered(const struct page *page, const struct template *t,
+	const struct catalog *cards, struct asl_session *s)
 {
-	FILE *f = fopen("asl_done.html", "r");
-	if (!f) {
-		perror("Failed to open asl_done.html file");
-		return errno;
+	struct rendered_page *c = &s->rendered;
+	const int hit = (c->page == page) && (c->version == s->version) &&
+		(c->template == t->version);
+	metrics_count_cache(hit);
+	if (hit) return 0;
+
+	struct iobuf *io = iobuf_get();
+	if (!io) return ENOMEM;
+	const uint64_t start = monotonic_ns();
+	struct str values[ASL_VARS];
+	struct iovec iov[TEMPLATE_MAX_SEGMENTS];
+	int err = format_values(cards, s, io->data, IOBUF_SIZE, values);
+	const int count = err ? 0 : template_render(t, values, iov);
+	size_t len = 0;
+	for (int i = 0; i < count; ++i) len += iov[i].iov_len;
+	c->page = NULL;
+	if (!err && (len > c->cap)) {
+		char *body = realloc(c->body, len);
+		if (body) {
+			c->body = body;
+			c->cap = len;
+		} else {
+			err = ENOMEM;
+		}
+	}
+	if (!err) {
+		c->len = 0;
+		for (int i = 0; i < count; ++i) {
+			memcpy(c->body + c->len, iov[i].iov_base,
+				iov[i].iov_len);
+			c->len += iov[i].iov_len;
+		}
+		c->page = page;
+		c->version = s->version;
+		c->template = t->version;
 	}
-	int err = send_file_with_replaced_params(f, client);
-	fclose(f);
+	timing_add(TIMING_RENDER, start);
+	iobuf_put(io);
+	if (err) LOG_ERROR("Failed to replace paramters in %s.", page->path);
 	return err;
 }
 
 /*
- * Load a file and replace any variables in it. Then send it to the
- * client.
+ * Send a page from the session's rendered copy of it. See send_page.
  */
-static int send_file_with_replaced_params(FILE *f, int client)
+static int render_page(const struct page *page, const struct template *t,
+	const struct catalog *cards, const struct request *r, int client,
+	struct asl_session *s, int created)
 {
-	/* Allocate 4KiB for the file and 2KiB for augmentation by parameter
-	 * data. */
-	char buf[4 * KIBIBYTE * 2];
+	// Different for every session, quiz state and compile of the page.
+	char etag[48];
+	(void)snprintf(etag, sizeof(etag), "\"%.8s-%lx-%lx\"", s->base.id,
+		(unsigned long)s->version, t->version);
+	char header[128 + ASL_COOKIES_MAX + ASL_LINKS_MAX];
+	if (!created && client_has_page(r, etag)) {
+		metrics_count_cache(1);
+		(void)snprintf(header, sizeof(header),
+			"HTTP/1.1 304 Not Modified\r\nETag: %s", etag);
+		return send_data(client, header, "", 0);
+	}
+	// Hint at the images before rendering, and again with the page for
+	// clients that ignore the hints.
+	char links[ASL_LINKS_MAX];
+	format_links(cards, s, links, sizeof(links));
+	int err = send_early_hints(client, r, links);
+	if (err) return err;
+	const int len = snprintf(header, sizeof(header), "%s\r\nETag: %s%s%s",
+		ok_header, etag, links[0] ? "\r\n" : "", links);
+	if (created) add_cookie(header, sizeof(header), len, s);
+
+	err = update_rendered(page, t, cards, s);
+	if (err) return err;
+	// iov[0] is for the header.
+	struct iovec iov[2] = {{0}, {s->rendered.body, s->rendered.len}};
+	return send_iov(client, header, iov, 2);
+}
+
+static int send_page(struct page *page, const struct catalog *cards,
+	const struct request *r, int client, struct asl_session *s,
+	int created)
+{
+	const struct template *t = NULL;
+	int err = read_page(page, &t);
+	if (!err) err = render_page(page, t, cards, r, client, s, created);
+	snapshot_done();
+	return err;
+}
 
-	size_t buf_used = fread(buf, 1, sizeof(buf), f);
-	if (ferror(f)) {
-		perror("Failed to read file.");
-		return EIO;
+/*
+ * Returns the number of sides of cards in a quiz.
+ */
+static size_t quiz_size(const struct catalog *cards)
+{
+	const size_t sides = cards->count * 2;
+	return (sides < ASL_QUIZ_MAX) ? sides : ASL_QUIZ_MAX;
+}
+
+/*
+ * Returns nonzero if one of the first count items is the side.
+ */
+static int has_side(const struct asl_session *s, size_t count, size_t side)
+{
+	for (size_t i = 0; i < count; ++i) {
+		if ((s->items[i].card_id * 2u + s->items[i].front) == side) {
+			return 1;
+		}
 	}
-	int result = replace_in_buf(buf, &buf_used, LEN(buf));
-	if (result != 0) {
-		perror("Failed to replace paramters in file.");
-		return result;
+	return 0;
+}
+
+/*
+ * Choose the sides of the cards the quiz is on: all of them if there are few
+ * enough, otherwise a random sample, chosen with Floyd's algorithm so each
+ * side is equally likely.
+ */
+static void choose_sides(const struct catalog *cards, struct asl_session *s)
+{
+	const size_t sides = cards->count * 2;
+	for (size_t i = 0; i < s->len; ++i) {
+		size_t side = i;
+		if (sides > s->len) {
+			const size_t j = sides - s->len + i;
+			side = (((size_t)rand() << 31) ^ (size_t)rand()) %
+				(j + 1);
+			if (has_side(s, i, side)) side = j;
+		}
+		s->items[i].card_id = (uint32_t)(side / 2);
+		s->items[i].front = (uint8_t)(side % 2);
 	}
-	return send_data(client, ok_header, buf, buf_used);
+}
+
+/*
+ * Start a quiz on the sides choose_sides picks, with the progress saved for
+ * each.
+ */
+static void start_quiz(const struct catalog *cards, struct asl_session *s,
+	time_t now)
+{
+	s->quiz_start = now;
+	s->version = 1;
+	s->catalog_count = (uint32_t)cards->count;
+	s->len = (uint16_t)quiz_size(cards);
+	choose_sides(cards, s);
+	// Cards removed since the catalog was scanned aren't quizzed on.
+	size_t kept = 0;
+	for (size_t i = 0; i < s->len; ++i) {
+		if (!catalog_removed(cards, s->items[i].card_id)) {
+			s->items[kept++] = s->items[i];
+		}
+	}
+	s->len = (uint16_t)kept;
+	for (size_t i = 0; i < s->len; ++i) {
+		struct asl_item *item = s->items + i;
+		struct store_review review;
+		if (store_lookup(s->learner, catalog_name(cards,
+			item->card_id), item->front, &review) == 0)
+		{
+			item->confidence = review.confidence;
+			item->next_review = review.next_review;
+		} else {
+			item->confidence = NOT_TESTED;
+			item->next_review = now;
+		}
+	}
+	// Shuffled so cards that are equally due come up in a random order.
+	shuffle_cards(s);
+	s->remaining = 0;
+	for (size_t i = 0; i < s->len; ++i) {
+		s->remaining = (uint16_t)(s->remaining + is_due(s, s->items + i));
+	}
+	heapify(s);
+}
+
+/*
+ * Take cards removed from the catalog off the top of a quiz.
+ */
+static void drop_removed(const struct catalog *cards, struct asl_session *s)
+{
+	const uint16_t len = s->len;
+	while (s->len && catalog_removed(cards, s->items[0].card_id)) {
+		s->remaining = (uint16_t)(s->remaining - is_due(s, s->items));
+		s->items[0] = s->items[--s->len];
+		sift_down(s, 0);
+	}
+	if (s->len != len) ++s->version;
+}
+
+static void destroy_session(struct session *s)
+{
+	free(((struct asl_session*)s)->rendered.body);
+}
+
+static struct asl_session *find_session(const struct str *id,
+	const struct catalog **cards)
+{
+	struct asl_session *s = (struct asl_session*)session_acquire(id,
+		time(NULL));
+	if (!s) return NULL;
+	if (s->catalog_count > (*cards)->count) {
+		// Started from a newer catalog than this request read.
+		snapshot_done();
+		*cards = read_catalog();
+	}
+	drop_removed(*cards, s);
+	return s;
+}
+
+/*
+ * Returns nonzero if id could be a learner's id: as many lowercase hex digits
+ * as a session id.
+ */
+static int is_learner_id(const struct str *id)
+{
+	if (id->len != SESSION_ID_LEN) return 0;
+	for (long i = 0; i < id->len; ++i) {
+		const char c = id->s[i];
+		const int hex = ((c >= '0') && (c <= '9')) ||
+			((c >= 'a') && (c <= 'f'));
+		if (!hex) return 0;
+	}
+	return 1;
+}
+
+/*
+ * Set a new session's learner from the request's cookie, or make it a new
+ * learner named by the session's id.
+ */
+static void set_learner(const struct request *r, struct asl_session *s)
+{
+	struct str id;
+	if ((session_find_cookie(r, ASL_LEARNER_COOKIE, &id) == 0) &&
+		is_learner_id(&id))
+	{
+		memcpy(s->learner, id.s, SESSION_ID_LEN);
+		s->learner[SESSION_ID_LEN] = '\0';
+		s->new_learner = 0;
+	} else {
+		memcpy(s->learner, s->base.id, sizeof(s->learner));
+		s->new_learner = 1;
+	}
+}
+
+static int acquire_session(const struct request *r,
+	const struct catalog **cards, struct asl_session **out, int *created)
+{
+	struct str id;
+	*out = NULL;
+	if (session_find_cookie(r, SESSION_COOKIE, &id) == 0) {
+		*out = find_session(&id, cards);
+	}
+	*created = !*out;
+	if (*out) return 0;
+
+	const time_t now = time(NULL);
+	struct session *s = NULL;
+	const int err = session_create(sizeof(struct asl_session) +
+		quiz_size(*cards) * sizeof(struct asl_item), now, &s);
+	if (err) {
+		LOG_ERROR("Failed to create a session: %i", err);
+		return err;
+	}
+	s->destroy = destroy_session;
+	set_learner(r, (struct asl_session*)s);
+	start_quiz(*cards, (struct asl_session*)s, now);
+	LOG_DEBUG("Started a quiz in session %s.", s->id);
+	*out = (struct asl_session*)s;
+	return 0;
 }
 
 /*
  * This routine just does a basic random swap. I didn't think very hard
  * about this.
  */
-static void shuffle_cards(void)
+static void shuffle_cards(struct asl_session *s)
 {
-	for (size_t i = 0; i < quiz_len; ++i) {
-		size_t new_pos = ((size_t)rand()) % quiz_len;
+	for (size_t i = 0; i < s->len; ++i) {
+		size_t new_pos = ((size_t)rand()) % s->len;
 		if (new_pos == i)
 			continue;
-		struct quiz_item tmp = quiz[i];
-		quiz[i] = quiz[new_pos];
-		quiz[new_pos] = tmp;
+		struct asl_item tmp = s->items[i];
+		s->items[i] = s->items[new_pos];
+		s->items[new_pos] = tmp;
 	}
 }
@@ -2,7 +2,8 @@
  * Copyright (C) 2023 Joseph M Vrba
  *
  * This file contains structures and function declarations for the American
- * Sign Language web application for crvr.
+ * Sign Language web application for crvr. It's built as asl.so, a module
+ * whose crvr_module mounts asl.html, asl.json and asl.ws.
  */
 #ifndef ASL_H
 #define ASL_H
@@ -13,33 +14,36 @@
 #include <time.h>
 
 /*
- * The card represents an object with a front and back. Right now it only
- * supports that one side is an image and the other side is the text of
- * that image.
+ * Initialize the ASL application.
+ *
+ * Returns 0 if the application initialized successfully. Otherwise returns an
+ * error code.
  */
-struct card {
-	char file_name[FILENAME_MAX];
-};
+int asl_init(void);
 
 /*
- * The quiz_item is an entry in the quiz, which corresponds to a card and
- * whether the front or back of the card is shown first. Users are quizzed
- * on both sides of the card, so there are two quiz_items per card.
+ * Open the review store. Quizzes started from then on begin with the progress
+ * saved in it, and grades are saved to it.
+ *
+ * name - The path of the store's files, without their extensions.
+ *
+ * Returns 0 if the store was opened. Otherwise returns an error code, and
+ * progress isn't saved.
  */
-struct quiz_item {
-	size_t card_id;
-	int front;
-	int confidence;
-	time_t next_review;
-};
+int asl_load_progress(const char *name);
 
 /*
- * Initialize the ASL application.
- *
- * Returns 0 if the application initialized successfully. Otherwise returns an
- * error code.
+ * Pick up images added to or removed from the web root, and evict the
+ * sessions of learners who have left. Call it regularly; it only looks for
+ * idle sessions once a minute.
  */
-int asl_init(void);
+void asl_maintain(void);
+
+/*
+ * Save the quiz's progress and close the review store, if it's open, then
+ * free every session.
+ */
+void asl_close(void);
 
 /*
  * Read the file into the buffer, but swap out the variables with the current
@@ -57,4 +61,38 @@ int asl_get(struct request *r, int client);
  */
 int asl_post(struct request *r, int client);
 
+/*
+ * Send the next cards due in the request's quiz as JSON, so a client can show
+ * several of them without a request each. The query's count says how many.
+ *
+ * r - The request.
+ * client - The client to send them to.
+ *
+ * Returns 0 if the cards were sent, and an error code if it fails.
+ */
+int asl_get_batch(struct request *r, int client);
+
+/*
+ * Grade a batch of cards posted as JSON in one pass, then send the next cards
+ * due as asl_get_batch does.
+ *
+ * r - The request, with the reviews as its body.
+ * client - The client to respond to.
+ *
+ * Returns 0 if the post was handled, and an error code if it fails.
+ */
+int asl_post_batch(struct request *r, int client);
+
+/*
+ * Take a request to upgrade to a WebSocket over, so the quiz's page can ask
+ * for cards and grade them with a message each instead of a page load. The
+ * messages are described in README.txt.
+ *
+ * r - The request to upgrade.
+ * client - The client asking. Once upgraded, it's closed with the WebSocket.
+ *
+ * Returns 0 if the request was answered, and an error code if it fails.
+ */
+int asl_open_socket(struct request *r, int client);
+
 #endif // ASL_H
@@ -1,4 +1,8 @@
+// The pool maps its memory with mmap, which needs this for MAP_ANONYMOUS.
+#define _DEFAULT_SOURCE
 #define DEFINE_POOL // Bring in the definitions for the pool functions.
 #include "pool.h"
 #define DEFINE_STR // Bring in the definitions for the str.
 #include "str.h"
+#define DEFINE_HIST // Bring in the definitions for the histogram.
+#include "hist.h"
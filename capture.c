@@ -0,0 +1,116 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * Defines the routines for capturing requests to a file.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "capture.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "log.h"
+#include "utils.h"
+
+// Requests are buffered so capturing doesn't cost a write per request.
+#define CAPTURE_BUFFER (256 * KIBIBYTE)
+
+static FILE *s_capture = NULL;
+static uint64_t s_capture_start = 0;
+static char s_capture_buffer[CAPTURE_BUFFER];
+
+static uint64_t clock_ns(clockid_t clock)
+{
+	struct timespec ts;
+	(void)clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+int capture_open(const char *path)
+{
+	if (!path) return EINVAL;
+	if (s_capture) capture_close();
+
+	s_capture = fopen(path, "wb");
+	if (!s_capture) {
+		int err = errno;
+		LOG_ERROR("Failed to open capture file %s: %i", path, err);
+		return err;
+	}
+	(void)setvbuf(s_capture, s_capture_buffer, _IOFBF,
+		sizeof(s_capture_buffer));
+
+	struct capture_file_header header = {0};
+	memcpy(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC));
+	header.version = CAPTURE_VERSION;
+	header.start_ns = clock_ns(CLOCK_REALTIME);
+	if (fwrite(&header, sizeof(header), 1, s_capture) != 1) {
+		int err = errno;
+		LOG_ERROR("Failed to write capture header: %i", err);
+		capture_close();
+		return err;
+	}
+	s_capture_start = capture_now();
+	LOG_INFO("Capturing requests to %s.", path);
+	return 0;
+}
+
+int capture_enabled(void)
+{
+	return s_capture != NULL;
+}
+
+uint64_t capture_now(void)
+{
+	return clock_ns(CLOCK_MONOTONIC);
+}
+
+int capture_request(uint64_t arrival_ns, const struct str *parts,
+	size_t part_count, int status, uint64_t response_bytes)
+{
+	if (!s_capture) return 0;
+	if (!parts && (part_count > 0)) return EINVAL;
+
+	struct capture_record record = {0};
+	uint64_t len = 0;
+	for (size_t i = 0; i < part_count; ++i) {
+		if (parts[i].len > 0) len += (uint64_t)parts[i].len;
+	}
+	if (len > UINT32_MAX) return EFBIG;
+
+	record.offset_ns = (arrival_ns > s_capture_start) ?
+		arrival_ns - s_capture_start : 0;
+	record.response_bytes = response_bytes;
+	record.request_len = (uint32_t)len;
+	record.status = (status > 0) && (status <= UINT16_MAX) ?
+		(uint16_t)status : 0;
+
+	int err = 0;
+	if (fwrite(&record, sizeof(record), 1, s_capture) != 1) err = errno;
+	for (size_t i = 0; !err && (i < part_count); ++i) {
+		if (parts[i].len <= 0) continue;
+		if (fwrite(parts[i].s, 1, (size_t)parts[i].len, s_capture) !=
+			(size_t)parts[i].len)
+		{
+			err = errno;
+		}
+	}
+	if (err) {
+		LOG_ERROR("Failed to capture request, capturing stopped: %i",
+			err);
+		capture_close();
+	}
+	return err;
+}
+
+void capture_close(void)
+{
+	if (!s_capture) return;
+	if (fclose(s_capture) != 0) {
+		LOG_ERROR("Failed to close capture file: %i", errno);
+	}
+	s_capture = NULL;
+}
@@ -0,0 +1,94 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file declares the routines for capturing the requests crvr receives to
+ * a file so they can be replayed against a server later with crvr-replay.
+ *
+ * A capture file starts with a capture_file_header. It is followed by one
+ * capture_record per request, each followed by the raw bytes of the request.
+ * Everything is in the byte order of the machine that did the capture.
+ */
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "str.h"
+
+// The magic bytes at the start of a capture file.
+#define CAPTURE_MAGIC "CRVRCAP"
+// The version of the capture file layout.
+#define CAPTURE_VERSION 1
+
+/*
+ * The header at the start of a capture file.
+ */
+struct capture_file_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+	// When the capture started, in nanoseconds since the epoch.
+	uint64_t start_ns;
+};
+
+/*
+ * The header in front of every request in a capture file.
+ */
+struct capture_record {
+	// When the request arrived, in nanoseconds since the capture started.
+	uint64_t offset_ns;
+	// The bytes crvr sent back, header and content.
+	uint64_t response_bytes;
+	// The number of request bytes following this record.
+	uint32_t request_len;
+	// The status crvr responded with, or 0 if it didn't respond.
+	uint16_t status;
+	uint16_t reserved;
+};
+
+/*
+ * Start capturing requests to a file. The file is truncated.
+ *
+ * path - The path to the capture file.
+ *
+ * Returns 0 if the file was opened and requests will be captured. Otherwise
+ * returns an error code.
+ */
+int capture_open(const char *path);
+
+/*
+ * Returns nonzero if requests are being captured.
+ */
+int capture_enabled(void);
+
+/*
+ * Get the current time to pass to capture_request as the arrival time.
+ *
+ * Returns the monotonic time in nanoseconds.
+ */
+uint64_t capture_now(void);
+
+/*
+ * Append a request to the capture file. The request may have been read in
+ * more than one piece, like a POST whose body came after its header, so it is
+ * given as a list of parts that are written one after the other.
+ *
+ * arrival_ns - When the request arrived, from capture_now.
+ * parts - The pieces of the raw request.
+ * part_count - The number of pieces in parts.
+ * status - The status of the response, 0 if none was sent.
+ * response_bytes - The number of bytes sent in response.
+ *
+ * Returns 0 if the request was captured or capturing is off. Otherwise returns
+ * an error code, and capturing is turned off.
+ */
+int capture_request(uint64_t arrival_ns, const struct str *parts,
+	size_t part_count, int status, uint64_t response_bytes);
+
+/*
+ * Flush and close the capture file.
+ */
+void capture_close(void);
+
+#endif // CAPTURE_H
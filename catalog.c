@@ -0,0 +1,845 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * Defines the card catalog.
+ *
+ * Each thread collects what it finds into a catalog of its own, so the only
+ * thing the threads share is the directory queue. A directory is counted as
+ * pending from when it's queued until it has been read, so the threads know
+ * the scan is over when nothing is queued and nothing is pending.
+ *
+ * The watcher is polled from the thread that serves requests, so the catalog
+ * is never changed while a request is reading it.
+ */
+#define _DEFAULT_SOURCE
+
+#include "catalog.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if LINUX
+#include <sys/inotify.h>
+#endif
+
+#include "log.h"
+#include "utils.h"
+
+// The most threads a scan uses.
+#define CATALOG_MAX_THREADS 16
+
+/*
+ * What the threads of a scan share.
+ */
+struct scan {
+	pthread_mutex_t lock;
+	pthread_cond_t wake;
+	// The directories waiting to be read, relative to the root.
+	char **dirs;
+	size_t dir_count;
+	size_t dir_cap;
+	// Directories queued or being read.
+	size_t pending;
+	size_t dirs_read;
+	int root;
+	int err;
+};
+
+struct worker {
+	struct scan *scan;
+	pthread_t thread;
+	struct catalog found;
+};
+
+/*
+ * The memory names or offsets are in, which copies of a catalog share. Both
+ * are only appended to, so the catalog can keep adding to memory its copies
+ * read, past where they stop; anything a copy can see is copied before it's
+ * changed.
+ */
+struct catalog_block {
+	atomic_size_t refs;
+	_Alignas(max_align_t) unsigned char data[];
+};
+
+/*
+ * Let go of a block, freeing it if nothing else has it.
+ */
+static void block_release(struct catalog_block *b)
+{
+	if (b && (atomic_fetch_sub(&b->refs, 1) == 1)) free(b);
+}
+
+/*
+ * Make room for size bytes in a block holding used. A block copies share is
+ * left to them and a new one allocated.
+ *
+ * Returns 0 if there's room. Otherwise returns an error code and the block
+ * is unchanged.
+ */
+static int block_grow(struct catalog_block **block, size_t used, size_t size)
+{
+	struct catalog_block *old = *block;
+	struct catalog_block *b;
+	if (old && (atomic_load(&old->refs) == 1)) {
+		b = realloc(old, sizeof(*b) + size);
+		if (!b) return ENOMEM;
+	} else {
+		b = malloc(sizeof(*b) + size);
+		if (!b) return ENOMEM;
+		atomic_init(&b->refs, 1);
+		if (old) memcpy(b->data, old->data, used);
+		block_release(old);
+	}
+	*block = b;
+	return 0;
+}
+
+/*
+ * Returns a block, now shared by one more catalog.
+ */
+static struct catalog_block *block_share(struct catalog_block *b)
+{
+	if (b) (void)atomic_fetch_add(&b->refs, 1);
+	return b;
+}
+
+// The names being sorted, for compare_names.
+static const char *s_sort_names = NULL;
+
+/*
+ * Look for certain extensions in the file name to figure out if it is an
+ * image.
+ */
+static int is_image(const char *file, size_t name_len)
+{
+	static const char *const file_types[] = {
+		".png",
+		".jpg",
+		".jpeg",
+	};
+	for (size_t type = 0; type < LEN(file_types); ++type) {
+		const size_t type_len = strlen(file_types[type]);
+		if ((name_len >= type_len) && (memcmp(file + name_len -
+			type_len, file_types[type], type_len) == 0))
+		{
+			return 1;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Join a directory's path and an entry's name. The caller frees the path.
+ */
+static char *join_path(const char *dir, const char *name, size_t *len)
+{
+	const size_t dir_len = strlen(dir);
+	const size_t name_len = strlen(name);
+	*len = dir_len + (dir_len ? 1 : 0) + name_len;
+	if (*len >= PATH_MAX) return NULL;
+	char *path = malloc(*len + 1);
+	if (!path) return NULL;
+	memcpy(path, dir, dir_len);
+	if (dir_len) path[dir_len] = '/';
+	memcpy(path + *len - name_len, name, name_len + 1);
+	return path;
+}
+
+/*
+ * Queue a directory to be read. Takes ownership of path.
+ */
+static int queue_dir(struct scan *scan, char *path)
+{
+	pthread_mutex_lock(&scan->lock);
+	int err = 0;
+	if (scan->dir_count == scan->dir_cap) {
+		const size_t cap = scan->dir_cap ? scan->dir_cap * 2 : 64;
+		char **dirs = realloc(scan->dirs, cap * sizeof(*dirs));
+		if (dirs) {
+			scan->dirs = dirs;
+			scan->dir_cap = cap;
+		} else {
+			err = ENOMEM;
+		}
+	}
+	if (!err) {
+		scan->dirs[scan->dir_count++] = path;
+		++scan->pending;
+		pthread_cond_signal(&scan->wake);
+	}
+	pthread_mutex_unlock(&scan->lock);
+	if (err) free(path);
+	return err;
+}
+
+/*
+ * Append a card to a catalog, without indexing it.
+ */
+static int add_card(struct catalog *c, const char *path, size_t len)
+{
+	if (c->names_len + len + 1 >= CATALOG_REMOVED) return E2BIG;
+	if (c->count == c->cap) {
+		const size_t cap = c->cap ? c->cap * 2 : 1024;
+		if (block_grow(&c->offsets_block, c->count *
+			sizeof(*c->offsets), cap * sizeof(*c->offsets)))
+		{
+			return ENOMEM;
+		}
+		c->offsets = (void*)c->offsets_block->data;
+		c->cap = cap;
+	}
+	if (c->names_len + len + 1 > c->names_cap) {
+		size_t cap = c->names_cap ? c->names_cap : 64 * KIBIBYTE;
+		while (c->names_len + len + 1 > cap) cap *= 2;
+		if (block_grow(&c->names_block, c->names_len, cap)) {
+			return ENOMEM;
+		}
+		c->names = (char*)c->names_block->data;
+		c->names_cap = cap;
+	}
+	c->offsets[c->count++] = (uint32_t)c->names_len;
+	memcpy(c->names + c->names_len, path, len + 1);
+	c->names_len += len + 1;
+	return 0;
+}
+
+/*
+ * Read one directory, queueing its subdirectories and adding its images.
+ */
+static int scan_dir(struct worker *w, const char *dir)
+{
+	const int fd = openat(w->scan->root, dir[0] ? dir : ".",
+		O_RDONLY | O_DIRECTORY);
+	DIR *d = (fd == -1) ? NULL : fdopendir(fd);
+	if (!d) {
+		LOG_WARN("Failed to open directory %s: %i", dir[0] ? dir : ".",
+			errno);
+		if (fd != -1) close(fd);
+		return 0;
+	}
+	int err = 0;
+	struct dirent *entry;
+	while (!err && (entry = readdir(d))) {
+		const char *name = entry->d_name;
+		if (name[0] == '.') continue;
+		int is_dir = entry->d_type == DT_DIR;
+		int is_file = entry->d_type == DT_REG;
+		if ((entry->d_type == DT_UNKNOWN) || (entry->d_type == DT_LNK)) {
+			struct stat st;
+			if (fstatat(dirfd(d), name, &st, 0) != 0) continue;
+			// Following a link to a directory could loop.
+			is_dir = S_ISDIR(st.st_mode) &&
+				(entry->d_type == DT_UNKNOWN);
+			is_file = S_ISREG(st.st_mode);
+		}
+		const size_t name_len = strlen(name);
+		if (!is_dir && !(is_file && is_image(name, name_len))) {
+			continue;
+		}
+		size_t len = 0;
+		char *path = join_path(dir, name, &len);
+		if (!path) {
+			LOG_WARN("Skipping %s/%s, its path is too long.", dir,
+				name);
+			continue;
+		}
+		if (is_dir) {
+			err = queue_dir(w->scan, path);
+		} else {
+			err = add_card(&w->found, path, len);
+			free(path);
+		}
+	}
+	(void)closedir(d);
+	return err;
+}
+
+static void *scan_thread(void *arg)
+{
+	struct worker *w = arg;
+	struct scan *scan = w->scan;
+	pthread_mutex_lock(&scan->lock);
+	for (;;) {
+		while (!scan->dir_count && scan->pending && !scan->err) {
+			pthread_cond_wait(&scan->wake, &scan->lock);
+		}
+		if (!scan->dir_count || scan->err) break;
+		char *dir = scan->dirs[--scan->dir_count];
+		pthread_mutex_unlock(&scan->lock);
+
+		const int err = scan_dir(w, dir);
+		free(dir);
+
+		pthread_mutex_lock(&scan->lock);
+		if (err && !scan->err) scan->err = err;
+		++scan->dirs_read;
+		if ((--scan->pending == 0) || scan->err) {
+			pthread_cond_broadcast(&scan->wake);
+		}
+	}
+	pthread_mutex_unlock(&scan->lock);
+	return NULL;
+}
+
+static uint64_t hash_name(const char *name)
+{
+	uint64_t hash = 14695981039346656037u;
+	for (; *name; ++name) {
+		hash = (hash ^ (unsigned char)*name) * 1099511628211u;
+	}
+	return hash;
+}
+
+/*
+ * Find a path's slot in the index. Returns an empty slot if it isn't there.
+ */
+static uint32_t *index_slot(const struct catalog *c, const char *path)
+{
+	for (size_t i = (size_t)hash_name(path);; ++i) {
+		uint32_t *slot = c->index + (i & (c->index_cap - 1));
+		if (!*slot || (strcmp(catalog_name(c, *slot - 1), path) == 0)) {
+			return slot;
+		}
+	}
+}
+
+/*
+ * Index every card, in a table at most half full.
+ */
+static int build_index(struct catalog *c)
+{
+	size_t cap = 1024;
+	while (cap < c->count * 2) cap *= 2;
+	uint32_t *index = calloc(cap, sizeof(*index));
+	if (!index) return ENOMEM;
+	free(c->index);
+	c->index = index;
+	c->index_cap = cap;
+	for (size_t i = 0; i < c->count; ++i) {
+		*index_slot(c, catalog_name(c, i)) = (uint32_t)i + 1;
+	}
+	return 0;
+}
+
+static int compare_names(const void *a, const void *b)
+{
+	return strcmp(s_sort_names + *(const uint32_t*)a,
+		s_sort_names + *(const uint32_t*)b);
+}
+
+/*
+ * Combine what the threads found into one sorted catalog.
+ */
+static int merge(struct catalog *c, struct worker *workers, int count)
+{
+	size_t total = 0;
+	size_t names_len = 0;
+	for (int i = 0; i < count; ++i) {
+		total += workers[i].found.count;
+		names_len += workers[i].found.names_len;
+	}
+	if (names_len > UINT32_MAX) return E2BIG;
+	c->names_cap = names_len ? names_len : 1;
+	c->cap = total ? total : 1;
+	if (block_grow(&c->names_block, 0, c->names_cap) ||
+		block_grow(&c->offsets_block, 0, c->cap * sizeof(*c->offsets)))
+	{
+		return ENOMEM;
+	}
+	c->names = (char*)c->names_block->data;
+	c->offsets = (void*)c->offsets_block->data;
+	for (int i = 0; i < count; ++i) {
+		const struct catalog *found = &workers[i].found;
+		memcpy(c->names + c->names_len, found->names,
+			found->names_len);
+		for (size_t j = 0; j < found->count; ++j) {
+			c->offsets[c->count++] = (uint32_t)(c->names_len +
+				found->offsets[j]);
+		}
+		c->names_len += found->names_len;
+	}
+	s_sort_names = c->names;
+	qsort(c->offsets, c->count, sizeof(*c->offsets), compare_names);
+	s_sort_names = NULL;
+	return build_index(c);
+}
+
+int catalog_scan(struct catalog *c, const char *root, int threads)
+{
+	if (!c || !root || (threads < 0)) return EINVAL;
+	catalog_free(c);
+	if (threads == 0) {
+		const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		threads = (cpus > 0) ? (int)cpus : 1;
+	}
+	if (threads > CATALOG_MAX_THREADS) threads = CATALOG_MAX_THREADS;
+
+	const uint64_t start = monotonic_ns();
+	struct scan scan = {.root = open(root, O_RDONLY | O_DIRECTORY)};
+	if (scan.root == -1) return errno;
+	(void)pthread_mutex_init(&scan.lock, NULL);
+	(void)pthread_cond_init(&scan.wake, NULL);
+	struct worker workers[CATALOG_MAX_THREADS] = {0};
+	char *top = calloc(1, 1);
+	int err = top ? queue_dir(&scan, top) : ENOMEM;
+
+	// The threads are only for the scan, so keep signals for the server.
+	sigset_t all;
+	sigset_t old;
+	(void)sigfillset(&all);
+	(void)pthread_sigmask(SIG_BLOCK, &all, &old);
+	int started = 0;
+	for (; !err && (started < threads); ++started) {
+		workers[started].scan = &scan;
+		err = pthread_create(&workers[started].thread, NULL,
+			scan_thread, workers + started);
+		if (err) {
+			pthread_mutex_lock(&scan.lock);
+			scan.err = err;
+			pthread_cond_broadcast(&scan.wake);
+			pthread_mutex_unlock(&scan.lock);
+			break;
+		}
+	}
+	(void)pthread_sigmask(SIG_SETMASK, &old, NULL);
+	for (int i = 0; i < started; ++i) {
+		(void)pthread_join(workers[i].thread, NULL);
+	}
+
+	if (!err) err = scan.err;
+	if (!err) err = merge(c, workers, started);
+	for (int i = 0; i < started; ++i) catalog_free(&workers[i].found);
+	for (size_t i = 0; i < scan.dir_count; ++i) free(scan.dirs[i]);
+	free(scan.dirs);
+	(void)pthread_cond_destroy(&scan.wake);
+	(void)pthread_mutex_destroy(&scan.lock);
+	close(scan.root);
+	if (err) {
+		LOG_ERROR("Failed to scan %s for cards: %i", root, err);
+		catalog_free(c);
+		return err;
+	}
+	LOG_INFO("Found %zu cards in %zu directories with %i threads in "
+		"%.1fms.", c->count, scan.dirs_read, started,
+		(double)(monotonic_ns() - start) / 1e6);
+	return 0;
+}
+
+const char *catalog_name(const struct catalog *c, size_t card)
+{
+	return c->names + (c->offsets[card] & ~CATALOG_REMOVED);
+}
+
+int catalog_removed(const struct catalog *c, size_t card)
+{
+	return (c->offsets[card] & CATALOG_REMOVED) != 0;
+}
+
+int catalog_copy(const struct catalog *c, struct catalog *copy)
+{
+	if (!c || !copy) return EINVAL;
+	catalog_free(copy);
+	copy->names_block = block_share(c->names_block);
+	copy->offsets_block = block_share(c->offsets_block);
+	copy->names = c->names;
+	copy->offsets = c->offsets;
+	copy->names_len = c->names_len;
+	copy->names_cap = c->names_len;
+	copy->count = c->count;
+	copy->cap = c->count;
+	copy->removed = c->removed;
+	return 0;
+}
+
+#if LINUX
+
+/*
+ * Mark a card removed, or not, first copying the offsets if a copy of the
+ * catalog shares them.
+ *
+ * Returns 0 if the card was marked. Otherwise returns an error code.
+ */
+static int mark_removed(struct catalog *c, size_t card, int removed)
+{
+	if (atomic_load(&c->offsets_block->refs) > 1) {
+		if (block_grow(&c->offsets_block, c->count *
+			sizeof(*c->offsets), c->cap * sizeof(*c->offsets)))
+		{
+			return ENOMEM;
+		}
+		c->offsets = (void*)c->offsets_block->data;
+	}
+	if (removed) {
+		c->offsets[card] |= CATALOG_REMOVED;
+		++c->removed;
+	} else {
+		c->offsets[card] &= ~CATALOG_REMOVED;
+		--c->removed;
+	}
+	return 0;
+}
+
+/*
+ * Add a card, or revive it if it was removed.
+ *
+ * Returns 1 if the catalog changed, 0 if the card was already in it.
+ * Otherwise returns a negative error code.
+ */
+static int catalog_add(struct catalog *c, const char *path)
+{
+	uint32_t *slot = index_slot(c, path);
+	if (*slot) {
+		if (!catalog_removed(c, *slot - 1)) return 0;
+		const int err = mark_removed(c, *slot - 1, 0);
+		return err ? -err : 1;
+	}
+	const int err = add_card(c, path, strlen(path));
+	if (err) return -err;
+	if (c->count * 2 > c->index_cap) {
+		const int index_err = build_index(c);
+		if (index_err) {
+			// Unindexed it would be added again and again.
+			--c->count;
+			return -index_err;
+		}
+	} else {
+		*slot = (uint32_t)c->count;
+	}
+	return 1;
+}
+
+/*
+ * Mark a card removed. Returns 1 if it was in the catalog.
+ */
+static int catalog_remove(struct catalog *c, const char *path)
+{
+	const uint32_t *slot = index_slot(c, path);
+	if (!*slot || catalog_removed(c, *slot - 1)) return 0;
+	return mark_removed(c, *slot - 1, 1) == 0;
+}
+
+/*
+ * Mark every card in a directory removed.
+ */
+static size_t remove_dir(struct catalog *c, const char *dir)
+{
+	const size_t len = strlen(dir);
+	size_t removed = 0;
+	for (size_t i = 0; i < c->count; ++i) {
+		const char *name = catalog_name(c, i);
+		if (catalog_removed(c, i) || (strncmp(name, dir, len) != 0) ||
+			(name[len] != '/'))
+		{
+			continue;
+		}
+		if (mark_removed(c, i, 1) == 0) ++removed;
+	}
+	return removed;
+}
+
+/*
+ * Put the root before a path relative to it.
+ */
+static int full_path(const struct catalog *c, const char *path, char *full)
+{
+	const int len = snprintf(full, PATH_MAX, "%s%s%s", c->root,
+		path[0] ? "/" : "", path);
+	return ((len < 0) || (len >= PATH_MAX)) ? ENAMETOOLONG : 0;
+}
+
+struct catalog_watch {
+	struct catalog_watch *next;
+	int wd;
+	// Relative to the root.
+	char dir[];
+};
+
+/*
+ * Stop keeping a watched directory. The watch itself is left to the caller.
+ */
+static void drop_watch(struct catalog *c, struct catalog_watch *w)
+{
+	for (struct catalog_watch **link = &c->watches; *link;
+		link = &(*link)->next)
+	{
+		if (*link == w) {
+			*link = w->next;
+			break;
+		}
+	}
+	if (c->watch_by_wd[w->wd] == w) c->watch_by_wd[w->wd] = NULL;
+	free(w);
+}
+
+/*
+ * Note which directory a watch descriptor is for.
+ */
+static int add_watch(struct catalog *c, int wd, const char *dir)
+{
+	if ((size_t)wd >= c->watch_by_wd_cap) {
+		size_t cap = c->watch_by_wd_cap ? c->watch_by_wd_cap : 64;
+		while ((size_t)wd >= cap) cap *= 2;
+		struct catalog_watch **by_wd = realloc(c->watch_by_wd,
+			cap * sizeof(*by_wd));
+		if (!by_wd) return ENOMEM;
+		memset(by_wd + c->watch_by_wd_cap, 0,
+			(cap - c->watch_by_wd_cap) * sizeof(*by_wd));
+		c->watch_by_wd = by_wd;
+		c->watch_by_wd_cap = cap;
+	}
+	const size_t len = strlen(dir);
+	struct catalog_watch *w = malloc(sizeof(*w) + len + 1);
+	if (!w) return ENOMEM;
+	w->wd = wd;
+	memcpy(w->dir, dir, len + 1);
+	// A directory deleted and recreated may get its old descriptor back.
+	if (c->watch_by_wd[wd]) drop_watch(c, c->watch_by_wd[wd]);
+	w->next = c->watches;
+	c->watches = w;
+	c->watch_by_wd[wd] = w;
+	return 0;
+}
+
+/*
+ * Watch a directory, then its subdirectories, adding any images in them if
+ * add_cards is set.
+ *
+ * Returns the number of cards added.
+ */
+static size_t watch_tree(struct catalog *c, const char *dir, int add_cards)
+{
+	char full[PATH_MAX];
+	if (full_path(c, dir, full) != 0) return 0;
+	const int wd = inotify_add_watch(c->watch_fd, full, IN_CREATE |
+		IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+	if (wd < 0) {
+		LOG_WARN("Failed to watch %s: %i", full, errno);
+		return 0;
+	}
+	if (add_watch(c, wd, dir) != 0) {
+		(void)inotify_rm_watch(c->watch_fd, wd);
+		return 0;
+	}
+
+	DIR *d = opendir(full);
+	if (!d) return 0;
+	size_t added = 0;
+	struct dirent *entry;
+	while ((entry = readdir(d))) {
+		const char *name = entry->d_name;
+		if (name[0] == '.') continue;
+		int is_dir = entry->d_type == DT_DIR;
+		int is_file = entry->d_type == DT_REG;
+		if ((entry->d_type == DT_UNKNOWN) || (entry->d_type == DT_LNK)) {
+			struct stat st;
+			if (fstatat(dirfd(d), name, &st, 0) != 0) continue;
+			is_dir = S_ISDIR(st.st_mode) &&
+				(entry->d_type == DT_UNKNOWN);
+			is_file = S_ISREG(st.st_mode);
+		}
+		if (!is_dir && !(add_cards && is_file &&
+			is_image(name, strlen(name))))
+		{
+			continue;
+		}
+		size_t len = 0;
+		char *path = join_path(dir, name, &len);
+		if (!path) continue;
+		if (is_dir) {
+			added += watch_tree(c, path, add_cards);
+		} else {
+			added += catalog_add(c, path) > 0;
+		}
+		free(path);
+	}
+	(void)closedir(d);
+	return added;
+}
+
+/*
+ * Stop watching a directory and its subdirectories.
+ */
+static void unwatch_all_in(struct catalog *c, const char *dir)
+{
+	const size_t len = strlen(dir);
+	struct catalog_watch *w = c->watches;
+	while (w) {
+		struct catalog_watch *next = w->next;
+		if ((strncmp(w->dir, dir, len) == 0) &&
+			((w->dir[len] == '\0') || (w->dir[len] == '/')))
+		{
+			(void)inotify_rm_watch(c->watch_fd, w->wd);
+			drop_watch(c, w);
+		}
+		w = next;
+	}
+}
+
+/*
+ * Check every card after changes were lost, then look for new ones.
+ */
+static size_t resync(struct catalog *c)
+{
+	size_t changed = 0;
+	char full[PATH_MAX];
+	for (size_t i = 0; i < c->count; ++i) {
+		struct stat st;
+		if (catalog_removed(c, i) ||
+			(full_path(c, catalog_name(c, i), full) != 0) ||
+			(stat(full, &st) == 0))
+		{
+			continue;
+		}
+		if (mark_removed(c, i, 1) == 0) ++changed;
+	}
+	return changed + watch_tree(c, "", 1);
+}
+
+/*
+ * Apply one change.
+ */
+static size_t apply_event(struct catalog *c, const struct inotify_event *e)
+{
+	if (e->mask & IN_Q_OVERFLOW) {
+		LOG_WARN("Missed changes to the cards, checking them all.");
+		return resync(c);
+	}
+	if ((e->wd < 0) || ((size_t)e->wd >= c->watch_by_wd_cap) ||
+		!c->watch_by_wd[e->wd])
+	{
+		return 0;
+	}
+	struct catalog_watch *w = c->watch_by_wd[e->wd];
+	if (e->mask & IN_IGNORED) {
+		drop_watch(c, w);
+		return 0;
+	}
+	if (!e->len || (e->name[0] == '.')) return 0;
+
+	size_t len = 0;
+	char *path = join_path(w->dir, e->name, &len);
+	if (!path) return 0;
+	size_t changed = 0;
+	const int added = e->mask & (IN_CREATE | IN_MOVED_TO);
+	if (e->mask & IN_ISDIR) {
+		if (added) {
+			changed = watch_tree(c, path, 1);
+		} else {
+			unwatch_all_in(c, path);
+			changed = remove_dir(c, path);
+		}
+	} else if (is_image(e->name, strlen(e->name))) {
+		if (added) {
+			const int result = catalog_add(c, path);
+			if (result < 0) {
+				LOG_WARN("Failed to add the card %s: %i", path,
+					-result);
+			}
+			changed = result > 0;
+		} else {
+			changed = (size_t)catalog_remove(c, path);
+		}
+	}
+	if (changed) {
+		LOG_DEBUG("%s %s: %zu cards.", added ? "Added" : "Removed",
+			path, changed);
+	}
+	free(path);
+	return changed;
+}
+
+int catalog_watch(struct catalog *c, const char *root)
+{
+	if (!c || !root) return EINVAL;
+	if (c->watching) return 0;
+	c->root = strdup(root);
+	if (!c->root) return ENOMEM;
+	c->watch_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (c->watch_fd == -1) {
+		const int err = errno;
+		free(c->root);
+		c->root = NULL;
+		return err;
+	}
+	c->watching = 1;
+	const uint64_t start = monotonic_ns();
+	(void)watch_tree(c, "", 0);
+	LOG_INFO("Watching %s for new cards, set up in %.1fms.", root,
+		(double)(monotonic_ns() - start) / 1e6);
+	return 0;
+}
+
+size_t catalog_poll(struct catalog *c)
+{
+	if (!c || !c->watching) return 0;
+	_Alignas(struct inotify_event) char buf[4096];
+	size_t changed = 0;
+	for (;;) {
+		const ssize_t len = read(c->watch_fd, buf, sizeof(buf));
+		if (len <= 0) {
+			if ((len == -1) && (errno == EINTR)) continue;
+			break;
+		}
+		for (ssize_t at = 0; at < len;) {
+			const struct inotify_event *e =
+				(const struct inotify_event*)(buf + at);
+			changed += apply_event(c, e);
+			at += (ssize_t)(sizeof(*e) + e->len);
+		}
+	}
+	return changed;
+}
+
+static void unwatch(struct catalog *c)
+{
+	if (!c->watching) return;
+	close(c->watch_fd);
+	while (c->watches) {
+		struct catalog_watch *next = c->watches->next;
+		free(c->watches);
+		c->watches = next;
+	}
+	free(c->watch_by_wd);
+	free(c->root);
+}
+
+#else
+
+int catalog_watch(struct catalog *c, const char *root)
+{
+	(void)c;
+	(void)root;
+	return ENOSYS;
+}
+
+size_t catalog_poll(struct catalog *c)
+{
+	(void)c;
+	return 0;
+}
+
+static void unwatch(struct catalog *c)
+{
+	(void)c;
+}
+
+#endif // LINUX
+
+void catalog_free(struct catalog *c)
+{
+	if (!c) return;
+	unwatch(c);
+	block_release(c->names_block);
+	block_release(c->offsets_block);
+	free(c->index);
+	*c = (struct catalog){0};
+}
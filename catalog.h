@@ -0,0 +1,133 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file declares the card catalog: every image under the web root, each
+ * of which is a card. The front of a card is the image and the back is its
+ * path.
+ *
+ * The paths are kept in one contiguous string table, found by their offsets
+ * into it, so a catalog of hundreds of thousands of cards is a few
+ * allocations rather than one per card. A scan sorts them, so the catalog
+ * comes out the same whichever order the directories were read in.
+ *
+ * The web root is scanned by several threads sharing a queue of directories.
+ * The type readdir gives each entry decides whether it is a directory to
+ * queue or a file to check, so only entries of unknown type are stat'd.
+ * Files and directories whose names start with a . are skipped, and symbolic
+ * links are only followed to files, so a link can't make the scan loop.
+ *
+ * On Linux the catalog can then watch the web root with inotify and be kept
+ * up to date by calling catalog_poll, which applies the changes since it was
+ * last called without blocking. A card's id never changes: a new image is
+ * appended, and a removed one is marked removed and revived if it comes back.
+ * A renamed image is removed and added under its new name. If the kernel's
+ * queue of changes overflows, every card is checked and the tree walked
+ * again.
+ *
+ * Paths from catalog_name are only good until the next catalog_poll.
+ */
+#ifndef CATALOG_H
+#define CATALOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Set in a card's offset once it's removed.
+#define CATALOG_REMOVED 0x80000000u
+
+struct catalog_block;
+struct catalog_watch;
+
+/*
+ * The cards found by a scan. Zero it before the first catalog_scan.
+ */
+struct catalog {
+	// Every card's path, each NUL terminated.
+	char *names;
+	size_t names_len;
+	size_t names_cap;
+	// Where each card's path starts in names, ORed with CATALOG_REMOVED
+	// if it was removed.
+	uint32_t *offsets;
+	size_t count;
+	size_t cap;
+	size_t removed;
+	// The memory names and offsets are in, shared with copies.
+	struct catalog_block *names_block;
+	struct catalog_block *offsets_block;
+	// An open addressed table of card ids + 1 by path, 0 where empty.
+	uint32_t *index;
+	size_t index_cap;
+	// The inotify descriptor, the root it's watching and the directories
+	// watched, also found by their watch descriptors.
+	int watching;
+	int watch_fd;
+	char *root;
+	struct catalog_watch *watches;
+	struct catalog_watch **watch_by_wd;
+	size_t watch_by_wd_cap;
+};
+
+/*
+ * Scan a directory and its subdirectories for images.
+ *
+ * c - Set to the cards found. Anything it held is freed.
+ * root - The directory to scan. Paths are relative to it.
+ * threads - The number of threads to scan with, 0 for one per CPU.
+ *
+ * Returns 0 if the directory was scanned. Directories that can't be read are
+ * logged and skipped. Otherwise returns an error code and c is empty.
+ */
+int catalog_scan(struct catalog *c, const char *root, int threads);
+
+/*
+ * Returns the path of a card.
+ */
+const char *catalog_name(const struct catalog *c, size_t card);
+
+/*
+ * Returns nonzero if the card's image was removed.
+ */
+int catalog_removed(const struct catalog *c, size_t card);
+
+/*
+ * Copy a catalog's cards, for readers that mustn't see it change. The copy
+ * shares the catalog's memory, which the catalog copies before changing any
+ * of it the copy can see, so copying takes the same time however many cards
+ * there are.
+ *
+ * c - The catalog.
+ * copy - Set to the same cards with the same ids. It isn't watched and has
+ *        no index. Anything it held is freed. It can be freed on any thread.
+ *
+ * Returns 0 if the cards were copied. Otherwise returns an error code and
+ * copy is empty.
+ */
+int catalog_copy(const struct catalog *c, struct catalog *copy);
+
+/*
+ * Start watching the directory a catalog was scanned from for images being
+ * added, removed or renamed.
+ *
+ * c - The catalog.
+ * root - The directory it was scanned from.
+ *
+ * Returns 0 if the directory is being watched. Otherwise returns an error
+ * code; ENOSYS where inotify isn't available.
+ */
+int catalog_watch(struct catalog *c, const char *root);
+
+/*
+ * Apply the changes to a watched catalog's directory since the last poll.
+ * Returns at once if there are none, or if the catalog isn't watched.
+ *
+ * Returns the number of cards added or removed.
+ */
+size_t catalog_poll(struct catalog *c);
+
+/*
+ * Stop watching and free a catalog's memory.
+ */
+void catalog_free(struct catalog *c);
+
+#endif // CATALOG_H
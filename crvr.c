@@ -4,29 +4,89 @@
  * This file contains the main routine and helper routines for the crvr
  * c[e]rv[e]r program.
  */
+#define _POSIX_C_SOURCE 200809L
+
 #include <assert.h>
 #include <dirent.h>
 #include <errno.h>
 #include <limits.h>
+#include <poll.h>
+#include <signal.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
 
-#include "asl.h"
+#include "access_log.h"
+#include "capture.h"
+#include "iobuf.h"
+#include "log.h"
+#include "metrics.h"
+#include "module.h"
 #include "pool.h"
+#include "pool_profile.h"
+#include "probes.h"
+#include "router.h"
+#include "slow_log.h"
 #include "socket_layer.h"
 #include "str.h"
+#include "timing.h"
 #include "utils.h"
+#include "websocket.h"
 
 // Default port for the webserver
 static const unsigned short port = 8080;
+// The default size the access log is rotated at, in megabytes.
+#define ACCESS_LOG_DEFAULT_MB 64
+// The number of rotated access logs kept.
+#define ACCESS_LOG_KEEP 4
+// Requests slower than this many milliseconds go in the slow log by default.
+#define SLOW_LOG_DEFAULT_MS 100
+// By default memory pool a spike used is given back after this many seconds
+// without another.
+#define POOL_RECLAIM_DEFAULT_S 10
+// The module loaded if none are given.
+#define MODULE_DEFAULT "asl.so"
+// Where the quiz's progress is saved by default, without the extensions.
+#define ASL_PROGRESS_DEFAULT "asl_progress"
+// The most bytes the metrics page can be.
+#define METRICS_PAGE_MAX (256 * KIBIBYTE)
+// The most clients waiting for the rest of their request's header. Past
+// that, no more are accepted until one finishes or times out.
+#define PENDING_MAX 64
+// Clients that haven't sent a whole header this long after connecting are
+// dropped.
+#define PENDING_TIMEOUT_S 10
+// The flags the memory pool is created with.
+static int s_pool_flags = 0;
+// How long the memory pool must be quiet before it gives memory back, 0 to
+// keep it.
+static unsigned long s_pool_reclaim_s = POOL_RECLAIM_DEFAULT_S;
+// Cleared by SIGINT or SIGTERM to shut the server down.
+static volatile sig_atomic_t s_keep_running = 1;
 static const struct str s_end_of_header_str = STR("\r\n\r\n");
+
+/*
+ * A client accepted whose request's header hasn't all arrived yet.
+ */
+struct pending {
+	int fd;
+	struct sockaddr_in addr;
+	// When it was accepted, by capture_now and time.
+	uint64_t arrival;
+	time_t accepted;
+	// What has arrived, NUL terminated. NULL until anything does.
+	struct iobuf *io;
+	long len;
+};
+static struct pending s_pending[PENDING_MAX];
+static size_t s_pending_count = 0;
 // Local functions
 /**
  * @brief Updates the POST buffer in the request with data from the client.
@@ -47,7 +107,7 @@ static int update_post_data(struct request *r, int client, struct pool *p,
 	const long bytes_needed, long bytes_received);
 
 /*
- * Prints the address in a sockaddr_in.
+ * Logs the address in a sockaddr_in.
  */
 void print(struct sockaddr_in *address)
 {
@@ -57,8 +117,90 @@ void print(struct sockaddr_in *address)
 	const unsigned char byte2 = (unsigned char)((ip & 0x0000ff00) >> 8);
 	const unsigned char byte1 = (unsigned char)(ip & 0x000000ff);
 	const unsigned short port = ntohs(address->sin_port);
-	printf("Contact: %hhu.%hhu.%hhu.%hhu:%hu\n", byte4, byte3, byte2, byte1,
-		port);
+	LOG_DEBUG("Contact: %hhu.%hhu.%hhu.%hhu:%hu", byte4, byte3, byte2,
+		byte1, port);
+}
+
+/*
+ * Send the metrics in the Prometheus text format.
+ */
+static int send_metrics(struct request *r, int client, struct pool *p)
+{
+	static const char header[] = "HTTP/1.1 200 OK\r\n"
+		"Content-Type: text/plain; version=0.0.4";
+	(void)r;
+
+	const long start = pool_get_position(p);
+	char *page = pool_alloc(p, METRICS_PAGE_MAX);
+	if (!page) return ENOBUFS;
+	size_t len = 0;
+	int err = metrics_render(page, METRICS_PAGE_MAX, &len);
+	if (!err) err = send_data(client, header, page, len);
+	pool_reset(p, start);
+	return err;
+}
+
+#if POOL_ACCOUNTING
+/*
+ * Send the pool profile: how much of the pool requests use and where it's
+ * allocated.
+ */
+static int send_pool_profile(struct request *r, int client,
+	struct pool *p)
+{
+	static const char header[] = "HTTP/1.1 200 OK\r\n"
+		"Content-Type: text/plain";
+	(void)r;
+
+	const long start = pool_get_position(p);
+	char *page = pool_alloc(p, METRICS_PAGE_MAX);
+	if (!page) return ENOBUFS;
+	int err = 0;
+	FILE *f = fmemopen(page, METRICS_PAGE_MAX, "w");
+	if (!f) {
+		err = errno;
+	} else {
+		err = pool_profile_write(f);
+		const long len = ftell(f);
+		fclose(f);
+		if (!err && (len >= 0)) {
+			err = send_data(client, header, page, (size_t)len);
+		}
+	}
+	pool_reset(p, start);
+	return err;
+}
+#endif
+
+/*
+ * Add the server's own pages to the router.
+ */
+static int add_server_routes(void)
+{
+	const struct route metrics = {
+		MODULE_GET, send_metrics, METRICS_ROUTE_METRICS
+	};
+	int err = router_add("metrics", &metrics);
+#if POOL_ACCOUNTING
+	const struct route pool = {
+		MODULE_GET, send_pool_profile, METRICS_ROUTE_METRICS
+	};
+	if (!err) err = router_add("debug/pool", &pool);
+#endif
+	return err;
+}
+
+/*
+ * Find the route that handles a request, or NULL if it's served from the web
+ * root.
+ */
+static const struct route *route_of(const struct request *r)
+{
+	const struct route *route = router_find(&r->path);
+	if (!route) return NULL;
+	const unsigned method = websocket_is_upgrade(r) ? MODULE_UPGRADE :
+		(r->type == GET) ? MODULE_GET : MODULE_POST;
+	return (route->methods & method) ? route : NULL;
 }
 
 /*
@@ -67,24 +209,17 @@ void print(struct sockaddr_in *address)
  */
 int handle_get_request(int client, struct request *request, struct pool *p)
 {
-	static const struct str ASL_PAGE = STR("asl.html");
-	printf("Getting \"");
-	str_print(stdout, &request->path);
-	printf("\"\n");
-
-	if (str_cmp(&request->path, &ASL_PAGE) == 0) {
-		printf("Dynamic URI\n");
-		return asl_get(request, client);
-	}
+	LOG_DEBUG("Getting \"%.*s\"", (int)request->path.len, request->path.s);
+
 	FILE *f = NULL;
 	char file_path[PATH_MAX] = {0};
 
 	int err = str_copy_to_cstr(&request->path, file_path, PATH_MAX);
 	if (err) return err;
 
-	f = fopen(file_path, "r");
+	f = open_file(file_path);
 	if (!f) {
-		fprintf(stderr, "\"%s\" not found.\n", file_path);
+		LOG_INFO("\"%s\" not found.", file_path);
 		err = send_404(client);
 	} else {
 		err = send_file(f, client, p);
@@ -93,8 +228,20 @@ int handle_get_request(int client, struct request *request, struct pool *p)
 	return err;
 }
 
+/*
+ * Hand a request to upgrade to a WebSocket to the route that speaks it at
+ * that path, or send a 404 if none does.
+ */
+static int handle_upgrade_request(int client, struct request *r,
+	struct pool *p, const struct route *route)
+{
+	if (route) return route->handle(r, client, p);
+	LOG_INFO("No WebSocket at \"%.*s\"", (int)r->path.len, r->path.s);
+	return send_404(client);
+}
+
 int handle_post_request(int client, struct request *r, struct pool *p,
-	long bytes_received)
+	long bytes_received, const struct route *route)
 {
 	long content_len = 0;
 	long total_len = 0;
@@ -107,155 +254,558 @@ int handle_post_request(int client, struct request *r, struct pool *p,
 	struct str content_len_str = {0};
 	int err = header_find_value(r, "Content-Length", &content_len_str);
 	if (err) {
-		fprintf(stderr, "Did not find Content-Length in header\n");
+		LOG_WARN("Did not find Content-Length in header");
 		print_request(r);
 		return EINVAL;
 	}
 	err = str_to_long(&content_len_str, 10, &content_len);
 	if (err) {
-		fputs("Failed to convert \"", stderr);
-		str_print(stderr, &content_len_str);
-		fprintf(stderr, "\" to long. err=%u.\n", err);
+		LOG_WARN("Failed to convert \"%.*s\" to long. err=%i.",
+			(int)content_len_str.len, content_len_str.s, err);
 		return err;
 	}
 	if (content_len < 0) {
-		fprintf(stderr, "Invalid content length %lu.\n", content_len);
+		LOG_WARN("Invalid content length %ld.", content_len);
 		return EINVAL;
 	}
-	printf("content length is %ld\n", content_len);
+	LOG_DEBUG("content length is %ld", content_len);
 	bytes_needed = bytes_received - (r->buffer.len + total_len);
 
 	if (bytes_needed > 0) {
 		err = update_post_data(r, client, p, bytes_needed,
 			bytes_received);
 		if (err) {
-			fprintf(stderr, "%s> Failed to read post data: %i\n",
-				__func__, err);
+			LOG_ERROR("%s> Failed to read post data: %i", __func__,
+				err);
 			return err;
 		}
 	}
 
-	if (str_cmp_cstr(&r->path, "asl.html") == 0)
-		return asl_post(r, client);
+	if (route) return route->handle(r, client, p);
 
-	printf("No post response\n");
+	LOG_DEBUG("No post response");
 
 	send_path(&r->path, client, p);
 
-	printf("Don't know what to do with post to \"");
-	str_print(stdout, &r->path);
-	printf("\"\n");
+	LOG_INFO("Don't know what to do with post to \"%.*s\"",
+		(int)r->path.len, r->path.s);
 
 	return 0;
 }
 
-int handle_client(int client, struct sockaddr_in *client_addr, struct pool *p)
+/*
+ * Returns nonzero if the POST body was read separately, after the initial
+ * recv into buffer.
+ */
+static int body_read_separately(const struct request *r, const char *buffer,
+	long bytes_rxed)
 {
-	(void)client_addr;
-
-	char buffer[8192] = {0};
-	memset(buffer, 0, sizeof(buffer));
-	ssize_t recv_result = -1;
-	do {
-		recv_result = recv(client, buffer, LEN(buffer) - 1, 0);
-	} while ((recv_result == -1) && (errno == EAGAIN));
-	
-	long bytes_rxed = recv_result;
-	if (bytes_rxed == -1) {
-		fprintf(stderr, "Failed to read from client: %d.\n",
-			get_error());
-		return -1;
+	return r && (r->post_params_buffer.len > 0) &&
+		((r->post_params_buffer.s < buffer) ||
+		(r->post_params_buffer.s >= buffer + bytes_rxed));
+}
+
+/*
+ * Capture the request if capturing is on. raw is the copy of the received
+ * bytes taken before parsing decoded them in place. The part of a POST body
+ * that was read after the initial recv is captured after the rest of the
+ * request.
+ */
+static void capture_client_request(uint64_t arrival, const struct str *raw,
+	const char *buffer, long bytes_rxed, const struct request *r)
+{
+	if (!capture_enabled() || !raw->s) return;
+
+	struct str parts[2] = {*raw, {0}};
+	size_t part_count = 1;
+	if (body_read_separately(r, buffer, bytes_rxed)) {
+		parts[part_count++] = r->post_params_buffer;
 	}
+	const struct response_stats *response = response_stats_get();
+	(void)capture_request(arrival, parts, part_count, response->status,
+		response->bytes);
+}
+
+/*
+ * Record the finished request in the metrics, and in the access and slow logs
+ * if they're on, then stop timing it. access has the arrival time, peer and
+ * the durations measured so far. raw is the request as received, if it was
+ * copied. r is NULL if the request couldn't be parsed.
+ */
+static void record_client_request(struct access_info *access,
+	const struct request_timing *timing, const struct str *raw,
+	const char *buffer, long bytes_rxed, const struct request *r)
+{
+	const struct response_stats *response = response_stats_get();
+	access->total_ns = monotonic_ns() - timing->start_ns;
+	access->status = response->status;
+	access->bytes_out = response->bytes;
+	access->write_ns = timing->phase_ns[TIMING_WRITE];
+	access->bytes_in = (bytes_rxed > 0) ? (uint64_t)bytes_rxed : 0;
+	enum metrics_method method = METRICS_METHOD_NONE;
+	enum metrics_route route = METRICS_ROUTE_NONE;
+	if (r) {
+		access->method = (r->type == GET) ? ACCESS_METHOD_GET :
+			ACCESS_METHOD_POST;
+		access->path = &r->path;
+		if (body_read_separately(r, buffer, bytes_rxed)) {
+			access->bytes_in += (uint64_t)r->post_params_buffer.len;
+		}
+		method = (r->type == GET) ? METRICS_METHOD_GET :
+			METRICS_METHOD_POST;
+		const struct route *handler = route_of(r);
+		route = handler ? handler->metrics : METRICS_ROUTE_STATIC;
+	}
+	metrics_record_request(method, route, access->status,
+		access->total_ns, access->bytes_in, access->bytes_out);
+	if (access_log_enabled()) (void)access_log_request(access);
+	PROBE3(response__sent, access->status, access->bytes_out,
+		access->total_ns);
+	slow_log_request(access->time_ns, timing, access->total_ns,
+		access->status, raw);
+	timing_end();
+}
+
+/*
+ * Receive what a client has sent without waiting for more.
+ *
+ * Returns 1 once the end of the header has arrived, the buffer is full or the
+ * client has stopped sending, 0 if the rest hasn't arrived yet, or -1 if recv
+ * failed or there's no buffer to receive into.
+ */
+static int receive_header(struct pending *c)
+{
+	if (!c->io) {
+		c->io = iobuf_get();
+		if (!c->io) return -1;
+	}
+	char *buffer = c->io->data;
+	const long cap = IOBUF_SIZE;
+	int done = 0;
+	while (!done && (c->len < cap - 1)) {
+		const ssize_t in = recv(c->fd, buffer + c->len,
+			(size_t)(cap - 1 - c->len), MSG_DONTWAIT);
+		if (in == -1) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+			return -1;
+		}
+		if (in == 0) {
+			done = 1;
+			break;
+		}
+		// Only the new bytes, and the three before them, could complete
+		// the end of the header.
+		const long from = (c->len > 3) ? c->len - 3 : 0;
+		c->len += in;
+		const struct str got = {buffer + from, c->len - from};
+		done = str_find_substr(&got, &s_end_of_header_str) != -1;
+	}
+	buffer[c->len] = '\0';
+	return done || (c->len == cap - 1);
+}
+
+/*
+ * Free everything a request allocated from the pool, noting how much it used
+ * when the pool is accounting.
+ */
+static void release_request_memory(struct pool *p, long start)
+{
+#if POOL_ACCOUNTING
+	pool_profile_request(pool_get_peak(p) - start);
+#endif
+	pool_reset(p, start);
+}
+
+/*
+ * Handle a client whose request's header has arrived, taking its buffer.
+ */
+static int handle_client(struct pending *c, struct pool *p)
+{
+	const int client = c->fd;
+	const struct sockaddr_in *client_addr = &c->addr;
+	const uint64_t arrival = c->arrival;
+	struct request_timing timing;
+	timing_begin(&timing, arrival);
+	struct access_info access = {0};
+	access.time_ns = realtime_ns();
+	access.peer_addr = client_addr->sin_addr.s_addr;
+	access.peer_port = ntohs(client_addr->sin_port);
+	response_stats_reset();
+
+	struct str raw = {0};
+	struct iobuf *io = c->io;
+	c->io = NULL;
+	char *buffer = io->data;
+	const long bytes_rxed = c->len;
+	const uint64_t received = timing_add(TIMING_RECV, arrival);
+	access.recv_ns = timing.phase_ns[TIMING_RECV];
 
 	struct request request;
 	const long start = pool_get_position(p);
-	int err = parse_request(buffer, LEN(buffer), &request, p);
+	pool_reset_peak(p);
+	// Parsing decodes the buffer in place, so keep a copy of what was
+	// received for anything that wants the original.
+	if ((capture_enabled() || slow_log_enabled()) && (bytes_rxed > 0)) {
+		(void)str_alloc_from_cstr(p, buffer, bytes_rxed, &raw);
+	}
+	int err = parse_request(buffer, bytes_rxed, &request, p);
+	const uint64_t parsed = timing_add(TIMING_PARSE, received);
+	access.parse_ns = timing.phase_ns[TIMING_PARSE];
 	if (err) {
-		fprintf(stderr,
-			"Failed to parse client's request (%i).\n"
+		LOG_WARN("Failed to parse client's request (%i).\n"
 			"Buffer was:\n%s\n", err, buffer);
+		metrics_count_parse_error();
+		capture_client_request(arrival, &raw, buffer, bytes_rxed,
+			NULL);
+		record_client_request(&access, &timing, &raw, buffer,
+			bytes_rxed, NULL);
+		release_request_memory(p, start);
+		iobuf_put(io);
 		return -1;
 	}
+	PROBE5(request__parsed, request.type, request.path.s, request.path.len,
+		access.recv_ns, access.parse_ns);
 	err = 0;
-	if (request.type == GET) {
-		printf("GET \"");
-		str_print(stdout, &request.path);
-		printf("\"\n");
-		err = handle_get_request(client, &request, p);
+	PROBE3(handler__start, request.type, request.path.s, request.path.len);
+	const struct route *route = route_of(&request);
+	if (websocket_is_upgrade(&request)) {
+		LOG_INFO("Upgrade \"%.*s\"", (int)request.path.len,
+			request.path.s);
+		err = handle_upgrade_request(client, &request, p, route);
+	} else if (request.type == GET) {
+		LOG_INFO("GET \"%.*s\"", (int)request.path.len, request.path.s);
+		err = route ? route->handle(&request, client, p) :
+			handle_get_request(client, &request, p);
 	} else {
-		printf("POST \"");
-		str_print(stdout, &request.path);
-		printf("\"\n");
-		err = handle_post_request(client, &request, p, bytes_rxed);
+		LOG_INFO("POST \"%.*s\"", (int)request.path.len,
+			request.path.s);
+		err = handle_post_request(client, &request, p, bytes_rxed,
+			route);
 	}
+	// Writing is logged as its own phase.
+	const uint64_t handled = monotonic_ns() - parsed;
+	const uint64_t written = timing.phase_ns[TIMING_WRITE];
+	access.handle_ns = (handled > written) ? handled - written : 0;
+	PROBE4(handler__end, request.type, response_stats_get()->status, err,
+		access.handle_ns);
 	if (err != 0) {
-		fprintf(stderr, "Failed to handle client %d\nBuffer was:\n%s\n",
-			err, buffer);
+		LOG_ERROR("Failed to handle client %d\nBuffer was:\n%s\n", err,
+			buffer);
 	}
-	pool_reset(p, start);
+	capture_client_request(arrival, &raw, buffer, bytes_rxed, &request);
+	record_client_request(&access, &timing, &raw, buffer, bytes_rxed,
+		&request);
+	release_request_memory(p, start);
+	iobuf_put(io);
 	return err;
 }
 
+/*
+ * Give memory the pool hasn't needed lately back, and report its use.
+ */
+static void maintain_pool(struct pool *p)
+{
+	const int err = pool_reclaim(p, monotonic_ns());
+	if (err) LOG_WARN("Failed to reclaim pool memory: %i", err);
+	struct pool_stats stats;
+	pool_get_stats(p, &stats);
+	metrics_pool_stats(&stats);
+}
+
+/*
+ * Stop serving when interrupted so everything can be flushed and closed.
+ */
+static void on_stop_signal(int sig)
+{
+	(void)sig;
+	s_keep_running = 0;
+}
+
+/*
+ * Stop waiting for a client's header. Closing it is left to the caller.
+ */
+static void drop_pending(size_t i)
+{
+	iobuf_put(s_pending[i].io);
+	s_pending[i] = s_pending[--s_pending_count];
+}
+
+/*
+ * Accept a client and wait for its request without blocking on it.
+ */
+static void accept_client(int server_sock)
+{
+	struct sockaddr_in client_addr;
+	memset(&client_addr, 0, sizeof(client_addr));
+	unsigned addr_len = sizeof(client_addr);
+	const int client = accept(server_sock, (struct sockaddr*)&client_addr,
+		&addr_len);
+	if (client == -1) {
+		if (get_error() != EINTR) {
+			LOG_ERROR("Error accepting client connection: %d.",
+				get_error());
+		}
+		return;
+	}
+	assert(sizeof(client_addr) == addr_len);
+	PROBE3(accept, client, client_addr.sin_addr.s_addr,
+		ntohs(client_addr.sin_port));
+	print(&client_addr);
+	s_pending[s_pending_count++] = (struct pending){
+		client, client_addr, capture_now(), time(NULL), NULL, 0
+	};
+}
+
+/*
+ * Read what the waiting clients polled have sent, handle those whose headers
+ * have all arrived and drop those that have waited too long.
+ *
+ * fds - The waiting clients' entries, after poll, in the order of s_pending.
+ * count - The number of entries in fds.
+ * p - The pool to handle requests with.
+ * now - The current time.
+ *
+ * Returns 0, or the error of the last client whose handling failed.
+ */
+static int serve_pending(const struct pollfd *fds, size_t count,
+	struct pool *p, time_t now)
+{
+	int result = 0;
+	// Backwards, as dropping one moves the last into its place.
+	for (size_t i = count; i-- > 0;) {
+		struct pending *c = &s_pending[i];
+		const int fd = c->fd;
+		const int got = fds[i].revents ? receive_header(c) : 0;
+		if (got == 0) {
+			if (now - c->accepted < PENDING_TIMEOUT_S) continue;
+			LOG_DEBUG("Client %d didn't send a request in time.",
+				fd);
+		} else if (got == -1) {
+			LOG_ERROR("Failed to read from client: %d.",
+				get_error());
+		} else if (c->len > 0) {
+			const int err = handle_client(c, p);
+			if (err != 0) {
+				LOG_WARN("Handling the client failed: %d", err);
+				result = err;
+			}
+		}
+		drop_pending(i);
+		// An upgraded client stays open.
+		if (!websocket_owns(fd)) close(fd);
+	}
+	return result;
+}
+
 int serve(int server_sock)
 {
 	struct pool p = {};
 	int result = 0;
-	int keep_running = 1;
-
-	if (pool_init(&p, GIGABYTE) != 0) {
-		printf("Failed to create memory pool: %d.\n", errno);
+	// The server socket, the clients waiting for their headers, then the
+	// WebSockets.
+	struct pollfd fds[1 + PENDING_MAX + WEBSOCKET_MAX];
+	// Wake up when idle so a spike is reclaimed, and idle WebSockets are
+	// closed, even if no more requests come.
+	const int idle_ms = (int)(((s_pool_reclaim_s > 0) &&
+		(s_pool_reclaim_s < WEBSOCKET_IDLE_S)) ? s_pool_reclaim_s :
+		WEBSOCKET_IDLE_S) * 1000;
+
+	if (pool_init_flags(&p, GIGABYTE, s_pool_flags) != 0) {
+		LOG_ERROR("Failed to create memory pool: %d.", errno);
 		return -1;
 	}
-	while (keep_running) {
-		struct sockaddr_in client_addr;
-		memset(&client_addr, 0, sizeof(client_addr));
-		unsigned addr_len = sizeof(client_addr);
-		printf("Waiting for connection...");
-		int client = accept(server_sock,
-			(struct sockaddr*)&client_addr, &addr_len);
-		printf("contact detected.\n");
-		if (client != -1) {
-			assert(sizeof(client_addr) == addr_len);
-			print(&client_addr);
-			result = handle_client(client, &client_addr, &p);
-			close(client);
-
-			if (result != 0) {
-				printf("Handling the client failed: %d\n",
-					result);
-			}
-		} else {
-			printf("Error accepting client connection: %d.\n",
+	if (s_pool_reclaim_s) {
+		pool_set_reclaim(&p, (uint64_t)s_pool_reclaim_s * 1000000000u);
+	}
+	// Map and touch what the modules expect a request to use, so the
+	// first request doesn't.
+	const long hint = module_arena_hint();
+	const long start = pool_get_position(&p);
+	char *warm = (hint > 0) ? pool_alloc(&p, hint) : NULL;
+	if (warm) memset(warm, 0, (size_t)hint);
+	pool_reset(&p, start);
+	while (s_keep_running) {
+		LOG_DEBUG("Waiting for connection...");
+		// Until a waiting client finishes or times out there's no room
+		// for another.
+		fds[0] = (struct pollfd){server_sock,
+			(s_pending_count < PENDING_MAX) ? POLLIN : 0, 0};
+		const size_t pending = s_pending_count;
+		for (size_t i = 0; i < pending; ++i) {
+			fds[1 + i] = (struct pollfd){s_pending[i].fd, POLLIN,
+				0};
+		}
+		const size_t count = 1 + pending + websocket_poll_fds(
+			fds + 1 + pending, WEBSOCKET_MAX);
+		const int timeout_ms = (pending && (idle_ms >
+			PENDING_TIMEOUT_S * 1000)) ? PENDING_TIMEOUT_S * 1000 :
+			idle_ms;
+		const int ready = poll(fds, count, timeout_ms);
+		if (ready == 0) {
+			// Idle, so free the I/O buffers a burst needed.
+			iobuf_trim();
+		} else if ((ready == -1) && (get_error() != EINTR)) {
+			LOG_ERROR("Error polling for clients: %d.",
 				get_error());
 		}
+		// Each revents is still 0 if poll failed.
+		const time_t now = time(NULL);
+		websocket_serve(fds + 1 + pending, count - 1 - pending, now);
+		const int err = serve_pending(fds + 1, pending, &p, now);
+		if (err) result = err;
+		if (fds[0].revents & POLLIN) accept_client(server_sock);
+		maintain_pool(&p);
+		module_maintain_all();
+	}
+	websocket_close_all();
+	while (s_pending_count) {
+		close(s_pending[s_pending_count - 1].fd);
+		drop_pending(s_pending_count - 1);
 	}
+#if POOL_ACCOUNTING
+	// The allocation sites are this thread's, so report them from here.
+	fputs("\n", stderr);
+	(void)pool_profile_write(stderr);
+#endif
+	iobuf_free_all();
 	pool_free(&p);
 	return result;
 }
 
-int main()
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-a access_log [-A mb]] [-c capture_file] "
+		"[-l level]\n"
+		"          [-s slow_log [-S ms]] [-H] [-r seconds] [-p progress]\n"
+		"          [-m module[:mount[:arg]]]...\n"
+		"  -a  log every request to access_log, read it with "
+		"crvr-logcat\n"
+		"  -A  rotate the access log when it reaches mb megabytes "
+		"(default %i)\n"
+		"  -c  capture every request to capture_file for crvr-replay\n"
+		"  -H  back the memory pool with huge pages\n"
+		"  -l  log level: debug, info (default), warn, error or off\n"
+		"  -m  load module and mount its pages at mount (default /), "
+		"giving it arg;\n"
+		"      repeat for more modules (default %s)\n"
+		"  -p  the arg modules get if -m doesn't give one: for asl.so, "
+		"save quiz\n"
+		"      progress to progress.snap and progress.wal, - not at "
+		"all (default %s)\n"
+		"  -r  give unused memory back after seconds without a spike, "
+		"0 never (default %i)\n"
+		"  -s  log requests slower than ms, with a dump of the "
+		"request, to slow_log\n"
+		"  -S  the slow request threshold in milliseconds "
+		"(default %i)\n",
+		name, ACCESS_LOG_DEFAULT_MB, MODULE_DEFAULT,
+		ASL_PROGRESS_DEFAULT,
+		POOL_RECLAIM_DEFAULT_S,
+		SLOW_LOG_DEFAULT_MS);
+}
+
+int main(int argc, char *argv[])
 {
 	int result = 0;
+	int opt;
+	const char *capture_path = NULL;
+	const char *access_path = NULL;
+	unsigned long access_mb = ACCESS_LOG_DEFAULT_MB;
+	const char *slow_path = NULL;
+	unsigned long slow_ms = SLOW_LOG_DEFAULT_MS;
+	enum log_level level = LOG_LEVEL_INFO;
+	const char *progress_path = ASL_PROGRESS_DEFAULT;
+	const char *modules[MODULE_MAX];
+	size_t module_count = 0;
+
+	while ((opt = getopt(argc, argv, "a:A:c:Hl:m:p:r:s:S:h")) != -1) {
+		switch (opt) {
+		case 'a': access_path = optarg; break;
+		case 'A': access_mb = strtoul(optarg, NULL, 10); break;
+		case 'c': capture_path = optarg; break;
+		case 'H': s_pool_flags |= POOL_HUGE_PAGES; break;
+		case 'p': progress_path = optarg; break;
+		case 'r': s_pool_reclaim_s = strtoul(optarg, NULL, 10); break;
+		case 's': slow_path = optarg; break;
+		case 'S': slow_ms = strtoul(optarg, NULL, 10); break;
+		case 'm':
+			if (module_count == MODULE_MAX) {
+				fprintf(stderr, "At most %d modules.\n",
+					MODULE_MAX);
+				return EINVAL;
+			}
+			modules[module_count++] = optarg;
+			break;
+		case 'l':
+			if (log_parse_level(optarg, &level) == 0) break;
+			// fallthrough
+		default:
+			usage(argv[0]);
+			return (opt == 'h') ? 0 : EINVAL;
+		}
+	}
+	// Everything logged is written out when main returns.
+	if (log_init(level) == 0) (void)atexit(log_shutdown);
+	if (capture_path && (capture_open(capture_path) != 0)) {
+		return -1;
+	}
+	if (access_path && (access_log_open(access_path, (uint64_t)access_mb *
+		MEBIBYTE, ACCESS_LOG_KEEP) != 0))
+	{
+		LOG_ERROR("Failed to open the access log %s.", access_path);
+		return -1;
+	}
+	if (slow_path && (slow_log_open(slow_path, (uint64_t)slow_ms *
+		1000000u) != 0))
+	{
+		return -1;
+	}
 
-	// Load the ASL app
-	if (asl_init() != 0) {
-		fprintf(stderr, "Failed to initialize ASL\n");
+	// Without SA_RESTART accept fails with EINTR, so serve notices.
+	struct sigaction stop = {0};
+	stop.sa_handler = on_stop_signal;
+	(void)sigaction(SIGINT, &stop, NULL);
+	(void)sigaction(SIGTERM, &stop, NULL);
+	// A client hanging up early makes write fail with EPIPE instead of
+	// killing the server before the logs are closed.
+	struct sigaction ignore = {0};
+	ignore.sa_handler = SIG_IGN;
+	(void)sigaction(SIGPIPE, &ignore, NULL);
+
+	// Load the applications and route requests to them.
+	if (module_count == 0) modules[module_count++] = MODULE_DEFAULT;
+	int err = add_server_routes();
+	for (size_t i = 0; !err && (i < module_count); ++i) {
+		err = module_load(modules[i], progress_path);
+	}
+	if (!err) err = router_compile();
+	if (err) {
+		LOG_ERROR("Failed to load the modules: %i", err);
+		module_unload_all();
+		router_free();
 		return -1;
 	}
 
 	// Load the server up
 	if (init_socket_layer() != 0) {
-		printf("Failed to initialize the socket layer\n");
+		LOG_ERROR("Failed to initialize the socket layer");
 		return get_error();
 	}
 	int server_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
 	if (server_sock != -1) {
+		// Let a restarted server bind while the last one's connections
+		// are still in TIME_WAIT.
+		const int reuse = 1;
+		(void)setsockopt(server_sock, SOL_SOCKET, SO_REUSEADDR, &reuse,
+			sizeof(reuse));
 		struct sockaddr_in address;
 		address.sin_family = AF_INET;
 		//address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
 		address.sin_addr.s_addr = htonl(INADDR_ANY);
 		address.sin_port = htons(port);
-		printf("Server will listen on port %hu.\n", port);
+		LOG_INFO("Server will listen on port %hu.", port);
 
 		result = bind(server_sock, (struct sockaddr*)&address,
 			sizeof(address));
@@ -264,22 +814,27 @@ int main()
 			if (result != -1) {
 				result = serve(server_sock);
 			} else {
-				printf("Server socket failed to listen: %d.\n",
+				LOG_ERROR("Server socket failed to listen: %d.",
 					get_error());
 				result = -1;
 			}
 		} else {
-			printf("Failed to bind socket: %d\n", get_error());
+			LOG_ERROR("Failed to bind socket: %d", get_error());
 			result = -1;
 		}
 
 		close(server_sock);
 	} else {
-		printf("Could not create server socket: %d\n", get_error());
+		LOG_ERROR("Could not create server socket: %d", get_error());
 		result = -1;
 	}
 
 	cleanup_socket_layer();
+	module_unload_all();
+	router_free();
+	capture_close();
+	access_log_close();
+	slow_log_close();
 	return result;
 }
 
@@ -301,13 +856,12 @@ static int get_more_data(struct request *r, int client, struct pool *p,
 	const long bytes_needed, long bytes_received)
 {
 	// Get the data needed
-	printf("Have %lu bytes of content, Need to read in %lu more bytes\n",
+	LOG_DEBUG("Have %ld bytes of content, Need to read in %ld more bytes",
 		bytes_received, bytes_needed);
 
 	int err = str_alloc(p, bytes_needed, &r->post_params_buffer);
 	if (err) {
-		fprintf(stderr, "%s: Failed to allocate str: %i.\n",
-			__func__, err);
+		LOG_ERROR("%s: Failed to allocate str: %i.", __func__, err);
 		return err;
 	}
 	long bytes_read = 0;
@@ -318,13 +872,11 @@ static int get_more_data(struct request *r, int client, struct pool *p,
 		ssize_t in = read(client, r->post_params_buffer.s +
 			bytes_read, space);
 		if (in < 0) {
-			fprintf(stderr,
-				"Failed to read from client: %d.\n",
-				errno);
+			LOG_ERROR("Failed to read from client: %d.", errno);
 			err = errno;
 		} else {
 			bytes_read += in;
-			printf("Read %ld (%lu/%lu)\n", in, bytes_read,
+			LOG_DEBUG("Read %ld (%ld/%ld)", (long)in, bytes_read,
 				bytes_needed);
 		}
 	}
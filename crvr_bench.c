@@ -0,0 +1,832 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file contains crvr-bench, an HTTP/1.1 load generator for crvr.
+ *
+ * Each thread runs an epoll loop over its share of the connections. Every
+ * connection repeatedly picks an entry from the request mix and runs it:
+ * either a static GET, or an ASL quiz cycle, which GETs asl.html and then
+ * POSTs a grade to it like a user clicking through the quiz.
+ *
+ * Without -R each connection sends its next request as soon as the last one
+ * finishes. With -R the requests are sent on a fixed schedule and latency is
+ * measured from when each request should have been sent, so a stalled server
+ * isn't hidden by the requests that were never sent while it stalled
+ * (coordinated omission).
+ *
+ * Slow clients (-S) trickle their requests out a few bytes at a time. Their
+ * latency is reported separately, so the report shows how much they hold up
+ * everybody else.
+ */
+#define _GNU_SOURCE
+
+#include <arpa/inet.h>
+#include <assert.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hist.h"
+#include "utils.h"
+
+#define NS_PER_MS (1000000ull)
+#define NS_PER_SEC (1000000000ull)
+
+// The most entries the request mix can have.
+#define MAX_MIX 32
+// The space for a request. Requests are small, crvr only reads 8KiB.
+#define REQUEST_MAX (2 * KIBIBYTE)
+// The space for a response header. The body is counted, not stored.
+#define RESPONSE_HEADER_MAX (8 * KIBIBYTE)
+// The most events handled per epoll_wait call.
+#define MAX_EVENTS 64
+// How long a connection waits after an error before it tries again, so a
+// server that is down isn't hammered with connects.
+#define RETRY_DELAY_NS (10 * NS_PER_MS)
+
+/*
+ * The kinds of entries in the request mix.
+ */
+enum mix_kind {
+	MIX_GET,
+	MIX_ASL,
+};
+
+/*
+ * An entry in the request mix. Each time a connection starts a new entry it
+ * picks one with a probability proportional to its weight.
+ */
+struct mix_entry {
+	enum mix_kind kind;
+	const char *path;
+	unsigned weight;
+};
+
+/*
+ * The states a connection goes through for every request.
+ */
+enum conn_state {
+	CONN_IDLE,
+	CONN_CONNECTING,
+	CONN_SENDING,
+	CONN_READING,
+};
+
+struct conn {
+	int fd;
+	enum conn_state state;
+	int slow;
+	// The mix entry being run and the step within it.
+	const struct mix_entry *entry;
+	int step;
+	// When the request was scheduled to go out, and when it actually did.
+	uint64_t intended_ns;
+	uint64_t sent_ns;
+	uint64_t next_chunk_ns;
+	uint64_t deadline_ns;
+	char request[REQUEST_MAX];
+	size_t request_len;
+	size_t request_sent;
+	char header[RESPONSE_HEADER_MAX];
+	size_t header_len;
+	int header_done;
+	int status;
+	int server_closes;
+	// Set when the request went out on a kept-alive connection.
+	int reused;
+	long content_length;
+	long body_read;
+};
+
+/*
+ * The results gathered by a thread. They are merged after the run.
+ */
+struct stats {
+	uint64_t requests;
+	uint64_t slow_requests;
+	uint64_t bytes_read;
+	uint64_t connects;
+	uint64_t connect_errors;
+	uint64_t io_errors;
+	uint64_t timeouts;
+	uint64_t status[6];
+	struct hist latency;
+	struct hist uncorrected;
+	struct hist slow_latency;
+};
+
+struct thread {
+	pthread_t id;
+	int epoll;
+	struct conn *conns;
+	size_t conn_count;
+	uint64_t interval_ns;
+	uint64_t seed;
+	struct stats stats;
+};
+
+struct options {
+	const char *host;
+	struct sockaddr_in address;
+	unsigned long connections;
+	unsigned long threads;
+	unsigned long duration_s;
+	unsigned long rate;
+	unsigned long timeout_ms;
+	int keep_alive;
+	unsigned long slow_clients;
+	unsigned long trickle_bytes;
+	unsigned long trickle_ms;
+	struct mix_entry mix[MAX_MIX];
+	size_t mix_len;
+	unsigned mix_weight;
+};
+
+static struct options s_opts;
+static uint64_t s_start_ns;
+static uint64_t s_end_ns;
+static volatile sig_atomic_t s_stop = 0;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * A xorshift generator, so threads don't share rand()'s state.
+ */
+static uint64_t next_random(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+static void on_signal(int sig)
+{
+	(void)sig;
+	s_stop = 1;
+}
+
+static const struct mix_entry *pick_entry(struct thread *t)
+{
+	uint64_t pick = next_random(&t->seed) % s_opts.mix_weight;
+	for (size_t i = 0; i < s_opts.mix_len; ++i) {
+		if (pick < s_opts.mix[i].weight) return s_opts.mix + i;
+		pick -= s_opts.mix[i].weight;
+	}
+	return s_opts.mix + s_opts.mix_len - 1;
+}
+
+/*
+ * Fill in the connection's request buffer for the current step of its mix
+ * entry.
+ */
+static void build_request(struct thread *t, struct conn *c)
+{
+	static const char *const grades[] = {"poor", "good", "great"};
+	const char *connection = s_opts.keep_alive ? "keep-alive" : "close";
+	int len;
+
+	if ((c->entry->kind == MIX_ASL) && (c->step == 1)) {
+		const char *grade = grades[next_random(&t->seed) % LEN(grades)];
+		const size_t body_len = strlen("button=") + strlen(grade);
+		len = snprintf(c->request, sizeof(c->request),
+			"POST /asl.html HTTP/1.1\r\n"
+			"Host: %s\r\n"
+			"Content-Type: application/x-www-form-urlencoded\r\n"
+			"Content-Length: %zu\r\n"
+			"Connection: %s\r\n"
+			"\r\n"
+			"button=%s", s_opts.host, body_len, connection, grade);
+	} else {
+		const char *path = (c->entry->kind == MIX_ASL) ? "asl.html" :
+			c->entry->path;
+		len = snprintf(c->request, sizeof(c->request),
+			"GET /%s HTTP/1.1\r\n"
+			"Host: %s\r\n"
+			"Connection: %s\r\n"
+			"\r\n", path, s_opts.host, connection);
+	}
+	assert((len > 0) && ((size_t)len < sizeof(c->request)));
+	c->request_len = (size_t)len;
+	c->request_sent = 0;
+	c->header_len = 0;
+	c->header_done = 0;
+	c->status = 0;
+	c->server_closes = !s_opts.keep_alive;
+	c->content_length = -1;
+	c->body_read = 0;
+}
+
+static void close_conn(struct thread *t, struct conn *c)
+{
+	if (c->fd != -1) {
+		(void)epoll_ctl(t->epoll, EPOLL_CTL_DEL, c->fd, NULL);
+		close(c->fd);
+		c->fd = -1;
+	}
+}
+
+static int watch(struct thread *t, struct conn *c, uint32_t events, int op)
+{
+	struct epoll_event ev = {.events = events, .data.ptr = c};
+	if (epoll_ctl(t->epoll, op, c->fd, &ev) != 0) {
+		t->stats.io_errors++;
+		return errno;
+	}
+	return 0;
+}
+
+static int open_conn(struct thread *t, struct conn *c)
+{
+	c->fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+	if (c->fd == -1) {
+		t->stats.connect_errors++;
+		return errno;
+	}
+	const int one = 1;
+	(void)setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	t->stats.connects++;
+	if ((connect(c->fd, (struct sockaddr*)&s_opts.address,
+		sizeof(s_opts.address)) != 0) && (errno != EINPROGRESS))
+	{
+		t->stats.connect_errors++;
+		close(c->fd);
+		c->fd = -1;
+		return errno;
+	}
+	c->state = CONN_CONNECTING;
+	return watch(t, c, EPOLLOUT, EPOLL_CTL_ADD);
+}
+
+/*
+ * Drop the connection's request and schedule its next one. Without a rate
+ * the next request waits RETRY_DELAY_NS.
+ */
+static void abandon(struct thread *t, struct conn *c)
+{
+	close_conn(t, c);
+	c->state = CONN_IDLE;
+	c->entry = NULL;
+	if (t->interval_ns) {
+		c->intended_ns += t->interval_ns;
+	} else {
+		c->intended_ns = now_ns() + RETRY_DELAY_NS;
+	}
+}
+
+/*
+ * Handle a connection failing mid request. A kept-alive connection the server
+ * closed before answering is reopened and the request is sent again. Anything
+ * else is an error and the connection gives up on its mix entry.
+ */
+static void conn_failed(struct thread *t, struct conn *c)
+{
+	close_conn(t, c);
+	if (c->reused && !c->header_done && (c->header_len == 0)) {
+		c->reused = 0;
+		c->request_sent = 0;
+		if (open_conn(t, c) == 0) return;
+		close_conn(t, c);
+	}
+	t->stats.io_errors++;
+	abandon(t, c);
+}
+
+/*
+ * Start the connection's next request. If a rate was given the request keeps
+ * its place in the schedule even if it is late.
+ */
+static void start_request(struct thread *t, struct conn *c, uint64_t now)
+{
+	if (!c->entry || (c->entry->kind != MIX_ASL) || (c->step >= 1)) {
+		c->entry = pick_entry(t);
+		c->step = 0;
+	} else {
+		c->step++;
+	}
+	build_request(t, c);
+	if (t->interval_ns == 0) c->intended_ns = now;
+	c->deadline_ns = now + s_opts.timeout_ms * NS_PER_MS;
+	c->reused = (c->fd != -1);
+	if (c->fd == -1) {
+		if (open_conn(t, c) != 0) abandon(t, c);
+		return;
+	}
+	c->state = CONN_SENDING;
+	c->next_chunk_ns = now;
+	(void)watch(t, c, EPOLLOUT, EPOLL_CTL_MOD);
+}
+
+/*
+ * Send what the connection is allowed to send. Slow clients only send
+ * trickle_bytes every trickle_ms.
+ */
+static void send_some(struct thread *t, struct conn *c, uint64_t now)
+{
+	size_t want = c->request_len - c->request_sent;
+	if (c->slow) {
+		if (now < c->next_chunk_ns) return;
+		if (want > s_opts.trickle_bytes) want = s_opts.trickle_bytes;
+		c->next_chunk_ns = now + s_opts.trickle_ms * NS_PER_MS;
+	}
+	if (c->request_sent == 0) c->sent_ns = now;
+	const ssize_t sent = send(c->fd, c->request + c->request_sent, want,
+		MSG_NOSIGNAL);
+	if (sent < 0) {
+		if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+		conn_failed(t, c);
+		return;
+	}
+	c->request_sent += (size_t)sent;
+	if (c->request_sent == c->request_len) {
+		c->state = CONN_READING;
+		(void)watch(t, c, EPOLLIN, EPOLL_CTL_MOD);
+	}
+}
+
+/*
+ * Look through the complete response header for the status, the length of
+ * the body and whether the server is going to close the connection.
+ */
+static void parse_header(struct conn *c)
+{
+	c->header[c->header_len] = '\0';
+	if (sscanf(c->header, "HTTP/%*d.%*d %d", &c->status) != 1) {
+		c->status = 0;
+	}
+	for (char *line = strstr(c->header, "\r\n"); line;
+		line = strstr(line, "\r\n"))
+	{
+		line += 2;
+		if (strncasecmp(line, "Content-Length:", 15) == 0) {
+			c->content_length = strtol(line + 15, NULL, 10);
+		} else if (strncasecmp(line, "Connection: close", 17) == 0) {
+			c->server_closes = 1;
+		}
+	}
+}
+
+static void finish_request(struct thread *t, struct conn *c, uint64_t now)
+{
+	if (c->slow) {
+		hist_record(&t->stats.slow_latency, now - c->intended_ns);
+		t->stats.slow_requests++;
+	} else {
+		// Measuring from the intended send time already accounts for
+		// the requests a stall held back, so no samples are added.
+		hist_record(&t->stats.latency, now - c->intended_ns);
+		hist_record(&t->stats.uncorrected, now - c->sent_ns);
+		t->stats.requests++;
+	}
+	const int status_class = c->status / 100;
+	if ((status_class >= 1) && (status_class <= 5)) {
+		t->stats.status[status_class]++;
+	} else {
+		t->stats.status[0]++;
+	}
+	c->intended_ns += t->interval_ns;
+	if (c->server_closes) close_conn(t, c);
+	c->state = CONN_IDLE;
+	if (c->fd != -1) (void)watch(t, c, 0, EPOLL_CTL_MOD);
+}
+
+/*
+ * Returns nonzero if the header is an interim 1xx response, like 103 Early
+ * Hints, which the real response follows. 101 ends HTTP, so isn't.
+ */
+static int is_interim(const char *header)
+{
+	int status = 0;
+	if (sscanf(header, "HTTP/%*d.%*d %d", &status) != 1) return 0;
+	return (status >= 100) && (status < 200) && (status != 101);
+}
+
+static void read_some(struct thread *t, struct conn *c, uint64_t now)
+{
+	char scratch[64 * KIBIBYTE];
+	for (;;) {
+		char *dest = scratch;
+		size_t space = sizeof(scratch);
+		if (!c->header_done) {
+			dest = c->header + c->header_len;
+			space = sizeof(c->header) - 1 - c->header_len;
+		}
+		const ssize_t got = recv(c->fd, dest, space, 0);
+		if (got < 0) {
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) return;
+			conn_failed(t, c);
+			return;
+		}
+		if (got == 0) {
+			// A response without a length ends when the server
+			// closes.
+			if (c->header_done && (c->content_length < 0)) {
+				close_conn(t, c);
+				finish_request(t, c, now);
+			} else {
+				conn_failed(t, c);
+			}
+			return;
+		}
+		t->stats.bytes_read += (uint64_t)got;
+		if (!c->header_done) {
+			c->header_len += (size_t)got;
+			c->header[c->header_len] = '\0';
+			char *end = strstr(c->header, "\r\n\r\n");
+			while (end && is_interim(c->header)) {
+				const size_t size = (size_t)(end + 4 - c->header);
+				c->header_len -= size;
+				memmove(c->header, c->header + size,
+					c->header_len + 1);
+				end = strstr(c->header, "\r\n\r\n");
+			}
+			if (!end) {
+				if (c->header_len + 1 >= sizeof(c->header)) {
+					c->reused = 0;
+					conn_failed(t, c);
+					return;
+				}
+				continue;
+			}
+			const size_t header_size = (size_t)(end - c->header) + 4;
+			c->body_read = (long)(c->header_len - header_size);
+			c->header_len = header_size;
+			c->header_done = 1;
+			parse_header(c);
+		} else {
+			c->body_read += got;
+		}
+		if ((c->content_length >= 0) &&
+			(c->body_read >= c->content_length))
+		{
+			finish_request(t, c, now);
+			return;
+		}
+	}
+}
+
+static void handle_event(struct thread *t, struct conn *c, uint32_t events,
+	uint64_t now)
+{
+	if (c->state == CONN_IDLE) {
+		// The server hung up on a kept-alive connection.
+		if (events & (EPOLLERR | EPOLLHUP)) close_conn(t, c);
+		return;
+	}
+	if (c->state == CONN_CONNECTING) {
+		int err = 0;
+		socklen_t len = sizeof(err);
+		(void)getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+		if (err || (events & (EPOLLERR | EPOLLHUP))) {
+			t->stats.connect_errors++;
+			abandon(t, c);
+			return;
+		}
+		c->state = CONN_SENDING;
+		c->next_chunk_ns = now;
+	}
+	if (c->state == CONN_SENDING) {
+		send_some(t, c, now);
+	} else if (c->state == CONN_READING) {
+		read_some(t, c, now);
+	}
+}
+
+/*
+ * Run timers: start requests that are due, trickle slow clients and time out
+ * requests that have taken too long. Returns how many milliseconds epoll_wait
+ * may sleep.
+ */
+static int run_timers(struct thread *t, uint64_t now)
+{
+	uint64_t next = now + 100 * NS_PER_MS;
+	for (size_t i = 0; i < t->conn_count; ++i) {
+		struct conn *c = t->conns + i;
+		if (c->state == CONN_IDLE) {
+			if (c->intended_ns <= now) {
+				start_request(t, c, now);
+			} else if (c->intended_ns < next) {
+				next = c->intended_ns;
+				continue;
+			}
+		}
+		if ((c->state != CONN_IDLE) && (now >= c->deadline_ns)) {
+			t->stats.timeouts++;
+			abandon(t, c);
+			continue;
+		}
+		if ((c->state == CONN_SENDING) && c->slow) {
+			send_some(t, c, now);
+			if ((c->state == CONN_SENDING) && (c->next_chunk_ns < next))
+				next = c->next_chunk_ns;
+		}
+		if ((c->state != CONN_IDLE) && (c->deadline_ns < next))
+			next = c->deadline_ns;
+	}
+	// Round down. epoll_wait only has millisecond resolution, so the last
+	// fraction of a millisecond before a request is due is spent polling
+	// rather than sending the request late.
+	if (next <= now) return 0;
+	return (int)((next - now) / NS_PER_MS);
+}
+
+static void *run_thread(void *arg)
+{
+	struct thread *t = arg;
+	struct epoll_event events[MAX_EVENTS];
+
+	for (size_t i = 0; i < t->conn_count; ++i) {
+		// Spread the first requests over one interval.
+		t->conns[i].intended_ns = s_start_ns + (t->conn_count > 0 ?
+			(t->interval_ns * i) / t->conn_count : 0);
+	}
+	for (;;) {
+		uint64_t now = now_ns();
+		if (s_stop || (now >= s_end_ns)) break;
+		int timeout = run_timers(t, now);
+		const uint64_t left_ms = (s_end_ns - now) / NS_PER_MS + 1;
+		if ((uint64_t)timeout > left_ms) timeout = (int)left_ms;
+		const int n = epoll_wait(t->epoll, events, MAX_EVENTS, timeout);
+		if ((n < 0) && (errno != EINTR)) {
+			perror("epoll_wait failed");
+			break;
+		}
+		now = now_ns();
+		for (int i = 0; i < n; ++i) {
+			handle_event(t, events[i].data.ptr, events[i].events,
+				now);
+		}
+	}
+	for (size_t i = 0; i < t->conn_count; ++i) {
+		close_conn(t, t->conns + i);
+	}
+	return NULL;
+}
+
+static void print_latency(const char *name, const struct hist *h)
+{
+	if (h->total == 0) return;
+	printf("  %-12s p50 %9.3f ms  p90 %9.3f ms  p99 %9.3f ms  "
+		"p99.9 %9.3f ms  max %9.3f ms\n", name,
+		(double)hist_percentile(h, 50) / NS_PER_MS,
+		(double)hist_percentile(h, 90) / NS_PER_MS,
+		(double)hist_percentile(h, 99) / NS_PER_MS,
+		(double)hist_percentile(h, 99.9) / NS_PER_MS,
+		(double)h->max / NS_PER_MS);
+}
+
+static void report(const struct stats *s, double seconds)
+{
+	printf("%lu requests in %.2f s, %.2f MB read\n",
+		s->requests + s->slow_requests, seconds,
+		(double)s->bytes_read / MEGABYTE);
+	printf("  throughput   %.2f req/s, %.2f MB/s\n",
+		(double)(s->requests + s->slow_requests) / seconds,
+		(double)s->bytes_read / MEGABYTE / seconds);
+	printf("latency%s\n", s_opts.rate ?
+		" (corrected for coordinated omission)" : "");
+	print_latency("all", &s->latency);
+	if (s_opts.rate) {
+		printf("latency from when each request was actually sent\n");
+		print_latency("all", &s->uncorrected);
+	}
+	if (s->slow_requests) {
+		printf("slow clients (%lu requests)\n", s->slow_requests);
+		print_latency("slow", &s->slow_latency);
+	}
+	printf("status 1xx %lu, 2xx %lu, 3xx %lu, 4xx %lu, 5xx %lu, "
+		"other %lu\n", s->status[1], s->status[2], s->status[3],
+		s->status[4], s->status[5], s->status[0]);
+	printf("connects %lu, connect errors %lu, io errors %lu, "
+		"timeouts %lu\n", s->connects, s->connect_errors, s->io_errors,
+		s->timeouts);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options] [host] [port]\n"
+		"  -c n       connections (default 16)\n"
+		"  -t n       threads (default 2)\n"
+		"  -d s       duration in seconds (default 10)\n"
+		"  -R n       total requests per second, 0 for as fast as\n"
+		"             possible (default 0)\n"
+		"  -k         use keep-alive connections\n"
+		"  -g path[:weight]\n"
+		"             add a static GET to the mix, may be repeated\n"
+		"  -a weight  add ASL quiz cycles (GET then POST asl.html) to the\n"
+		"             mix\n"
+		"  -S n       how many of the connections are slow clients\n"
+		"  -b n       bytes a slow client sends at a time (default 1)\n"
+		"  -i ms      how long a slow client waits between sends\n"
+		"             (default 100)\n"
+		"  -T ms      request timeout (default 10000)\n"
+		"The host defaults to 127.0.0.1 and the port to 8080. Without -g\n"
+		"or -a the mix is GET index.html.\n", name);
+}
+
+static int add_mix(enum mix_kind kind, const char *path, unsigned weight)
+{
+	if (s_opts.mix_len >= LEN(s_opts.mix)) {
+		fprintf(stderr, "Too many mix entries, the max is %zu.\n",
+			LEN(s_opts.mix));
+		return ENOBUFS;
+	}
+	if (weight == 0) return 0;
+	// Paths are sent as /path, like crvr expects them.
+	while (path && (path[0] == '/')) path++;
+	s_opts.mix[s_opts.mix_len++] = (struct mix_entry){kind, path, weight};
+	s_opts.mix_weight += weight;
+	return 0;
+}
+
+static int parse_options(int argc, char *argv[])
+{
+	int opt;
+	int err = 0;
+
+	s_opts.connections = 16;
+	s_opts.threads = 2;
+	s_opts.duration_s = 10;
+	s_opts.timeout_ms = 10000;
+	s_opts.trickle_bytes = 1;
+	s_opts.trickle_ms = 100;
+	while (!err && ((opt = getopt(argc, argv, "c:t:d:R:kg:a:S:b:i:T:h"))
+		!= -1))
+	{
+		switch (opt) {
+		case 'c': s_opts.connections = strtoul(optarg, NULL, 10); break;
+		case 't': s_opts.threads = strtoul(optarg, NULL, 10); break;
+		case 'd': s_opts.duration_s = strtoul(optarg, NULL, 10); break;
+		case 'R': s_opts.rate = strtoul(optarg, NULL, 10); break;
+		case 'k': s_opts.keep_alive = 1; break;
+		case 'g': {
+			char *weight = strrchr(optarg, ':');
+			unsigned long w = 1;
+			if (weight) {
+				*weight = '\0';
+				w = strtoul(weight + 1, NULL, 10);
+			}
+			err = add_mix(MIX_GET, optarg, (unsigned)w);
+			break;
+		}
+		case 'a':
+			err = add_mix(MIX_ASL, NULL,
+				(unsigned)strtoul(optarg, NULL, 10));
+			break;
+		case 'S': s_opts.slow_clients = strtoul(optarg, NULL, 10); break;
+		case 'b': s_opts.trickle_bytes = strtoul(optarg, NULL, 10); break;
+		case 'i': s_opts.trickle_ms = strtoul(optarg, NULL, 10); break;
+		case 'T': s_opts.timeout_ms = strtoul(optarg, NULL, 10); break;
+		default:
+			usage(argv[0]);
+			return (opt == 'h') ? -1 : EINVAL;
+		}
+	}
+	if (err) return err;
+	if ((s_opts.connections == 0) || (s_opts.threads == 0) ||
+		(s_opts.duration_s == 0) || (s_opts.trickle_bytes == 0) ||
+		(s_opts.slow_clients > s_opts.connections))
+	{
+		usage(argv[0]);
+		return EINVAL;
+	}
+	if (s_opts.threads > s_opts.connections) {
+		s_opts.threads = s_opts.connections;
+	}
+	if (s_opts.mix_len == 0) {
+		(void)add_mix(MIX_GET, "index.html", 1);
+	}
+
+	s_opts.host = (optind < argc) ? argv[optind] : "127.0.0.1";
+	const char *port = (optind + 1 < argc) ? argv[optind + 1] : "8080";
+	struct addrinfo hints = {0};
+	struct addrinfo *found = NULL;
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	err = getaddrinfo(s_opts.host, port, &hints, &found);
+	if (err) {
+		fprintf(stderr, "Failed to look up %s:%s: %s\n", s_opts.host,
+			port, gai_strerror(err));
+		return EINVAL;
+	}
+	memcpy(&s_opts.address, found->ai_addr, sizeof(s_opts.address));
+	freeaddrinfo(found);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int err = parse_options(argc, argv);
+	if (err) return (err == -1) ? 0 : err;
+
+	struct sigaction sa = {0};
+	sa.sa_handler = on_signal;
+	(void)sigaction(SIGINT, &sa, NULL);
+	(void)sigaction(SIGTERM, &sa, NULL);
+
+	struct thread *threads = calloc(s_opts.threads, sizeof(*threads));
+	struct conn *conns = calloc(s_opts.connections, sizeof(*conns));
+	if (!threads || !conns) {
+		fprintf(stderr, "Failed to allocate connections.\n");
+		free(threads);
+		free(conns);
+		return ENOMEM;
+	}
+
+	// Slow clients are spread across the threads, then take the end of
+	// each thread's connections.
+	size_t first = 0;
+	for (size_t i = 0; i < s_opts.threads; ++i) {
+		struct thread *t = threads + i;
+		t->conn_count = s_opts.connections / s_opts.threads +
+			((i < s_opts.connections % s_opts.threads) ? 1 : 0);
+		t->conns = conns + first;
+		first += t->conn_count;
+		if (s_opts.rate) {
+			t->interval_ns = (NS_PER_SEC * s_opts.connections) /
+				s_opts.rate;
+		}
+		t->seed = 0x9e3779b97f4a7c15ull * (i + 1);
+		hist_reset(&t->stats.latency);
+		hist_reset(&t->stats.uncorrected);
+		hist_reset(&t->stats.slow_latency);
+	}
+	for (size_t i = 0; i < s_opts.connections; ++i) {
+		conns[i].fd = -1;
+		conns[i].state = CONN_IDLE;
+	}
+	for (size_t i = 0; i < s_opts.slow_clients; ++i) {
+		struct thread *t = threads + (i % s_opts.threads);
+		t->conns[t->conn_count - 1 - i / s_opts.threads].slow = 1;
+	}
+
+	printf("Running %lus against %s:%hu with %lu connections on %lu "
+		"threads%s\n", s_opts.duration_s, s_opts.host,
+		ntohs(s_opts.address.sin_port), s_opts.connections,
+		s_opts.threads, s_opts.keep_alive ? ", keep-alive" : "");
+	s_start_ns = now_ns();
+	s_end_ns = s_start_ns + s_opts.duration_s * NS_PER_SEC;
+	size_t started = 0;
+	for (; started < s_opts.threads; ++started) {
+		struct thread *t = threads + started;
+		t->epoll = epoll_create1(0);
+		if ((t->epoll == -1) ||
+			(pthread_create(&t->id, NULL, run_thread, t) != 0))
+		{
+			fprintf(stderr, "Failed to start thread %zu.\n",
+				started);
+			s_stop = 1;
+			err = EAGAIN;
+			break;
+		}
+	}
+
+	struct stats total = {0};
+	hist_reset(&total.latency);
+	hist_reset(&total.uncorrected);
+	hist_reset(&total.slow_latency);
+	for (size_t i = 0; i < started; ++i) {
+		struct thread *t = threads + i;
+		(void)pthread_join(t->id, NULL);
+		close(t->epoll);
+		total.requests += t->stats.requests;
+		total.slow_requests += t->stats.slow_requests;
+		total.bytes_read += t->stats.bytes_read;
+		total.connects += t->stats.connects;
+		total.connect_errors += t->stats.connect_errors;
+		total.io_errors += t->stats.io_errors;
+		total.timeouts += t->stats.timeouts;
+		for (size_t s = 0; s < LEN(total.status); ++s) {
+			total.status[s] += t->stats.status[s];
+		}
+		hist_merge(&total.latency, &t->stats.latency);
+		hist_merge(&total.uncorrected, &t->stats.uncorrected);
+		hist_merge(&total.slow_latency, &t->stats.slow_latency);
+	}
+	const double seconds = (double)(now_ns() - s_start_ns) / NS_PER_SEC;
+	if (!err) report(&total, seconds);
+
+	free(conns);
+	free(threads);
+	return err;
+}
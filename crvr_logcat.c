@@ -0,0 +1,236 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file contains crvr-logcat, which decodes the binary access logs crvr
+ * writes with -a into text, one line per request, or CSV for spreadsheets and
+ * scripts.
+ *
+ * Files are decoded in the order they're given, so to read a rotated log
+ * oldest first pass access.log.4 ... access.log.1 access.log.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "access_log.h"
+#include "utils.h"
+
+/*
+ * A path defined in the file being decoded. It points into the mapped file.
+ */
+struct path_def {
+	const char *path;
+	uint32_t len;
+};
+
+static int s_csv = 0;
+static struct path_def *s_paths = NULL;
+static size_t s_path_cap = 0;
+
+static const char *method_name(uint8_t method)
+{
+	switch (method) {
+	case ACCESS_METHOD_GET: return "GET";
+	case ACCESS_METHOD_POST: return "POST";
+	default: return "-";
+	}
+}
+
+static void print_time(uint64_t time_ns)
+{
+	const time_t seconds = (time_t)(time_ns / 1000000000u);
+	struct tm tm;
+	char date[32] = "?";
+
+	if (gmtime_r(&seconds, &tm)) {
+		(void)strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+	}
+	printf("%s.%06u", date, (unsigned)(time_ns % 1000000000u / 1000u));
+}
+
+static int define_path(const struct access_path *def, size_t avail)
+{
+	if ((def->path_id == 0) || (sizeof(*def) + def->len > avail)) {
+		return EINVAL;
+	}
+	if (def->path_id >= s_path_cap) {
+		size_t cap = s_path_cap ? s_path_cap : 256;
+		while (cap <= def->path_id) cap *= 2;
+		struct path_def *bigger = realloc(s_paths, cap * sizeof(*bigger));
+		if (!bigger) return ENOMEM;
+		memset(bigger + s_path_cap, 0,
+			(cap - s_path_cap) * sizeof(*bigger));
+		s_paths = bigger;
+		s_path_cap = cap;
+	}
+	s_paths[def->path_id].path = (const char*)(def + 1);
+	s_paths[def->path_id].len = def->len;
+	return 0;
+}
+
+static void print_request(const struct access_request *r)
+{
+	struct path_def path = {"-", 1};
+	if ((r->path_id < s_path_cap) && s_paths[r->path_id].path) {
+		path = s_paths[r->path_id];
+	}
+	char peer[INET_ADDRSTRLEN] = "?";
+	struct in_addr addr = { r->peer_addr };
+	(void)inet_ntop(AF_INET, &addr, peer, sizeof(peer));
+
+	print_time(r->time_ns);
+	if (s_csv) {
+		printf(",%s,%u,%s,\"", peer, r->peer_port,
+			method_name(r->method));
+		for (uint32_t i = 0; i < path.len; ++i) {
+			if (path.path[i] == '"') putchar('"');
+			putchar(path.path[i]);
+		}
+		printf("\",%u,%u,%lu,%u,%u,%u,%u,%lu\n", r->status, r->bytes_in,
+			(unsigned long)r->bytes_out, r->recv_ns, r->parse_ns,
+			r->handle_ns, r->write_ns, (unsigned long)r->total_ns);
+		return;
+	}
+	printf(" %s:%u %s \"%.*s\" %u in=%u out=%lu recv=%.1fus parse=%.1fus "
+		"handle=%.1fus write=%.1fus total=%.1fus\n", peer, r->peer_port,
+		method_name(r->method), (int)path.len, path.path, r->status,
+		r->bytes_in, (unsigned long)r->bytes_out, r->recv_ns / 1e3,
+		r->parse_ns / 1e3, r->handle_ns / 1e3, r->write_ns / 1e3,
+		(double)r->total_ns / 1e3);
+}
+
+/*
+ * Decode every entry in a mapped log file.
+ */
+static int decode(const char *name, const char *data, size_t size)
+{
+	struct access_log_header header;
+	if ((size < sizeof(header)) || (memcmp(data, ACCESS_LOG_MAGIC,
+		sizeof(ACCESS_LOG_MAGIC)) != 0))
+	{
+		fprintf(stderr, "%s is not an access log.\n", name);
+		return EINVAL;
+	}
+	memcpy(&header, data, sizeof(header));
+	if (header.version != ACCESS_LOG_VERSION) {
+		fprintf(stderr, "%s is version %u, only version %i can be "
+			"decoded.\n", name, header.version, ACCESS_LOG_VERSION);
+		return EINVAL;
+	}
+
+	// Ids are only good for the file that defined them.
+	if (s_paths) memset(s_paths, 0, s_path_cap * sizeof(*s_paths));
+	size_t offset = sizeof(header);
+	while (offset + sizeof(struct access_entry) <= size) {
+		struct access_entry entry;
+		memcpy(&entry, data + offset, sizeof(entry));
+		if (entry.type == ACCESS_END) break;
+		if ((entry.size < sizeof(entry)) || (entry.size % 8) ||
+			(offset + entry.size > size))
+		{
+			fprintf(stderr, "%s: bad entry at offset %zu.\n", name,
+				offset);
+			return EINVAL;
+		}
+		if (entry.type == ACCESS_PATH) {
+			// Entries are 8 byte aligned, so the path can be used
+			// where it is in the file.
+			const int err = (entry.size < sizeof(struct access_path)) ?
+				EINVAL : define_path((const struct access_path*)
+				(data + offset), entry.size);
+			if (err) {
+				fprintf(stderr, "%s: bad path at offset %zu.\n",
+					name, offset);
+				return err;
+			}
+		} else if ((entry.type == ACCESS_REQUEST) &&
+			(entry.size >= sizeof(struct access_request)))
+		{
+			struct access_request r;
+			memcpy(&r, data + offset, sizeof(r));
+			print_request(&r);
+		}
+		// Unknown entries are skipped so newer writers stay readable.
+		offset += entry.size;
+	}
+	return 0;
+}
+
+static int decode_file(const char *path)
+{
+	const int fd = open(path, O_RDONLY);
+	if (fd == -1) {
+		fprintf(stderr, "Failed to open %s: %i\n", path, errno);
+		return errno;
+	}
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		const int err = errno;
+		fprintf(stderr, "Failed to stat %s: %i\n", path, err);
+		close(fd);
+		return err;
+	}
+	if (st.st_size == 0) {
+		close(fd);
+		fprintf(stderr, "%s is empty.\n", path);
+		return EINVAL;
+	}
+	const size_t size = (size_t)st.st_size;
+	void *data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED) {
+		fprintf(stderr, "Failed to map %s: %i\n", path, errno);
+		return errno;
+	}
+	const int err = decode(path, data, size);
+	(void)munmap(data, size);
+	return err;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-c] access_log...\n"
+		"  -c  print CSV with a header row instead of text\n",
+		name);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt;
+
+	while ((opt = getopt(argc, argv, "ch")) != -1) {
+		switch (opt) {
+		case 'c': s_csv = 1; break;
+		default:
+			usage(argv[0]);
+			return (opt == 'h') ? 0 : EINVAL;
+		}
+	}
+	if (optind >= argc) {
+		usage(argv[0]);
+		return EINVAL;
+	}
+
+	if (s_csv) {
+		printf("time,peer,port,method,path,status,bytes_in,bytes_out,"
+			"recv_ns,parse_ns,handle_ns,write_ns,total_ns\n");
+	}
+	int result = 0;
+	for (int i = optind; i < argc; ++i) {
+		const int err = decode_file(argv[i]);
+		if (err) result = err;
+	}
+	free(s_paths);
+	return result;
+}
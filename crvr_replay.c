@@ -0,0 +1,368 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file contains crvr-replay, which sends the requests in a capture file
+ * made with crvr -c back to a server.
+ *
+ * The requests are sent one at a time, in the order they were captured, each
+ * on its own connection, so a replay against the same build from the same
+ * starting state gets the same responses. Each response's status and size are
+ * compared to the ones that were captured, and every difference is reported.
+ *
+ * By default requests are sent at the times they were captured. -s scales
+ * those times, -s 2 replays twice as fast, and -s 0 sends each request as soon
+ * as the last response arrives.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "capture.h"
+#include "hist.h"
+#include "utils.h"
+
+#define NS_PER_MS (1000000ull)
+#define NS_PER_SEC (1000000000ull)
+
+// The most differences printed unless -v is given.
+#define MAX_REPORTED 20
+// The room for a request to start with. Bigger ones grow it.
+#define REQUEST_CAP_INITIAL (8 * KIBIBYTE)
+
+/*
+ * What came back for a replayed request.
+ */
+struct reply {
+	int status;
+	uint64_t bytes;
+};
+
+struct options {
+	const char *capture_path;
+	struct sockaddr_in address;
+	double speed;
+	unsigned long limit;
+	unsigned long timeout_ms;
+	int verbose;
+};
+
+static struct options s_opts;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * NS_PER_SEC + (uint64_t)ts.tv_nsec;
+}
+
+static void sleep_until(uint64_t when_ns)
+{
+	struct timespec ts = {
+		(time_t)(when_ns / NS_PER_SEC), (long)(when_ns % NS_PER_SEC)
+	};
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) ==
+		EINTR);
+}
+
+/*
+ * Returns nonzero if the header is an interim 1xx response, like 103 Early
+ * Hints, which the real response follows. 101 ends HTTP, so isn't.
+ */
+static int is_interim(const char *header)
+{
+	int status = 0;
+	if (sscanf(header, "HTTP/%*d.%*d %d", &status) != 1) return 0;
+	return (status >= 100) && (status < 200) && (status != 101);
+}
+
+/*
+ * Send a request on a new connection and read the response until the server
+ * closes the connection or the whole body has arrived.
+ */
+static int replay_request(const char *request, size_t len, struct reply *out)
+{
+	char buf[64 * KIBIBYTE];
+	char header[8 * KIBIBYTE];
+	size_t header_len = 0;
+	long content_length = -1;
+	uint64_t body = 0;
+	// The bytes of interim responses before the real one.
+	uint64_t skipped = 0;
+	int header_done = 0;
+
+	out->status = 0;
+	out->bytes = 0;
+
+	const int fd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (fd == -1) return errno;
+	struct timeval timeout = {
+		(time_t)(s_opts.timeout_ms / 1000),
+		(suseconds_t)((s_opts.timeout_ms % 1000) * 1000)
+	};
+	(void)setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+		sizeof(timeout));
+	(void)setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout,
+		sizeof(timeout));
+	if (connect(fd, (struct sockaddr*)&s_opts.address,
+		sizeof(s_opts.address)) != 0)
+	{
+		const int err = errno;
+		close(fd);
+		return err;
+	}
+	for (size_t sent = 0; sent < len;) {
+		const ssize_t n = send(fd, request + sent, len - sent,
+			MSG_NOSIGNAL);
+		if (n < 0) {
+			const int err = errno;
+			close(fd);
+			return err;
+		}
+		sent += (size_t)n;
+	}
+
+	int err = 0;
+	for (;;) {
+		const ssize_t n = recv(fd, buf, sizeof(buf), 0);
+		if (n < 0) {
+			if (errno == EINTR) continue;
+			// A reset after the response is still the response.
+			if ((errno != ECONNRESET) || !header_done) err = errno;
+			break;
+		}
+		if (n == 0) break;
+		out->bytes += (uint64_t)n;
+		if (!header_done) {
+			size_t copy = (size_t)n;
+			if (copy > sizeof(header) - 1 - header_len) {
+				copy = sizeof(header) - 1 - header_len;
+			}
+			memcpy(header + header_len, buf, copy);
+			header_len += copy;
+			header[header_len] = '\0';
+			char *end = strstr(header, "\r\n\r\n");
+			while (end && is_interim(header)) {
+				const size_t size = (size_t)(end + 4 - header);
+				header_len -= size;
+				memmove(header, header + size, header_len + 1);
+				skipped += size;
+				end = strstr(header, "\r\n\r\n");
+			}
+			if (!end) continue;
+			header_done = 1;
+			body = out->bytes - skipped - (uint64_t)(end + 4 - header);
+			if (sscanf(header, "HTTP/%*d.%*d %d", &out->status) != 1)
+				out->status = 0;
+			for (char *line = strstr(header, "\r\n"); line && line < end;
+				line = strstr(line + 2, "\r\n"))
+			{
+				if (strncmp(line + 2, "Content-Length:", 15) == 0) {
+					content_length = strtol(line + 17, NULL, 10);
+				}
+			}
+		} else {
+			body += (uint64_t)n;
+		}
+		if (header_done && (content_length >= 0) &&
+			(body >= (uint64_t)content_length))
+		{
+			break;
+		}
+	}
+	close(fd);
+	return err;
+}
+
+/*
+ * Print the first line of a request, which has the method and path.
+ */
+static void print_request_line(const char *request, size_t len)
+{
+	size_t line = 0;
+	while ((line < len) && (request[line] != '\r') &&
+		(request[line] != '\n'))
+	{
+		++line;
+	}
+	printf("\"%.*s\"", (int)line, request);
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-s speed] [-n count] [-T ms] [-v] capture_file "
+		"[host] [port]\n"
+		"  -s  replay speed: 1 as captured (default), 2 twice as fast,\n"
+		"      0 as fast as the server responds\n"
+		"  -n  only replay the first count requests\n"
+		"  -T  timeout for each request in milliseconds (default 10000)\n"
+		"  -v  print every difference, not just the first %i\n"
+		"The host defaults to 127.0.0.1 and the port to 8080.\n",
+		name, MAX_REPORTED);
+}
+
+static int parse_options(int argc, char *argv[])
+{
+	int opt;
+
+	s_opts.speed = 1;
+	s_opts.timeout_ms = 10000;
+	while ((opt = getopt(argc, argv, "s:n:T:vh")) != -1) {
+		switch (opt) {
+		case 's': s_opts.speed = strtod(optarg, NULL); break;
+		case 'n': s_opts.limit = strtoul(optarg, NULL, 10); break;
+		case 'T': s_opts.timeout_ms = strtoul(optarg, NULL, 10); break;
+		case 'v': s_opts.verbose = 1; break;
+		default:
+			usage(argv[0]);
+			return (opt == 'h') ? -1 : EINVAL;
+		}
+	}
+	if ((optind >= argc) || (s_opts.speed < 0)) {
+		usage(argv[0]);
+		return EINVAL;
+	}
+	s_opts.capture_path = argv[optind];
+	const char *host = (optind + 1 < argc) ? argv[optind + 1] : "127.0.0.1";
+	const char *port = (optind + 2 < argc) ? argv[optind + 2] : "8080";
+
+	struct addrinfo hints = {0};
+	struct addrinfo *found = NULL;
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	const int err = getaddrinfo(host, port, &hints, &found);
+	if (err) {
+		fprintf(stderr, "Failed to look up %s:%s: %s\n", host, port,
+			gai_strerror(err));
+		return EINVAL;
+	}
+	memcpy(&s_opts.address, found->ai_addr, sizeof(s_opts.address));
+	freeaddrinfo(found);
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	int err = parse_options(argc, argv);
+	if (err) return (err == -1) ? 0 : err;
+
+	FILE *f = fopen(s_opts.capture_path, "rb");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s: %i\n", s_opts.capture_path,
+			errno);
+		return errno;
+	}
+	struct capture_file_header header;
+	if ((fread(&header, sizeof(header), 1, f) != 1) ||
+		(memcmp(header.magic, CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC)) != 0)
+		|| (header.version != CAPTURE_VERSION))
+	{
+		fprintf(stderr, "%s is not a version %i capture file.\n",
+			s_opts.capture_path, CAPTURE_VERSION);
+		fclose(f);
+		return EINVAL;
+	}
+
+	static struct hist latency;
+	hist_reset(&latency);
+	// Allocated up front, so even an empty first request has somewhere
+	// to go.
+	size_t request_cap = REQUEST_CAP_INITIAL;
+	char *request = malloc(request_cap);
+	if (!request) {
+		fclose(f);
+		return ENOMEM;
+	}
+	unsigned long replayed = 0;
+	unsigned long status_diffs = 0;
+	unsigned long size_diffs = 0;
+	unsigned long failures = 0;
+	uint64_t max_lag = 0;
+	const uint64_t start = now_ns();
+	struct capture_record record;
+	while ((!s_opts.limit || (replayed < s_opts.limit)) &&
+		(fread(&record, sizeof(record), 1, f) == 1))
+	{
+		if (record.request_len > request_cap) {
+			char *bigger = realloc(request, record.request_len);
+			if (!bigger) {
+				err = ENOMEM;
+				break;
+			}
+			request = bigger;
+			request_cap = record.request_len;
+		}
+		if (fread(request, 1, record.request_len, f) !=
+			record.request_len)
+		{
+			fprintf(stderr, "Capture file is truncated.\n");
+			err = EIO;
+			break;
+		}
+
+		if (s_opts.speed > 0) {
+			const uint64_t due = start + (uint64_t)((double)
+				record.offset_ns / s_opts.speed);
+			const uint64_t now = now_ns();
+			if (now < due) sleep_until(due);
+			else if (now - due > max_lag) max_lag = now - due;
+		}
+		const uint64_t sent = now_ns();
+		struct reply reply;
+		const int replay_err = replay_request(request,
+			record.request_len, &reply);
+		hist_record(&latency, now_ns() - sent);
+		replayed++;
+
+		const int status_diff = reply.status != record.status;
+		const int size_diff = reply.bytes != record.response_bytes;
+		if (replay_err) failures++;
+		if (status_diff) status_diffs++;
+		if (size_diff) size_diffs++;
+		if ((replay_err || status_diff || size_diff) &&
+			(s_opts.verbose || (status_diffs + size_diffs + failures <=
+			MAX_REPORTED)))
+		{
+			printf("#%lu ", replayed);
+			print_request_line(request, record.request_len);
+			if (replay_err) printf(" failed: %s", strerror(replay_err));
+			printf(" status %i (captured %u), %lu bytes (captured "
+				"%lu)\n", reply.status, record.status, reply.bytes,
+				record.response_bytes);
+		}
+	}
+	fclose(f);
+	free(request);
+
+	const double seconds = (double)(now_ns() - start) / NS_PER_SEC;
+	printf("Replayed %lu requests in %.2f s (%.2f req/s)\n", replayed,
+		seconds, seconds > 0 ? (double)replayed / seconds : 0);
+	printf("  %lu status differences, %lu size differences, %lu failed\n",
+		status_diffs, size_diffs, failures);
+	if (s_opts.speed > 0) {
+		printf("  fell at most %.3f ms behind the captured timing\n",
+			(double)max_lag / NS_PER_MS);
+	}
+	if (replayed > 0) {
+		printf("  latency p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, "
+			"p99.9 %.3f ms, max %.3f ms\n",
+			(double)hist_percentile(&latency, 50) / NS_PER_MS,
+			(double)hist_percentile(&latency, 90) / NS_PER_MS,
+			(double)hist_percentile(&latency, 99) / NS_PER_MS,
+			(double)hist_percentile(&latency, 99.9) / NS_PER_MS,
+			(double)latency.max / NS_PER_MS);
+	}
+	if (!err && (status_diffs || size_diffs || failures)) err = 1;
+	return err;
+}
@@ -0,0 +1,213 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file defines a log-linear histogram in the style of HdrHistogram. Each
+ * power of two is split into HIST_SUB_COUNT linear buckets, so every recorded
+ * value lands in a bucket no wider than about 3% of the value, and the whole
+ * range of a uint64_t fits in a fixed array of counts.
+ *
+ * A hist has one writer. Recording is a couple of relaxed loads and stores,
+ * so any number of other threads may read or merge it while it is being
+ * written without taking a lock. The counts they see may be a few records
+ * behind.
+ */
+#ifndef HIST_H
+#define HIST_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+// The number of bits of precision below the most significant bit.
+#define HIST_SUB_BITS 5
+// The number of linear buckets per power of two.
+#define HIST_SUB_COUNT (1u << HIST_SUB_BITS)
+// The number of buckets needed to cover every uint64_t value.
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+/*
+ * Stores the counts of the values recorded in each bucket along with the
+ * number of values, their sum and their extremes.
+ */
+struct hist {
+	_Atomic uint64_t counts[HIST_BUCKETS];
+	_Atomic uint64_t total;
+	_Atomic uint64_t sum;
+	_Atomic uint64_t min;
+	_Atomic uint64_t max;
+};
+
+/*
+ * Empty the histogram. This must be called before the first record, a zeroed
+ * hist is not valid because its min would be 0.
+ *
+ * h - The histogram to reset.
+ */
+void hist_reset(struct hist *h);
+
+/*
+ * Record a value in the histogram.
+ *
+ * h - The histogram to record to.
+ * value - The value to record.
+ */
+void hist_record(struct hist *h, uint64_t value);
+
+/*
+ * Record a value that was measured by something expected to take a sample
+ * every expected_interval, correcting for coordinated omission.
+ *
+ * When a measurement stalls, the samples that should have been taken during
+ * the stall are never taken, so the stall is under-represented. This records
+ * the samples that were missed, each expected_interval shorter than the last,
+ * the same way HdrHistogram does.
+ *
+ * h - The histogram to record to.
+ * value - The value to record.
+ * expected_interval - The expected time between samples. If 0, only value is
+ *                     recorded.
+ */
+void hist_record_corrected(struct hist *h, uint64_t value,
+	uint64_t expected_interval);
+
+/*
+ * Add the counts in src to dst. dst must have a single writer, the caller.
+ *
+ * dst - The histogram to add to.
+ * src - The histogram to add.
+ */
+void hist_merge(struct hist *dst, const struct hist *src);
+
+/*
+ * Get the value at a percentile.
+ *
+ * h - The histogram to query.
+ * percentile - The percentile, 0 to 100.
+ *
+ * Returns the highest value that can be in the bucket holding the percentile,
+ * clamped to the largest value recorded. Returns 0 if the hist is empty.
+ */
+uint64_t hist_percentile(const struct hist *h, double percentile);
+
+/*
+ * Get the bucket a value is counted in.
+ *
+ * value - The value to find the bucket for.
+ *
+ * Returns the index of the bucket in counts.
+ */
+unsigned hist_bucket(uint64_t value);
+
+/*
+ * Get the largest value that is counted in a bucket.
+ *
+ * bucket - The index of the bucket in counts.
+ *
+ * Returns the upper bound of the bucket, inclusive.
+ */
+uint64_t hist_bucket_max(unsigned bucket);
+
+/*
+ * If you set this #define, the functions definitions will be included in the
+ * current file.
+ */
+#ifdef DEFINE_HIST
+
+#include <assert.h>
+
+#define HIST_LOAD(a) atomic_load_explicit(&(a), memory_order_relaxed)
+#define HIST_STORE(a, v) atomic_store_explicit(&(a), (v), memory_order_relaxed)
+
+void hist_reset(struct hist *h)
+{
+	for (unsigned i = 0; i < HIST_BUCKETS; ++i) {
+		HIST_STORE(h->counts[i], 0);
+	}
+	HIST_STORE(h->total, 0);
+	HIST_STORE(h->sum, 0);
+	HIST_STORE(h->min, UINT64_MAX);
+	HIST_STORE(h->max, 0);
+}
+
+unsigned hist_bucket(uint64_t value)
+{
+	if (value < HIST_SUB_COUNT) return (unsigned)value;
+	const unsigned msb = 63u - (unsigned)__builtin_clzll(value);
+	const unsigned shift = msb - HIST_SUB_BITS;
+	const unsigned sub = (unsigned)(value >> shift) & (HIST_SUB_COUNT - 1);
+	return (shift + 1) * HIST_SUB_COUNT + sub;
+}
+
+uint64_t hist_bucket_max(unsigned bucket)
+{
+	assert(bucket < HIST_BUCKETS);
+	if (bucket < HIST_SUB_COUNT) return bucket;
+	const unsigned shift = bucket / HIST_SUB_COUNT - 1;
+	const uint64_t sub = bucket % HIST_SUB_COUNT;
+	const uint64_t low = (HIST_SUB_COUNT + sub) << shift;
+	return low + ((uint64_t)1 << shift) - 1;
+}
+
+void hist_record(struct hist *h, uint64_t value)
+{
+	// Single writer, so load and store instead of the locked fetch_add.
+	const unsigned bucket = hist_bucket(value);
+	HIST_STORE(h->counts[bucket], HIST_LOAD(h->counts[bucket]) + 1);
+	HIST_STORE(h->total, HIST_LOAD(h->total) + 1);
+	HIST_STORE(h->sum, HIST_LOAD(h->sum) + value);
+	if (value < HIST_LOAD(h->min)) HIST_STORE(h->min, value);
+	if (value > HIST_LOAD(h->max)) HIST_STORE(h->max, value);
+}
+
+void hist_record_corrected(struct hist *h, uint64_t value,
+	uint64_t expected_interval)
+{
+	hist_record(h, value);
+	if (expected_interval == 0) return;
+	for (uint64_t missed = value; missed > expected_interval;) {
+		missed -= expected_interval;
+		hist_record(h, missed);
+	}
+}
+
+void hist_merge(struct hist *dst, const struct hist *src)
+{
+	for (unsigned i = 0; i < HIST_BUCKETS; ++i) {
+		const uint64_t count = HIST_LOAD(src->counts[i]);
+		if (count) HIST_STORE(dst->counts[i],
+			HIST_LOAD(dst->counts[i]) + count);
+	}
+	HIST_STORE(dst->total, HIST_LOAD(dst->total) + HIST_LOAD(src->total));
+	HIST_STORE(dst->sum, HIST_LOAD(dst->sum) + HIST_LOAD(src->sum));
+	if (HIST_LOAD(src->min) < HIST_LOAD(dst->min))
+		HIST_STORE(dst->min, HIST_LOAD(src->min));
+	if (HIST_LOAD(src->max) > HIST_LOAD(dst->max))
+		HIST_STORE(dst->max, HIST_LOAD(src->max));
+}
+
+uint64_t hist_percentile(const struct hist *h, double percentile)
+{
+	const uint64_t total = HIST_LOAD(h->total);
+	if (total == 0) return 0;
+	if (percentile < 0) percentile = 0;
+	if (percentile > 100) percentile = 100;
+
+	uint64_t wanted = (uint64_t)((percentile / 100.0) * (double)total + 0.5);
+	if (wanted == 0) wanted = 1;
+	uint64_t seen = 0;
+	const uint64_t max = HIST_LOAD(h->max);
+	for (unsigned i = 0; i < HIST_BUCKETS; ++i) {
+		seen += HIST_LOAD(h->counts[i]);
+		if (seen >= wanted) {
+			const uint64_t value = hist_bucket_max(i);
+			return (value < max) ? value : max;
+		}
+	}
+	return max;
+}
+
+#undef HIST_LOAD
+#undef HIST_STORE
+
+#endif // DEFINE_HIST
+
+#endif // HIST_H
@@ -11,6 +11,9 @@
 #include <string.h>
 #include <unistd.h>
 
+#include "iobuf.h"
+#include "log.h"
+#include "timing.h"
 #include "utils.h"
 
 const char ok_header[] = "HTTP/1.1 200 OK";
@@ -18,11 +21,32 @@ static const struct str s_index_page = STR("index.html");
 static const struct str s_line_end = STR("\r\n");
 static const struct str s_post_param_delimiter = STR("=");
 static const struct str s_header_param_delimiter = STR(": ");
+static const struct str s_form_urlencoded =
+	STR("application/x-www-form-urlencoded");
+
+static struct response_stats s_response_stats;
 
 // Local functions
 static int add_param_to_request(struct request *r, struct http_param *param);
 static int add_post_param(struct request *r, struct http_param *param);
 
+/**
+ * @brief Parse an application/x-www-form-urlencoded buffer into params.
+ *
+ * The buffer is split on '&' into key=value pairs and each key and value is
+ * percent-decoded in place. A pair without an '=' gets an empty value.
+ *
+ * @param[in,out] buf - The buffer to parse. It is decoded in place.
+ * @param[out] params - The array to store the params in.
+ * @param[in] max_params - The number of params that fit in params.
+ * @param[out] param_count - The number of params stored in params.
+ *
+ * @return Returns 0 if the buffer was parsed. Returns ENOBUFS if there were
+ *         more params than fit in params. Otherwise returns an error code.
+ */
+static int parse_urlencoded(struct str buf, struct http_param *params,
+	long max_params, long *param_count);
+
 /**
  * @brief Parse the line into an http_param.
  *
@@ -55,6 +79,17 @@ static int parse_request_buffer(struct request *request, struct pool *p);
  */
 static int modify_path(struct request *r, struct pool *p);
 
+void response_stats_reset(void)
+{
+	s_response_stats.status = 0;
+	s_response_stats.bytes = 0;
+}
+
+const struct response_stats *response_stats_get(void)
+{
+	return &s_response_stats;
+}
+
 int find_param(const struct request *r, const char *param_name,
 	struct http_param *out)
 {
@@ -87,6 +122,22 @@ int find_post_param(const struct request *r, const char *param_name,
 	return ENOENT;
 }
 
+int find_query_param(const struct request *r, const char *param_name,
+	struct http_param *out)
+{
+	if (!r || !param_name || !out) return EINVAL;
+
+	static_assert(SIZE_MAX > LONG_MAX, "Update cast below");
+	assert((size_t)r->query_param_count <= LEN(r->query_params));
+	for (long i = 0; i < r->query_param_count; ++i) {
+		if (str_cmp_cstr(&r->query_params[i].key, param_name) == 0) {
+			*out = r->query_params[i];
+			return 0;
+		}
+	}
+	return ENOENT;
+}
+
 int header_find_value(struct request *r, const char *key, struct str *value)
 {
 	if (!r || !key || !value) return EINVAL;
@@ -129,9 +180,8 @@ static int parse_header_options(struct str rest_of_header, struct request *r)
 		struct str line;
 		int err = str_get_substr(&rest_of_header, 0, eol, &line);
 		if (err) {
-			fputs("Failed to get line from \"", stderr);
-			str_print(stderr, &rest_of_header);
-			fprintf(stderr, "\": %i\n", err);
+			LOG_WARN("Failed to get line from \"%.*s\": %i",
+				(int)rest_of_header.len, rest_of_header.s, err);
 			return err;
 		}
 
@@ -141,15 +191,14 @@ static int parse_header_options(struct str rest_of_header, struct request *r)
 		error = parse_into_param(&line, &s_header_param_delimiter,
 			&param);
 		if (error) {
-			fputs("Failed to parse param \"", stderr);
-			str_print(stderr, &line);
-			fprintf(stderr, "\": %i\n", error);
+			LOG_WARN("Failed to parse param \"%.*s\": %i",
+				(int)line.len, line.s, error);
 			return error;
 		}
 		error = add_param_to_request(r, &param);
 	}
 
-	printf("Found %lu headers.\n", r->header_count);
+	LOG_DEBUG("Found %ld headers.", r->header_count);
 	return 0;
 }
 
@@ -178,7 +227,7 @@ int parse_request(char *data, long data_len, struct request *request,
 	// If we didn't find the end of the header, refuse to parse it. Probably
 	// need a bigger buffer.
 	if (end_of_header == -1) {
-		DEBUG("No end to header found\n");
+		DEBUG("No end to header found");
 		return ENOBUFS;
 	}
 
@@ -186,13 +235,44 @@ int parse_request(char *data, long data_len, struct request *request,
 		header_separator.len, EOSTR, &request->post_params_buffer);
 	err = parse_request_buffer(request, p);
 	if (err) {
-		fprintf(stderr, "Failed to parse request buffer %d.\n", err);
+		LOG_WARN("Failed to parse request buffer %d.", err);
 		return err;
 	}
 
 	return 0;
 }
 
+/*
+ * Count the times c appears in s.
+ */
+static long count_char(const struct str *s, char c)
+{
+	long count = 0;
+	for (long i = 0; i < s->len; ++i) {
+		if (s->s[i] == c) ++count;
+	}
+	return count;
+}
+
+/*
+ * Returns nonzero if one of the /-separated segments of path is "..", which
+ * would climb out of the web root.
+ */
+static int has_parent_segment(const struct str *path)
+{
+	long start = 0;
+	for (long i = 0; i <= path->len; ++i) {
+		if ((i < path->len) && (path->s[i] != '/')) continue;
+		if ((i - start == 2) && (path->s[start] == '.') &&
+			(path->s[start + 1] == '.'))
+		{
+			return 1;
+		}
+		start = i + 1;
+	}
+	return 0;
+}
+
 /*
  * Parse the buffer in the request. Determine if it is a POST or GET request
  * and parse its parameters storing the data in the request itself.
@@ -202,6 +282,7 @@ static int parse_request_buffer(struct request *request, struct pool *p)
 	static const struct str eol = STR("\r\n");
 	static const struct str header_end = STR("\r\n\r\n");
 	static const struct str space = STR(" ");
+	static const struct str s_query_start = STR("?");
 
 	// Type, path and format are all on the first line.
 	struct str req_buf = request->buffer;
@@ -209,31 +290,28 @@ static int parse_request_buffer(struct request *request, struct pool *p)
 	long end_of_line = str_find_substr(&req_buf, &eol);
 	if (end_of_line == -1) {
 		// Uh... wut? We should have at least one EOL.
-		fputs("Did not find EOL in header. Header:\n", stderr);
-		str_print(stderr, &request->buffer);
-		fputs("\n", stderr);
+		LOG_WARN("Did not find EOL in header. Header:\n%.*s",
+			(int)request->buffer.len, request->buffer.s);
 		return EINVAL;
 	}
 	struct str header;
 	int err = str_get_substr(&req_buf, 0, end_of_line, &header);
 	if (err) {
-		fprintf(stderr, "Failed to substr the header: %i\n", err);
+		LOG_WARN("Failed to substr the header: %i", err);
 		return err;
 	}
 
 	// Find the space between GET\POST and the path.
 	long req_type_end = str_find_substr(&header, &space);
 	if (req_type_end == -1) {
-		fputs("Did not find GET\\POST to path space in header. Header: \"",
-			stderr);
-		str_print(stderr, &header);
-		fputs("\"\n", stderr);
+		LOG_WARN("Did not find GET\\POST to path space in header. "
+			"Header: \"%.*s\"", (int)header.len, header.s);
 		return EINVAL;
 	}
 	struct str req_type;
 	err = str_get_substr(&header, 0, req_type_end, &req_type);
 	if (err) {
-		fprintf(stderr, "Failed to substr request type: %i\n", err);
+		LOG_WARN("Failed to substr request type: %i", err);
 		return err;
 	}
 
@@ -243,9 +321,8 @@ static int parse_request_buffer(struct request *request, struct pool *p)
 	} else if (str_cmp_cstr(&req_type, "POST") == 0) {
 		request->type = POST;
 	} else {
-		fputs("Unrecognized request type \"", stderr);
-		str_print(stderr, &req_type);
-		fputs("\"\n", stderr);
+		LOG_WARN("Unrecognized request type \"%.*s\"", (int)req_type.len,
+			req_type.s);
 		return EINVAL;
 	}
 
@@ -253,14 +330,13 @@ static int parse_request_buffer(struct request *request, struct pool *p)
 	err = str_get_substr(&header, req_type_end + space.len, EOSTR,
 		&request->path);
 	if (err) {
-		fprintf(stderr, "Failed to substr path: %i\n", err);
+		LOG_WARN("Failed to substr path: %i", err);
 		return err;
 	}
 	long path_end = str_find_substr(&request->path, &space);
 	if (path_end == -1) {
-		fprintf(stderr, "Failed to find path end: \"");
-		str_print(stderr, &header);
-		fprintf(stderr, "\"\n");
+		LOG_WARN("Failed to find path end: \"%.*s\"", (int)header.len,
+			header.s);
 		return EINVAL;
 	}
 	request->path.len = path_end;
@@ -269,14 +345,56 @@ static int parse_request_buffer(struct request *request, struct pool *p)
 	err = str_get_substr(&header, req_type.len + space.len +
 		request->path.len + space.len, EOSTR, &request->format);
 	if (err) {
-		fprintf(stderr, "Failed to substr format: %i\n", err);
+		LOG_WARN("Failed to substr format: %i", err);
+		return err;
+	}
+
+	// Split the query string off of the path, then decode both in place.
+	const long query_start = str_find_substr(&request->path, &s_query_start);
+	if (query_start != -1) {
+		err = str_get_substr(&request->path, query_start +
+			s_query_start.len, EOSTR, &request->query);
+		if (err) {
+			LOG_WARN("Failed to substr query: %i", err);
+			return err;
+		}
+		request->path.len = query_start;
+		err = parse_urlencoded(request->query, request->query_params,
+			(long)LEN(request->query_params),
+			&request->query_param_count);
+		if (err) {
+			LOG_WARN("Failed to parse query string: %i", err);
+			return err;
+		}
+	}
+	const long slashes = count_char(&request->path, '/');
+	err = percent_decode(&request->path, 0);
+	if (err) {
+		LOG_WARN("Failed to decode path: %i", err);
 		return err;
 	}
+	// The path is opened relative to the web root, so refuse one that
+	// climbs out of it, including with a / or .. that was encoded.
+	if ((count_char(&request->path, '/') != slashes) ||
+		has_parent_segment(&request->path))
+	{
+		LOG_WARN("Refusing path outside the web root: \"%.*s\"",
+			(int)request->path.len, request->path.s);
+		return EACCES;
+	}
+	// A decoded %00 would silently truncate the path when it is handed to
+	// fopen, so refuse it.
+	static_assert(SIZE_MAX > LONG_MAX, "Update cast below");
+	if ((request->path.len > 0) &&
+		memchr(request->path.s, '\0', (size_t)request->path.len))
+	{
+		LOG_WARN("Refusing path with an embedded NUL.");
+		return EINVAL;
+	}
 
 	err = modify_path(request, p);
 	if (err) {
-		fprintf(stderr, "%s> failed to modify path: %i\n", __func__,
-			err);
+		LOG_WARN("%s> failed to modify path: %i", __func__, err);
 		return err;
 	}
 
@@ -285,7 +403,7 @@ static int parse_request_buffer(struct request *request, struct pool *p)
 	err = str_get_substr(&req_buf, header.len + eol.len, eoh,
 		&rest_of_header);
 	if (err) {
-		fprintf(stderr, "Failed to substr rest of header: %i\n", err);
+		LOG_WARN("Failed to substr rest of header: %i", err);
 		return err;
 	}
 	parse_header_options(rest_of_header, request);
@@ -298,10 +416,25 @@ int parse_post_parameters(struct request *r)
 
 	r->post_param_count = 0;
 	if (r->post_params_buffer.len <= 0) {
-		printf("%s> No post params\n", __func__);
+		LOG_DEBUG("%s> No post params", __func__);
 		return 0;
 	}
 
+	struct str content_type = {0};
+	if ((header_find_value(r, "Content-Type", &content_type) == 0) &&
+		(content_type.len >= s_form_urlencoded.len) &&
+		(str_cmp_cstr(&content_type, s_form_urlencoded.s) == 0))
+	{
+		int err = parse_urlencoded(r->post_params_buffer,
+			r->post_params, (long)LEN(r->post_params),
+			&r->post_param_count);
+		if (err) {
+			LOG_WARN("%s> Failed to parse form body: %i", __func__,
+				err);
+		}
+		return err;
+	}
+
 	struct str buf = r->post_params_buffer;
 	// Need to fix the cast below if this static assert fails.
 	static_assert((size_t)LONG_MAX > LEN(r->post_params),
@@ -314,10 +447,9 @@ int parse_post_parameters(struct request *r)
 		if (eol != -1) {
 			int err = str_get_substr(&buf, 0, eol, &line);
 			if (err) {
-				fprintf(stderr, "%s> Failed to get substr. eol=%li, buf=\"",
-					__func__, eol);
-				str_print(stderr, &buf);
-				fprintf(stderr, "\": %i\n", err);
+				LOG_WARN("%s> Failed to get substr. eol=%li, "
+					"buf=\"%.*s\": %i", __func__, eol,
+					(int)buf.len, buf.s, err);
 				return err;
 			}
 		} else {
@@ -327,16 +459,14 @@ int parse_post_parameters(struct request *r)
 		int err = parse_into_param(&line, &s_post_param_delimiter,
 			&param);
 		if (err) {
-			fprintf(stderr, "%s> Failed to parse param from \"",
-				__func__);
-			str_print(stderr, &line);
-			fprintf(stderr, "\": %i\n", err);
+			LOG_WARN("%s> Failed to parse param from \"%.*s\": %i",
+				__func__, (int)line.len, line.s, err);
 			return err;
 		}
 		err = add_post_param(r, &param);
 		if (err) {
-			fprintf(stderr, "%s> add post param failed: %i\n",
-				__func__, err);
+			LOG_WARN("%s> add post param failed: %i", __func__,
+				err);
 			return err;
 		}
 		buf.len -= line.len;
@@ -377,47 +507,129 @@ void print_request(struct request *r)
 	}
 }
 
+/*
+ * Note the status of the response being sent, from its header.
+ */
+static void note_status(const char *header)
+{
+	// The status code follows the version: "HTTP/1.1 200 OK".
+	const char *status = strchr(header, ' ');
+	if (status) {
+		s_response_stats.status = (int)strtol(status + 1, NULL, 10);
+	}
+}
+
 int send_data(int client, const char *header, const char *contents,
 	size_t content_len)
 {
-	static char buffer[MEGABYTE];
-	int bytes;
-
-	memset(buffer, 0, LEN(buffer));
-
-	bytes = snprintf(buffer, STRMAX(buffer),
-		"%s\r\nContent Length: %lu\r\n\r\n", header, content_len);
-	if (bytes < 0) {
-		fprintf(stderr, "Buf write failure. %d.\n", errno);
-		return errno;
+	struct iobuf *io = iobuf_get();
+	if (!io) return ENOMEM;
+	const int bytes = snprintf(io->data, IOBUF_SIZE,
+		"%s\r\nContent-Length: %lu\r\n\r\n", header, content_len);
+	if ((bytes < 0) || (bytes >= IOBUF_SIZE)) {
+		LOG_ERROR("Buf write failure. %d.", errno);
+		iobuf_put(io);
+		return (bytes < 0) ? errno : ENOBUFS;
 	}
 
 	// Send header
-	ssize_t bytes_sent = write(client, buffer, (size_t)bytes);
+	const uint64_t write_start = monotonic_ns();
+	ssize_t bytes_sent = write(client, io->data, (size_t)bytes);
+	timing_add(TIMING_WRITE, write_start);
+	iobuf_put(io);
 	if (bytes_sent == -1) {
-		fprintf(stderr, "Failed to write buffer to client! %d\n",
-			errno);
+		LOG_ERROR("Failed to write buffer to client! %d", errno);
 		return -1;
 	}
 	if (bytes_sent != bytes) {
-		fprintf(stderr, "Only sent %ld of %d of header\n", bytes_sent,
+		LOG_ERROR("Only sent %ld of %d of header", (long)bytes_sent,
 			bytes);
 		return -1;
 	}
-	printf("Sent %ld byte header and ", bytes_sent);
+	s_response_stats.bytes += (uint64_t)bytes_sent;
+	note_status(header);
 
 	// Send contents
+	const uint64_t contents_start = monotonic_ns();
 	bytes_sent = write(client, contents, content_len);
+	timing_add(TIMING_WRITE, contents_start);
 	if (bytes_sent == -1) {
-		perror("Failed to write buffer to client.");
+		LOG_ERROR("Failed to write buffer to client: %d", errno);
 		return errno;
 	}
 	if ((size_t)bytes_sent != content_len) {
-		fprintf(stderr, "Only sent %ld of %ld of the content.\n",
-			bytes_sent, content_len);
+		LOG_ERROR("Only sent %ld of %zu of the content.",
+			(long)bytes_sent, content_len);
 		return -1;
 	}
-	printf("%ld byte content.\n", bytes_sent);
+	LOG_DEBUG("Sent %d byte header and %ld byte content.", bytes,
+		(long)bytes_sent);
+	s_response_stats.bytes += (uint64_t)bytes_sent;
+	return 0;
+}
+
+/*
+ * Write all of iov, picking up where a partial write left off. iov is
+ * advanced past what was written.
+ *
+ * Returns 0 if everything was written. Otherwise returns an error code.
+ */
+static int write_iov(int client, struct iovec *iov, int count, size_t *sent)
+{
+	int first = 0;
+	*sent = 0;
+	while (first < count) {
+		const ssize_t out = writev(client, iov + first, count - first);
+		if (out == -1) {
+			if (errno == EINTR) continue;
+			return errno;
+		}
+		*sent += (size_t)out;
+		size_t left = (size_t)out;
+		while ((first < count) && (left >= iov[first].iov_len)) {
+			left -= iov[first].iov_len;
+			++first;
+		}
+		if (first < count) {
+			iov[first].iov_base = (char*)iov[first].iov_base + left;
+			iov[first].iov_len -= left;
+		}
+	}
+	return 0;
+}
+
+int send_iov(int client, const char *header, struct iovec *iov, int count)
+{
+	if (!header || !iov || (count < 1)) return EINVAL;
+	size_t content_len = 0;
+	for (int i = 1; i < count; ++i) content_len += iov[i].iov_len;
+
+	struct iobuf *io = iobuf_get();
+	if (!io) return ENOMEM;
+	const int bytes = snprintf(io->data, IOBUF_SIZE,
+		"%s\r\nContent-Length: %zu\r\n\r\n", header, content_len);
+	if ((bytes < 0) || (bytes >= IOBUF_SIZE)) {
+		LOG_ERROR("Buf write failure. %d.", errno);
+		iobuf_put(io);
+		return (bytes < 0) ? errno : ENOBUFS;
+	}
+	iov[0].iov_base = io->data;
+	iov[0].iov_len = (size_t)bytes;
+
+	const uint64_t write_start = monotonic_ns();
+	size_t sent = 0;
+	const int err = write_iov(client, iov, count, &sent);
+	timing_add(TIMING_WRITE, write_start);
+	iobuf_put(io);
+	s_response_stats.bytes += (uint64_t)sent;
+	if (sent >= (size_t)bytes) note_status(header);
+	if (err) {
+		LOG_ERROR("Failed to write to client after %zu of %zu bytes: "
+			"%d", sent, (size_t)bytes + content_len, err);
+		return err;
+	}
+	LOG_DEBUG("Sent %d byte header and %zu byte content.", bytes,
+		content_len);
 	return 0;
 }
 
@@ -426,19 +638,18 @@ int send_path(struct str *file_path, int client, struct pool *p)
 	char path[PATH_MAX + 1] = {0};
 	int err = str_copy_to_cstr(file_path, path, PATH_MAX);
 	if (err) {
-		fprintf(stderr, "Failed to copy path to c-string: %i\n", err);
+		LOG_ERROR("Failed to copy path to c-string: %i", err);
 		return err;
 	}
-	FILE *f = fopen(path, "r");
+	FILE *f = open_file(path);
 	if (!f) {
-		fprintf(stderr, "Failed to open file \"%s\": %i\n", path,
-			errno);
+		LOG_WARN("Failed to open file \"%s\": %i", path, errno);
 		return errno;
 	}
 	err = send_file(f, client, p);
 	fclose(f);
 	if (err)
-		fprintf(stderr, "send_file failed for \"%s\": %i\n", path, err);
+		LOG_ERROR("send_file failed for \"%s\": %i", path, err);
 	return err;
 }
 
@@ -451,33 +662,33 @@ int send_file(FILE *f, int client, struct pool *p)
 
 	(void)p;
 
+	const uint64_t read_start = monotonic_ns();
 	if (fseek(f, 0, SEEK_END) != 0) {
-		perror("Failed to seek to the end of the file.\n");
+		LOG_ERROR("Failed to seek to the end of the file: %d", errno);
 		return -1;
 	}
 	file_size = ftell(f);
 	if (file_size < 0) {
-		perror("Failed to read the file size of the file.\n");
+		LOG_ERROR("Failed to read the file size of the file: %d", errno);
 		return -1;
 	}
 	if (fseek(f, 0, SEEK_SET) != 0) {
-		perror("Failed to seek to beginning of the file.\n");
+		LOG_ERROR("Failed to seek to beginning of the file: %d", errno);
 		return -1;
 	}
-	printf("File is %lu bytes.\n", file_size);
+	LOG_DEBUG("File is %ld bytes.", file_size);
 
 	long pool_cap = pool_get_remaining_capacity(p);
 	if (pool_cap < file_size) {
-		fprintf(stderr, "%s> No pool space. Needed %li have %li\n",
-			__func__, file_size, pool_cap);
+		LOG_ERROR("%s> No pool space. Needed %li have %li", __func__,
+			file_size, pool_cap);
 		return ENOBUFS;
 	}
 	long pool_pos = pool_get_position(p);
 	assert(pool_pos != -1);
 	contents = pool_alloc(p, file_size);
 	if (!contents) {
-		fprintf(stderr, "Failed to allocate buffer for file: %d.\n",
-			errno);
+		LOG_ERROR("Failed to allocate buffer for file: %d.", errno);
 		return errno;
 	}
 
@@ -485,17 +696,18 @@ int send_file(FILE *f, int client, struct pool *p)
 	
 	chars_read = fread((void*)contents, sizeof(*contents),
 		(size_t)file_size, f);
+	timing_add(TIMING_FILE, read_start);
 	if (chars_read == (size_t)file_size) {
 		result = send_data(client, ok_header, contents,
 			(size_t)file_size);
 	} else {
-		printf("Failed to read in file: %lu of %ld\n", chars_read,
+		LOG_ERROR("Failed to read in file: %zu of %ld", chars_read,
 			file_size);
 		result = errno;
 	}
 
 	if (result != 0) {
-		fprintf(stderr, "Failed to send message.\n");
+		LOG_ERROR("Failed to send message.");
 		result = errno;
 	}
 	pool_reset(p, pool_pos);
@@ -503,6 +715,55 @@ int send_file(FILE *f, int client, struct pool *p)
 	return result;
 }
 
+/*
+ * Write a response that is only a status line and header lines, with no
+ * Content-Length and no body.
+ *
+ * interim - Nonzero for a 1xx the real response follows, whose status isn't
+ *           the response's.
+ */
+static int send_head(int client, const char *status, const char *lines,
+	int interim)
+{
+	struct iobuf *io = iobuf_get();
+	if (!io) return ENOMEM;
+	const int bytes = snprintf(io->data, IOBUF_SIZE, "%s\r\n%s\r\n\r\n",
+		status, lines);
+	int err = ((bytes < 0) || (bytes >= IOBUF_SIZE)) ? ENOBUFS : 0;
+	if (!err) {
+		const uint64_t write_start = monotonic_ns();
+		const ssize_t sent = write(client, io->data, (size_t)bytes);
+		timing_add(TIMING_WRITE, write_start);
+		if (sent == -1) {
+			err = errno;
+		} else {
+			s_response_stats.bytes += (uint64_t)sent;
+			if (sent != bytes) err = EIO;
+		}
+	}
+	iobuf_put(io);
+	if (err) {
+		LOG_ERROR("Failed to send \"%s\": %i", status, err);
+	} else if (!interim) {
+		note_status(status);
+	}
+	return err;
+}
+
+int send_early_hints(int client, const struct request *r, const char *links)
+{
+	static const struct str http_1_1 = STR("HTTP/1.1");
+	if (!r || !links || !links[0]) return 0;
+	if (str_cmp(&r->format, &http_1_1) != 0) return 0;
+	return send_head(client, "HTTP/1.1 103 Early Hints", links, 1);
+}
+
+int send_switching_protocols(int client, const char *lines)
+{
+	if (!lines) return EINVAL;
+	return send_head(client, "HTTP/1.1 101 Switching Protocols", lines, 0);
+}
+
 int send_404(int client)
 {
 	static const char html[] = 
@@ -519,6 +780,88 @@ int send_404(int client)
 	return send_data(client, header, html, STRMAX(html));
 }
 
+/**
+ * @brief Convert a hex digit to its value.
+ *
+ * @param[in] c - The character to convert.
+ *
+ * @return Returns the value of the digit, or -1 if c isn't a hex digit.
+ */
+static int hex_value(char c)
+{
+	if ((c >= '0') && (c <= '9')) return c - '0';
+	if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+	if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+	return -1;
+}
+
+int percent_decode(struct str *s, int plus_as_space)
+{
+	if (!s || (s->len < 0)) return EINVAL;
+
+	// dst never passes src, so the decode can happen in place.
+	long dst = 0;
+	for (long src = 0; src < s->len; ++src, ++dst) {
+		char c = s->s[src];
+		if ((c == '%') && (src + 2 < s->len)) {
+			const int high = hex_value(s->s[src + 1]);
+			const int low = hex_value(s->s[src + 2]);
+			if ((high != -1) && (low != -1)) {
+				c = (char)((high << 4) | low);
+				src += 2;
+			}
+		} else if (plus_as_space && (c == '+')) {
+			c = ' ';
+		}
+		s->s[dst] = c;
+	}
+	s->len = dst;
+	return 0;
+}
+
+static int parse_urlencoded(struct str buf, struct http_param *params,
+	long max_params, long *param_count)
+{
+	static const struct str pair_delimiter = STR("&");
+
+	if (!params || !param_count || (max_params <= 0)) return EINVAL;
+
+	*param_count = 0;
+	while (buf.len > 0) {
+		struct str pair = buf;
+		const long pair_end = str_find_substr(&buf, &pair_delimiter);
+		if (pair_end != -1) {
+			pair.len = pair_end;
+			buf.s += pair_end + pair_delimiter.len;
+			buf.len -= pair_end + pair_delimiter.len;
+		} else {
+			buf.len = 0;
+		}
+		// Skip the empty pairs from "a=b&&c=d" or a trailing '&'.
+		if (pair.len == 0) continue;
+		if (*param_count >= max_params) return ENOBUFS;
+
+		struct http_param *param = params + *param_count;
+		const long delim = str_find_substr(&pair,
+			&s_post_param_delimiter);
+		param->key = pair;
+		if (delim == -1) {
+			param->value = (struct str){pair.s + pair.len, 0};
+		} else {
+			param->key.len = delim;
+			param->value.s = pair.s + delim +
+				s_post_param_delimiter.len;
+			param->value.len = pair.len - delim -
+				s_post_param_delimiter.len;
+		}
+		int err = percent_decode(&param->key, 1);
+		if (!err) err = percent_decode(&param->value, 1);
+		if (err) return err;
+		(*param_count)++;
+	}
+	return 0;
+}
+
 static int add_post_param(struct request *r, struct http_param *param)
 {
 	if (!r || !param) return EINVAL;
@@ -542,26 +885,21 @@ static int parse_into_param(struct str *str, const struct str *delimiter,
 
 	const long delim_location = str_find_substr(str, delimiter);
 	if (delim_location == -1) {
-		fputs("Failed to find delimiter for \"", stderr);
-		str_print(stderr, str);
-		fputs("\"\n", stderr);
+		LOG_WARN("Failed to find delimiter for \"%.*s\"", (int)str->len,
+			str->s);
 		return EPROTO;
 	}
 	int err = str_get_substr(str, 0, delim_location, &param->key);
 	if (err) {
-		fprintf(stderr, "Failed to get key from [0, %li] in \"",
-			delim_location);
-		str_print(stderr, str);
-		fprintf(stderr, "\": %i\n", err);
+		LOG_WARN("Failed to get key from [0, %li] in \"%.*s\": %i",
+			delim_location, (int)str->len, str->s, err);
 		return err;
 	}
 	const long value_start = delim_location + delimiter->len;
 	err = str_get_substr(str, value_start, EOSTR, &param->value);
 	if (err) {
-		fprintf(stderr, "Failed to get value from [%li, -1] in \"",
-			value_start);
-		str_print(stderr, str);
-		fprintf(stderr, "\": %i\n", err);
+		LOG_WARN("Failed to get value from [%li, -1] in \"%.*s\": %i",
+			value_start, (int)str->len, str->s, err);
 		return err;
 	}
 	return 0;
@@ -603,8 +941,7 @@ static int modify_path(struct request *r, struct pool *p)
 		long space_needed = r->path.len + s_index_page.len;
 		int error = str_alloc(p, space_needed, &actual_path);
 		if (error) {
-			fprintf(stderr, "Failed to allocate actual path: %i.\n",
-				error);
+			LOG_ERROR("Failed to allocate actual path: %i.", error);
 			return EINVAL;
 		}
 		assert(actual_path.len == space_needed);
@@ -614,7 +951,7 @@ static int modify_path(struct request *r, struct pool *p)
 		static_assert(SIZE_MAX > LONG_MAX, "Update case below");
 		(void)memcpy(actual_path.s, r->path.s,
 			(size_t)r->path.len);
-		(void)strncat(actual_path.s + actual_path.len, s_index_page.s,
+		(void)memcpy(actual_path.s + r->path.len, s_index_page.s,
 			(size_t)s_index_page.len);
 
 		r->path = actual_path;
@@ -8,6 +8,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/uio.h>
 
 #include "pool.h"
 #include "str.h"
@@ -20,6 +21,9 @@
 #define MAX_HEADER_LINES 32
 // The maximum number of post parameters that can be processed in a reqest.
 #define MAX_POST_PARAMS 32
+// The maximum number of query string parameters that can be processed in a
+// request.
+#define MAX_QUERY_PARAMS 32
 
 /**
  * @brief The supported HTTP request types.
@@ -43,6 +47,7 @@ struct http_param {
 struct request {
 	enum request_type type;
 	struct str path;
+	struct str query;
 	struct str format;
 	long header_count;
 	struct http_param headers[MAX_HEADER_LINES];
@@ -50,6 +55,18 @@ struct request {
 	struct str post_params_buffer;
 	long post_param_count;
 	struct http_param post_params[MAX_POST_PARAMS]; 
+	long query_param_count;
+	struct http_param query_params[MAX_QUERY_PARAMS];
+};
+
+/**
+ * @brief What has been sent in response to the current request.
+ */
+struct response_stats {
+	// The status code of the response. 0 if nothing has been sent.
+	int status;
+	// The bytes written to the client, header and content.
+	uint64_t bytes;
 };
 
 /*
@@ -57,6 +74,21 @@ struct request {
  */
 extern const char ok_header[];
 
+/**
+ * @brief Clear the response stats before handling a new request.
+ */
+void response_stats_reset(void);
+
+/**
+ * @brief Get the stats for the response to the current request.
+ *
+ * send_data updates the stats every time it sends something, so after a
+ * request has been handled they describe everything that was sent for it.
+ *
+ * @return Returns the stats for the current response.
+ */
+const struct response_stats *response_stats_get(void);
+
 /**
  * @brief Searches for a parameter in the http request.
  *
@@ -83,6 +115,23 @@ int find_param(const struct request *r, const char *param_name,
 int find_post_param(const struct request *r, const char *param_name,
 	struct http_param *out);
 
+/**
+ * @brief Searches the query string params in the request.
+ *
+ * The query string is the part of the request path after the '?'. It is split
+ * off of the path and parsed by parse_request, so the params are always
+ * available, already percent-decoded.
+ *
+ * @param[in] r - The request to search.
+ * @param[in] param_name - The name of the parameter to search for.
+ * @param[out] out - A location to store the parameter key and value.
+ *
+ * @return Returns 0 if the parameter was found or ENOENT if it wasn't found.
+ *         Returns an error code on error.
+ */
+int find_query_param(const struct request *r, const char *param_name,
+	struct http_param *out);
+
 /**
  * @brief Lookup a header parameter in the request.
  *
@@ -110,6 +159,23 @@ int header_find_value(struct request *r, const char *key, struct str *value);
 int parse_request(char *data, long data_len, struct request *request,
 	struct pool *p);
 
+/**
+ * @brief Decode the %XX escapes in a str in place.
+ *
+ * The decoded form of a string is never longer than the encoded form, so the
+ * decoding is done in the str's own buffer and its len is shrunk to fit. An
+ * escape that isn't followed by two hex digits is left as is, the same way
+ * browsers treat it.
+ *
+ * @param[in,out] s - The str to decode.
+ * @param[in] plus_as_space - If nonzero, '+' is decoded to ' ' as it is in
+ *                            query strings and form bodies. Paths should pass
+ *                            0.
+ *
+ * @return Returns 0 if the str was decoded. Otherwise returns an error code.
+ */
+int percent_decode(struct str *s, int plus_as_space);
+
 /**
  * @brief Set up the post_params array from the post_params_buffer.
  *
@@ -123,6 +189,10 @@ int parse_request(char *data, long data_len, struct request *request,
  * array. Then a module can call find_post_param to look up each param as
  * needed.
  *
+ * If the request's Content-Type is application/x-www-form-urlencoded the
+ * buffer is split on '&' and each key and value is percent-decoded in place,
+ * the same as the query string. Otherwise each line is a key=value pair.
+ *
  * @param[in] r - The request to parse the POST params for.
  *
  * @return Returns 0 if no error occurs. Otherwise returns an error code.
@@ -150,6 +220,21 @@ void print_request(struct request *r);
 int send_data(int client, const char *header, const char *contents,
 	size_t content_len);
 
+/*
+ * Sends a response gathered from several buffers to the client with the
+ * specified header, in one writev.
+ *
+ * client - The client to send the data to.
+ * header - The HTTP response header to send with the data.
+ * iov - The buffers to send. iov[0] is set to the header, so the contents
+ *       start at iov[1]. iov is changed as it is written.
+ * count - The number of entries in iov, including the header's.
+ *
+ * Returns 0 if the data was sent to the client. Otherwise returns an error
+ * code.
+ */
+int send_iov(int client, const char *header, struct iovec *iov, int count);
+
 /**
  * @file Sends the file with the specified path to a client.
  *
@@ -175,6 +260,31 @@ int send_path(struct str *file_path, int client, struct pool *p);
  */
 int send_file(FILE *f, int client, struct pool *p);
 
+/*
+ * Send a 103 Early Hints interim response, so the client can start fetching
+ * what the real response will need while it's being made. Clients older than
+ * HTTP/1.1 don't expect interim responses and aren't sent one.
+ *
+ * client - The client to send the hints to.
+ * r - The request being answered.
+ * links - The Link header lines, separated by "\r\n".
+ *
+ * Returns 0 if the hints were sent or weren't needed. Otherwise returns an
+ * error code.
+ */
+int send_early_hints(int client, const struct request *r, const char *links);
+
+/*
+ * Send 101 Switching Protocols, after which the connection speaks the
+ * protocol the client asked to upgrade to.
+ *
+ * client - The client to send it to.
+ * lines - The header lines, separated by "\r\n".
+ *
+ * Returns 0 if it was sent. Otherwise returns an error code.
+ */
+int send_switching_protocols(int client, const char *lines);
+
 /*
  * Sends the 404 error code to the client.
  *
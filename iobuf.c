@@ -0,0 +1,155 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * Defines the I/O buffers.
+ *
+ * A slab's buffers are one aligned allocation, with their headers kept in the
+ * slab beside it so each buffer is a full IOBUF_SIZE bytes. A slab counts how
+ * many of its buffers are free, and one whose buffers are all free can be
+ * released by unlinking them from the free list.
+ */
+#include "iobuf.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+
+#include "log.h"
+
+static_assert((IOBUF_SIZE % IOBUF_ALIGNMENT) == 0,
+	"Every buffer in a slab must start on a cache line");
+
+struct iobuf_slab {
+	struct iobuf_slab *next;
+	// How many of the slab's buffers are on the free list.
+	int free;
+	char *data;
+	struct iobuf bufs[IOBUF_SLAB_COUNT];
+};
+
+/*
+ * A thread's buffers.
+ */
+struct iobuf_cache {
+	struct iobuf_slab *slabs;
+	struct iobuf *free_list;
+	int free;
+	int borrowed;
+	// The most borrowed at once since the last trim.
+	int peak;
+};
+
+static _Thread_local struct iobuf_cache t_cache = {0};
+
+/*
+ * Allocate a slab and put its buffers on the free list.
+ */
+static int add_slab(struct iobuf_cache *c)
+{
+	struct iobuf_slab *s = malloc(sizeof(*s));
+	if (!s) return ENOMEM;
+	s->data = aligned_alloc(IOBUF_ALIGNMENT,
+		(size_t)IOBUF_SIZE * IOBUF_SLAB_COUNT);
+	if (!s->data) {
+		free(s);
+		return ENOMEM;
+	}
+	for (int i = 0; i < IOBUF_SLAB_COUNT; ++i) {
+		struct iobuf *b = s->bufs + i;
+		b->data = s->data + (size_t)i * IOBUF_SIZE;
+		b->slab = s;
+		b->next = c->free_list;
+		c->free_list = b;
+	}
+	s->free = IOBUF_SLAB_COUNT;
+	s->next = c->slabs;
+	c->slabs = s;
+	c->free += IOBUF_SLAB_COUNT;
+	LOG_DEBUG("Added an I/O buffer slab, %i buffers are free.", c->free);
+	return 0;
+}
+
+struct iobuf *iobuf_get(void)
+{
+	struct iobuf_cache *c = &t_cache;
+	if (!c->free_list && (add_slab(c) != 0)) {
+		LOG_ERROR("Failed to allocate I/O buffers.");
+		return NULL;
+	}
+	struct iobuf *b = c->free_list;
+	c->free_list = b->next;
+	b->next = NULL;
+	--b->slab->free;
+	--c->free;
+	if (++c->borrowed > c->peak) c->peak = c->borrowed;
+	return b;
+}
+
+void iobuf_put(struct iobuf *b)
+{
+	if (!b) return;
+	struct iobuf_cache *c = &t_cache;
+	b->next = c->free_list;
+	c->free_list = b;
+	++b->slab->free;
+	++c->free;
+	--c->borrowed;
+}
+
+/*
+ * Take a slab's buffers off the free list and free it. All of its buffers
+ * must be free.
+ */
+static void release_slab(struct iobuf_cache *c, struct iobuf_slab *s)
+{
+	struct iobuf **link = &c->free_list;
+	while (*link) {
+		if ((*link)->slab == s) {
+			*link = (*link)->next;
+		} else {
+			link = &(*link)->next;
+		}
+	}
+	c->free -= IOBUF_SLAB_COUNT;
+	free(s->data);
+	free(s);
+}
+
+void iobuf_trim(void)
+{
+	struct iobuf_cache *c = &t_cache;
+	struct iobuf_slab **link = &c->slabs;
+	int released = 0;
+	while (*link) {
+		struct iobuf_slab *s = *link;
+		// Keep enough for the peak, counting what's borrowed now.
+		const int spare = c->free + c->borrowed - c->peak;
+		if ((s->free == IOBUF_SLAB_COUNT) && (spare >= IOBUF_SLAB_COUNT)) {
+			*link = s->next;
+			release_slab(c, s);
+			++released;
+		} else {
+			link = &s->next;
+		}
+	}
+	if (released) {
+		LOG_DEBUG("Freed %i I/O buffer slabs, %i buffers are free.",
+			released, c->free);
+	}
+	c->peak = c->borrowed;
+}
+
+void iobuf_free_all(void)
+{
+	struct iobuf_cache *c = &t_cache;
+	if (c->borrowed) {
+		LOG_WARN("%i I/O buffers are still borrowed.", c->borrowed);
+	}
+	while (c->slabs) {
+		struct iobuf_slab *s = c->slabs;
+		c->slabs = s->next;
+		free(s->data);
+		free(s);
+	}
+	*c = (struct iobuf_cache){0};
+}
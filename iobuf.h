@@ -0,0 +1,71 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file declares the I/O buffers. Requests are received, and response
+ * headers and small pages are built, in fixed-size buffers borrowed from here
+ * instead of on the stack or in a static buffer, and given back when done.
+ *
+ * Buffers are carved out of slabs of IOBUF_SLAB_COUNT and each starts on a
+ * cache line. Every thread keeps its own free list, so borrowing and
+ * returning a buffer is a couple of pointer moves with no locking. The
+ * buffers aren't cleared, so whatever is read into one has to be terminated
+ * by whoever reads it.
+ *
+ * A thread maps more slabs when its free list runs dry, and iobuf_trim frees
+ * the slabs the thread hasn't needed lately.
+ */
+#ifndef IOBUF_H
+#define IOBUF_H
+
+#include <stddef.h>
+
+#include "utils.h"
+
+// The bytes in each buffer.
+#define IOBUF_SIZE (8 * KIBIBYTE)
+// The buffers allocated together.
+#define IOBUF_SLAB_COUNT 8
+// Each buffer starts on a boundary of this many bytes.
+#define IOBUF_ALIGNMENT 64
+
+struct iobuf_slab;
+
+/*
+ * A borrowed buffer.
+ */
+struct iobuf {
+	// IOBUF_SIZE bytes, not cleared.
+	char *data;
+	// The free list, while the buffer isn't borrowed.
+	struct iobuf *next;
+	struct iobuf_slab *slab;
+};
+
+/*
+ * Borrow a buffer from the thread's free list.
+ *
+ * Returns the buffer, or NULL if the free list was empty and another slab
+ * couldn't be allocated.
+ */
+struct iobuf *iobuf_get(void);
+
+/*
+ * Give a buffer back. It must have been borrowed on this thread.
+ *
+ * b - The buffer to give back. May be NULL.
+ */
+void iobuf_put(struct iobuf *b);
+
+/*
+ * Free the slabs the thread doesn't need. Enough buffers are kept for the
+ * most the thread had borrowed at once since the last trim. Call it when the
+ * thread is idle, or between requests.
+ */
+void iobuf_trim(void);
+
+/*
+ * Free all of the thread's slabs. Every buffer must have been given back.
+ */
+void iobuf_free_all(void);
+
+#endif // IOBUF_H
@@ -0,0 +1,755 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * Defines the logger.
+ *
+ * Every thread that logs gets a ring, registered in a list the writer thread
+ * walks. A ring has one producer, its thread, and one consumer, the writer, so
+ * it needs no lock: the producer publishes records by advancing head with a
+ * release store, and the consumer frees space by advancing tail the same way.
+ *
+ * A record is a log_record followed by the arguments of its format, each in 8
+ * bytes, except strings which are an 8 byte length followed by the characters
+ * padded to 8 bytes. Records never wrap around the end of the ring; if one
+ * doesn't fit before the end, the rest of the ring is filled with a padding
+ * record and it goes at the start.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "utils.h"
+
+// The bytes in each thread's ring. Must be a power of two.
+#define LOG_RING_SIZE (256 * KIBIBYTE)
+// The largest record, longer strings are cut short.
+#define LOG_RECORD_MAX (4 * KIBIBYTE)
+// The bytes formatted for each stream before they are written out.
+#define LOG_BATCH_SIZE (64 * KIBIBYTE)
+// How long the writer sleeps when there is nothing to write.
+#define LOG_IDLE_NS (5 * 1000000L)
+// The most bytes a single argument can format to, other than strings.
+#define LOG_ARG_MAX (512)
+// The level of a padding record.
+#define LOG_PAD (0xff)
+
+struct log_record {
+	// The bytes in the record, including this header. A multiple of 8.
+	uint32_t size;
+	uint8_t level;
+	uint8_t reserved[3];
+	uint64_t time_ns;
+	const char *format;
+};
+
+struct log_ring {
+	_Alignas(64) _Atomic uint64_t head;
+	_Alignas(64) _Atomic uint64_t tail;
+	_Atomic uint64_t dropped;
+	// Set when the thread exits, the writer frees the ring once it's empty.
+	_Atomic int orphaned;
+	struct log_ring *next;
+	_Alignas(64) char data[LOG_RING_SIZE];
+};
+
+/*
+ * Formatted log text waiting to be written to a stream.
+ */
+struct log_batch {
+	FILE *stream;
+	size_t len;
+	char data[LOG_BATCH_SIZE];
+};
+
+/*
+ * The pieces of a conversion specification in a format.
+ */
+enum log_length {
+	LENGTH_NONE, LENGTH_HH, LENGTH_H, LENGTH_L, LENGTH_LL, LENGTH_J,
+	LENGTH_Z, LENGTH_T, LENGTH_BIG_L
+};
+
+struct log_spec {
+	// The spec up to the length modifier, "%-*.3" for "%-*.3lu".
+	const char *start;
+	size_t start_len;
+	int width_star;
+	int precision_star;
+	// The precision, -1 if none was given or it was a star.
+	int precision;
+	enum log_length length;
+	char conversion;
+};
+
+_Atomic int log_runtime_level = LOG_LEVEL_INFO;
+
+static const char *s_level_names[] = {
+	"DEBUG", "INFO ", "WARN ", "ERROR"
+};
+
+static pthread_mutex_t s_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct log_ring *s_rings = NULL;
+static pthread_key_t s_ring_key;
+static _Thread_local struct log_ring *t_ring = NULL;
+
+static pthread_t s_writer;
+static _Atomic int s_running = 0;
+static _Atomic int s_stopping = 0;
+// Counted up by log_flush, and copied to s_flushed by the writer once
+// everything logged before has been written.
+static _Atomic uint64_t s_flush_wanted = 0;
+static _Atomic uint64_t s_flushed = 0;
+
+static struct log_batch s_out_batch;
+static struct log_batch s_err_batch;
+
+static uint64_t clock_ns(void)
+{
+	struct timespec ts;
+	(void)clock_gettime(CLOCK_REALTIME, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Parse the conversion specification that p points to, just after the %. Star
+ * widths and precisions are left for the caller.
+ *
+ * Returns a pointer to the conversion character.
+ */
+static const char *parse_spec(const char *p, struct log_spec *spec)
+{
+	spec->start = p - 1;
+	spec->width_star = 0;
+	spec->precision_star = 0;
+	spec->precision = -1;
+	spec->length = LENGTH_NONE;
+
+	while (*p && strchr("-+ #0", *p)) ++p;
+	if (*p == '*') {
+		spec->width_star = 1;
+		++p;
+	} else {
+		while ((*p >= '0') && (*p <= '9')) ++p;
+	}
+	if (*p == '.') {
+		++p;
+		if (*p == '*') {
+			spec->precision_star = 1;
+			++p;
+		} else {
+			spec->precision = 0;
+			while ((*p >= '0') && (*p <= '9')) {
+				spec->precision = spec->precision * 10 + (*p - '0');
+				++p;
+			}
+		}
+	}
+	spec->start_len = (size_t)(p - spec->start);
+
+	switch (*p) {
+	case 'h':
+		spec->length = (p[1] == 'h') ? LENGTH_HH : LENGTH_H;
+		p += (p[1] == 'h') ? 2 : 1;
+		break;
+	case 'l':
+		spec->length = (p[1] == 'l') ? LENGTH_LL : LENGTH_L;
+		p += (p[1] == 'l') ? 2 : 1;
+		break;
+	case 'j': spec->length = LENGTH_J; ++p; break;
+	case 'z': spec->length = LENGTH_Z; ++p; break;
+	case 't': spec->length = LENGTH_T; ++p; break;
+	case 'L': spec->length = LENGTH_BIG_L; ++p; break;
+	default: break;
+	}
+	spec->conversion = *p;
+	return p;
+}
+
+static int put_u64(char *record, size_t *used, uint64_t value)
+{
+	if (*used + sizeof(value) > LOG_RECORD_MAX) return ENOBUFS;
+	memcpy(record + *used, &value, sizeof(value));
+	*used += sizeof(value);
+	return 0;
+}
+
+static int get_u64(const char *record, size_t *used, size_t size,
+	uint64_t *value)
+{
+	if (*used + sizeof(*value) > size) return ENOBUFS;
+	memcpy(value, record + *used, sizeof(*value));
+	*used += sizeof(*value);
+	return 0;
+}
+
+/*
+ * Copy the arguments of a format into a record, starting at used.
+ *
+ * Returns 0 if every argument fit. Otherwise the record holds the arguments
+ * that fit and the rest will be printed as truncated.
+ */
+static int encode_args(char *record, size_t *used, const char *format,
+	va_list args)
+{
+	struct log_spec spec;
+
+	for (const char *p = format; *p; ++p) {
+		if (*p != '%') continue;
+		++p;
+		if (*p == '%') continue;
+		p = parse_spec(p, &spec);
+
+		int err = 0;
+		if (spec.width_star) {
+			err = put_u64(record, used, (uint64_t)va_arg(args, int));
+		}
+		if (!err && spec.precision_star) {
+			const int precision = va_arg(args, int);
+			spec.precision = precision;
+			err = put_u64(record, used, (uint64_t)precision);
+		}
+		if (err) return err;
+
+		uint64_t value = 0;
+		switch (spec.conversion) {
+		case 'd':
+		case 'i': {
+			int64_t v;
+			switch (spec.length) {
+			case LENGTH_HH: v = (signed char)va_arg(args, int); break;
+			case LENGTH_H: v = (short)va_arg(args, int); break;
+			case LENGTH_L: v = va_arg(args, long); break;
+			case LENGTH_LL: v = va_arg(args, long long); break;
+			case LENGTH_J: v = va_arg(args, intmax_t); break;
+			case LENGTH_Z: v = (int64_t)va_arg(args, size_t); break;
+			case LENGTH_T: v = va_arg(args, ptrdiff_t); break;
+			default: v = va_arg(args, int); break;
+			}
+			value = (uint64_t)v;
+			break;
+		}
+		case 'u':
+		case 'o':
+		case 'x':
+		case 'X':
+			switch (spec.length) {
+			case LENGTH_HH:
+				value = (unsigned char)va_arg(args, unsigned int);
+				break;
+			case LENGTH_H:
+				value = (unsigned short)va_arg(args, unsigned int);
+				break;
+			case LENGTH_L: value = va_arg(args, unsigned long); break;
+			case LENGTH_LL:
+				value = va_arg(args, unsigned long long);
+				break;
+			case LENGTH_J: value = va_arg(args, uintmax_t); break;
+			case LENGTH_Z: value = va_arg(args, size_t); break;
+			case LENGTH_T:
+				value = (uint64_t)va_arg(args, ptrdiff_t);
+				break;
+			default: value = va_arg(args, unsigned int); break;
+			}
+			break;
+		case 'c':
+			value = (uint64_t)va_arg(args, int);
+			break;
+		case 'p':
+			value = (uint64_t)(uintptr_t)va_arg(args, void*);
+			break;
+		case 'f':
+		case 'F':
+		case 'e':
+		case 'E':
+		case 'g':
+		case 'G':
+		case 'a':
+		case 'A': {
+			const double d = (spec.length == LENGTH_BIG_L) ?
+				(double)va_arg(args, long double) :
+				va_arg(args, double);
+			memcpy(&value, &d, sizeof(value));
+			break;
+		}
+		case 's': {
+			const char *s = va_arg(args, const char*);
+			if (!s) s = "(null)";
+			size_t len = (spec.precision >= 0) ?
+				strnlen(s, (size_t)spec.precision) : strlen(s);
+			if (*used + sizeof(uint64_t) > LOG_RECORD_MAX) return ENOBUFS;
+			const size_t room = LOG_RECORD_MAX - *used - sizeof(uint64_t);
+			if (len > room) len = room;
+			(void)put_u64(record, used, len);
+			memcpy(record + *used, s, len);
+			*used += (len + 7) & ~(size_t)7;
+			continue;
+		}
+		case 'n':
+			(void)va_arg(args, void*);
+			continue;
+		default:
+			// An unknown conversion, nothing after it can be trusted.
+			return EINVAL;
+		}
+		if (put_u64(record, used, value)) return ENOBUFS;
+	}
+	return 0;
+}
+
+static void batch_flush(struct log_batch *batch)
+{
+	if (batch->len == 0) return;
+	(void)fwrite(batch->data, 1, batch->len, batch->stream);
+	(void)fflush(batch->stream);
+	batch->len = 0;
+}
+
+static void batch_append(struct log_batch *batch, const char *s, size_t len)
+{
+	while (len > 0) {
+		if (batch->len == sizeof(batch->data)) batch_flush(batch);
+		size_t copy = sizeof(batch->data) - batch->len;
+		if (copy > len) copy = len;
+		memcpy(batch->data + batch->len, s, copy);
+		batch->len += copy;
+		s += copy;
+		len -= copy;
+	}
+}
+
+/*
+ * Make room for n bytes to be formatted straight into the batch.
+ */
+static char *batch_reserve(struct log_batch *batch, size_t n)
+{
+	if (sizeof(batch->data) - batch->len < n) batch_flush(batch);
+	return batch->data + batch->len;
+}
+
+#define FORMAT_ARG(dst, cap, spec, stars, a, b, value)\
+	((stars) == 0 ? snprintf((dst), (cap), (spec), (value)) :\
+	 (stars) == 1 ? snprintf((dst), (cap), (spec), (a), (value)) :\
+	 snprintf((dst), (cap), (spec), (a), (b), (value)))
+
+/*
+ * Format one argument of a record into the batch.
+ *
+ * Returns 0 if the argument was formatted, ENOBUFS if the record ran out.
+ */
+static int format_arg(struct log_batch *batch, const struct log_spec *spec,
+	const char *record, size_t *used, size_t size)
+{
+	char fmt[48];
+	uint64_t star[2] = {0, 0};
+	int stars = 0;
+	int err = 0;
+
+	if (spec->start_len + 4 > sizeof(fmt)) return EINVAL;
+	if (spec->width_star) err = get_u64(record, used, size, &star[stars++]);
+	if (!err && spec->precision_star) {
+		err = get_u64(record, used, size, &star[stars++]);
+	}
+	if (err) return err;
+	const int a = (int)(int64_t)star[0];
+	const int b = (int)(int64_t)star[1];
+
+	if (spec->conversion == 's') {
+		// The string was already cut to the precision, it isn't terminated.
+		uint64_t len;
+		if (get_u64(record, used, size, &len) ||
+			(*used + len > size))
+		{
+			return ENOBUFS;
+		}
+		const char *s = record + *used;
+		*used += (len + 7) & ~(size_t)7;
+		if (!spec->width_star && (spec->start_len == 1)) {
+			batch_append(batch, s, (size_t)len);
+			return 0;
+		}
+		// Rebuild the spec with the width, a star precision and s.
+		size_t n = 0;
+		for (size_t i = 0; i < spec->start_len; ++i) {
+			if (spec->start[i] == '.') break;
+			fmt[n++] = spec->start[i];
+		}
+		memcpy(fmt + n, ".*s", 4);
+		const size_t cap = (size_t)len + LOG_ARG_MAX;
+		if (cap > sizeof(batch->data)) {
+			batch_append(batch, s, (size_t)len);
+			return 0;
+		}
+		char *dst = batch_reserve(batch, cap);
+		const int w = spec->width_star ? a : 0;
+		const int written = spec->width_star ?
+			snprintf(dst, cap, fmt, w, (int)len, s) :
+			snprintf(dst, cap, fmt, (int)len, s);
+		if (written > 0) {
+			batch->len += ((size_t)written < cap) ? (size_t)written :
+				cap - 1;
+		}
+		return 0;
+	}
+
+	uint64_t value;
+	if (get_u64(record, used, size, &value)) return ENOBUFS;
+	memcpy(fmt, spec->start, spec->start_len);
+	size_t n = spec->start_len;
+	char *dst = batch_reserve(batch, LOG_ARG_MAX);
+	int written = 0;
+
+	switch (spec->conversion) {
+	case 'd':
+	case 'i':
+	case 'u':
+	case 'o':
+	case 'x':
+	case 'X':
+		fmt[n++] = 'l';
+		fmt[n++] = 'l';
+		fmt[n++] = spec->conversion;
+		fmt[n] = '\0';
+		if ((spec->conversion == 'd') || (spec->conversion == 'i')) {
+			written = FORMAT_ARG(dst, LOG_ARG_MAX, fmt, stars, a, b,
+				(long long)value);
+		} else {
+			written = FORMAT_ARG(dst, LOG_ARG_MAX, fmt, stars, a, b,
+				(unsigned long long)value);
+		}
+		break;
+	case 'c':
+		fmt[n++] = 'c';
+		fmt[n] = '\0';
+		written = FORMAT_ARG(dst, LOG_ARG_MAX, fmt, stars, a, b,
+			(int)value);
+		break;
+	case 'p':
+		fmt[n++] = 'p';
+		fmt[n] = '\0';
+		written = FORMAT_ARG(dst, LOG_ARG_MAX, fmt, stars, a, b,
+			(void*)(uintptr_t)value);
+		break;
+	default: {
+		double d;
+		memcpy(&d, &value, sizeof(d));
+		fmt[n++] = spec->conversion;
+		fmt[n] = '\0';
+		written = FORMAT_ARG(dst, LOG_ARG_MAX, fmt, stars, a, b, d);
+		break;
+	}
+	}
+	if (written > 0) {
+		batch->len += ((size_t)written < LOG_ARG_MAX) ? (size_t)written :
+			LOG_ARG_MAX - 1;
+	}
+	return 0;
+}
+
+/*
+ * Append the time and level that start every line.
+ */
+static void format_prefix(struct log_batch *batch, uint64_t time_ns,
+	unsigned level)
+{
+	static time_t last_second = -1;
+	static char date[32];
+	static size_t date_len = 0;
+
+	const time_t second = (time_t)(time_ns / 1000000000u);
+	if (second != last_second) {
+		struct tm tm;
+		if (gmtime_r(&second, &tm)) {
+			date_len = strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S",
+				&tm);
+		}
+		last_second = second;
+	}
+	char *dst = batch_reserve(batch, date_len + 32);
+	memcpy(dst, date, date_len);
+	const int written = snprintf(dst + date_len, 32, ".%06u %s ",
+		(unsigned)(time_ns % 1000000000u / 1000u),
+		level < LEN(s_level_names) ? s_level_names[level] : "?????");
+	batch->len += date_len + (written > 0 ? (size_t)written : 0);
+}
+
+/*
+ * Format a record into the batch for its level.
+ */
+static void format_record(const struct log_record *rec)
+{
+	struct log_batch *batch = (rec->level >= LOG_LEVEL_WARN) ?
+		&s_err_batch : &s_out_batch;
+	const char *record = (const char*)rec;
+	size_t used = sizeof(*rec);
+	struct log_spec spec;
+
+	format_prefix(batch, rec->time_ns, rec->level);
+	const char *p = rec->format;
+	while (*p) {
+		const char *literal = p;
+		while (*p && (*p != '%')) ++p;
+		batch_append(batch, literal, (size_t)(p - literal));
+		if (!*p) break;
+		++p;
+		if (*p == '%') {
+			batch_append(batch, "%", 1);
+			++p;
+			continue;
+		}
+		p = parse_spec(p, &spec);
+		if (!*p) break;
+		++p;
+		if (spec.conversion == 'n') continue;
+		if (format_arg(batch, &spec, record, &used, rec->size)) {
+			static const char truncated[] = "...";
+			batch_append(batch, truncated, STRMAX(truncated));
+			break;
+		}
+	}
+	const size_t len = strlen(rec->format);
+	if ((len == 0) || (rec->format[len - 1] != '\n')) {
+		batch_append(batch, "\n", 1);
+	}
+}
+
+/*
+ * Format everything in a ring.
+ *
+ * Returns nonzero if anything was formatted.
+ */
+static int drain_ring(struct log_ring *ring)
+{
+	uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+	const uint64_t head = atomic_load_explicit(&ring->head,
+		memory_order_acquire);
+	const int any = tail != head;
+
+	while (tail != head) {
+		const struct log_record *rec = (const struct log_record*)
+			(ring->data + (tail & (LOG_RING_SIZE - 1)));
+		if (rec->level != LOG_PAD) format_record(rec);
+		tail += rec->size;
+		atomic_store_explicit(&ring->tail, tail, memory_order_release);
+	}
+
+	const uint64_t dropped = atomic_exchange_explicit(&ring->dropped, 0,
+		memory_order_relaxed);
+	if (dropped) {
+		char line[80];
+		const int n = snprintf(line, sizeof(line), "%lu log messages were "
+			"dropped, the ring was full.\n", (unsigned long)dropped);
+		format_prefix(&s_err_batch, clock_ns(), LOG_LEVEL_WARN);
+		if (n > 0) batch_append(&s_err_batch, line, (size_t)n);
+	}
+	return any || dropped;
+}
+
+/*
+ * Drain every ring, freeing the ones whose threads have exited.
+ *
+ * Returns nonzero if anything was formatted.
+ */
+static int drain_rings(void)
+{
+	int any = 0;
+
+	pthread_mutex_lock(&s_rings_lock);
+	struct log_ring **link = &s_rings;
+	while (*link) {
+		struct log_ring *ring = *link;
+		// Check before draining so nothing written before exit is lost.
+		const int orphaned = atomic_load_explicit(&ring->orphaned,
+			memory_order_acquire);
+		any |= drain_ring(ring);
+		if (orphaned) {
+			*link = ring->next;
+			free(ring);
+		} else {
+			link = &ring->next;
+		}
+	}
+	pthread_mutex_unlock(&s_rings_lock);
+	return any;
+}
+
+static void *writer_thread(void *arg)
+{
+	(void)arg;
+	const struct timespec idle = {0, LOG_IDLE_NS};
+
+	while (!atomic_load_explicit(&s_stopping, memory_order_acquire)) {
+		const uint64_t wanted = atomic_load_explicit(&s_flush_wanted,
+			memory_order_acquire);
+		if (drain_rings()) {
+			batch_flush(&s_out_batch);
+			batch_flush(&s_err_batch);
+		} else if (wanted == atomic_load_explicit(&s_flushed,
+			memory_order_relaxed))
+		{
+			(void)nanosleep(&idle, NULL);
+		}
+		atomic_store_explicit(&s_flushed, wanted, memory_order_release);
+	}
+	(void)drain_rings();
+	batch_flush(&s_out_batch);
+	batch_flush(&s_err_batch);
+	return NULL;
+}
+
+static void orphan_ring(void *ring)
+{
+	atomic_store_explicit(&((struct log_ring*)ring)->orphaned, 1,
+		memory_order_release);
+}
+
+static struct log_ring *get_ring(void)
+{
+	if (t_ring) return t_ring;
+
+	struct log_ring *ring = calloc(1, sizeof(*ring));
+	if (!ring) return NULL;
+	pthread_mutex_lock(&s_rings_lock);
+	ring->next = s_rings;
+	s_rings = ring;
+	pthread_mutex_unlock(&s_rings_lock);
+	(void)pthread_setspecific(s_ring_key, ring);
+	t_ring = ring;
+	return ring;
+}
+
+/*
+ * Copy a record into the ring, or count it as dropped if it doesn't fit.
+ */
+static void ring_push(struct log_ring *ring, const struct log_record *rec)
+{
+	uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+	const uint64_t tail = atomic_load_explicit(&ring->tail,
+		memory_order_acquire);
+	const size_t offset = (size_t)(head & (LOG_RING_SIZE - 1));
+	const size_t contiguous = LOG_RING_SIZE - offset;
+	const size_t needed = (contiguous < rec->size) ?
+		contiguous + rec->size : rec->size;
+
+	if (head + needed - tail > LOG_RING_SIZE) {
+		atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+		return;
+	}
+	if (contiguous < rec->size) {
+		struct log_record pad = {0};
+		pad.size = (uint32_t)contiguous;
+		pad.level = LOG_PAD;
+		// Only the size and level of a padding record are ever read.
+		memcpy(ring->data + offset, &pad, 8);
+		head += contiguous;
+	}
+	memcpy(ring->data + (head & (LOG_RING_SIZE - 1)), rec, rec->size);
+	atomic_store_explicit(&ring->head, head + rec->size, memory_order_release);
+}
+
+int log_init(enum log_level level)
+{
+	log_set_level(level);
+	if (atomic_load(&s_running)) return 0;
+
+	s_out_batch.stream = stdout;
+	s_err_batch.stream = stderr;
+	int err = pthread_key_create(&s_ring_key, orphan_ring);
+	if (err) return err;
+	atomic_store(&s_stopping, 0);
+	// Leave signals to the threads doing the work, they're what need to
+	// be interrupted.
+	sigset_t all;
+	sigset_t old;
+	(void)sigfillset(&all);
+	(void)pthread_sigmask(SIG_BLOCK, &all, &old);
+	err = pthread_create(&s_writer, NULL, writer_thread, NULL);
+	(void)pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (err) {
+		(void)pthread_key_delete(s_ring_key);
+		return err;
+	}
+	atomic_store(&s_running, 1);
+	return 0;
+}
+
+void log_set_level(enum log_level level)
+{
+	atomic_store_explicit(&log_runtime_level, (int)level,
+		memory_order_relaxed);
+}
+
+int log_parse_level(const char *name, enum log_level *level)
+{
+	static const char *names[] = { "debug", "info", "warn", "error", "off" };
+
+	if (!name || !level) return EINVAL;
+	for (size_t i = 0; i < LEN(names); ++i) {
+		if (strcmp(name, names[i]) == 0) {
+			*level = (enum log_level)i;
+			return 0;
+		}
+	}
+	return EINVAL;
+}
+
+void log_write(enum log_level level, const char *format, ...)
+{
+	va_list args;
+
+	if (!format || (level >= LOG_LEVEL_OFF)) return;
+	struct log_ring *ring = atomic_load_explicit(&s_running,
+		memory_order_acquire) ? get_ring() : NULL;
+	if (!ring) {
+		// No writer thread, so write it now.
+		FILE *stream = (level >= LOG_LEVEL_WARN) ? stderr : stdout;
+		fprintf(stream, "%s ", s_level_names[level]);
+		va_start(args, format);
+		vfprintf(stream, format, args);
+		va_end(args);
+		const size_t len = strlen(format);
+		if ((len == 0) || (format[len - 1] != '\n')) fputc('\n', stream);
+		return;
+	}
+
+	_Alignas(8) char record[LOG_RECORD_MAX];
+	struct log_record *rec = (struct log_record*)record;
+	size_t used = sizeof(*rec);
+	rec->level = (uint8_t)level;
+	rec->time_ns = clock_ns();
+	rec->format = format;
+	va_start(args, format);
+	(void)encode_args(record, &used, format, args);
+	va_end(args);
+	rec->size = (uint32_t)((used + 7) & ~(size_t)7);
+	ring_push(ring, rec);
+}
+
+void log_flush(void)
+{
+	if (!atomic_load(&s_running)) return;
+	const uint64_t wanted = atomic_fetch_add(&s_flush_wanted, 1) + 1;
+	const struct timespec wait = {0, LOG_IDLE_NS / 5};
+	while (atomic_load_explicit(&s_flushed, memory_order_acquire) <
+		wanted)
+	{
+		(void)nanosleep(&wait, NULL);
+	}
+}
+
+void log_shutdown(void)
+{
+	if (!atomic_load(&s_running)) return;
+	atomic_store(&s_running, 0);
+	atomic_store_explicit(&s_stopping, 1, memory_order_release);
+	(void)pthread_join(s_writer, NULL);
+}
@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file declares crvr's logger.
+ *
+ * Logging on the request path has to be cheap, so log_write doesn't format
+ * anything. It copies the format pointer and the raw arguments into a binary
+ * record in a ring owned by the calling thread. A background thread drains
+ * the rings, formats the records and writes them out in batches.
+ *
+ * Use the LOG_* macros rather than log_write. Messages below
+ * LOG_COMPILE_LEVEL are compiled out, and messages below the runtime level
+ * cost a load and a branch.
+ *
+ * Formats are regular printf formats, checked by the compiler. The format
+ * itself is kept by pointer, so it must be a string literal. %s arguments are
+ * copied, so a str can be logged with "%.*s", (int)s.len, s.s. %n is not
+ * supported.
+ */
+#ifndef LOG_H
+#define LOG_H
+
+#include <stdatomic.h>
+#include <stdio.h>
+
+/*
+ * The levels of log messages, least to most severe.
+ */
+enum log_level {
+	LOG_LEVEL_DEBUG,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_WARN,
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_OFF,
+};
+
+/*
+ * Messages below this level aren't compiled in at all. Release builds
+ * (NDEBUG) drop debug messages unless this is set on the command line.
+ */
+#ifndef LOG_COMPILE_LEVEL
+#ifdef NDEBUG
+#define LOG_COMPILE_LEVEL LOG_LEVEL_INFO
+#else
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+#endif
+
+// The level set by log_set_level. Read it through the LOG_* macros.
+extern _Atomic int log_runtime_level;
+
+#define LOG_AT(level, ...) do {\
+	if (((level) >= LOG_COMPILE_LEVEL) && ((int)(level) >=\
+		atomic_load_explicit(&log_runtime_level,\
+		memory_order_relaxed)))\
+	{\
+		log_write((level), __VA_ARGS__);\
+	}\
+} while (0)
+
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#define LOG_WARN(...) LOG_AT(LOG_LEVEL_WARN, __VA_ARGS__)
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+/*
+ * Start the background thread that writes the log.
+ *
+ * Until this is called, and after log_shutdown, messages are formatted and
+ * written by the calling thread.
+ *
+ * level - Messages below this level are ignored.
+ *
+ * Returns 0 if the logger was started. Otherwise returns an error code and
+ * messages keep being written synchronously.
+ */
+int log_init(enum log_level level);
+
+/*
+ * Change the level messages need to be at to be logged.
+ *
+ * level - The new level.
+ */
+void log_set_level(enum log_level level);
+
+/*
+ * Parse a level name: debug, info, warn, error or off.
+ *
+ * name - The name to parse.
+ * level - The location to store the level.
+ *
+ * Returns 0 if the name was a level. Otherwise returns EINVAL.
+ */
+int log_parse_level(const char *name, enum log_level *level);
+
+/*
+ * Record a log message. Messages at LOG_LEVEL_WARN and above go to stderr,
+ * the rest to stdout. A newline is added if the message doesn't end in one.
+ *
+ * If the calling thread's ring is full the message is dropped and counted.
+ * The count is logged once there is room.
+ *
+ * level - The level of the message.
+ * format - The printf format. It must outlive the logger, or at least last
+ *          until log_flush, use a literal.
+ * ... - The arguments for the format.
+ */
+void log_write(enum log_level level, const char *format, ...)
+	__attribute__((format(printf, 2, 3)));
+
+/*
+ * Wait until everything logged so far has been written out. Call it before
+ * unloading code whose formats may still be waiting in a ring.
+ */
+void log_flush(void);
+
+/*
+ * Write out everything that has been logged and stop the background thread.
+ */
+void log_shutdown(void);
+
+#endif // LOG_H
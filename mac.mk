@@ -4,7 +4,7 @@ OBJ=o
 COMMON_FLAGS=-DMAC=1 -Werror -Wextra -Wall -Wconversion
 #SANITIZERS=-fsanitize=address -fsanitize=undefined
 DEBUG_FLAGS=-g -O0 $(COMMON_FLAGS) $(SANITIZERS)
-RELEASE_FLAGS=-Os $(COMMON_FLAGS)
+RELEASE_FLAGS=-Os -DNDEBUG $(COMMON_FLAGS)
 
 BUILD=$(DEBUG_FLAGS)
 
@@ -12,5 +12,11 @@ CXXFLAGS=$(BUILD) -std=c++17
 CFLAGS=$(BUILD) -std=c17 -Ibase
 
 LDFLAGS=$(SANITIZERS)
-LDLIBS=-lm
+LDLIBS=-lm -lpthread
+# Modules are position independent shared objects that use the server's
+# symbols, so the server exports them.
+MODEXT=.so
+MODULE_CFLAGS=-fPIC
+MODULE_LDFLAGS=-bundle -undefined dynamic_lookup
+EXPORT_LDFLAGS=
 RM=rm -f
@@ -0,0 +1,329 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * Defines crvr's metrics.
+ *
+ * A shard is allocated for a thread the first time it records something and
+ * is linked into the list that scrapes walk. Shards live as long as the
+ * process so a scrape never races with one being freed.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "metrics.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hist.h"
+#include "log.h"
+#include "utils.h"
+
+// The longest name of a module's route, with its NUL.
+#define METRICS_NAME_MAX 128
+// None, then 1xx through 5xx.
+#define STATUS_CLASSES 6
+
+// Single writer, so a relaxed load and store instead of a locked add.
+#define METRIC_LOAD(a) atomic_load_explicit(&(a), memory_order_relaxed)
+#define METRIC_ADD(a, v) atomic_store_explicit(&(a), METRIC_LOAD(a) + (v),\
+	memory_order_relaxed)
+
+struct metrics_shard {
+	_Atomic uint64_t requests[METRICS_METHOD_COUNT][METRICS_ROUTE_COUNT]
+		[STATUS_CLASSES];
+	_Atomic uint64_t bytes_in;
+	_Atomic uint64_t bytes_out;
+	_Atomic uint64_t parse_errors;
+	_Atomic uint64_t cache_hits;
+	_Atomic uint64_t cache_misses;
+	_Atomic uint64_t pool_mapped;
+	_Atomic uint64_t pool_resident;
+	_Atomic uint64_t pool_high_water;
+	_Atomic uint64_t pool_reclaimed;
+	struct hist latency[METRICS_ROUTE_COUNT];
+	struct metrics_shard *next;
+};
+
+static const char *s_method_names[METRICS_METHOD_COUNT] = {
+	"none", "GET", "POST"
+};
+// The modules' names follow the server's own, NULL past the last.
+static const char *s_route_names[METRICS_ROUTE_COUNT] = {
+	"none", "static", "metrics"
+};
+static char s_module_names[METRICS_MODULE_MAX][METRICS_NAME_MAX];
+static size_t s_module_count = 0;
+static const char *s_status_names[STATUS_CLASSES] = {
+	"none", "1xx", "2xx", "3xx", "4xx", "5xx"
+};
+// The upper bounds of the latency buckets reported, in seconds.
+static const double s_latency_bounds[] = {
+	0.00005, 0.0001, 0.00025, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025,
+	0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10
+};
+
+static pthread_mutex_t s_shards_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct metrics_shard *s_shards = NULL;
+static _Thread_local struct metrics_shard *t_shard = NULL;
+
+// The shards merged for a scrape. Guarded by s_shards_lock.
+static struct metrics_shard s_merged;
+
+static struct metrics_shard *get_shard(void)
+{
+	if (t_shard) return t_shard;
+
+	struct metrics_shard *shard = calloc(1, sizeof(*shard));
+	if (!shard) return NULL;
+	for (size_t i = 0; i < LEN(shard->latency); ++i) {
+		hist_reset(shard->latency + i);
+	}
+	pthread_mutex_lock(&s_shards_lock);
+	shard->next = s_shards;
+	s_shards = shard;
+	pthread_mutex_unlock(&s_shards_lock);
+	t_shard = shard;
+	return shard;
+}
+
+int metrics_add_module(const char *name, enum metrics_route *route)
+{
+	if (s_module_count == METRICS_MODULE_MAX) return ENOSPC;
+	char *copy = s_module_names[s_module_count];
+	(void)snprintf(copy, METRICS_NAME_MAX, "%s", name);
+	// It goes in a label value, where these would need escaping.
+	for (char *c = copy; *c; ++c) {
+		if ((*c == '"') || (*c == '\\') || (*c == '\n')) *c = '_';
+	}
+	*route = (enum metrics_route)(METRICS_ROUTE_MODULE + s_module_count);
+	s_route_names[*route] = copy;
+	++s_module_count;
+	return 0;
+}
+
+void metrics_record_request(enum metrics_method method,
+	enum metrics_route route, int status, uint64_t latency_ns,
+	uint64_t bytes_in, uint64_t bytes_out)
+{
+	struct metrics_shard *shard = get_shard();
+	if (!shard) return;
+	if ((unsigned)method >= METRICS_METHOD_COUNT) method = 0;
+	if ((unsigned)route >= METRICS_ROUTE_COUNT) route = 0;
+	const int status_class = ((status >= 100) && (status < 600)) ?
+		status / 100 : 0;
+
+	METRIC_ADD(shard->requests[method][route][status_class], 1);
+	METRIC_ADD(shard->bytes_in, bytes_in);
+	METRIC_ADD(shard->bytes_out, bytes_out);
+	hist_record(shard->latency + route, latency_ns);
+}
+
+void metrics_count_parse_error(void)
+{
+	struct metrics_shard *shard = get_shard();
+	if (shard) METRIC_ADD(shard->parse_errors, 1);
+}
+
+void metrics_count_cache(int hit)
+{
+	struct metrics_shard *shard = get_shard();
+	if (!shard) return;
+	if (hit) {
+		METRIC_ADD(shard->cache_hits, 1);
+	} else {
+		METRIC_ADD(shard->cache_misses, 1);
+	}
+}
+
+void metrics_pool_stats(const struct pool_stats *stats)
+{
+	struct metrics_shard *shard = get_shard();
+	if (!shard) return;
+	atomic_store_explicit(&shard->pool_mapped, (uint64_t)stats->mapped,
+		memory_order_relaxed);
+	atomic_store_explicit(&shard->pool_resident,
+		(uint64_t)stats->resident, memory_order_relaxed);
+	atomic_store_explicit(&shard->pool_high_water,
+		(uint64_t)stats->high_water, memory_order_relaxed);
+	atomic_store_explicit(&shard->pool_reclaimed,
+		(uint64_t)stats->reclaimed, memory_order_relaxed);
+}
+
+/*
+ * Sum every shard into s_merged. s_shards_lock must be held.
+ */
+static void merge_shards(void)
+{
+	struct metrics_shard *m = &s_merged;
+	memset(m, 0, sizeof(*m));
+	for (size_t i = 0; i < LEN(m->latency); ++i) hist_reset(m->latency + i);
+
+	for (struct metrics_shard *s = s_shards; s; s = s->next) {
+		for (int method = 0; method < METRICS_METHOD_COUNT; ++method) {
+			for (int route = 0; route < METRICS_ROUTE_COUNT; ++route) {
+				for (int c = 0; c < STATUS_CLASSES; ++c) {
+					METRIC_ADD(m->requests[method][route][c],
+						METRIC_LOAD(s->requests[method]
+						[route][c]));
+				}
+			}
+		}
+		METRIC_ADD(m->bytes_in, METRIC_LOAD(s->bytes_in));
+		METRIC_ADD(m->bytes_out, METRIC_LOAD(s->bytes_out));
+		METRIC_ADD(m->parse_errors, METRIC_LOAD(s->parse_errors));
+		METRIC_ADD(m->cache_hits, METRIC_LOAD(s->cache_hits));
+		METRIC_ADD(m->cache_misses, METRIC_LOAD(s->cache_misses));
+		METRIC_ADD(m->pool_mapped, METRIC_LOAD(s->pool_mapped));
+		METRIC_ADD(m->pool_resident, METRIC_LOAD(s->pool_resident));
+		METRIC_ADD(m->pool_reclaimed, METRIC_LOAD(s->pool_reclaimed));
+		const uint64_t high_water = METRIC_LOAD(s->pool_high_water);
+		if (high_water > METRIC_LOAD(m->pool_high_water)) {
+			atomic_store_explicit(&m->pool_high_water, high_water,
+				memory_order_relaxed);
+		}
+		for (size_t i = 0; i < LEN(m->latency); ++i) {
+			hist_merge(m->latency + i, s->latency + i);
+		}
+	}
+}
+
+/*
+ * Somewhere to write the metrics that remembers if it ran out of room.
+ */
+struct writer {
+	char *buf;
+	size_t cap;
+	size_t len;
+	int err;
+};
+
+__attribute__((format(printf, 2, 3)))
+static void emit(struct writer *w, const char *format, ...)
+{
+	va_list args;
+
+	if (w->err) return;
+	va_start(args, format);
+	const int n = vsnprintf(w->buf + w->len, w->cap - w->len, format, args);
+	va_end(args);
+	if ((n < 0) || ((size_t)n >= w->cap - w->len)) {
+		w->err = ENOBUFS;
+		return;
+	}
+	w->len += (size_t)n;
+}
+
+static void emit_counter(struct writer *w, const char *name,
+	const char *help, uint64_t value)
+{
+	emit(w, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", name, help, name,
+		name, (unsigned long)value);
+}
+
+/*
+ * Write a route's latencies as a Prometheus histogram. A hist bucket is only
+ * counted under a bound it lies entirely below, so a bucket straddling a bound
+ * counts toward the next one.
+ */
+static void emit_latency(struct writer *w, const char *route,
+	const struct hist *h)
+{
+	static const char name[] = "crvr_request_duration_seconds";
+	uint64_t cumulative = 0;
+	unsigned bucket = 0;
+
+	for (size_t i = 0; i < LEN(s_latency_bounds); ++i) {
+		const uint64_t bound_ns = (uint64_t)(s_latency_bounds[i] * 1e9);
+		while ((bucket < HIST_BUCKETS) &&
+			(hist_bucket_max(bucket) <= bound_ns))
+		{
+			cumulative += METRIC_LOAD(h->counts[bucket]);
+			++bucket;
+		}
+		emit(w, "%s_bucket{route=\"%s\",le=\"%g\"} %lu\n", name, route,
+			s_latency_bounds[i], (unsigned long)cumulative);
+	}
+	const uint64_t total = METRIC_LOAD(h->total);
+	emit(w, "%s_bucket{route=\"%s\",le=\"+Inf\"} %lu\n", name, route,
+		(unsigned long)total);
+	emit(w, "%s_sum{route=\"%s\"} %.9f\n", name, route,
+		(double)METRIC_LOAD(h->sum) / 1e9);
+	emit(w, "%s_count{route=\"%s\"} %lu\n", name, route,
+		(unsigned long)total);
+}
+
+int metrics_render(char *buf, size_t cap, size_t *len)
+{
+	if (!buf || !len || (cap == 0)) return EINVAL;
+	struct writer w = {buf, cap, 0, 0};
+
+	pthread_mutex_lock(&s_shards_lock);
+	merge_shards();
+	const struct metrics_shard *m = &s_merged;
+
+	emit(&w, "# HELP crvr_requests_total Requests handled, by method, "
+		"route and status class.\n"
+		"# TYPE crvr_requests_total counter\n");
+	for (int method = 0; method < METRICS_METHOD_COUNT; ++method) {
+		for (int route = 0; route < METRICS_ROUTE_COUNT; ++route) {
+			for (int c = 0; c < STATUS_CLASSES; ++c) {
+				const uint64_t count = METRIC_LOAD(
+					m->requests[method][route][c]);
+				if (!count || !s_route_names[route]) continue;
+				emit(&w, "crvr_requests_total{method=\"%s\","
+					"route=\"%s\",status=\"%s\"} %lu\n",
+					s_method_names[method],
+					s_route_names[route], s_status_names[c],
+					(unsigned long)count);
+			}
+		}
+	}
+	emit_counter(&w, "crvr_received_bytes_total",
+		"Bytes read from clients.", METRIC_LOAD(m->bytes_in));
+	emit_counter(&w, "crvr_sent_bytes_total",
+		"Bytes written to clients.", METRIC_LOAD(m->bytes_out));
+	emit_counter(&w, "crvr_parse_errors_total",
+		"Requests that couldn't be parsed.",
+		METRIC_LOAD(m->parse_errors));
+	emit_counter(&w, "crvr_cache_hits_total",
+		"Cache lookups that found what they wanted.",
+		METRIC_LOAD(m->cache_hits));
+	emit_counter(&w, "crvr_cache_misses_total",
+		"Cache lookups that didn't.", METRIC_LOAD(m->cache_misses));
+	emit(&w, "# HELP crvr_pool_mapped_bytes Memory mapped for the "
+		"memory pools.\n"
+		"# TYPE crvr_pool_mapped_bytes gauge\n"
+		"crvr_pool_mapped_bytes %lu\n"
+		"# HELP crvr_pool_resident_bytes Memory pool that may be "
+		"resident.\n"
+		"# TYPE crvr_pool_resident_bytes gauge\n"
+		"crvr_pool_resident_bytes %lu\n"
+		"# HELP crvr_pool_high_water_bytes The most memory pool "
+		"that has been in use.\n"
+		"# TYPE crvr_pool_high_water_bytes gauge\n"
+		"crvr_pool_high_water_bytes %lu\n",
+		(unsigned long)METRIC_LOAD(m->pool_mapped),
+		(unsigned long)METRIC_LOAD(m->pool_resident),
+		(unsigned long)METRIC_LOAD(m->pool_high_water));
+	emit_counter(&w, "crvr_pool_reclaimed_bytes_total",
+		"Memory pool given back to the OS after going unused.",
+		METRIC_LOAD(m->pool_reclaimed));
+
+	emit(&w, "# HELP crvr_request_duration_seconds Time from a request "
+		"arriving to its response being sent, by route.\n"
+		"# TYPE crvr_request_duration_seconds histogram\n");
+	for (int route = 0; route < METRICS_ROUTE_COUNT; ++route) {
+		if (!s_route_names[route]) continue;
+		emit_latency(&w, s_route_names[route], m->latency + route);
+	}
+	pthread_mutex_unlock(&s_shards_lock);
+
+	*len = w.len;
+	if (w.err) LOG_WARN("The metrics didn't fit in %zu bytes.", cap);
+	return w.err;
+}
@@ -0,0 +1,106 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file declares crvr's metrics: counters and latency histograms that are
+ * served in the Prometheus text format at /metrics.
+ *
+ * Every thread records into its own shard, so recording never takes a lock or
+ * a locked instruction, just relaxed loads and stores. A scrape merges the
+ * shards, which may be a few records behind.
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "pool.h"
+
+// The most modules whose requests are counted apart.
+#define METRICS_MODULE_MAX 16
+
+/*
+ * What handled a request.
+ */
+enum metrics_route {
+	// The request couldn't be parsed.
+	METRICS_ROUTE_NONE,
+	// A file from the web root.
+	METRICS_ROUTE_STATIC,
+	// The metrics themselves.
+	METRICS_ROUTE_METRICS,
+	// The first module's routes. Each module gets its own from
+	// metrics_add_module, counting up from here.
+	METRICS_ROUTE_MODULE,
+	METRICS_ROUTE_COUNT = METRICS_ROUTE_MODULE + METRICS_MODULE_MAX
+};
+
+/*
+ * The method of a request, METRICS_METHOD_NONE if it couldn't be parsed.
+ */
+enum metrics_method {
+	METRICS_METHOD_NONE,
+	METRICS_METHOD_GET,
+	METRICS_METHOD_POST,
+	METRICS_METHOD_COUNT
+};
+
+/*
+ * Give a module's requests a route of their own in the metrics. Call it
+ * before any requests are handled.
+ *
+ * name - What the route is called. Copied, and cut short if it's long.
+ * route - Set to the route to record the module's requests as.
+ *
+ * Returns 0 if the route was added. Otherwise returns ENOSPC, as
+ * METRICS_MODULE_MAX modules already have one.
+ */
+int metrics_add_module(const char *name, enum metrics_route *route);
+
+/*
+ * Record a request that has been handled.
+ *
+ * method - The method of the request.
+ * route - What handled the request.
+ * status - The status of the response, 0 if none was sent.
+ * latency_ns - From the request arriving to the response being sent.
+ * bytes_in - The bytes read from the client.
+ * bytes_out - The bytes written to the client.
+ */
+void metrics_record_request(enum metrics_method method,
+	enum metrics_route route, int status, uint64_t latency_ns,
+	uint64_t bytes_in, uint64_t bytes_out);
+
+/*
+ * Count a request that couldn't be parsed.
+ */
+void metrics_count_parse_error(void);
+
+/*
+ * Count a lookup in a cache.
+ *
+ * hit - Nonzero if the lookup found what it was looking for.
+ */
+void metrics_count_cache(int hit);
+
+/*
+ * Note the memory use of the thread's pool. Each thread's latest stats are
+ * summed, except the high-water marks, of which the largest is reported.
+ *
+ * stats - The pool's stats, from pool_get_stats.
+ */
+void metrics_pool_stats(const struct pool_stats *stats);
+
+/*
+ * Write every metric in the Prometheus text exposition format.
+ *
+ * buf - The buffer to write to.
+ * cap - The size of buf.
+ * len - Set to the number of bytes written.
+ *
+ * Returns 0 if everything was written. Otherwise returns ENOBUFS and len is
+ * how much was written before buf ran out.
+ */
+int metrics_render(char *buf, size_t cap, size_t *len);
+
+#endif // METRICS_H
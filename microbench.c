@@ -0,0 +1,595 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file contains the microbenchmarks for crvr. Each benchmark times one
+ * small operation (a pool allocation, a str search, parsing a request, ...)
+ * over many iterations so regressions in the hot paths are measurable.
+ *
+ * The benchmarks are run with `make bench`. A human readable table is printed
+ * to stderr and the results are written as JSON to stdout, or to the file
+ * given with -o. Anything the code under test prints to stdout is discarded.
+ *
+ * The benchmarks that render asl.html need to be run from a directory that
+ * contains it, like the server.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC 1
+#else
+#define HAVE_RDTSC 0
+#endif
+
+#include "asl.h"
+#include "http.h"
+#include "log.h"
+#include "pool.h"
+#include "str.h"
+#include "utils.h"
+
+// The default number of untimed repetitions run before measuring.
+#define DEFAULT_WARMUP 2
+// The default number of timed repetitions.
+#define DEFAULT_REPS 7
+// The default amount of time each repetition should take.
+#define DEFAULT_REP_MS 50
+// Stop growing the iteration count at this many iterations per repetition.
+#define MAX_ITERATIONS (1L << 30)
+// The size of the scratch buffers requests and pages are copied into.
+#define SCRATCH_SIZE (MEGABYTE)
+
+/*
+ * The state handed to a benchmark. The benchmark runs its operation
+ * iterations times and sets bytes_per_op to the number of bytes it allocated
+ * per operation.
+ */
+struct bench_state {
+	long iterations;
+	double bytes_per_op;
+};
+
+/*
+ * A benchmark. setup is optional and is run once before the benchmark is
+ * timed.
+ */
+struct bench {
+	const char *name;
+	int (*setup)(void);
+	void (*run)(struct bench_state *b);
+};
+
+/*
+ * The results of timing a benchmark.
+ */
+struct bench_result {
+	const struct bench *bench;
+	long iterations;
+	int reps;
+	double ns_per_op_min;
+	double ns_per_op_median;
+	double ns_per_op_max;
+	double cycles_per_op;
+	double bytes_per_op;
+};
+
+/*
+ * Requests captured from browsers. They are what parse_request spends its
+ * time on in practice.
+ */
+static const char *const s_request_corpus[] = {
+	// Firefox loading the index page.
+	"GET / HTTP/1.1\r\n"
+	"Host: localhost:8080\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Connection: keep-alive\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"Sec-Fetch-Dest: document\r\n"
+	"Sec-Fetch-Mode: navigate\r\n"
+	"Sec-Fetch-Site: none\r\n"
+	"Sec-Fetch-User: ?1\r\n"
+	"\r\n",
+	// Chrome loading a card image.
+	"GET /hello%20world.png?v=2 HTTP/1.1\r\n"
+	"Host: localhost:8080\r\n"
+	"Connection: keep-alive\r\n"
+	"sec-ch-ua: \"Chromium\";v=\"116\", \"Not)A;Brand\";v=\"24\", \"Google Chrome\";v=\"116\"\r\n"
+	"sec-ch-ua-mobile: ?0\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) Chrome/116.0.0.0 Safari/537.36\r\n"
+	"sec-ch-ua-platform: \"Linux\"\r\n"
+	"Accept: image/avif,image/webp,image/apng,image/svg+xml,image/*,*/*;q=0.8\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"Sec-Fetch-Mode: no-cors\r\n"
+	"Sec-Fetch-Dest: image\r\n"
+	"Referer: http://localhost:8080/asl.html\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Accept-Language: en-US,en;q=0.9\r\n"
+	"\r\n",
+	// Firefox submitting the ASL quiz form.
+	"POST /asl.html HTTP/1.1\r\n"
+	"Host: localhost:8080\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Content-Type: application/x-www-form-urlencoded\r\n"
+	"Content-Length: 11\r\n"
+	"Origin: http://localhost:8080\r\n"
+	"Connection: keep-alive\r\n"
+	"Referer: http://localhost:8080/asl.html\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"\r\n"
+	"button=good",
+};
+
+// A form body with enough escapes to exercise the decoder.
+static const char s_post_request[] =
+	"POST /asl.html HTTP/1.1\r\n"
+	"Host: localhost:8080\r\n"
+	"Content-Type: application/x-www-form-urlencoded\r\n"
+	"Content-Length: 70\r\n"
+	"\r\n"
+	"button=good&card=hello+world.png&note=caf%C3%A9%20au%20lait&session=42";
+
+static struct pool s_pool;
+static char s_scratch[SCRATCH_SIZE];
+static char s_page[SCRATCH_SIZE];
+static size_t s_page_len = 0;
+static struct request s_request;
+// A reload of asl.html in a session.
+static char s_reload[256];
+static struct request s_reload_request;
+static int s_devnull = -1;
+// Written by the benchmarks so the compiler can't drop their work.
+static volatile long s_sink;
+
+/*
+ * Get the monotonic time in nanoseconds.
+ */
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+	(void)clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/*
+ * Read the CPU's cycle counter. Returns 0 where there isn't one.
+ */
+static uint64_t cycles(void)
+{
+#if HAVE_RDTSC
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static int setup_pool(void)
+{
+	if (s_pool.head) return 0;
+	return pool_init(&s_pool, 64 * MEBIBYTE);
+}
+
+static void bench_pool_alloc_reset(struct bench_state *b)
+{
+	const long start = pool_get_position(&s_pool);
+	for (long i = 0; i < b->iterations; ++i) {
+		char *mem = pool_alloc(&s_pool, 64);
+		mem[0] = (char)i;
+		s_sink += mem[0];
+		// Reset every 16 allocations, as if a request had finished.
+		if ((i & 15) == 15) pool_reset(&s_pool, start);
+	}
+	pool_reset(&s_pool, start);
+	b->bytes_per_op = 64;
+}
+
+static void bench_malloc_free(struct bench_state *b)
+{
+	char *mems[16] = {0};
+	for (long i = 0; i < b->iterations; ++i) {
+		mems[i & 15] = malloc(64);
+		if (!mems[i & 15]) abort();
+		mems[i & 15][0] = (char)i;
+		s_sink += mems[i & 15][0];
+		if ((i & 15) == 15) {
+			for (size_t m = 0; m < LEN(mems); ++m) {
+				free(mems[m]);
+				mems[m] = NULL;
+			}
+		}
+	}
+	for (size_t m = 0; m < LEN(mems); ++m) free(mems[m]);
+	b->bytes_per_op = 64;
+}
+
+static void bench_str_find_substr(struct bench_state *b)
+{
+	static const struct str end_of_header = STR("\r\n\r\n");
+	const struct str haystack = {
+		(char*)s_request_corpus[1], (long)strlen(s_request_corpus[1])
+	};
+	for (long i = 0; i < b->iterations; ++i) {
+		s_sink += str_find_substr(&haystack, &end_of_header);
+	}
+	b->bytes_per_op = 0;
+}
+
+static void bench_str_cmp_cstr(struct bench_state *b)
+{
+	static const struct str path = STR("asl.html");
+	for (long i = 0; i < b->iterations; ++i) {
+		s_sink += str_cmp_cstr(&path, "asl.html");
+	}
+	b->bytes_per_op = 0;
+}
+
+static void bench_str_to_long(struct bench_state *b)
+{
+	static const struct str number = STR("1048576");
+	long value = 0;
+	for (long i = 0; i < b->iterations; ++i) {
+		(void)str_to_long(&number, 10, &value);
+		s_sink += value;
+	}
+	b->bytes_per_op = 0;
+}
+
+/*
+ * Parse each request in the corpus in turn. The request is copied into a
+ * scratch buffer first because parsing decodes it in place.
+ */
+static void bench_parse_request(struct bench_state *b)
+{
+	size_t lens[LEN(s_request_corpus)];
+	for (size_t i = 0; i < LEN(s_request_corpus); ++i) {
+		lens[i] = strlen(s_request_corpus[i]);
+	}
+	const long start = pool_get_position(&s_pool);
+	long allocated = 0;
+	for (long i = 0; i < b->iterations; ++i) {
+		const size_t which = (size_t)i % LEN(s_request_corpus);
+		memcpy(s_scratch, s_request_corpus[which], lens[which] + 1);
+		(void)parse_request(s_scratch, (long)lens[which], &s_request,
+			&s_pool);
+		allocated += pool_get_position(&s_pool) - start;
+		pool_reset(&s_pool, start);
+		s_sink += s_request.header_count;
+	}
+	b->bytes_per_op = (double)allocated / (double)b->iterations;
+}
+
+static int setup_post_request(void)
+{
+	int err = setup_pool();
+	if (err) return err;
+	memcpy(s_scratch, s_post_request, sizeof(s_post_request));
+	return parse_request(s_scratch, (long)STRMAX(s_post_request),
+		&s_request, &s_pool);
+}
+
+/*
+ * Parse the params out of a form body. The body is restored before each parse
+ * because parsing decodes it in place.
+ */
+static void bench_parse_post_parameters(struct bench_state *b)
+{
+	const struct str body = s_request.post_params_buffer;
+	char original[sizeof(s_post_request)];
+	assert((size_t)body.len < sizeof(original));
+	memcpy(original, body.s, (size_t)body.len);
+	for (long i = 0; i < b->iterations; ++i) {
+		memcpy(body.s, original, (size_t)body.len);
+		s_request.post_params_buffer = body;
+		(void)parse_post_parameters(&s_request);
+		s_sink += s_request.post_param_count;
+	}
+	b->bytes_per_op = 0;
+}
+
+static int setup_page(void)
+{
+	if (s_page_len > 0) return 0;
+	int err = load_file("asl.html", s_page, LEN(s_page), &s_page_len);
+	if (err) return err;
+	if (s_devnull == -1) {
+		s_devnull = open("/dev/null", O_WRONLY);
+		if (s_devnull == -1) return errno;
+	}
+	return asl_init();
+}
+
+/*
+ * Substitute one variable into a fresh copy of asl.html.
+ */
+static void bench_print_var_to(struct bench_state *b)
+{
+	static const char var[] = "$cards";
+	const char *var_at = strstr(s_page, var);
+	assert(var_at);
+	const size_t var_offset = (size_t)(var_at - s_page);
+	for (long i = 0; i < b->iterations; ++i) {
+		size_t len = s_page_len;
+		memcpy(s_scratch, s_page, s_page_len);
+		(void)print_var_to(s_scratch + var_offset, &len, LEN(s_scratch),
+			var, "%li", i);
+		s_sink += (long)len;
+	}
+	b->bytes_per_op = 0;
+}
+
+/*
+ * Start a quiz and build a request that reloads it, with the cookie its
+ * response set.
+ */
+static int setup_session(void)
+{
+	int err = setup_page();
+	if (!err) err = setup_pool();
+	if (err) return err;
+	FILE *f = tmpfile();
+	if (!f) return errno;
+	static struct request no_cookie;
+	err = asl_get(&no_cookie, fileno(f));
+	char response[4096] = {0};
+	if (!err) {
+		rewind(f);
+		(void)fread(response, 1, sizeof(response) - 1, f);
+	}
+	fclose(f);
+	if (err) return err;
+
+	static const char cookie[] = "Set-Cookie: ";
+	const char *at = strstr(response, cookie);
+	const char *end = at ? strchr(at, ';') : NULL;
+	if (!end) return ENOENT;
+	at += STRMAX(cookie);
+	const int len = snprintf(s_reload, sizeof(s_reload),
+		"GET /asl.html HTTP/1.1\r\n"
+		"Host: localhost:8080\r\n"
+		"Cookie: %.*s\r\n"
+		"\r\n", (int)(end - at), at);
+	if ((len < 0) || ((size_t)len >= sizeof(s_reload))) return ENOBUFS;
+	return parse_request(s_reload, len, &s_reload_request, &s_pool);
+}
+
+/*
+ * Serve asl.html the way a reload does: find the session, check the template
+ * is current and send the page as the session last rendered it. The response
+ * goes to /dev/null.
+ */
+static void bench_asl_get(struct bench_state *b)
+{
+	for (long i = 0; i < b->iterations; ++i) {
+		s_sink += asl_get(&s_reload_request, s_devnull);
+	}
+	b->bytes_per_op = 0;
+}
+
+/*
+ * Send the session's next due cards as JSON, the way a batch client asks for
+ * them, with the same request as asl_get_render.
+ */
+static void bench_asl_get_batch(struct bench_state *b)
+{
+	for (long i = 0; i < b->iterations; ++i) {
+		s_sink += asl_get_batch(&s_reload_request, s_devnull);
+	}
+	b->bytes_per_op = 0;
+}
+
+static const struct bench s_benches[] = {
+	{"pool_alloc_reset", setup_pool, bench_pool_alloc_reset},
+	{"malloc_free", NULL, bench_malloc_free},
+	{"str_find_substr", NULL, bench_str_find_substr},
+	{"str_cmp_cstr", NULL, bench_str_cmp_cstr},
+	{"str_to_long", NULL, bench_str_to_long},
+	{"parse_request", setup_pool, bench_parse_request},
+	{"parse_post_parameters", setup_post_request,
+		bench_parse_post_parameters},
+	{"print_var_to", setup_page, bench_print_var_to},
+	{"asl_get_render", setup_session, bench_asl_get},
+	{"asl_get_batch", setup_session, bench_asl_get_batch},
+};
+
+static int compare_doubles(const void *a, const void *b)
+{
+	const double left = *(const double*)a;
+	const double right = *(const double*)b;
+	return (left > right) - (left < right);
+}
+
+/*
+ * Time one repetition of a benchmark.
+ */
+static void time_rep(const struct bench *bench, struct bench_state *state,
+	uint64_t *ns, uint64_t *cycle_count)
+{
+	const uint64_t start_cycles = cycles();
+	const uint64_t start = now_ns();
+	bench->run(state);
+	*ns = now_ns() - start;
+	*cycle_count = cycles() - start_cycles;
+}
+
+/*
+ * Warm up the benchmark while growing the iteration count until a single
+ * repetition takes about rep_ms, then time reps repetitions.
+ */
+static void run_bench(const struct bench *bench, int warmup, int reps,
+	long rep_ms, struct bench_result *result)
+{
+	struct bench_state state = {1, 0};
+	uint64_t ns = 0;
+	uint64_t cycle_count = 0;
+	const uint64_t target_ns = (uint64_t)rep_ms * 1000000u;
+
+	// Calibrate. Running the growing iteration counts doubles as warmup.
+	for (;;) {
+		time_rep(bench, &state, &ns, &cycle_count);
+		if ((ns >= target_ns) || (state.iterations >= MAX_ITERATIONS))
+			break;
+		long next = state.iterations * 2;
+		if (ns > 0) {
+			const double scale = (double)target_ns / (double)ns;
+			if (scale < 2) next = (long)((double)state.iterations *
+				scale) + 1;
+			else if (scale > 100) next = state.iterations * 100;
+		}
+		state.iterations = (next > MAX_ITERATIONS) ? MAX_ITERATIONS :
+			next;
+	}
+	for (int i = 0; i < warmup; ++i) {
+		time_rep(bench, &state, &ns, &cycle_count);
+	}
+
+	double ns_per_op[64];
+	double cycles_total = 0;
+	if (reps > (int)LEN(ns_per_op)) reps = (int)LEN(ns_per_op);
+	for (int i = 0; i < reps; ++i) {
+		time_rep(bench, &state, &ns, &cycle_count);
+		ns_per_op[i] = (double)ns / (double)state.iterations;
+		cycles_total += (double)cycle_count / (double)state.iterations;
+	}
+	qsort(ns_per_op, (size_t)reps, sizeof(ns_per_op[0]), compare_doubles);
+
+	result->bench = bench;
+	result->iterations = state.iterations;
+	result->reps = reps;
+	result->ns_per_op_min = ns_per_op[0];
+	result->ns_per_op_median = ns_per_op[reps / 2];
+	result->ns_per_op_max = ns_per_op[reps - 1];
+	result->cycles_per_op = cycles_total / reps;
+	result->bytes_per_op = state.bytes_per_op;
+}
+
+static void print_json(FILE *f, const struct bench_result *results,
+	size_t result_count)
+{
+	fprintf(f, "{\n  \"benchmarks\": [\n");
+	for (size_t i = 0; i < result_count; ++i) {
+		const struct bench_result *r = results + i;
+		fprintf(f,
+			"    {\"name\": \"%s\", \"iterations\": %li, "
+			"\"reps\": %i, \"ns_per_op\": %.3f, "
+			"\"ns_per_op_min\": %.3f, \"ns_per_op_max\": %.3f, "
+			"\"cycles_per_op\": %.1f, \"bytes_per_op\": %.1f}%s\n",
+			r->bench->name, r->iterations, r->reps,
+			r->ns_per_op_median, r->ns_per_op_min,
+			r->ns_per_op_max, r->cycles_per_op, r->bytes_per_op,
+			(i + 1 < result_count) ? "," : "");
+	}
+	fprintf(f, "  ]\n}\n");
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [-w warmup] [-r reps] [-t ms_per_rep] [-f filter] "
+		"[-o out.json] [-l level]\n"
+		"  -w  untimed repetitions after calibrating (default %i)\n"
+		"  -r  timed repetitions (default %i)\n"
+		"  -t  target milliseconds per repetition (default %i)\n"
+		"  -f  only run benchmarks whose name contains filter\n"
+		"  -o  write the JSON results here instead of stdout\n"
+		"  -l  log level of the code under test, as for crvr (default "
+		"info)\n",
+		name, DEFAULT_WARMUP, DEFAULT_REPS, DEFAULT_REP_MS);
+}
+
+int main(int argc, char *argv[])
+{
+	int warmup = DEFAULT_WARMUP;
+	int reps = DEFAULT_REPS;
+	long rep_ms = DEFAULT_REP_MS;
+	const char *filter = NULL;
+	const char *out_path = NULL;
+	enum log_level level = LOG_LEVEL_INFO;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "w:r:t:f:o:l:h")) != -1) {
+		switch (opt) {
+		case 'w': warmup = atoi(optarg); break;
+		case 'r': reps = atoi(optarg); break;
+		case 't': rep_ms = atol(optarg); break;
+		case 'f': filter = optarg; break;
+		case 'o': out_path = optarg; break;
+		case 'l':
+			if (log_parse_level(optarg, &level) == 0) break;
+			// fallthrough
+		default:
+			usage(argv[0]);
+			return (opt == 'h') ? 0 : EINVAL;
+		}
+	}
+	if ((warmup < 0) || (reps <= 0) || (rep_ms <= 0)) {
+		usage(argv[0]);
+		return EINVAL;
+	}
+
+	// The code under test logs to stdout. Keep the real stdout for the
+	// results and send everything else to /dev/null.
+	FILE *out = NULL;
+	if (out_path) {
+		out = fopen(out_path, "w");
+	} else {
+		const int out_fd = dup(STDOUT_FILENO);
+		if (out_fd != -1) out = fdopen(out_fd, "w");
+	}
+	if (!out) {
+		fprintf(stderr, "Failed to open the results file: %i\n",
+			errno);
+		return errno;
+	}
+	if (!freopen("/dev/null", "w", stdout)) {
+		fprintf(stderr, "Failed to silence stdout: %i\n", errno);
+		fclose(out);
+		return errno;
+	}
+	// Log through the background writer, the way the server does.
+	if (log_init(level) == 0) (void)atexit(log_shutdown);
+
+	struct bench_result results[LEN(s_benches)];
+	size_t result_count = 0;
+	int result = 0;
+	fprintf(stderr, "%-24s %12s %12s %12s %10s\n", "benchmark", "ns/op",
+		"min ns/op", "cycles/op", "bytes/op");
+	for (size_t i = 0; i < LEN(s_benches); ++i) {
+		const struct bench *bench = s_benches + i;
+		if (filter && !strstr(bench->name, filter)) continue;
+		if (bench->setup) {
+			int err = bench->setup();
+			if (err) {
+				fprintf(stderr, "%s setup failed: %i\n",
+					bench->name, err);
+				result = err;
+				continue;
+			}
+		}
+		struct bench_result *r = results + result_count++;
+		run_bench(bench, warmup, reps, rep_ms, r);
+		fprintf(stderr, "%-24s %12.2f %12.2f %12.1f %10.1f\n",
+			bench->name, r->ns_per_op_median, r->ns_per_op_min,
+			r->cycles_per_op, r->bytes_per_op);
+	}
+	print_json(out, results, result_count);
+	fclose(out);
+
+	if (s_devnull != -1) close(s_devnull);
+	pool_free(&s_pool);
+	return result;
+}
@@ -0,0 +1,217 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * Defines loading application modules.
+ *
+ * Modules are opened with RTLD_NOW, so one missing a symbol fails to load at
+ * startup instead of when a request first reaches the code that needs it,
+ * and RTLD_LOCAL, so modules can't see each other's symbols.
+ */
+#define _DEFAULT_SOURCE
+
+#include "module.h"
+
+#include <assert.h>
+#include <dlfcn.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "router.h"
+
+/*
+ * A module that was loaded.
+ */
+struct loaded {
+	void *handle;
+	const struct module *module;
+};
+
+static_assert(METRICS_MODULE_MAX >= MODULE_MAX,
+	"Every module needs a route in the metrics");
+
+static struct loaded s_modules[MODULE_MAX];
+static size_t s_module_count = 0;
+
+/*
+ * Find the file a module is in. A file without a / is next to the crvr
+ * executable, if where that is can be found, and wherever dlopen looks if
+ * not.
+ */
+static void resolve_file(const char *file, char *path, size_t cap)
+{
+	(void)snprintf(path, cap, "%s", file);
+	if (strchr(file, '/')) return;
+#if LINUX
+	char exe[PATH_MAX];
+	const ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+	if (len <= 0) return;
+	exe[len] = '\0';
+	char *slash = strrchr(exe, '/');
+	if (!slash) return;
+	*slash = '\0';
+	const int n = snprintf(path, cap, "%s/%s", exe, file);
+	if ((n < 0) || ((size_t)n >= cap)) {
+		(void)snprintf(path, cap, "%s", file);
+	}
+#endif
+}
+
+/*
+ * Close a module. Its formats may still be waiting to be logged, which would
+ * be read from unmapped memory once it's closed, so the log is written out
+ * first.
+ */
+static void close_module(void *handle)
+{
+	log_flush();
+	dlclose(handle);
+}
+
+/*
+ * Add a module's routes to the router under mount. Its requests are counted
+ * in the metrics as its name and mount, like asl:/.
+ */
+static int add_routes(const struct module *m, const char *mount)
+{
+	// The router's paths don't start with a /, and a mount point other
+	// than the root ends in one.
+	while (*mount == '/') ++mount;
+	const size_t mount_len = strlen(mount);
+	const char *sep = ((mount_len > 0) && (mount[mount_len - 1] != '/')) ?
+		"/" : "";
+
+	char name[PATH_MAX];
+	const int name_len = snprintf(name, sizeof(name), "%s:/%s%s", m->name,
+		mount, sep);
+	if ((name_len < 0) || ((size_t)name_len >= sizeof(name))) {
+		return ENAMETOOLONG;
+	}
+	enum metrics_route metrics = METRICS_ROUTE_NONE;
+	const int metrics_err = metrics_add_module(name, &metrics);
+	if (metrics_err) return metrics_err;
+
+	for (size_t i = 0; i < m->route_count; ++i) {
+		const struct module_route *mr = &m->routes[i];
+		char path[PATH_MAX];
+		const int n = snprintf(path, sizeof(path), "%s%s%s", mount, sep,
+			mr->path);
+		if ((n < 0) || ((size_t)n >= sizeof(path))) {
+			return ENAMETOOLONG;
+		}
+		const struct route route = {
+			mr->methods, mr->handle, metrics
+		};
+		const int err = router_add(path, &route);
+		if (err) return err;
+		LOG_DEBUG("%s handles /%s", m->name, path);
+	}
+	return 0;
+}
+
+int module_load(const char *spec, const char *default_arg)
+{
+	if (s_module_count == MODULE_MAX) {
+		LOG_ERROR("Only %d modules can be loaded.", MODULE_MAX);
+		return ENOSPC;
+	}
+
+	// file[:mount[:arg]]
+	char file[PATH_MAX];
+	const char *mount = "/";
+	const char *arg = default_arg;
+	const char *colon = strchr(spec, ':');
+	const size_t file_len = colon ? (size_t)(colon - spec) : strlen(spec);
+	if ((file_len == 0) || (file_len >= sizeof(file))) {
+		LOG_ERROR("Bad module \"%s\".", spec);
+		return EINVAL;
+	}
+	memcpy(file, spec, file_len);
+	file[file_len] = '\0';
+	char mount_buf[PATH_MAX];
+	if (colon) {
+		const char *colon2 = strchr(colon + 1, ':');
+		const size_t mount_len = colon2 ? (size_t)(colon2 - colon - 1) :
+			strlen(colon + 1);
+		if (mount_len >= sizeof(mount_buf)) {
+			LOG_ERROR("Bad module \"%s\".", spec);
+			return EINVAL;
+		}
+		memcpy(mount_buf, colon + 1, mount_len);
+		mount_buf[mount_len] = '\0';
+		mount = mount_buf;
+		if (colon2) arg = colon2 + 1;
+	}
+
+	char path[PATH_MAX];
+	resolve_file(file, path, sizeof(path));
+	void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (!handle) {
+		LOG_ERROR("Failed to load %s: %s", path, dlerror());
+		return ENOENT;
+	}
+	const struct module *m = dlsym(handle, MODULE_SYMBOL);
+	if (!m) {
+		LOG_ERROR("%s isn't a module: %s", path, dlerror());
+		close_module(handle);
+		return ENOEXEC;
+	}
+	if (m->abi_version != MODULE_ABI_VERSION) {
+		LOG_ERROR("%s was built for module ABI %u, not %u.", path,
+			m->abi_version, MODULE_ABI_VERSION);
+		close_module(handle);
+		return ENOEXEC;
+	}
+
+	int err = m->init ? m->init(arg) : 0;
+	if (err) {
+		LOG_ERROR("Failed to initialize %s: %i", m->name, err);
+		close_module(handle);
+		return err;
+	}
+	// The routes added before one failed can't be taken back, so they
+	// stay in the router, but nothing is built from them; starting up
+	// fails.
+	err = add_routes(m, mount);
+	if (err) {
+		LOG_ERROR("Failed to mount %s at %s: %i", m->name, mount, err);
+		if (m->shutdown) m->shutdown();
+		close_module(handle);
+		return err;
+	}
+	s_modules[s_module_count++] = (struct loaded){handle, m};
+	LOG_INFO("Loaded %s from %s at %s.", m->name, path, mount);
+	return 0;
+}
+
+void module_maintain_all(void)
+{
+	for (size_t i = 0; i < s_module_count; ++i) {
+		if (s_modules[i].module->maintain) {
+			s_modules[i].module->maintain();
+		}
+	}
+}
+
+long module_arena_hint(void)
+{
+	long hint = 0;
+	for (size_t i = 0; i < s_module_count; ++i) {
+		if (s_modules[i].module->arena_hint > hint) {
+			hint = s_modules[i].module->arena_hint;
+		}
+	}
+	return hint;
+}
+
+void module_unload_all(void)
+{
+	while (s_module_count > 0) {
+		const struct loaded *l = &s_modules[--s_module_count];
+		if (l->module->shutdown) l->module->shutdown();
+		close_module(l->handle);
+	}
+}
@@ -0,0 +1,125 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file declares application modules: shared objects crvr loads with
+ * dlopen and mounts at a path, so applications like the ASL quiz don't have
+ * to be built into the server.
+ *
+ * A module defines MODULE_SYMBOL, a struct module saying what it handles.
+ * Each of its routes is mounted under the module's path and added to the
+ * router, so a request reaches its handler with one walk of the path however
+ * many modules are loaded. Requests no route handles are served from the web
+ * root as before.
+ *
+ * Modules run in the server's process and call its functions, send_data,
+ * iobuf_get, the LOG macros and so on, directly; the server exports them.
+ *
+ * The second half of the file is the server's side: loading modules and
+ * driving them.
+ */
+#ifndef MODULE_H
+#define MODULE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "http.h"
+#include "pool.h"
+
+// Bumped whenever struct module or what the server passes modules changes.
+// A module built against another version isn't loaded.
+#define MODULE_ABI_VERSION 1
+// The name of the struct module a module defines.
+#define MODULE_SYMBOL "crvr_module"
+// The most modules loaded at once.
+#define MODULE_MAX 16
+
+/*
+ * The kinds of request a route handles.
+ */
+enum module_method {
+	MODULE_GET = 1,
+	MODULE_POST = 2,
+	// A GET asking to upgrade to a WebSocket.
+	MODULE_UPGRADE = 4
+};
+
+/*
+ * Handles a request.
+ *
+ * r - The request. A POST's body has been read into post_params_buffer.
+ * client - The client to respond to.
+ * p - The pool, for memory the request needs. Everything allocated from it
+ *     is freed once the request is done.
+ *
+ * Returns 0 if the request was handled. Otherwise returns an error code.
+ */
+typedef int (*module_handler)(struct request *r, int client, struct pool *p);
+
+/*
+ * A path a module handles.
+ */
+struct module_route {
+	// The path under the module's mount point, without a leading /. A
+	// path ending in /, or an empty one, is a prefix: it handles every
+	// path under it that no other route does.
+	const char *path;
+	// The module_methods it handles. Requests of other kinds fall back to
+	// the web root.
+	unsigned methods;
+	module_handler handle;
+};
+
+/*
+ * What a module defines as MODULE_SYMBOL.
+ */
+struct module {
+	// MODULE_ABI_VERSION, as the module was built with.
+	uint32_t abi_version;
+	const char *name;
+	// Set the module up. arg is the argument it was loaded with, or NULL.
+	// Returns 0 if the module can serve requests. Otherwise returns an
+	// error code and the module is unloaded.
+	int (*init)(const char *arg);
+	// Called between requests, to do anything the module does over time.
+	// May be NULL.
+	void (*maintain)(void);
+	// Called before the module is unloaded. May be NULL.
+	void (*shutdown)(void);
+	const struct module_route *routes;
+	size_t route_count;
+	// The most of the pool one of its requests is expected to use, so the
+	// server has that much ready before the first. 0 if it doesn't use the
+	// pool.
+	long arena_hint;
+};
+
+/*
+ * Load a module, set it up and add its routes to the router.
+ *
+ * spec - file[:mount[:arg]]. A file without a / is looked for next to the
+ *        crvr executable. mount is the path its routes go under, / if not
+ *        given.
+ * default_arg - The argument to set it up with if spec doesn't have one.
+ *
+ * Returns 0 if the module was loaded. Otherwise returns an error code.
+ */
+int module_load(const char *spec, const char *default_arg);
+
+/*
+ * Let every module do what it does between requests.
+ */
+void module_maintain_all(void);
+
+/*
+ * Returns the largest arena hint of the modules loaded.
+ */
+long module_arena_hint(void);
+
+/*
+ * Shut every module down and unload it, the last loaded first. Nothing the
+ * modules handed out, like WebSocket handlers, may be used after this.
+ */
+void module_unload_all(void);
+
+#endif // MODULE_H
@@ -6,42 +6,132 @@
  * dynamic memory allocations without going all the way to the OS.
  *
  * The pool is designed to be created and reused over and over again. First
- * initialize the pool to a large size, then allocate items from it. When
- * you are done with those items, just call pool_reset to "free" them, which
- * just tells the pool to start allocating from the provided index again.
- * 
+ * initialize the pool, then allocate items from it. When you are done with
+ * those items, just call pool_reset to "free" them, which just tells the pool
+ * to start allocating from the provided index again.
+ *
  * This makes deallocation constant time.
+ *
+ * The memory is a chain of segments mapped from the OS as the pool grows,
+ * each twice the size of the last, up to the maximum size the pool was
+ * initialized with. Positions are offsets into the whole chain, so a position
+ * taken in one segment can be reset to after allocations have moved on to
+ * later ones. Segments stay mapped once they've been used so a pool that
+ * grew to handle a big request doesn't have to map them again.
+ *
+ * The memory a spike touched does stay resident though. With
+ * pool_set_reclaim, pool_reclaim gives the pages above the pool's working
+ * set back to the OS once the pool has gone a quiet period without needing
+ * them. The working set is the most the pool used during that period.
  */
 #ifndef POOL_H
 #define POOL_H
 
+#include <stddef.h>
+#include <stdint.h>
+
+// Debug builds count the allocations made at each call site of pool_alloc.
+// Release builds (-DNDEBUG) leave the accounting out.
+#if !defined(NDEBUG) && !defined(POOL_NO_ACCOUNTING)
+#define POOL_ACCOUNTING 1
+#endif
+
+// Every allocation is aligned to this.
+#define POOL_ALIGNMENT ((long)_Alignof(max_align_t))
+// The size of the first segment, and of a huge page.
+#define POOL_SEGMENT_SIZE (2L * 1024 * 1024)
+
+/*
+ * Flags for pool_init_flags.
+ */
+enum pool_flags {
+	// Back the pool with huge pages: explicit ones if the system has any
+	// reserved, otherwise segments are aligned for transparent huge pages.
+	POOL_HUGE_PAGES = 1,
+	// Reclaim with MADV_FREE, which leaves the pages resident until the
+	// system needs them, instead of MADV_DONTNEED.
+	POOL_LAZY_RECLAIM = 2
+};
+
+/*
+ * A piece of the pool's memory. The segment's header is at the start of its
+ * mapping and the memory handed out follows it.
+ */
+struct pool_segment {
+	struct pool_segment *next;
+	// The pool offset of the first byte of data.
+	long base;
+	// The number of bytes of data.
+	long size;
+	// The size of the whole mapping, header included.
+	size_t map_size;
+	// The size of the pages backing the mapping.
+	size_t page_size;
+	char *data;
+};
+
 /*
- * Stores a block of memory, the offset into it where memory is unused and
- * the total capacity of the block.
+ * Stores the chain of segments, the offset into it where memory is unused and
+ * the most memory the pool may map.
  */
 struct pool {
 	long offset;
 	long cap;
-	char *buffer;
+	// The highest offset seen by pool_reset.
+	long high_water;
+	// The bytes of data in every segment.
+	long reserved;
+	int flags;
+	// The highest offset seen since memory was last reclaimed. Everything
+	// below it may be resident.
+	long touched;
+	// How long the pool must be quiet before reclaiming, 0 to never.
+	uint64_t quiet_ns;
+	// When the current quiet period started, and the highest offset seen
+	// during it.
+	uint64_t window_start_ns;
+	long window_peak;
+	// The bytes given back to the OS and the number of times it was done.
+	long reclaimed;
+	unsigned long reclaims;
+	// The highest offset seen since pool_reset_peak.
+	long peak;
+	struct pool_segment *head;
+	// The segment offset is in.
+	struct pool_segment *current;
 };
 
 /*
- * Initialize the memory pool.
+ * Initialize the memory pool. Only the first segment is mapped, more are
+ * mapped as needed.
  *
  * p - The pool to initialize.
- * desired_size - The capacity of the pool.
+ * desired_size - The most memory the pool may grow to.
  *
- * Returns 0 if the pool, p, was successfully initialized to the desired
- * size. Otherwise returns an error code.
+ * Returns 0 if the pool, p, was successfully initialized. Otherwise returns an
+ * error code.
  */
 int pool_init(struct pool *p, long desired_size);
 
+/*
+ * Initialize the memory pool, like pool_init.
+ *
+ * p - The pool to initialize.
+ * desired_size - The most memory the pool may grow to.
+ * flags - A combination of pool_flags.
+ *
+ * Returns 0 if the pool, p, was successfully initialized. Otherwise returns an
+ * error code.
+ */
+int pool_init_flags(struct pool *p, long desired_size, int flags);
+
 /**
- * @brief Return the number of unused bytes in the pool.
+ * @brief Return the largest allocation the pool can still make.
  *
  * @param[in] p - The pool to query.
  *
- * @return Returns the space left in p. Returns -1 if p is NULL.
+ * @return Returns the most bytes a single pool_alloc from p can get. Returns
+ *         -1 if p is NULL.
  */
 long pool_get_remaining_capacity(struct pool *p);
 
@@ -57,7 +147,8 @@ long pool_get_remaining_capacity(struct pool *p);
 void pool_free(struct pool *p);
 
 /*
- * Allocate memory from the pool and return it.
+ * Allocate memory from the pool and return it. The memory is aligned to
+ * POOL_ALIGNMENT.
  *
  * p - The pool to allocate from.
  * byte_amount - The number of bytes to allocate.
@@ -65,7 +156,48 @@ void pool_free(struct pool *p);
  * Returns a valid pointer if successful. If the pool has no more memory
  * NULL will be returned.
  */
-void *pool_alloc(struct pool *p, long byte_amount);
+void *(pool_alloc)(struct pool *p, long byte_amount);
+
+#if POOL_ACCOUNTING
+/*
+ * The allocations made from one line of code.
+ */
+struct pool_site {
+	const char *file;
+	int line;
+	unsigned long count;
+	// The bytes asked for, before alignment.
+	long bytes;
+	long largest;
+	// The allocations that failed.
+	unsigned long failures;
+};
+
+// The most call sites counted. Allocations from any more are only counted in
+// the total of dropped sites.
+#define POOL_SITES_MAX 256
+
+/*
+ * pool_alloc, counting the allocation against the line it was made from.
+ * Call it through pool_alloc.
+ */
+void *pool_alloc_at(struct pool *p, long byte_amount, const char *file,
+	int line);
+
+#define pool_alloc(p, byte_amount)\
+	pool_alloc_at(p, byte_amount, __FILE__, __LINE__)
+
+/*
+ * Get the call sites that have allocated on this thread.
+ *
+ * sites - Set to up to max of the sites, in no particular order.
+ * max - The size of sites.
+ * dropped - Set to the allocations from sites that didn't fit in the table.
+ *
+ * Returns the number of sites set.
+ */
+int pool_get_sites(struct pool_site *sites, int max, unsigned long *dropped);
+#endif
 
 /**
  * @brief Returns the current position of the pool.
@@ -79,6 +211,81 @@ void *pool_alloc(struct pool *p, long byte_amount);
  */
 long pool_get_position(struct pool *p);
 
+/*
+ * A pool's memory use.
+ */
+struct pool_stats {
+	// The bytes of memory mapped for data.
+	long mapped;
+	// The bytes that may be resident: everything touched since memory was
+	// last reclaimed.
+	long resident;
+	// The most memory that has been in use at once.
+	long high_water;
+	// The bytes in use now.
+	long in_use;
+	// The bytes given back to the OS so far, and the number of times.
+	long reclaimed;
+	unsigned long reclaims;
+};
+
+/*
+ * Get a pool's memory use.
+ *
+ * p - The pool to query.
+ * stats - Set to p's stats.
+ */
+void pool_get_stats(struct pool *p, struct pool_stats *stats);
+
+/*
+ * Turn on reclaiming memory the pool no longer needs. Nothing is reclaimed
+ * until pool_reclaim is called.
+ *
+ * p - The pool.
+ * quiet_ns - How long the pool must go without needing memory before it is
+ *            given back. 0 turns reclaiming off.
+ */
+void pool_set_reclaim(struct pool *p, uint64_t quiet_ns);
+
+/*
+ * Give the memory above the pool's working set back to the OS if a quiet
+ * period has passed since the last time. Call it regularly, between requests
+ * and when idle; it only checks the time unless a period has passed.
+ *
+ * p - The pool.
+ * now_ns - The monotonic time in nanoseconds.
+ *
+ * Returns 0 if nothing went wrong. Otherwise returns an error code from
+ * madvise.
+ */
+int pool_reclaim(struct pool *p, uint64_t now_ns);
+
+/*
+ * Start measuring the pool's peak from its current offset. Like the
+ * high-water mark, this costs nothing when allocating.
+ *
+ * p - The pool.
+ */
+void pool_reset_peak(struct pool *p);
+
+/*
+ * Returns the highest offset the pool has been at since pool_reset_peak.
+ */
+long pool_get_peak(struct pool *p);
+
+/**
+ * @brief Returns the most memory that has been in use in the pool at once.
+ *
+ * The pool notes its offset whenever it is reset, so this costs nothing when
+ * allocating.
+ *
+ * @param[in] p - The pool to query.
+ *
+ * @return Returns the highest position the pool has been at. Returns -1 if p
+ *         is NULL.
+ */
+long pool_get_high_water(struct pool *p);
+
 /**
  * @brief Reset the pool to a specific offset, reclaiming memory.
  *
@@ -124,48 +331,244 @@ int pool_reset(struct pool *p, long offset);
 
 /*
  * If you set this #define, the functions definitions will be included in the
- * current file.
+ * current file. mmap's flags need _DEFAULT_SOURCE defined before anything is
+ * included.
  */
 #ifdef DEFINE_POOL
 
 #include <assert.h>
 #include <errno.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "probes.h"
+
+#if !defined(MAP_ANONYMOUS) && defined(MAP_ANON)
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+// The segment header is padded so the data starts on a cache line.
+#define POOL_HEADER_SIZE ((sizeof(struct pool_segment) + 63) & ~(size_t)63)
+
+static long pool_align(long byte_amount)
+{
+	return (byte_amount + POOL_ALIGNMENT - 1) & ~(POOL_ALIGNMENT - 1);
+}
+
+/*
+ * Map size bytes, with huge pages if flags asks for them. size is a multiple
+ * of POOL_SEGMENT_SIZE. page_size is set to the size of the pages used.
+ */
+static void *pool_map(size_t size, int flags, size_t *page_size)
+{
+	const int prot = PROT_READ | PROT_WRITE;
+	const int map = MAP_PRIVATE | MAP_ANONYMOUS;
+	*page_size = (size_t)sysconf(_SC_PAGESIZE);
+	if (!(flags & POOL_HUGE_PAGES)) {
+		void *m = mmap(NULL, size, prot, map, -1, 0);
+		return (m == MAP_FAILED) ? NULL : m;
+	}
+#ifdef MAP_HUGETLB
+	void *huge = mmap(NULL, size, prot, map | MAP_HUGETLB, -1, 0);
+	if (huge != MAP_FAILED) {
+		*page_size = POOL_SEGMENT_SIZE;
+		return huge;
+	}
+#endif
+	// No huge pages reserved, so map extra and trim it to a huge page
+	// boundary for the kernel to back with transparent huge pages.
+	const size_t span = size + POOL_SEGMENT_SIZE;
+	char *m = mmap(NULL, span, prot, map, -1, 0);
+	if (m == MAP_FAILED) return NULL;
+	char *aligned = (char*)(((uintptr_t)m + POOL_SEGMENT_SIZE - 1) &
+		~(uintptr_t)(POOL_SEGMENT_SIZE - 1));
+	if (aligned > m) (void)munmap(m, (size_t)(aligned - m));
+	if (aligned + size < m + span) {
+		(void)munmap(aligned + size, (size_t)(m + span - (aligned + size)));
+	}
+#ifdef MADV_HUGEPAGE
+	(void)madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+	return aligned;
+}
+
+/*
+ * Map a segment with room for at least need bytes of data and add it to the
+ * end of the chain.
+ *
+ * Returns the new segment, or NULL if the pool is at its maximum size or the
+ * memory couldn't be mapped.
+ */
+static struct pool_segment *pool_add_segment(struct pool *p, long need)
+{
+	struct pool_segment *last = p->head;
+	while (last && last->next) last = last->next;
+
+	const long room = p->cap - p->reserved;
+	if ((room <= 0) || (need > room)) return NULL;
+	size_t map_size = last ? last->map_size * 2 : POOL_SEGMENT_SIZE;
+	if (map_size < (size_t)need + POOL_HEADER_SIZE) {
+		map_size = ((size_t)need + POOL_HEADER_SIZE +
+			POOL_SEGMENT_SIZE - 1) & ~(size_t)(POOL_SEGMENT_SIZE - 1);
+	}
+	// Don't map much more than the pool is allowed to use.
+	const size_t most = ((size_t)room + POOL_HEADER_SIZE +
+		POOL_SEGMENT_SIZE - 1) & ~(size_t)(POOL_SEGMENT_SIZE - 1);
+	if (map_size > most) map_size = most;
+
+	size_t page_size = 0;
+	struct pool_segment *s = pool_map(map_size, p->flags, &page_size);
+	if (!s) return NULL;
+	s->next = NULL;
+	s->page_size = page_size;
+	s->base = last ? last->base + last->size : 0;
+	s->map_size = map_size;
+	s->data = (char*)s + POOL_HEADER_SIZE;
+	s->size = (long)(map_size - POOL_HEADER_SIZE);
+	if (s->size > room) s->size = room;
+	p->reserved += s->size;
+	if (last) {
+		last->next = s;
+	} else {
+		p->head = s;
+	}
+	return s;
+}
+
+/*
+ * Move the pool to the next segment with room for need bytes, mapping a new
+ * one if none of the segments after the current one are big enough.
+ */
+static struct pool_segment *pool_next_segment(struct pool *p, long need)
+{
+	struct pool_segment *s = p->current ? p->current->next : p->head;
+	while (s && (s->size < need)) s = s->next;
+	if (!s) s = pool_add_segment(p, need);
+	if (!s) return NULL;
+	p->current = s;
+	p->offset = s->base;
+	return s;
+}
 
 int pool_init(struct pool *p, const long desired_size)
 {
-	assert(p && (p->buffer == NULL));
+	return pool_init_flags(p, desired_size, 0);
+}
+
+int pool_init_flags(struct pool *p, const long desired_size, int flags)
+{
+	assert(p && (p->head == NULL));
+	if (desired_size <= 0) return EINVAL;
 	p->offset = 0;
 	p->cap = desired_size;
-	p->buffer = malloc((size_t)p->cap);
+	p->high_water = 0;
+	p->reserved = 0;
+	p->flags = flags;
+	p->touched = 0;
+	p->quiet_ns = 0;
+	p->window_start_ns = 0;
+	p->window_peak = 0;
+	p->reclaimed = 0;
+	p->reclaims = 0;
+	p->peak = 0;
+	p->head = NULL;
 
-	if (!p->buffer) {
-		return errno;
+	p->current = pool_add_segment(p, 0);
+	if (!p->current) {
+		return errno ? errno : ENOMEM;
 	}
 	return 0;
 }
 
 void pool_free(struct pool *p)
 {
-	if (p && p->buffer) {
-		free(p->buffer);
-		p->buffer = NULL;
+	if (!p) return;
+	struct pool_segment *s = p->head;
+	while (s) {
+		struct pool_segment *next = s->next;
+		(void)munmap(s, s->map_size);
+		s = next;
 	}
-	p->offset = p->cap = 0;
+	p->head = p->current = NULL;
+	p->offset = p->cap = p->reserved = 0;
 }
 
-void *pool_alloc(struct pool *p, long byte_amount)
+void *(pool_alloc)(struct pool *p, long byte_amount)
 {
-	long alignment = (long)sizeof(void*) - byte_amount %
-		(long)sizeof(void*);
-	byte_amount += alignment;
-	if ((p->offset + byte_amount) > p->cap) return NULL;
-	assert(p->buffer);
-	void *allocation = (void*)(p->buffer + p->offset);
+	if (byte_amount < 0) return NULL;
+	byte_amount = pool_align(byte_amount);
+	struct pool_segment *s = p->current;
+	if (!s || (p->offset + byte_amount > s->base + s->size)) {
+		s = pool_next_segment(p, byte_amount);
+		if (!s) return NULL;
+	}
+	void *allocation = (void*)(s->data + (p->offset - s->base));
 	p->offset += byte_amount;
 	return allocation;
 }
 
+#if POOL_ACCOUNTING
+static _Thread_local struct pool_site t_sites[POOL_SITES_MAX];
+static _Thread_local unsigned long t_sites_dropped;
+
+/*
+ * Find the slot for a call site, claiming an empty one if it's new. Returns
+ * NULL if the table is full.
+ */
+static struct pool_site *pool_find_site(const char *file, int line)
+{
+	// The same file's name is almost always the same literal, so hash the
+	// pointer and only compare the strings if it differs.
+	size_t i = (((uintptr_t)file >> 4) ^ ((size_t)line * 2654435761u)) %
+		POOL_SITES_MAX;
+	for (int probes = 0; probes < POOL_SITES_MAX; ++probes) {
+		struct pool_site *site = t_sites + i;
+		if (!site->file) {
+			site->file = file;
+			site->line = line;
+			return site;
+		}
+		if ((site->line == line) && ((site->file == file) ||
+			(strcmp(site->file, file) == 0)))
+		{
+			return site;
+		}
+		i = (i + 1) % POOL_SITES_MAX;
+	}
+	return NULL;
+}
+
+void *pool_alloc_at(struct pool *p, long byte_amount, const char *file,
+	int line)
+{
+	void *allocation = (pool_alloc)(p, byte_amount);
+	struct pool_site *site = pool_find_site(file, line);
+	if (!site) {
+		++t_sites_dropped;
+	} else if (!allocation) {
+		++site->failures;
+	} else {
+		++site->count;
+		site->bytes += byte_amount;
+		if (byte_amount > site->largest) site->largest = byte_amount;
+	}
+	return allocation;
+}
+
+int pool_get_sites(struct pool_site *sites, int max, unsigned long *dropped)
+{
+	int count = 0;
+	for (int i = 0; (i < POOL_SITES_MAX) && (count < max); ++i) {
+		if (t_sites[i].file) sites[count++] = t_sites[i];
+	}
+	if (dropped) *dropped = t_sites_dropped;
+	return count;
+}
+#endif
+
 long pool_get_position(struct pool *p)
 {
 	if (!p) return -1;
@@ -175,14 +578,133 @@ long pool_get_position(struct pool *p)
 int pool_reset(struct pool *p, long offset)
 {
 	if (!p || (offset < 0)) return EINVAL;
+	struct pool_segment *s = p->current;
+	if (!s || (offset < s->base) || (offset > s->base + s->size)) {
+		s = p->head;
+		while (s && (offset > s->base + s->size)) s = s->next;
+		if (!s && (offset > 0)) return EINVAL;
+	}
+	if (p->offset > p->touched) {
+		p->touched = p->offset;
+		if (p->touched > p->high_water) p->high_water = p->touched;
+	}
+	if (p->offset > p->window_peak) p->window_peak = p->offset;
+	if (p->offset > p->peak) p->peak = p->offset;
+	PROBE2(pool__reset, p->offset - offset, offset);
+	p->current = s;
 	p->offset = offset;
 	return 0;
 }
 
+void pool_reset_peak(struct pool *p)
+{
+	p->peak = p->offset;
+}
+
+long pool_get_peak(struct pool *p)
+{
+	if (!p) return -1;
+	return (p->offset > p->peak) ? p->offset : p->peak;
+}
+
+long pool_get_high_water(struct pool *p)
+{
+	if (!p) return -1;
+	return (p->offset > p->high_water) ? p->offset : p->high_water;
+}
+
+void pool_get_stats(struct pool *p, struct pool_stats *stats)
+{
+	const long touched = (p->offset > p->touched) ? p->offset : p->touched;
+	stats->mapped = p->reserved;
+	stats->resident = touched;
+	stats->high_water = pool_get_high_water(p);
+	stats->in_use = p->offset;
+	stats->reclaimed = p->reclaimed;
+	stats->reclaims = p->reclaims;
+}
+
+void pool_set_reclaim(struct pool *p, uint64_t quiet_ns)
+{
+	p->quiet_ns = quiet_ns;
+	p->window_start_ns = 0;
+	p->window_peak = p->offset;
+}
+
+/*
+ * Give the pages holding the pool offsets from start to end back to the OS.
+ * Pages that are partly below start are kept.
+ */
+static int pool_release(struct pool *p, long start, long end)
+{
+#if defined(MADV_FREE)
+	const int advice = (p->flags & POOL_LAZY_RECLAIM) ? MADV_FREE :
+		MADV_DONTNEED;
+#else
+	const int advice = MADV_DONTNEED;
+#endif
+	for (struct pool_segment *s = p->head; s; s = s->next) {
+		const long lo = (start > s->base) ? start : s->base;
+		const long hi = (end < s->base + s->size) ? end :
+			s->base + s->size;
+		if (lo >= hi) continue;
+		const uintptr_t mask = ~(uintptr_t)(s->page_size - 1);
+		const uintptr_t first = ((uintptr_t)(s->data + (lo - s->base)) +
+			s->page_size - 1) & mask;
+		uintptr_t last = ((uintptr_t)(s->data + (hi - s->base)) +
+			s->page_size - 1) & mask;
+		const uintptr_t map_end = (uintptr_t)s + s->map_size;
+		if (last > map_end) last = map_end;
+		if ((first < last) && (madvise((void*)first, last - first,
+			advice) != 0))
+		{
+			return errno;
+		}
+	}
+	return 0;
+}
+
+int pool_reclaim(struct pool *p, uint64_t now_ns)
+{
+	if (!p || !p->quiet_ns) return 0;
+	if (p->window_start_ns == 0) {
+		p->window_start_ns = now_ns;
+		p->window_peak = p->offset;
+		return 0;
+	}
+	if (now_ns - p->window_start_ns < p->quiet_ns) return 0;
+
+	if (p->offset > p->touched) p->touched = p->offset;
+	if (p->offset > p->window_peak) p->window_peak = p->offset;
+	int err = 0;
+	if (p->touched > p->window_peak) {
+		err = pool_release(p, p->window_peak, p->touched);
+		if (!err) {
+			p->reclaimed += p->touched - p->window_peak;
+			++p->reclaims;
+			p->touched = p->window_peak;
+		}
+	}
+	p->window_start_ns = now_ns;
+	p->window_peak = p->offset;
+	return err;
+}
+
 long pool_get_remaining_capacity(struct pool *p)
 {
 	if (!p) return -1;
-	return p->cap - p->offset;
+	long most = p->cap - p->reserved;
+	if (p->current) {
+		const long left = p->current->base + p->current->size -
+			p->offset;
+		if (left > most) most = left;
+		for (struct pool_segment *s = p->current->next; s; s = s->next) {
+			if (s->size > most) most = s->size;
+		}
+	}
+	// Allocations are rounded up, so a partial unit at the end can't be
+	// used.
+	return most & ~(POOL_ALIGNMENT - 1);
 }
 
 #endif // DEFINE_POOL
@@ -0,0 +1,85 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * Defines the pool profile.
+ */
+#include "pool_profile.h"
+
+#if POOL_ACCOUNTING
+
+#include <errno.h>
+#include <stdlib.h>
+
+#include "hist.h"
+#include "utils.h"
+
+// The percentiles of the request footprints reported.
+static const double s_percentiles[] = {50.0, 90.0, 99.0, 99.9};
+
+static struct hist s_footprints;
+static int s_footprints_ready = 0;
+
+void pool_profile_request(long bytes)
+{
+	if (!s_footprints_ready) {
+		hist_reset(&s_footprints);
+		s_footprints_ready = 1;
+	}
+	hist_record(&s_footprints, (bytes > 0) ? (uint64_t)bytes : 0);
+}
+
+static int by_bytes(const void *a, const void *b)
+{
+	const long x = ((const struct pool_site*)a)->bytes;
+	const long y = ((const struct pool_site*)b)->bytes;
+	return (x < y) - (x > y);
+}
+
+static void write_footprints(FILE *f)
+{
+	const uint64_t total = s_footprints_ready ? s_footprints.total : 0;
+	fprintf(f, "# Pool bytes used per request\n"
+		"requests %lu\n", (unsigned long)total);
+	if (!total) return;
+	fprintf(f, "mean %lu", (unsigned long)(s_footprints.sum / total));
+	for (size_t i = 0; i < LEN(s_percentiles); ++i) {
+		fprintf(f, " p%g %lu", s_percentiles[i], (unsigned long)
+			hist_percentile(&s_footprints, s_percentiles[i]));
+	}
+	fprintf(f, " max %lu\n", (unsigned long)s_footprints.max);
+	// Only the buckets something landed in, as "up to bytes: requests".
+	for (unsigned i = 0; i < HIST_BUCKETS; ++i) {
+		const uint64_t count = s_footprints.counts[i];
+		if (!count) continue;
+		fprintf(f, "<= %lu: %lu\n", (unsigned long)hist_bucket_max(i),
+			(unsigned long)count);
+	}
+}
+
+int pool_profile_write(FILE *f)
+{
+	if (!f) return EINVAL;
+	struct pool_site *sites = malloc(sizeof(*sites) * POOL_SITES_MAX);
+	if (!sites) return ENOMEM;
+	unsigned long dropped = 0;
+	const int count = pool_get_sites(sites, POOL_SITES_MAX, &dropped);
+	qsort(sites, (size_t)count, sizeof(*sites), by_bytes);
+
+	write_footprints(f);
+	fprintf(f, "\n# Pool allocations by call site\n"
+		"%12s %10s %10s %8s  site\n", "bytes", "count", "largest",
+		"failed");
+	for (int i = 0; i < count; ++i) {
+		fprintf(f, "%12ld %10lu %10ld %8lu  %s:%i\n", sites[i].bytes,
+			sites[i].count, sites[i].largest, sites[i].failures,
+			sites[i].file, sites[i].line);
+	}
+	if (dropped) {
+		fprintf(f, "%lu allocations from sites that didn't fit in the "
+			"table\n", dropped);
+	}
+	free(sites);
+	return ferror(f) ? EIO : 0;
+}
+
+#endif // POOL_ACCOUNTING
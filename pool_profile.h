@@ -0,0 +1,39 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file declares the pool profile, for sizing the memory pool. It keeps a
+ * histogram of how much of the pool each request used, and reports it with
+ * the allocations made from each line of code that pool_alloc counts.
+ *
+ * It only exists when the pool is accounting, which release builds
+ * (-DNDEBUG) leave out.
+ */
+#ifndef POOL_PROFILE_H
+#define POOL_PROFILE_H
+
+#include "pool.h"
+
+#if POOL_ACCOUNTING
+
+#include <stdio.h>
+
+/*
+ * Record the most of the pool a request used.
+ *
+ * bytes - The request's peak, from pool_get_peak, less where it started.
+ */
+void pool_profile_request(long bytes);
+
+/*
+ * Write the request footprints and this thread's allocation sites, the
+ * sites that allocated the most first.
+ *
+ * f - The file to write to.
+ *
+ * Returns 0 if the report was written. Otherwise returns an error code.
+ */
+int pool_profile_write(FILE *f);
+
+#endif // POOL_ACCOUNTING
+
+#endif // POOL_PROFILE_H
@@ -0,0 +1,61 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file defines crvr's static tracepoints, USDT probes that bpftrace,
+ * perf and systemtap can attach to. The probes are all in the crvr provider,
+ * so with bpftrace they're usdt:./crvr:crvr:<name>. See trace/ for examples.
+ *
+ * A probe is a single nop in the code until a tracer attaches to it, and
+ * their arguments are values crvr already has, so they cost nothing when
+ * nothing is tracing. The probes are:
+ *
+ * accept(fd, addr, port) - A client connected. addr is the IPv4 address in
+ *     network byte order.
+ * request__parsed(method, path, path_len, recv_ns, parse_ns) - A request was
+ *     read and parsed. method is 0 for GET, 1 for POST. path is not NUL
+ *     terminated.
+ * handler__start(method, path, path_len) - A handler is about to run.
+ * handler__end(method, status, err, handle_ns) - The handler returned. status
+ *     is 0 if nothing was sent.
+ * file__open(path, ok, open_ns) - A file was opened, or not if ok is 0.
+ * pool__reset(bytes, offset) - bytes were released from a pool by resetting
+ *     it to offset.
+ * response__sent(status, bytes, total_ns) - Handling a request finished.
+ *     total_ns is from the request arriving to here.
+ *
+ * sys/sdt.h comes from systemtap's development package (systemtap-sdt-dev or
+ * systemtap-sdt-devel). Without it, or with -DCRVR_NO_PROBES, the probes
+ * compile to nothing.
+ */
+#ifndef PROBES_H
+#define PROBES_H
+
+#if !defined(CRVR_NO_PROBES) && defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define CRVR_PROBES 1
+#endif
+#endif
+
+#if CRVR_PROBES
+#define PROBE0(name) DTRACE_PROBE(crvr, name)
+#define PROBE1(name, a) DTRACE_PROBE1(crvr, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(crvr, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(crvr, name, a, b, c)
+#define PROBE4(name, a, b, c, d) DTRACE_PROBE4(crvr, name, a, b, c, d)
+#define PROBE5(name, a, b, c, d, e) DTRACE_PROBE5(crvr, name, a, b, c, d, e)
+#else
+// The arguments are referenced without being evaluated, so values only
+// computed for a probe don't trip -Wunused.
+#define PROBE0(name) ((void)0)
+#define PROBE1(name, a) ((void)sizeof(a))
+#define PROBE2(name, a, b) ((void)sizeof(a), (void)sizeof(b))
+#define PROBE3(name, a, b, c) ((void)sizeof(a), (void)sizeof(b),\
+	(void)sizeof(c))
+#define PROBE4(name, a, b, c, d) ((void)sizeof(a), (void)sizeof(b),\
+	(void)sizeof(c), (void)sizeof(d))
+#define PROBE5(name, a, b, c, d, e) ((void)sizeof(a), (void)sizeof(b),\
+	(void)sizeof(c), (void)sizeof(d), (void)sizeof(e))
+#endif
+
+#endif // PROBES_H
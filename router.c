@@ -0,0 +1,251 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * Defines the router.
+ *
+ * The trie is built from the routes sorted by path. The paths under a node
+ * are then a run of the sorted list, and the label of the node is the prefix
+ * the first and last of them share past the node's parent. Each child's slots
+ * are taken before any of them is built, so a node's children are next to
+ * each other, in the order of their first characters.
+ */
+#define _DEFAULT_SOURCE
+
+#include "router.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+/*
+ * A node of the compiled trie.
+ */
+struct node {
+	// Where the node's label is in s_labels.
+	size_t label;
+	size_t label_len;
+	// The index of the node's first child in s_nodes.
+	size_t first_child;
+	size_t child_count;
+	// The index of the route ending at this node in s_routes, or -1.
+	long route;
+	// The first character of the label, so children are searched without
+	// going to s_labels.
+	unsigned char first;
+};
+
+/*
+ * A route as added.
+ */
+struct entry {
+	char *path;
+	size_t len;
+	struct route route;
+};
+
+static struct entry *s_entries = NULL;
+static size_t s_entry_count = 0;
+static size_t s_entry_cap = 0;
+
+// The compiled trie, the root first.
+static struct node *s_nodes = NULL;
+static size_t s_node_count = 0;
+static char *s_labels = NULL;
+static size_t s_labels_len = 0;
+// The routes, in the order of the sorted entries.
+static struct route *s_routes = NULL;
+// Whether s_routes[i] is a prefix.
+static unsigned char *s_prefixes = NULL;
+
+int router_add(const char *path, const struct route *route)
+{
+	if (s_entry_count == s_entry_cap) {
+		const size_t cap = s_entry_cap ? s_entry_cap * 2 : 16;
+		struct entry *entries = realloc(s_entries,
+			cap * sizeof(*entries));
+		if (!entries) return ENOMEM;
+		s_entries = entries;
+		s_entry_cap = cap;
+	}
+
+	char *copy = strdup(path);
+	if (!copy) return ENOMEM;
+	s_entries[s_entry_count++] = (struct entry){
+		copy, strlen(copy), *route
+	};
+	return 0;
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	const struct entry *x = a;
+	const struct entry *y = b;
+	return strcmp(x->path, y->path);
+}
+
+/*
+ * Build the node at index from entries [lo, hi), which all share the first
+ * depth characters.
+ */
+static void build(size_t index, size_t lo, size_t hi, size_t depth)
+{
+	const struct entry *first = &s_entries[lo];
+	const struct entry *last = &s_entries[hi - 1];
+	size_t end = depth;
+	while ((end < first->len) && (end < last->len) &&
+		(first->path[end] == last->path[end]))
+	{
+		++end;
+	}
+
+	struct node *node = &s_nodes[index];
+	node->label = s_labels_len;
+	node->label_len = end - depth;
+	node->first = (unsigned char)first->path[depth];
+	node->route = -1;
+	memcpy(&s_labels[s_labels_len], &first->path[depth], end - depth);
+	s_labels_len += end - depth;
+
+	// Sorted, the one path that ends here comes before the rest.
+	if (first->len == end) {
+		node->route = (long)lo;
+		++lo;
+	}
+
+	size_t count = 0;
+	for (size_t i = lo; i < hi; ++i) {
+		if ((i == lo) || (s_entries[i].path[end] !=
+			s_entries[i - 1].path[end]))
+		{
+			++count;
+		}
+	}
+	node->first_child = s_node_count;
+	node->child_count = count;
+	s_node_count += count;
+
+	size_t child = node->first_child;
+	size_t start = lo;
+	for (size_t i = lo + 1; i <= hi; ++i) {
+		if ((i == hi) || (s_entries[i].path[end] !=
+			s_entries[start].path[end]))
+		{
+			build(child++, start, i, end);
+			start = i;
+		}
+	}
+}
+
+static void free_trie(void)
+{
+	free(s_nodes);
+	free(s_labels);
+	free(s_routes);
+	free(s_prefixes);
+	s_nodes = NULL;
+	s_labels = NULL;
+	s_routes = NULL;
+	s_prefixes = NULL;
+	s_node_count = 0;
+	s_labels_len = 0;
+}
+
+int router_compile(void)
+{
+	free_trie();
+	if (s_entry_count == 0) return 0;
+
+	qsort(s_entries, s_entry_count, sizeof(*s_entries), compare_entries);
+	size_t chars = 0;
+	for (size_t i = 0; i < s_entry_count; ++i) {
+		if ((i > 0) && (strcmp(s_entries[i].path,
+			s_entries[i - 1].path) == 0))
+		{
+			LOG_ERROR("Two routes for /%s.", s_entries[i].path);
+			return EEXIST;
+		}
+		chars += s_entries[i].len;
+	}
+
+	// Each route adds at most a leaf and the node it splits off.
+	s_nodes = calloc(2 * s_entry_count + 1, sizeof(*s_nodes));
+	s_labels = malloc(chars + 1);
+	s_routes = malloc(s_entry_count * sizeof(*s_routes));
+	s_prefixes = malloc(s_entry_count);
+	if (!s_nodes || !s_labels || !s_routes || !s_prefixes) {
+		free_trie();
+		return ENOMEM;
+	}
+
+	for (size_t i = 0; i < s_entry_count; ++i) {
+		const struct entry *e = &s_entries[i];
+		s_routes[i] = e->route;
+		s_prefixes[i] = (e->len == 0) || (e->path[e->len - 1] == '/');
+	}
+	s_node_count = 1;
+	build(0, 0, s_entry_count, 0);
+	LOG_DEBUG("Compiled %zu routes into %zu nodes.", s_entry_count,
+		s_node_count);
+	return 0;
+}
+
+/*
+ * Returns the child of node whose label starts with c, or NULL.
+ */
+static const struct node *find_child(const struct node *node, unsigned char c)
+{
+	size_t lo = node->first_child;
+	size_t hi = lo + node->child_count;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		if (s_nodes[mid].first == c) return &s_nodes[mid];
+		if (s_nodes[mid].first < c) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return NULL;
+}
+
+const struct route *router_find(const struct str *path)
+{
+	if (!s_nodes) return NULL;
+
+	const size_t len = (path->len > 0) ? (size_t)path->len : 0;
+	const struct route *prefix = NULL;
+	const struct node *node = &s_nodes[0];
+	size_t at = 0;
+	while (node) {
+		if (((len - at) < node->label_len) || (memcmp(&path->s[at],
+			&s_labels[node->label], node->label_len) != 0))
+		{
+			break;
+		}
+		at += node->label_len;
+
+		if (node->route >= 0) {
+			if (at == len) return &s_routes[node->route];
+			if (s_prefixes[node->route]) {
+				prefix = &s_routes[node->route];
+			}
+		}
+		if (at == len) break;
+		node = find_child(node, (unsigned char)path->s[at]);
+	}
+	return prefix;
+}
+
+void router_free(void)
+{
+	free_trie();
+	for (size_t i = 0; i < s_entry_count; ++i) {
+		free(s_entries[i].path);
+	}
+	free(s_entries);
+	s_entries = NULL;
+	s_entry_count = 0;
+	s_entry_cap = 0;
+}
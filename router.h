@@ -0,0 +1,65 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file declares the router, which finds what handles a request's path.
+ *
+ * Routes are added at startup and compiled into a radix trie: a tree whose
+ * edges are the runs of characters the paths share, laid out in one array
+ * with each node's children next to each other and their labels in another.
+ * Finding a path walks it once, comparing each character at most once, so
+ * it costs the same however many routes there are.
+ *
+ * A route is either a whole path, or a prefix ending in / that handles every
+ * path under it. The whole path wins over a prefix, and a longer prefix over
+ * a shorter one.
+ */
+#ifndef ROUTER_H
+#define ROUTER_H
+
+#include "metrics.h"
+#include "module.h"
+#include "str.h"
+
+/*
+ * What handles a path.
+ */
+struct route {
+	// The module_methods it handles.
+	unsigned methods;
+	module_handler handle;
+	// What its requests are counted as in the metrics.
+	enum metrics_route metrics;
+};
+
+/*
+ * Add a route. Routes can only be added before router_compile.
+ *
+ * path - The path, without a leading /. One ending in /, or an empty one, is
+ *        a prefix.
+ * route - Copied.
+ *
+ * Returns 0 if the route was added. Otherwise returns an error code.
+ */
+int router_add(const char *path, const struct route *route);
+
+/*
+ * Build the trie from the routes added, replacing any built before.
+ *
+ * Returns 0 if it was built. Otherwise returns an error code; EEXIST means
+ * two routes have the same path.
+ */
+int router_compile(void);
+
+/*
+ * Find the route for a path, without its leading /.
+ *
+ * Returns the route, or NULL if none handles the path.
+ */
+const struct route *router_find(const struct str *path);
+
+/*
+ * Free the routes and the trie.
+ */
+void router_free(void);
+
+#endif // ROUTER_H
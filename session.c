@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * Defines sessions.
+ *
+ * Each shard is a chained hash table that doubles its buckets when it holds
+ * more sessions than it has buckets. A session's shard and bucket both come
+ * from one hash of its id, the shard from the low bits.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "session.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/random.h>
+
+#include "log.h"
+#include "utils.h"
+
+// The buckets a shard starts with.
+#define SHARD_BUCKETS 64
+
+static_assert((SESSION_SHARDS & (SESSION_SHARDS - 1)) == 0,
+	"SESSION_SHARDS must be a power of 2");
+static_assert(SESSION_SHARDS <= 256, "The shard must fit in a byte");
+
+struct shard {
+	// Each on its own cache line, so locking one doesn't slow the others.
+	_Alignas(64) pthread_mutex_t lock;
+	struct session **buckets;
+	size_t bucket_count;
+	size_t count;
+};
+
+static struct shard s_shards[SESSION_SHARDS];
+static pthread_once_t s_init_once = PTHREAD_ONCE_INIT;
+
+static void init_shards(void)
+{
+	for (size_t i = 0; i < SESSION_SHARDS; ++i) {
+		(void)pthread_mutex_init(&s_shards[i].lock, NULL);
+	}
+}
+
+static uint64_t hash_id(const char *id, size_t len)
+{
+	uint64_t hash = 14695981039346656037u;
+	for (size_t i = 0; i < len; ++i) {
+		hash = (hash ^ (unsigned char)id[i]) * 1099511628211u;
+	}
+	return hash;
+}
+
+static struct session **bucket_of(struct shard *shard, uint64_t hash)
+{
+	return shard->buckets + ((hash / SESSION_SHARDS) &
+		(shard->bucket_count - 1));
+}
+
+static void unlink_session(struct shard *shard, struct session **link)
+{
+	struct session *s = *link;
+	*link = s->next;
+	--shard->count;
+	if (s->destroy) s->destroy(s);
+	free(s);
+}
+
+/*
+ * Double a shard's buckets. If there isn't memory to, the chains just get
+ * longer.
+ */
+static void grow_shard(struct shard *shard)
+{
+	const size_t count = shard->bucket_count ? shard->bucket_count * 2 :
+		SHARD_BUCKETS;
+	struct session **buckets = calloc(count, sizeof(*buckets));
+	if (!buckets) return;
+	struct shard grown = {.buckets = buckets, .bucket_count = count};
+	for (size_t i = 0; i < shard->bucket_count; ++i) {
+		struct session *s = shard->buckets[i];
+		while (s) {
+			struct session *next = s->next;
+			struct session **b = bucket_of(&grown, hash_id(s->id,
+				SESSION_ID_LEN));
+			s->next = *b;
+			*b = s;
+			s = next;
+		}
+	}
+	free(shard->buckets);
+	shard->buckets = buckets;
+	shard->bucket_count = count;
+}
+
+/*
+ * Evict the session in a full shard that was used longest ago.
+ */
+static void evict_oldest(struct shard *shard)
+{
+	struct session **oldest = NULL;
+	for (size_t i = 0; i < shard->bucket_count; ++i) {
+		for (struct session **link = shard->buckets + i; *link;
+			link = &(*link)->next)
+		{
+			if (!oldest || ((*link)->last_used <
+				(*oldest)->last_used))
+			{
+				oldest = link;
+			}
+		}
+	}
+	if (oldest) {
+		LOG_DEBUG("Session table full, evicting %s.", (*oldest)->id);
+		unlink_session(shard, oldest);
+	}
+}
+
+int session_find_cookie(const struct request *r, const char *name,
+	struct str *id)
+{
+	if (!r || !name || !id) return EINVAL;
+	struct http_param cookie = {0};
+	if (find_param(r, "Cookie", &cookie) != 0) return ENOENT;
+
+	const long name_len = (long)strlen(name);
+	const char *value = cookie.value.s;
+	const long len = cookie.value.len;
+	for (long at = 0; at + name_len + 1 + SESSION_ID_LEN <= len; ++at) {
+		// Only a whole cookie name, not the end of a longer one.
+		if ((at > 0) && (value[at - 1] != ' ') &&
+			(value[at - 1] != ';'))
+		{
+			continue;
+		}
+		if ((memcmp(value + at, name, (size_t)name_len) != 0) ||
+			(value[at + name_len] != '='))
+		{
+			continue;
+		}
+		*id = (struct str){(char*)value + at + name_len + 1,
+			SESSION_ID_LEN};
+		return 0;
+	}
+	return ENOENT;
+}
+
+struct session *session_acquire(const struct str *id, time_t now)
+{
+	if (!id || (id->len != SESSION_ID_LEN)) return NULL;
+	(void)pthread_once(&s_init_once, init_shards);
+	const uint64_t hash = hash_id(id->s, SESSION_ID_LEN);
+	struct shard *shard = s_shards + (hash & (SESSION_SHARDS - 1));
+	pthread_mutex_lock(&shard->lock);
+	if (shard->bucket_count) {
+		for (struct session *s = *bucket_of(shard, hash); s;
+			s = s->next)
+		{
+			if (memcmp(s->id, id->s, SESSION_ID_LEN) == 0) {
+				s->last_used = now;
+				return s;
+			}
+		}
+	}
+	pthread_mutex_unlock(&shard->lock);
+	return NULL;
+}
+
+int session_create(size_t size, time_t now, struct session **out)
+{
+	if (!out || (size < sizeof(struct session))) return EINVAL;
+	(void)pthread_once(&s_init_once, init_shards);
+
+	unsigned char bytes[SESSION_ID_BYTES];
+	if (getentropy(bytes, sizeof(bytes)) != 0) return errno;
+	struct session *s = calloc(1, size);
+	if (!s) return ENOMEM;
+	static const char hex[] = "0123456789abcdef";
+	for (size_t i = 0; i < sizeof(bytes); ++i) {
+		s->id[i * 2] = hex[bytes[i] >> 4];
+		s->id[i * 2 + 1] = hex[bytes[i] & 0xf];
+	}
+	s->last_used = now;
+
+	const uint64_t hash = hash_id(s->id, SESSION_ID_LEN);
+	s->shard = (unsigned char)(hash & (SESSION_SHARDS - 1));
+	struct shard *shard = s_shards + s->shard;
+	pthread_mutex_lock(&shard->lock);
+	if (shard->count >= SESSION_MAX / SESSION_SHARDS) {
+		evict_oldest(shard);
+	}
+	if (shard->count >= shard->bucket_count) grow_shard(shard);
+	if (!shard->bucket_count) {
+		pthread_mutex_unlock(&shard->lock);
+		free(s);
+		return ENOMEM;
+	}
+	struct session **b = bucket_of(shard, hash);
+	s->next = *b;
+	*b = s;
+	++shard->count;
+	*out = s;
+	return 0;
+}
+
+void session_release(struct session *s)
+{
+	if (s) pthread_mutex_unlock(&s_shards[s->shard].lock);
+}
+
+size_t session_evict(time_t now)
+{
+	(void)pthread_once(&s_init_once, init_shards);
+	size_t evicted = 0;
+	for (size_t i = 0; i < SESSION_SHARDS; ++i) {
+		struct shard *shard = s_shards + i;
+		pthread_mutex_lock(&shard->lock);
+		for (size_t b = 0; b < shard->bucket_count; ++b) {
+			struct session **link = shard->buckets + b;
+			while (*link) {
+				if ((*link)->last_used + SESSION_IDLE_S > now) {
+					link = &(*link)->next;
+					continue;
+				}
+				unlink_session(shard, link);
+				++evicted;
+			}
+		}
+		pthread_mutex_unlock(&shard->lock);
+	}
+	if (evicted) LOG_DEBUG("Evicted %zu idle sessions.", evicted);
+	return evicted;
+}
+
+size_t session_count(void)
+{
+	(void)pthread_once(&s_init_once, init_shards);
+	size_t count = 0;
+	for (size_t i = 0; i < SESSION_SHARDS; ++i) {
+		pthread_mutex_lock(&s_shards[i].lock);
+		count += s_shards[i].count;
+		pthread_mutex_unlock(&s_shards[i].lock);
+	}
+	return count;
+}
+
+void session_free_all(void)
+{
+	(void)pthread_once(&s_init_once, init_shards);
+	for (size_t i = 0; i < SESSION_SHARDS; ++i) {
+		struct shard *shard = s_shards + i;
+		pthread_mutex_lock(&shard->lock);
+		for (size_t b = 0; b < shard->bucket_count; ++b) {
+			while (shard->buckets[b]) {
+				unlink_session(shard, shard->buckets + b);
+			}
+		}
+		free(shard->buckets);
+		shard->buckets = NULL;
+		shard->bucket_count = 0;
+		pthread_mutex_unlock(&shard->lock);
+	}
+}
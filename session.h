@@ -0,0 +1,122 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file declares sessions, which let each visitor to an application keep
+ * their own state. A session is named by a random id the client is given in a
+ * cookie, and is found again from the cookie on its next request.
+ *
+ * Sessions are kept in a hash table split into SESSION_SHARDS shards by their
+ * id, each with its own lock, so requests in different sessions rarely wait
+ * on one another. A session's shard stays locked from session_acquire until
+ * session_release, so its state can be read and changed in between without
+ * any other lock.
+ *
+ * A session that isn't used for SESSION_IDLE_S is evicted. When a shard is
+ * full, creating a session in it evicts the one in it that was used longest
+ * ago.
+ *
+ * The application's state is kept after the session's header: the
+ * application's struct starts with a struct session, and its size is passed
+ * to session_create. If the state points at memory of its own, the
+ * application sets the header's destroy to free it.
+ */
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <stddef.h>
+#include <time.h>
+
+#include "http.h"
+
+// The number of shards, a power of 2.
+#define SESSION_SHARDS 16
+// The number of random bytes in an id.
+#define SESSION_ID_BYTES 16
+// The length of an id as it appears in the cookie, in hex.
+#define SESSION_ID_LEN (SESSION_ID_BYTES * 2)
+// The name of the cookie the id is sent in.
+#define SESSION_COOKIE "crvr_session"
+// Sessions unused for this long are evicted.
+#define SESSION_IDLE_S (30 * 60)
+// The most sessions kept.
+#define SESSION_MAX 16384
+
+/*
+ * The header of every session.
+ */
+struct session {
+	// NUL terminated.
+	char id[SESSION_ID_LEN + 1];
+	unsigned char shard;
+	// When the session was last acquired.
+	time_t last_used;
+	// The next session in the same bucket.
+	struct session *next;
+	// Called just before the session is freed, if set.
+	void (*destroy)(struct session *s);
+};
+
+/*
+ * Find an id in a request's cookies.
+ *
+ * r - The request.
+ * name - The cookie's name, SESSION_COOKIE for the session id.
+ * id - Set to the first SESSION_ID_LEN characters of the cookie's value if
+ *      the request has it.
+ *
+ * Returns 0 if the request has the cookie, ENOENT if it doesn't.
+ */
+int session_find_cookie(const struct request *r, const char *name,
+	struct str *id);
+
+/*
+ * Find a session and lock its shard.
+ *
+ * id - The session's id.
+ * now - The current time, noted as when the session was last used.
+ *
+ * Returns the session, or NULL if there isn't one with that id. The caller
+ * must session_release a session it gets.
+ */
+struct session *session_acquire(const struct str *id, time_t now);
+
+/*
+ * Create a session with a new id and lock its shard.
+ *
+ * size - The size of the application's struct, at least
+ *        sizeof(struct session). Everything after the header is zeroed.
+ * now - The current time.
+ * out - Set to the session.
+ *
+ * Returns 0 if the session was created. Otherwise returns an error code. The
+ * caller must session_release a session it gets.
+ */
+int session_create(size_t size, time_t now, struct session **out);
+
+/*
+ * Unlock a session's shard. The session mustn't be used after this until it
+ * is acquired again.
+ */
+void session_release(struct session *s);
+
+/*
+ * Evict the sessions that haven't been used for SESSION_IDLE_S. Each shard is
+ * only locked while it is being swept.
+ *
+ * now - The current time.
+ *
+ * Returns the number of sessions evicted.
+ */
+size_t session_evict(time_t now);
+
+/*
+ * Returns the number of sessions.
+ */
+size_t session_count(void);
+
+/*
+ * Free every session.
+ */
+void session_free_all(void);
+
+#endif // SESSION_H
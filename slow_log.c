@@ -0,0 +1,135 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * Defines the slow log.
+ *
+ * The rate limit is a token bucket kept in nanoseconds: time since the last
+ * entry earns credit, up to SLOW_LOG_BURST entries' worth, and each entry
+ * spends one entry's worth.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "slow_log.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "log.h"
+#include "utils.h"
+
+// The credit one entry costs.
+#define ENTRY_COST_NS (1000000000u / SLOW_LOG_RATE)
+
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *s_slow_log = NULL;
+static uint64_t s_threshold_ns = 0;
+static uint64_t s_credit_ns = 0;
+static uint64_t s_last_ns = 0;
+static uint64_t s_suppressed = 0;
+
+int slow_log_open(const char *path, uint64_t threshold_ns)
+{
+	if (!path) return EINVAL;
+	if (s_slow_log) slow_log_close();
+
+	s_slow_log = fopen(path, "a");
+	if (!s_slow_log) {
+		const int err = errno;
+		LOG_ERROR("Failed to open slow log %s: %i", path, err);
+		return err;
+	}
+	s_threshold_ns = threshold_ns;
+	s_credit_ns = (uint64_t)SLOW_LOG_BURST * ENTRY_COST_NS;
+	s_last_ns = monotonic_ns();
+	s_suppressed = 0;
+	LOG_INFO("Logging requests slower than %.1fms to %s.",
+		(double)threshold_ns / 1e6, path);
+	return 0;
+}
+
+int slow_log_enabled(void)
+{
+	return s_slow_log != NULL;
+}
+
+/*
+ * Take one entry's worth of credit. s_lock must be held.
+ *
+ * Returns nonzero if there was enough.
+ */
+static int take_credit(void)
+{
+	static const uint64_t max_credit = (uint64_t)SLOW_LOG_BURST *
+		ENTRY_COST_NS;
+
+	const uint64_t now = monotonic_ns();
+	s_credit_ns += now - s_last_ns;
+	if (s_credit_ns > max_credit) s_credit_ns = max_credit;
+	s_last_ns = now;
+	if (s_credit_ns < ENTRY_COST_NS) return 0;
+	s_credit_ns -= ENTRY_COST_NS;
+	return 1;
+}
+
+static void write_entry(uint64_t time_ns, const struct request_timing *timing,
+	uint64_t total_ns, int status, const struct str *raw)
+{
+	const time_t seconds = (time_t)(time_ns / 1000000000u);
+	struct tm tm;
+	char date[32] = "?";
+
+	if (gmtime_r(&seconds, &tm)) {
+		(void)strftime(date, sizeof(date), "%Y-%m-%d %H:%M:%S", &tm);
+	}
+	fprintf(s_slow_log, "%s.%06u status %i total %.3fms:", date,
+		(unsigned)(time_ns % 1000000000u / 1000u), status,
+		(double)total_ns / 1e6);
+	uint64_t phases_ns = 0;
+	for (int i = 0; i < TIMING_PHASES; ++i) {
+		fprintf(s_slow_log, " %s %.3fms", timing_phase_name(i),
+			(double)timing->phase_ns[i] / 1e6);
+		phases_ns += timing->phase_ns[i];
+	}
+	fprintf(s_slow_log, " handler %.3fms\n", (total_ns > phases_ns) ?
+		(double)(total_ns - phases_ns) / 1e6 : 0.0);
+	if (s_suppressed) {
+		fprintf(s_slow_log, "(%lu slow requests before this one were "
+			"not logged)\n", (unsigned long)s_suppressed);
+		s_suppressed = 0;
+	}
+	if (raw && (raw->len > 0)) {
+		fprint_blob(s_slow_log, raw->s, (size_t)raw->len, -1);
+	}
+	fputc('\n', s_slow_log);
+	(void)fflush(s_slow_log);
+}
+
+void slow_log_request(uint64_t time_ns, const struct request_timing *timing,
+	uint64_t total_ns, int status, const struct str *raw)
+{
+	if (!s_slow_log || !timing || (total_ns <= s_threshold_ns)) return;
+
+	pthread_mutex_lock(&s_lock);
+	if (take_credit()) {
+		write_entry(time_ns, timing, total_ns, status, raw);
+	} else {
+		++s_suppressed;
+	}
+	pthread_mutex_unlock(&s_lock);
+}
+
+void slow_log_close(void)
+{
+	pthread_mutex_lock(&s_lock);
+	if (s_slow_log) {
+		if (s_suppressed) {
+			fprintf(s_slow_log, "(%lu slow requests at the end were "
+				"not logged)\n", (unsigned long)s_suppressed);
+		}
+		fclose(s_slow_log);
+		s_slow_log = NULL;
+	}
+	pthread_mutex_unlock(&s_lock);
+}
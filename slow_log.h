@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file declares the slow log. A request that takes longer than a
+ * threshold is written to it with the time spent in each phase and a dump of
+ * the raw request.
+ *
+ * At most SLOW_LOG_RATE requests a second are logged, with bursts of up to
+ * SLOW_LOG_BURST, so a server that has become slow isn't slowed further by
+ * logging all of it. The next entry says how many were left out.
+ */
+#ifndef SLOW_LOG_H
+#define SLOW_LOG_H
+
+#include <stdint.h>
+
+#include "str.h"
+#include "timing.h"
+
+// The slow requests logged per second, on average.
+#define SLOW_LOG_RATE 10
+// The most slow requests logged back to back.
+#define SLOW_LOG_BURST 20
+
+/*
+ * Start logging slow requests to a file. The file is appended to.
+ *
+ * path - The path to the slow log.
+ * threshold_ns - Requests that take longer than this are logged.
+ *
+ * Returns 0 if the file was opened. Otherwise returns an error code.
+ */
+int slow_log_open(const char *path, uint64_t threshold_ns);
+
+/*
+ * Returns nonzero if slow requests are being logged.
+ */
+int slow_log_enabled(void);
+
+/*
+ * Log a request if it was slow and the rate limit allows.
+ *
+ * time_ns - When the request arrived, in nanoseconds since the epoch.
+ * timing - The time the request spent in each phase.
+ * total_ns - How long the whole request took.
+ * status - The status of the response, 0 if none was sent.
+ * raw - The request as it was received. May be empty.
+ */
+void slow_log_request(uint64_t time_ns, const struct request_timing *timing,
+	uint64_t total_ns, int status, const struct str *raw);
+
+/*
+ * Flush and close the slow log.
+ */
+void slow_log_close(void);
+
+#endif // SLOW_LOG_H
@@ -0,0 +1,196 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * Defines snapshots.
+ *
+ * Every thread that reads gets a reader, registered in a list when it first
+ * reads and orphaned when it exits, like the logger's rings. Only that thread
+ * writes to it: the epoch it started reading in, or 0 when it isn't reading.
+ * The epoch goes up by one each time an item is retired, and the retired item
+ * is tagged with the epoch before, so any reader that could have it has an
+ * epoch no later than its tag.
+ *
+ * All of this uses sequentially consistent atomics. A reader stores its epoch
+ * before it loads the item, and a publisher swaps the item before it counts
+ * the epoch, so a reader that saw the later epoch can only load the new item.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "snapshot.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+
+struct snapshot_reader {
+	// On its own cache line, so readers don't slow one another.
+	_Alignas(64) _Atomic uint64_t epoch;
+	// Set when the thread exits. It can't be reading by then.
+	_Atomic int orphaned;
+	struct snapshot_reader *next;
+};
+
+// Starts at 1, as 0 means a reader isn't reading.
+static _Atomic uint64_t s_epoch = 1;
+
+// Guards the readers list and the retired items. Readers only take it the
+// first time they read.
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct snapshot_reader *s_readers = NULL;
+static struct snapshot_item *s_retired = NULL;
+
+static pthread_once_t s_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t s_reader_key;
+static int s_key_err = 0;
+
+// Read by threads there wasn't memory for a reader for, one at a time.
+static pthread_mutex_t s_fallback_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct snapshot_reader s_fallback = {0};
+
+static _Thread_local struct snapshot_reader *t_reader = NULL;
+static _Thread_local unsigned t_depth = 0;
+
+static void orphan_reader(void *reader)
+{
+	atomic_store_explicit(&((struct snapshot_reader*)reader)->orphaned, 1,
+		memory_order_release);
+}
+
+static void create_key(void)
+{
+	s_key_err = pthread_key_create(&s_reader_key, orphan_reader);
+}
+
+/*
+ * Returns this thread's reader, registering one if it has none. Returns NULL
+ * if it can't.
+ */
+static struct snapshot_reader *get_reader(void)
+{
+	if (t_reader) return t_reader;
+	(void)pthread_once(&s_key_once, create_key);
+	if (s_key_err) return NULL;
+
+	struct snapshot_reader *reader = aligned_alloc(_Alignof(
+		struct snapshot_reader), sizeof(*reader));
+	if (!reader) return NULL;
+	memset(reader, 0, sizeof(*reader));
+	if (pthread_setspecific(s_reader_key, reader) != 0) {
+		free(reader);
+		return NULL;
+	}
+	pthread_mutex_lock(&s_lock);
+	reader->next = s_readers;
+	s_readers = reader;
+	pthread_mutex_unlock(&s_lock);
+	t_reader = reader;
+	return reader;
+}
+
+struct snapshot_item *snapshot_read(struct snapshot *s)
+{
+	if (t_depth++ == 0) {
+		struct snapshot_reader *reader = get_reader();
+		if (!reader) {
+			pthread_mutex_lock(&s_fallback_lock);
+			reader = &s_fallback;
+		}
+		atomic_store(&reader->epoch, atomic_load(&s_epoch));
+		// Kept for snapshot_done, which must clear the same reader.
+		t_reader = reader;
+	}
+	return s ? atomic_load(&s->current) : NULL;
+}
+
+void snapshot_done(void)
+{
+	if ((t_depth == 0) || (--t_depth != 0)) return;
+	atomic_store_explicit(&t_reader->epoch, 0, memory_order_release);
+	if (t_reader == &s_fallback) {
+		t_reader = NULL;
+		pthread_mutex_unlock(&s_fallback_lock);
+	}
+}
+
+/*
+ * Returns the earliest epoch a thread is reading in, or UINT64_MAX if none
+ * is. Frees the readers of threads that have exited. Call with s_lock held.
+ */
+static uint64_t oldest_reader(void)
+{
+	uint64_t oldest = atomic_load(&s_fallback.epoch);
+	if (!oldest) oldest = UINT64_MAX;
+	struct snapshot_reader **link = &s_readers;
+	while (*link) {
+		struct snapshot_reader *reader = *link;
+		if (atomic_load_explicit(&reader->orphaned,
+			memory_order_acquire))
+		{
+			*link = reader->next;
+			free(reader);
+			continue;
+		}
+		const uint64_t epoch = atomic_load(&reader->epoch);
+		if (epoch && (epoch < oldest)) oldest = epoch;
+		link = &reader->next;
+	}
+	return oldest;
+}
+
+size_t snapshot_reclaim(void)
+{
+	pthread_mutex_lock(&s_lock);
+	const uint64_t oldest = oldest_reader();
+	// Newest first, so everything after the first that can go can too.
+	struct snapshot_item **link = &s_retired;
+	while (*link && ((*link)->retired >= oldest)) link = &(*link)->next;
+	struct snapshot_item *done = *link;
+	*link = NULL;
+	pthread_mutex_unlock(&s_lock);
+
+	size_t destroyed = 0;
+	while (done) {
+		struct snapshot_item *next = done->next;
+		done->destroy(done);
+		done = next;
+		++destroyed;
+	}
+	if (destroyed) LOG_DEBUG("Freed %zu retired snapshots.", destroyed);
+	return destroyed;
+}
+
+/*
+ * Hold an item until no thread can be reading it.
+ */
+static void retire(struct snapshot_item *item)
+{
+	pthread_mutex_lock(&s_lock);
+	item->retired = atomic_fetch_add(&s_epoch, 1);
+	item->next = s_retired;
+	s_retired = item;
+	pthread_mutex_unlock(&s_lock);
+}
+
+void snapshot_publish(struct snapshot *s, struct snapshot_item *item)
+{
+	if (!s) return;
+	struct snapshot_item *old = atomic_exchange(&s->current, item);
+	if (old) retire(old);
+	(void)snapshot_reclaim();
+}
+
+int snapshot_replace(struct snapshot *s, struct snapshot_item *expected,
+	struct snapshot_item *item)
+{
+	if (!s) return EINVAL;
+	if (!atomic_compare_exchange_strong(&s->current, &expected, item)) {
+		return EAGAIN;
+	}
+	if (expected) retire(expected);
+	(void)snapshot_reclaim();
+	return 0;
+}
@@ -0,0 +1,83 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file declares snapshots: a pointer to data that doesn't change once
+ * published, which any number of threads can read without taking a lock
+ * while another publishes a replacement.
+ *
+ * A replaced item is retired rather than freed, and only destroyed once no
+ * thread can still be reading it. Each reading thread notes the epoch it
+ * started reading in, in a slot of its own, so readers only ever write to
+ * their own cache line and don't slow one another down. An item retired in
+ * an epoch is destroyed once every thread still reading started after it.
+ *
+ * A thread's reads nest, and everything it reads stays valid until its
+ * outermost read is done. Reading threads shouldn't read for long, as that
+ * holds up freeing everything retired since.
+ */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * The header of every item published. The item's struct starts with one.
+ */
+struct snapshot_item {
+	// Frees the item once no reader can have it.
+	void (*destroy)(struct snapshot_item *item);
+	// Set when the item is retired.
+	uint64_t retired;
+	struct snapshot_item *next;
+};
+
+/*
+ * Where an item is published. Zero it to start with nothing published.
+ */
+struct snapshot {
+	struct snapshot_item *_Atomic current;
+};
+
+/*
+ * Start reading and get the item published, or NULL if there isn't one. It
+ * stays valid until snapshot_done is called as many times as this was.
+ */
+struct snapshot_item *snapshot_read(struct snapshot *s);
+
+/*
+ * Finish a read started with snapshot_read.
+ */
+void snapshot_done(void);
+
+/*
+ * Publish an item, retiring the one it replaces.
+ *
+ * s - Where to publish it.
+ * item - The item, with destroy set, or NULL to publish nothing.
+ */
+void snapshot_publish(struct snapshot *s, struct snapshot_item *item);
+
+/*
+ * Publish an item only if the one published is still expected, for a reader
+ * that found it stale and made a replacement.
+ *
+ * s - Where to publish it.
+ * expected - The item the replacement was made from.
+ * item - The replacement, with destroy set.
+ *
+ * Returns 0 if item was published. Otherwise returns EAGAIN, another thread
+ * published first, and item is still the caller's.
+ */
+int snapshot_replace(struct snapshot *s, struct snapshot_item *expected,
+	struct snapshot_item *item);
+
+/*
+ * Destroy the retired items no thread can still be reading. Publishing does
+ * this too, but readers finishing don't, so call it regularly.
+ *
+ * Returns the number of items destroyed.
+ */
+size_t snapshot_reclaim(void);
+
+#endif // SNAPSHOT_H
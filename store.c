@@ -0,0 +1,783 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * Defines the review store.
+ *
+ * Everything is guarded by s_lock except the commit thread's fdatasync,
+ * which runs unlocked on a descriptor that stays open until the thread has
+ * been joined. Compacting empties the log with ftruncate rather than
+ * replacing it, so a sync in progress is never left holding a stale file.
+ *
+ * A new snapshot is written beside the old one, synced and renamed over it
+ * before the log is emptied. Each snapshot notes the last log record it
+ * includes, so if the server stops between the rename and the truncate the
+ * records already in it are skipped when the log is replayed.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "store.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "utils.h"
+
+#define SNAP_MAGIC "CRVRSNAP"
+#define WAL_MAGIC 0x324c4157u
+// Version 2 keys entries by learner. Version 1 files had one progress shared
+// by everybody, which can't be told apart, so they're ignored.
+#define STORE_VERSION 2
+
+/*
+ * One learner's review of one side of a card, as it is laid out in both
+ * files.
+ */
+struct store_entry {
+	// Both NUL padded.
+	char learner[STORE_LEARNER_MAX];
+	char card[STORE_NAME_MAX];
+	int64_t next_review;
+	int32_t confidence;
+	uint8_t front;
+	uint8_t reserved[3];
+};
+
+struct snap_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t entry_size;
+	uint64_t count;
+	// The last log record the snapshot includes.
+	uint64_t seq;
+};
+
+struct wal_record {
+	uint32_t magic;
+	// Of everything after it.
+	uint32_t checksum;
+	uint64_t seq;
+	struct store_entry entry;
+};
+
+static_assert((sizeof(struct store_entry) % 8) == 0,
+	"Entries must pack without padding");
+static_assert((sizeof(struct snap_header) % 8) == 0,
+	"Entries after the header must be aligned");
+
+static pthread_mutex_t s_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t s_wake = PTHREAD_COND_INITIALIZER;
+static pthread_t s_committer;
+static int s_open = 0;
+static int s_stopping = 0;
+static char s_snap_path[PATH_MAX];
+static char s_wal_path[PATH_MAX];
+static int s_wal = -1;
+// The mapped snapshot, NULL if there isn't one.
+static const struct snap_header *s_snap = NULL;
+static size_t s_snap_size = 0;
+// The reviews in the log, an open addressed table by learner, card and side.
+static struct store_entry *s_table = NULL;
+static size_t s_table_cap = 0;
+static size_t s_table_count = 0;
+// The number of the last log record written.
+static uint64_t s_seq = 0;
+static uint64_t s_wal_records = 0;
+// The records written since the last sync.
+static uint64_t s_unsynced = 0;
+// The commit thread compacts when asked, once the log has s_compact_at records.
+static int s_compact_wanted = 0;
+static uint64_t s_compact_at = STORE_COMPACT_RECORDS;
+static int s_compacting = 0;
+
+static int sync_data(int fd)
+{
+#if LINUX
+	return fdatasync(fd);
+#else
+	return fsync(fd);
+#endif
+}
+
+static uint32_t fnv1a(const void *data, size_t len, uint32_t hash)
+{
+	const unsigned char *bytes = data;
+	for (size_t i = 0; i < len; ++i) {
+		hash = (hash ^ bytes[i]) * 16777619u;
+	}
+	return hash;
+}
+
+static uint32_t record_checksum(const struct wal_record *rec)
+{
+	return fnv1a(&rec->seq, sizeof(*rec) - offsetof(struct wal_record,
+		seq), 2166136261u);
+}
+
+/*
+ * Order entries by learner, then card, then side.
+ */
+static int compare_key(const char *learner, const char *card, int front,
+	const struct store_entry *e)
+{
+	int c = strncmp(learner, e->learner, STORE_LEARNER_MAX);
+	if (!c) c = strncmp(card, e->card, STORE_NAME_MAX);
+	if (c) return c;
+	return (front != 0) - (e->front != 0);
+}
+
+static int compare_entries(const void *a, const void *b)
+{
+	const struct store_entry *x = a;
+	return compare_key(x->learner, x->card, x->front, b);
+}
+
+static int make_entry(const char *learner, const char *card, int front,
+	const struct store_review *review, struct store_entry *e)
+{
+	const size_t learner_len = strlen(learner);
+	const size_t len = strlen(card);
+	if ((learner_len >= STORE_LEARNER_MAX) || (len >= STORE_NAME_MAX)) {
+		return ENAMETOOLONG;
+	}
+	memset(e, 0, sizeof(*e));
+	memcpy(e->learner, learner, learner_len);
+	memcpy(e->card, card, len);
+	e->front = front != 0;
+	e->confidence = review->confidence;
+	e->next_review = review->next_review;
+	return 0;
+}
+
+static const struct store_entry *snap_entries(void)
+{
+	return (const struct store_entry*)(s_snap + 1);
+}
+
+/*
+ * Binary search the snapshot.
+ */
+static const struct store_entry *snap_find(const char *learner,
+	const char *card, int front)
+{
+	if (!s_snap) return NULL;
+	const struct store_entry *entries = snap_entries();
+	size_t lo = 0;
+	size_t hi = (size_t)s_snap->count;
+	while (lo < hi) {
+		const size_t mid = lo + (hi - lo) / 2;
+		const int c = compare_key(learner, card, front, entries + mid);
+		if (c == 0) return entries + mid;
+		if (c < 0) {
+			hi = mid;
+		} else {
+			lo = mid + 1;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Find a side's slot in the table. Returns an empty slot if it isn't there.
+ */
+static struct store_entry *table_slot(const char *learner, const char *card,
+	int front)
+{
+	const uint32_t hash = fnv1a(learner, strlen(learner), 2166136261u);
+	size_t i = fnv1a(card, strlen(card), hash) ^ (size_t)(front != 0);
+	for (;; ++i) {
+		struct store_entry *e = s_table + (i & (s_table_cap - 1));
+		if (!e->card[0] || (compare_key(learner, card, front, e) == 0))
+		{
+			return e;
+		}
+	}
+}
+
+static int table_put(const struct store_entry *e)
+{
+	// Keep the table under 3/4 full.
+	if ((s_table_count + 1) * 4 > s_table_cap * 3) {
+		const size_t cap = s_table_cap ? s_table_cap * 2 : 1024;
+		struct store_entry *old = s_table;
+		const size_t old_cap = s_table_cap;
+		s_table = calloc(cap, sizeof(*s_table));
+		if (!s_table) {
+			s_table = old;
+			return ENOMEM;
+		}
+		s_table_cap = cap;
+		for (size_t i = 0; i < old_cap; ++i) {
+			if (old[i].card[0]) {
+				*table_slot(old[i].learner, old[i].card,
+					old[i].front) = old[i];
+			}
+		}
+		free(old);
+	}
+	struct store_entry *slot = table_slot(e->learner, e->card, e->front);
+	if (!slot->card[0]) ++s_table_count;
+	*slot = *e;
+	return 0;
+}
+
+static void table_clear(void)
+{
+	if (s_table) memset(s_table, 0, s_table_cap * sizeof(*s_table));
+	s_table_count = 0;
+}
+
+static void unmap_snapshot(void)
+{
+	if (s_snap) (void)munmap((void*)s_snap, s_snap_size);
+	s_snap = NULL;
+	s_snap_size = 0;
+}
+
+/*
+ * Map the snapshot, if there is one and it's valid.
+ */
+static int map_snapshot(void)
+{
+	unmap_snapshot();
+	const int fd = open(s_snap_path, O_RDONLY);
+	if (fd == -1) return (errno == ENOENT) ? 0 : errno;
+	struct stat st;
+	int err = (fstat(fd, &st) == 0) ? 0 : errno;
+	const size_t size = err ? 0 : (size_t)st.st_size;
+	void *m = NULL;
+	if (!err && (size >= sizeof(struct snap_header))) {
+		m = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (m == MAP_FAILED) {
+			err = errno;
+			m = NULL;
+		}
+	}
+	close(fd);
+	if (err || !m) return err;
+
+	const struct snap_header *h = m;
+	if ((memcmp(h->magic, SNAP_MAGIC, sizeof(h->magic)) != 0) ||
+		(h->version != STORE_VERSION) ||
+		(h->entry_size != sizeof(struct store_entry)) ||
+		(h->count > (size - sizeof(*h)) / sizeof(struct store_entry)))
+	{
+		LOG_WARN("Ignoring %s, it isn't a snapshot this version of crvr "
+			"can read.", s_snap_path);
+		(void)munmap(m, size);
+		return 0;
+	}
+	s_snap = h;
+	s_snap_size = size;
+	return 0;
+}
+
+/*
+ * Read the log into the table. A record that is torn or corrupt ends the
+ * log, and the file is cut back to the last good one.
+ */
+static int replay_wal(void)
+{
+	const uint64_t snap_seq = s_snap ? s_snap->seq : 0;
+	s_seq = snap_seq;
+	off_t good = 0;
+	struct wal_record rec;
+	for (;;) {
+		const ssize_t in = pread(s_wal, &rec, sizeof(rec), good);
+		if (in == -1) {
+			if (errno == EINTR) continue;
+			return errno;
+		}
+		if ((size_t)in < sizeof(rec) || (rec.magic != WAL_MAGIC) ||
+			(rec.checksum != record_checksum(&rec)))
+		{
+			break;
+		}
+		good += (off_t)sizeof(rec);
+		if (rec.seq <= snap_seq) continue;
+		rec.entry.learner[STORE_LEARNER_MAX - 1] = '\0';
+		rec.entry.card[STORE_NAME_MAX - 1] = '\0';
+		const int err = table_put(&rec.entry);
+		if (err) return err;
+		++s_wal_records;
+		if (rec.seq > s_seq) s_seq = rec.seq;
+	}
+	struct stat st;
+	if ((fstat(s_wal, &st) == 0) && (st.st_size > good)) {
+		LOG_WARN("Dropping %ld bytes of torn records from the end of "
+			"%s.", (long)(st.st_size - good), s_wal_path);
+		if (ftruncate(s_wal, good) != 0) return errno;
+	}
+	return 0;
+}
+
+/*
+ * Write all of buf to fd.
+ */
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const char *at = buf;
+	while (len > 0) {
+		const ssize_t out = write(fd, at, len);
+		if (out == -1) {
+			if (errno == EINTR) continue;
+			return errno;
+		}
+		at += out;
+		len -= (size_t)out;
+	}
+	return 0;
+}
+
+/*
+ * Sync the directory the snapshot is in, so its rename is durable.
+ */
+static void sync_snapshot_dir(void)
+{
+	char dir[PATH_MAX];
+	const char *slash = strrchr(s_snap_path, '/');
+	if (slash) {
+		const size_t len = (size_t)(slash - s_snap_path);
+		memcpy(dir, s_snap_path, len);
+		dir[len ? len : 1] = '\0';
+		if (!len) dir[0] = '/';
+	} else {
+		strcpy(dir, ".");
+	}
+	const int fd = open(dir, O_RDONLY);
+	if (fd == -1) return;
+	(void)fsync(fd);
+	close(fd);
+}
+
+/*
+ * Copy the table's entries, sorted, for the next snapshot.
+ */
+static struct store_entry *copy_table(size_t *count)
+{
+	struct store_entry *logged = malloc((s_table_count + 1) *
+		sizeof(*logged));
+	if (!logged) return NULL;
+	size_t n = 0;
+	for (size_t i = 0; i < s_table_cap; ++i) {
+		if (s_table[i].card[0]) logged[n++] = s_table[i];
+	}
+	qsort(logged, n, sizeof(*logged), compare_entries);
+	*count = n;
+	return logged;
+}
+
+/*
+ * Merge the snapshot and the logged entries, the logged ones winning, into a
+ * new snapshot at path that includes the log up to seq.
+ */
+static int write_snapshot(const char *path, const struct store_entry *logged,
+	size_t logged_count, uint64_t seq)
+{
+	const size_t snap_count = s_snap ? (size_t)s_snap->count : 0;
+	const int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) return errno;
+	struct snap_header h = {0};
+	memcpy(h.magic, SNAP_MAGIC, sizeof(h.magic));
+	h.version = STORE_VERSION;
+	h.entry_size = sizeof(struct store_entry);
+	h.seq = seq;
+	// The count is written last, once it's known.
+	int err = write_all(fd, &h, sizeof(h));
+
+	const struct store_entry *old = s_snap ? snap_entries() : NULL;
+	size_t i = 0;
+	size_t j = 0;
+	while (!err && ((i < snap_count) || (j < logged_count))) {
+		int c = 0;
+		if (i >= snap_count) {
+			c = 1;
+		} else if (j < logged_count) {
+			c = compare_entries(old + i, logged + j);
+		} else {
+			c = -1;
+		}
+		if (c < 0) {
+			err = write_all(fd, old + i++, sizeof(*old));
+		} else {
+			// The log has the newer review.
+			if (c == 0) ++i;
+			err = write_all(fd, logged + j++, sizeof(*logged));
+		}
+		++h.count;
+	}
+	if (!err && (pwrite(fd, &h, sizeof(h), 0) != (ssize_t)sizeof(h))) {
+		err = errno ? errno : EIO;
+	}
+	if (!err && (fsync(fd) != 0)) err = errno;
+	close(fd);
+	return err;
+}
+
+/*
+ * Replace the log with the records after end, the ones the new snapshot
+ * doesn't have, and rebuild the table from them. With s_lock held.
+ */
+static int trim_wal(off_t end)
+{
+	struct stat st;
+	if (fstat(s_wal, &st) != 0) return errno;
+	const size_t count = (size_t)(st.st_size - end) /
+		sizeof(struct wal_record);
+	if (!count) {
+		if (ftruncate(s_wal, 0) != 0) {
+			LOG_WARN("Failed to empty %s: %i", s_wal_path, errno);
+		}
+		table_clear();
+		s_wal_records = 0;
+		s_unsynced = 0;
+		return 0;
+	}
+
+	// Reviews were recorded while the snapshot was written. They move to a
+	// new log, and the old one stays until the new one is durable.
+	struct wal_record *recs = malloc(count * sizeof(*recs));
+	if (!recs) return ENOMEM;
+	const size_t len = count * sizeof(*recs);
+	int err = (pread(s_wal, recs, len, end) == (ssize_t)len) ? 0 :
+		(errno ? errno : EIO);
+	char tmp[PATH_MAX + 4];
+	(void)snprintf(tmp, sizeof(tmp), "%s.tmp", s_wal_path);
+	int fd = -1;
+	if (!err) {
+		fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+		if (fd == -1) err = errno;
+	}
+	if (!err) err = write_all(fd, recs, len);
+	if (!err && (sync_data(fd) != 0)) err = errno;
+	if (!err && (rename(tmp, s_wal_path) != 0)) err = errno;
+	if (err) {
+		if (fd != -1) {
+			close(fd);
+			(void)unlink(tmp);
+		}
+		free(recs);
+		return err;
+	}
+	close(s_wal);
+	s_wal = fd;
+	table_clear();
+	for (size_t i = 0; !err && (i < count); ++i) {
+		err = table_put(&recs[i].entry);
+	}
+	free(recs);
+	s_wal_records = count;
+	s_unsynced = 0;
+	return err;
+}
+
+/*
+ * Merge the log into a new snapshot and empty it. Called with s_lock held,
+ * which is released while the snapshot is written so that lookups and reviews
+ * carry on meanwhile. The old snapshot stays mapped until the new one is
+ * renamed into place, and only one compaction runs at a time.
+ */
+static int compact(void)
+{
+	if (s_compacting) return EBUSY;
+	const uint64_t start = monotonic_ns();
+	struct stat st;
+	if (fstat(s_wal, &st) != 0) return errno;
+	const uint64_t seq = s_seq;
+	size_t logged_count = 0;
+	struct store_entry *logged = copy_table(&logged_count);
+	if (!logged) return ENOMEM;
+	s_compacting = 1;
+	pthread_mutex_unlock(&s_lock);
+
+	char tmp[PATH_MAX + 4];
+	(void)snprintf(tmp, sizeof(tmp), "%s.tmp", s_snap_path);
+	int err = write_snapshot(tmp, logged, logged_count, seq);
+	free(logged);
+	if (!err && (rename(tmp, s_snap_path) != 0)) err = errno;
+	if (!err) {
+		sync_snapshot_dir();
+	} else {
+		(void)unlink(tmp);
+	}
+
+	pthread_mutex_lock(&s_lock);
+	s_compacting = 0;
+	if (err) {
+		LOG_ERROR("Failed to write the snapshot %s: %i", s_snap_path,
+			err);
+		return err;
+	}
+	err = map_snapshot();
+	if (err) {
+		LOG_ERROR("Failed to map the new snapshot %s: %i", s_snap_path,
+			err);
+		return err;
+	}
+	// The log up to where it ended is in the snapshot now.
+	err = trim_wal(st.st_size);
+	if (err) {
+		LOG_ERROR("Failed to carry reviews over to a new %s: %i",
+			s_wal_path, err);
+		return err;
+	}
+	LOG_INFO("Compacted the review store into %lu entries in %.1fms.",
+		(unsigned long)s_snap->count,
+		(double)(monotonic_ns() - start) / 1e6);
+	return 0;
+}
+
+/*
+ * Sync the log whenever reviews have been written, after waiting a little for
+ * more to arrive, and compact the store when the log has grown long. A failed
+ * compaction isn't retried until another STORE_COMPACT_RECORDS reviews have
+ * been logged.
+ */
+static void *commit_thread(void *arg)
+{
+	(void)arg;
+	pthread_mutex_lock(&s_lock);
+	for (;;) {
+		while (!s_unsynced && !s_compact_wanted && !s_stopping) {
+			pthread_cond_wait(&s_wake, &s_lock);
+		}
+		if (!s_unsynced && s_stopping) break;
+		if (s_unsynced) {
+			if (!s_stopping) {
+				struct timespec until;
+				(void)clock_gettime(CLOCK_REALTIME, &until);
+				until.tv_nsec += STORE_COMMIT_MS * 1000000L;
+				if (until.tv_nsec >= 1000000000L) {
+					until.tv_nsec -= 1000000000L;
+					++until.tv_sec;
+				}
+				// Woken early only to stop.
+				while (!s_stopping && (pthread_cond_timedwait(
+					&s_wake, &s_lock, &until) != ETIMEDOUT))
+				{
+				}
+			}
+			const uint64_t batch = s_unsynced;
+			s_unsynced = 0;
+			pthread_mutex_unlock(&s_lock);
+			if (sync_data(s_wal) != 0) {
+				LOG_ERROR("Failed to sync %s: %i", s_wal_path,
+					errno);
+			} else {
+				LOG_DEBUG("Committed %lu reviews.",
+					(unsigned long)batch);
+			}
+			pthread_mutex_lock(&s_lock);
+		}
+		// Closing the store compacts it.
+		if (s_compact_wanted && !s_stopping) {
+			s_compact_wanted = 0;
+			(void)compact();
+			// The next try is after the log grows that much again,
+			// whether this one worked or not.
+			s_compact_at = s_wal_records + STORE_COMPACT_RECORDS;
+		}
+	}
+	pthread_mutex_unlock(&s_lock);
+	return NULL;
+}
+
+/*
+ * Ask the commit thread to compact if the log has grown long. With s_lock
+ * held.
+ */
+static void request_compaction(void)
+{
+	if ((s_wal_records >= s_compact_at) && !s_compact_wanted) {
+		s_compact_wanted = 1;
+		pthread_cond_signal(&s_wake);
+	}
+}
+
+int store_open(const char *name)
+{
+	if (!name) return EINVAL;
+	if (s_open) return EBUSY;
+	if ((snprintf(s_snap_path, sizeof(s_snap_path), "%s.snap", name) >=
+		(int)sizeof(s_snap_path)) || (snprintf(s_wal_path,
+		sizeof(s_wal_path), "%s.wal", name) >= (int)sizeof(s_wal_path)))
+	{
+		return ENAMETOOLONG;
+	}
+
+	const uint64_t start = monotonic_ns();
+	int err = map_snapshot();
+	if (!err) {
+		s_wal = open(s_wal_path, O_RDWR | O_CREAT | O_APPEND, 0644);
+		if (s_wal == -1) err = errno;
+	}
+	if (!err) err = replay_wal();
+	if (!err) {
+		s_stopping = 0;
+		// A log left from the last run is compacted straight away.
+		s_compact_at = STORE_COMPACT_RECORDS;
+		s_compact_wanted = s_wal_records != 0;
+		// Signals are for the server's thread.
+		sigset_t all;
+		sigset_t old;
+		(void)sigfillset(&all);
+		(void)pthread_sigmask(SIG_BLOCK, &all, &old);
+		err = pthread_create(&s_committer, NULL, commit_thread, NULL);
+		(void)pthread_sigmask(SIG_SETMASK, &old, NULL);
+	}
+	if (err) {
+		LOG_ERROR("Failed to open the review store %s: %i", name, err);
+		if (s_wal != -1) close(s_wal);
+		s_wal = -1;
+		unmap_snapshot();
+		free(s_table);
+		s_table = NULL;
+		s_table_cap = s_table_count = 0;
+		return err;
+	}
+	s_open = 1;
+	LOG_INFO("Opened the review store %s: %lu in the snapshot, %lu in the "
+		"log, in %.1fms.", name, s_snap ? (unsigned long)s_snap->count :
+		0ul, (unsigned long)s_wal_records,
+		(double)(monotonic_ns() - start) / 1e6);
+	return 0;
+}
+
+int store_lookup(const char *learner, const char *card, int front,
+	struct store_review *review)
+{
+	if (!learner || !card || !review) return EINVAL;
+	int err = ENOENT;
+	pthread_mutex_lock(&s_lock);
+	const struct store_entry *e = NULL;
+	if (s_table_count) {
+		e = table_slot(learner, card, front);
+		if (!e->card[0]) e = NULL;
+	}
+	if (!e) e = snap_find(learner, card, front);
+	if (e) {
+		review->confidence = e->confidence;
+		review->next_review = e->next_review;
+		err = 0;
+	}
+	pthread_mutex_unlock(&s_lock);
+	return err;
+}
+
+int store_record(const char *learner, const char *card, int front,
+	const struct store_review *review)
+{
+	if (!learner || !card || !review) return EINVAL;
+	struct wal_record rec = {0};
+	int err = make_entry(learner, card, front, review, &rec.entry);
+	if (err) return err;
+
+	pthread_mutex_lock(&s_lock);
+	if (!s_open) {
+		pthread_mutex_unlock(&s_lock);
+		return EBADF;
+	}
+	rec.magic = WAL_MAGIC;
+	rec.seq = s_seq + 1;
+	rec.checksum = record_checksum(&rec);
+	err = write_all(s_wal, &rec, sizeof(rec));
+	if (!err) err = table_put(&rec.entry);
+	if (!err) {
+		s_seq = rec.seq;
+		++s_wal_records;
+		if (s_unsynced++ == 0) pthread_cond_signal(&s_wake);
+		request_compaction();
+	} else {
+		LOG_ERROR("Failed to log a review of %s: %i", card, err);
+	}
+	pthread_mutex_unlock(&s_lock);
+	return err;
+}
+
+int store_record_batch(const struct store_update *updates, size_t count)
+{
+	if (!updates && count) return EINVAL;
+	if (!count) return 0;
+	struct wal_record *recs = calloc(count, sizeof(*recs));
+	if (!recs) return ENOMEM;
+	size_t n = 0;
+	for (size_t i = 0; i < count; ++i) {
+		const struct store_update *u = updates + i;
+		if (u->learner && u->card && (make_entry(u->learner, u->card,
+			u->front, &u->review, &recs[n].entry) == 0))
+		{
+			++n;
+		}
+	}
+
+	pthread_mutex_lock(&s_lock);
+	int err = s_open ? 0 : EBADF;
+	if (!err) {
+		for (size_t i = 0; i < n; ++i) {
+			recs[i].magic = WAL_MAGIC;
+			recs[i].seq = s_seq + 1 + i;
+			recs[i].checksum = record_checksum(recs + i);
+		}
+		err = write_all(s_wal, recs, n * sizeof(*recs));
+	}
+	for (size_t i = 0; !err && (i < n); ++i) {
+		err = table_put(&recs[i].entry);
+	}
+	if (!err && n) {
+		s_seq += n;
+		s_wal_records += n;
+		if (s_unsynced == 0) pthread_cond_signal(&s_wake);
+		s_unsynced += n;
+		request_compaction();
+	} else if (err && (err != EBADF)) {
+		LOG_ERROR("Failed to log %zu reviews: %i", n, err);
+	}
+	pthread_mutex_unlock(&s_lock);
+	free(recs);
+	return err;
+}
+
+int store_compact(void)
+{
+	pthread_mutex_lock(&s_lock);
+	const int err = s_open ? compact() : EBADF;
+	pthread_mutex_unlock(&s_lock);
+	return err;
+}
+
+void store_close(void)
+{
+	pthread_mutex_lock(&s_lock);
+	if (!s_open) {
+		pthread_mutex_unlock(&s_lock);
+		return;
+	}
+	s_stopping = 1;
+	pthread_cond_signal(&s_wake);
+	pthread_mutex_unlock(&s_lock);
+	// The thread commits anything outstanding before it stops.
+	(void)pthread_join(s_committer, NULL);
+
+	pthread_mutex_lock(&s_lock);
+	if (s_wal_records) (void)compact();
+	close(s_wal);
+	s_wal = -1;
+	unmap_snapshot();
+	free(s_table);
+	s_table = NULL;
+	s_table_cap = s_table_count = 0;
+	s_wal_records = 0;
+	s_open = 0;
+	pthread_mutex_unlock(&s_lock);
+}
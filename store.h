@@ -0,0 +1,126 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file declares the review store, which keeps the ASL application's
+ * progress across restarts: each learner's confidence in each side of each
+ * card and when it is next due. A learner is named by an id the application
+ * chooses, so one learner's grades never change another's progress.
+ *
+ * The store is two files. <name>.snap is a snapshot, a header and then an
+ * array of fixed-size entries sorted by learner, card and side. It is mapped
+ * into memory when the store opens and searched in place, so nothing is parsed
+ * however many cards there are. <name>.wal is a write-ahead log of the reviews
+ * since the snapshot, also fixed-size records, each numbered and checksummed.
+ * It is replayed into a hash table when the store opens, and a torn record at
+ * its end is ignored.
+ *
+ * Reviews are appended to the log as they happen. A background thread makes
+ * them durable with fdatasync, waiting up to STORE_COMMIT_MS after the first
+ * one so that a burst of reviews is committed with one sync. When the log
+ * reaches STORE_COMPACT_RECORDS, and when the store is opened or closed with
+ * a log to replay, the snapshot and the log are merged into a new snapshot
+ * and the log is emptied. The same thread does this, so reviews aren't held
+ * up by it, and after a failure it waits for the log to grow by another
+ * STORE_COMPACT_RECORDS before trying again.
+ */
+#ifndef STORE_H
+#define STORE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// The longest card name the store keeps, NUL included. Cards with longer
+// names aren't persisted.
+#define STORE_NAME_MAX 256
+// The longest learner id the store keeps, NUL included. Reviews by learners
+// with longer ids aren't persisted.
+#define STORE_LEARNER_MAX 40
+// How long the log waits after a review to gather others into one sync.
+#define STORE_COMMIT_MS 10
+// The log is compacted into the snapshot when it reaches this many records.
+#define STORE_COMPACT_RECORDS 4096
+
+/*
+ * What the store remembers about one side of a card.
+ */
+struct store_review {
+	int32_t confidence;
+	// When the side is next due, in seconds since the epoch.
+	int64_t next_review;
+};
+
+/*
+ * Open the store, mapping its snapshot, replaying its log and starting the
+ * thread that commits it.
+ *
+ * name - The path of the store's files, without the .snap or .wal.
+ *
+ * Returns 0 if the store was opened. Otherwise returns an error code and
+ * reviews aren't kept.
+ */
+int store_open(const char *name);
+
+/*
+ * Find what the store remembers about a learner's review of a side of a card.
+ *
+ * learner - The learner's id.
+ * card - The card's name.
+ * front - Nonzero for the front of the card, 0 for the back.
+ * review - Set to the side's review if it was found.
+ *
+ * Returns 0 if the side was found, ENOENT if it wasn't. Otherwise returns an
+ * error code.
+ */
+int store_lookup(const char *learner, const char *card, int front,
+	struct store_review *review);
+
+/*
+ * Append a review to the log. It is durable once the commit thread next
+ * syncs, within about STORE_COMMIT_MS.
+ *
+ * learner - The id of the learner who gave it.
+ * card - The card's name.
+ * front - Nonzero for the front of the card, 0 for the back.
+ * review - The side's new state.
+ *
+ * Returns 0 if the review was logged. Otherwise returns an error code.
+ */
+int store_record(const char *learner, const char *card, int front,
+	const struct store_review *review);
+
+/*
+ * A review to append with store_record_batch.
+ */
+struct store_update {
+	const char *learner;
+	const char *card;
+	int front;
+	struct store_review review;
+};
+
+/*
+ * Append several reviews to the log with one write, as store_record does one.
+ *
+ * updates - The reviews. Those whose learner ids or card names are too long
+ *           are skipped.
+ * count - The number of reviews.
+ *
+ * Returns 0 if the reviews were logged. Otherwise returns an error code.
+ */
+int store_record_batch(const struct store_update *updates, size_t count);
+
+/*
+ * Merge the log into a new snapshot and empty the log.
+ *
+ * Returns 0 if the store was compacted, EBUSY if the commit thread is
+ * compacting it already. Otherwise returns an error code and the store is
+ * left as it was.
+ */
+int store_compact(void);
+
+/*
+ * Commit and compact the store, then close it.
+ */
+void store_close(void);
+
+#endif // STORE_H
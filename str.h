@@ -190,29 +190,16 @@ int str_cmp_cstr(const struct str *s, const char *cs)
 	return 0;
 }
 
-/*
- * I feel like there is a faster way to write this...
- */
 long str_find_substr(const struct str *haystack, const struct str *needle)
 {
-	long i = 0;
-	long j;
-	int found = 0;
-	char left;
-	char right;
-	for (; i < haystack->len; ++i) {
-		found = 1;
-		for (j = 0; (i + j < haystack->len) && (j < needle->len); ++j) {
-			left = haystack->s[i + j];
-			right = needle->s[j];
-			if (left != right) {
-				// Skip characters we scanned.
-				i += j;
-				found = 0;
-				break;
-			}
+	if (needle->len <= 0) return (haystack->len > 0) ? 0 : -1;
+	// Only a whole match counts, not a prefix of needle at the end.
+	for (long i = 0; i + needle->len <= haystack->len; ++i) {
+		if ((haystack->s[i] == needle->s[0]) && (memcmp(haystack->s + i,
+			needle->s, (size_t)needle->len) == 0))
+		{
+			return i;
 		}
-		if (found) return i;
 	}
 	return -1;
 }
@@ -240,9 +227,8 @@ int str_get_substr(const struct str *original, const long start, const long end,
 int str_print(FILE *f, const struct str *s)
 {
 	if (!f || !s) return EINVAL;
-	for (long i = 0; i < s->len; ++i) {
-		fputc(s->s[i], f);
-	}
+	if (s->len <= 0) return 0;
+	if (fwrite(s->s, 1, (size_t)s->len, f) != (size_t)s->len) return EIO;
 	return 0;
 }
 
@@ -0,0 +1,185 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * Defines page templates.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "template.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "log.h"
+#include "timing.h"
+#include "utils.h"
+
+/*
+ * Add a segment to the template being compiled.
+ */
+static int add_segment(struct template *t, int var, size_t start, size_t len)
+{
+	if (t->segment_count >= TEMPLATE_MAX_SEGMENTS) return E2BIG;
+	t->segments[t->segment_count++] = (struct template_segment){
+		var, start, len
+	};
+	return 0;
+}
+
+/*
+ * Find the longest variable name that follows the $ at text[at].
+ *
+ * Returns the index of the variable, or -1 if none does. name_len is set to
+ * the length of its name.
+ */
+static int match_var(const char *text, size_t len, size_t at,
+	const char *const *vars, int var_count, size_t *name_len)
+{
+	int var = -1;
+	*name_len = 0;
+	for (int v = 0; v < var_count; ++v) {
+		const size_t n = strlen(vars[v]);
+		if ((n > *name_len) && (at + 1 + n <= len) &&
+			(memcmp(text + at + 1, vars[v], n) == 0))
+		{
+			var = v;
+			*name_len = n;
+		}
+	}
+	return var;
+}
+
+/*
+ * Split t's text into segments.
+ */
+static int compile(struct template *t, const char *const *vars,
+	int var_count)
+{
+	size_t text_start = 0;
+	int err = 0;
+	for (size_t i = 0; !err && (i < t->len); ++i) {
+		if (t->text[i] != '$') continue;
+		size_t name_len = 0;
+		const int var = match_var(t->text, t->len, i, vars, var_count,
+			&name_len);
+		if (var < 0) continue;
+		if (i > text_start) {
+			err = add_segment(t, -1, text_start, i - text_start);
+		}
+		if (!err) err = add_segment(t, var, i, name_len + 1);
+		text_start = i + 1 + name_len;
+		i = text_start - 1;
+	}
+	if (!err && (text_start < t->len)) {
+		err = add_segment(t, -1, text_start, t->len - text_start);
+	}
+	return err;
+}
+
+/*
+ * Read a file into memory. The caller frees text.
+ */
+static int read_template(const char *path, off_t size, char **text,
+	size_t *len)
+{
+	FILE *f = open_file(path);
+	if (!f) return errno;
+	const uint64_t start = monotonic_ns();
+	*text = malloc((size_t)size + 1);
+	int err = *text ? 0 : ENOMEM;
+	if (!err) {
+		*len = fread(*text, 1, (size_t)size, f);
+		if (ferror(f)) err = EIO;
+		(*text)[*len] = '\0';
+	}
+	timing_add(TIMING_FILE, start);
+	fclose(f);
+	if (err) {
+		free(*text);
+		*text = NULL;
+	}
+	return err;
+}
+
+/*
+ * Stat a template's file, timed as file access.
+ */
+static int stat_template(const char *path, struct stat *st)
+{
+	const uint64_t start = monotonic_ns();
+	const int result = stat(path, st);
+	timing_add(TIMING_FILE, start);
+	return (result == 0) ? 0 : errno;
+}
+
+/*
+ * Returns nonzero if t was compiled from the file as it is now.
+ */
+static int is_current(const struct template *t, const struct stat *st)
+{
+	return t->text && (st->st_mtime == t->mtime) &&
+		(st->st_size == t->size);
+}
+
+int template_stale(const struct template *t, const char *path)
+{
+	if (!t || !path) return 1;
+	struct stat st;
+	return (stat_template(path, &st) != 0) || !is_current(t, &st);
+}
+
+int template_load(struct template *t, const char *path,
+	const char *const *vars, int var_count)
+{
+	if (!t || !path || (!vars && (var_count > 0))) return EINVAL;
+
+	struct stat st;
+	const int stat_err = stat_template(path, &st);
+	if (stat_err) return stat_err;
+	if (is_current(t, &st)) return 0;
+
+	struct template compiled = {0};
+	int err = read_template(path, st.st_size, &compiled.text,
+		&compiled.len);
+	if (!err) err = compile(&compiled, vars, var_count);
+	if (err) {
+		LOG_ERROR("Failed to compile template %s: %i", path, err);
+		free(compiled.text);
+		return err;
+	}
+	compiled.mtime = st.st_mtime;
+	compiled.size = st.st_size;
+	compiled.version = t->version + 1;
+	LOG_DEBUG("Compiled template %s into %i segments.", path,
+		compiled.segment_count);
+	template_free(t);
+	*t = compiled;
+	return 0;
+}
+
+int template_render(const struct template *t, const struct str *values,
+	struct iovec *iov)
+{
+	for (int i = 0; i < t->segment_count; ++i) {
+		const struct template_segment *s = t->segments + i;
+		if (s->var < 0) {
+			iov[i].iov_base = t->text + s->start;
+			iov[i].iov_len = s->len;
+		} else {
+			iov[i].iov_base = values[s->var].s;
+			iov[i].iov_len = (size_t)values[s->var].len;
+		}
+	}
+	return t->segment_count;
+}
+
+void template_free(struct template *t)
+{
+	if (!t) return;
+	free(t->text);
+	// Keep counting, so a page rendered before this isn't taken for one
+	// rendered from the next compile.
+	*t = (struct template){.version = t->version};
+}
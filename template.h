@@ -0,0 +1,97 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file declares page templates. A template is a file with $variables in
+ * it. It is read and compiled once into a list of segments, each either a
+ * span of the file's text or a variable, and rendered by pointing an iovec at
+ * each segment's text or value in turn. Nothing is copied or scanned again
+ * when rendering, and the response goes out with a single writev.
+ *
+ * template_load checks the file's modification time and size on every call
+ * and compiles it again if either changed, so a page can be edited while the
+ * server runs.
+ */
+#ifndef TEMPLATE_H
+#define TEMPLATE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+
+#include "str.h"
+
+// The most segments a template may compile to, so it can be rendered into an
+// iovec on the stack.
+#define TEMPLATE_MAX_SEGMENTS 64
+
+/*
+ * A span of the template's text, or a variable.
+ */
+struct template_segment {
+	// The index of the variable in the names the template was loaded
+	// with, or -1 for text.
+	int var;
+	// Where the text is in the template's file.
+	size_t start;
+	size_t len;
+};
+
+/*
+ * A compiled template. Zero it before the first template_load.
+ */
+struct template {
+	char *text;
+	size_t len;
+	struct template_segment segments[TEMPLATE_MAX_SEGMENTS];
+	int segment_count;
+	// The file's modification time and size when it was compiled.
+	time_t mtime;
+	off_t size;
+	// Counts the times the template was compiled, so anything rendered
+	// from an older compile can tell it's stale.
+	unsigned long version;
+};
+
+/*
+ * Compile the template from a file, unless it already is and the file hasn't
+ * changed.
+ *
+ * t - The template.
+ * path - The template's file.
+ * vars - The names of the variables, without the $. Where one name is the
+ *        start of another, the longest that matches is used.
+ * var_count - The number of names in vars.
+ *
+ * Returns 0 if t is compiled from the current file. Otherwise returns an
+ * error code, and t is left as it was. E2BIG means the file has too many
+ * variables.
+ */
+int template_load(struct template *t, const char *path,
+	const char *const *vars, int var_count);
+
+/*
+ * Returns nonzero if the template isn't compiled, or its file changed since
+ * it was, so template_load would compile it again.
+ */
+int template_stale(const struct template *t, const char *path);
+
+/*
+ * Point iov at the template's text with the variables replaced by values.
+ *
+ * t - The template to render.
+ * values - The value of each variable, indexed like the names the template
+ *          was loaded with.
+ * iov - Set to the segments. Must have room for TEMPLATE_MAX_SEGMENTS.
+ *
+ * Returns the number of entries set in iov.
+ */
+int template_render(const struct template *t, const struct str *values,
+	struct iovec *iov);
+
+/*
+ * Free a template's memory.
+ */
+void template_free(struct template *t);
+
+#endif // TEMPLATE_H
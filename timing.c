@@ -0,0 +1,43 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * Defines the routines for timing the phases of a request.
+ */
+#include "timing.h"
+
+#include <string.h>
+
+#include "utils.h"
+
+static _Thread_local struct request_timing *t_current = NULL;
+
+static const char *s_phase_names[TIMING_PHASES] = {
+	"recv", "parse", "file", "render", "write"
+};
+
+void timing_begin(struct request_timing *t, uint64_t start_ns)
+{
+	memset(t, 0, sizeof(*t));
+	t->start_ns = start_ns;
+	t_current = t;
+}
+
+void timing_end(void)
+{
+	t_current = NULL;
+}
+
+uint64_t timing_add(enum timing_phase phase, uint64_t since)
+{
+	const uint64_t now = monotonic_ns();
+	if (t_current && ((unsigned)phase < TIMING_PHASES) && (now > since)) {
+		t_current->phase_ns[phase] += now - since;
+	}
+	return now;
+}
+
+const char *timing_phase_name(enum timing_phase phase)
+{
+	if ((unsigned)phase >= TIMING_PHASES) return "?";
+	return s_phase_names[phase];
+}
@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file declares the routines for timing the phases of a request, so a
+ * slow request can be traced to whatever made it slow.
+ *
+ * handle_client starts a timing for each request and makes it the thread's
+ * current one. The code that reads files, renders pages and writes to the
+ * client adds its time to the current timing without having to be handed it.
+ */
+#ifndef TIMING_H
+#define TIMING_H
+
+#include <stdint.h>
+
+/*
+ * The phases a request's time is split into. Time not spent in any of these
+ * is the handler's own.
+ */
+enum timing_phase {
+	// Reading the request from the client.
+	TIMING_RECV,
+	// Parsing the request.
+	TIMING_PARSE,
+	// Opening and reading files.
+	TIMING_FILE,
+	// Replacing the variables in a page.
+	TIMING_RENDER,
+	// Writing the response to the client.
+	TIMING_WRITE,
+	TIMING_PHASES
+};
+
+/*
+ * How long a request spent in each phase.
+ */
+struct request_timing {
+	// When the request arrived, monotonic nanoseconds.
+	uint64_t start_ns;
+	uint64_t phase_ns[TIMING_PHASES];
+};
+
+/*
+ * Clear a timing and make it the thread's current one.
+ *
+ * t - The timing to start.
+ * start_ns - When the request arrived, from monotonic_ns.
+ */
+void timing_begin(struct request_timing *t, uint64_t start_ns);
+
+/*
+ * Stop adding time to the thread's current timing.
+ */
+void timing_end(void);
+
+/*
+ * Add the time since a phase started to the thread's current timing. Does
+ * nothing to the timing if there is no current one.
+ *
+ * phase - The phase that was running.
+ * since - When the phase started, from monotonic_ns.
+ *
+ * Returns the current time, so the next phase can start from it.
+ */
+uint64_t timing_add(enum timing_phase phase, uint64_t since);
+
+/*
+ * Returns the name of a phase.
+ */
+const char *timing_phase_name(enum timing_phase phase);
+
+#endif // TIMING_H
@@ -4,7 +4,11 @@ OBJ=o
 COMMON_FLAGS=-DUNIX=1 -Werror -Wextra -Wall -Wconversion -mshstk -fanalyzer
 #SANITIZERS=-fsanitize=address -fsanitize=undefined
 DEBUG_FLAGS=-g -O0 $(COMMON_FLAGS) $(SANITIZERS)
-RELEASE_FLAGS=-Os $(COMMON_FLAGS)
+RELEASE_FLAGS=-Os -DNDEBUG $(COMMON_FLAGS)
+# Optimized, but keeping symbols and frame pointers so perf and bpftrace can
+# walk the stack: make clean; make BUILD='$(PROFILE_FLAGS)'
+PROFILE_FLAGS=-O2 -g -fno-omit-frame-pointer -mno-omit-leaf-frame-pointer \
+	$(COMMON_FLAGS)
 
 BUILD=$(DEBUG_FLAGS)
 
@@ -12,5 +16,11 @@ CXXFLAGS=$(BUILD) -std=c++17
 CFLAGS=$(BUILD) -std=c17 -Ibase
 
 LDFLAGS=$(SANITIZERS)
-LDLIBS=-lm
+LDLIBS=-lm -lpthread
+# Modules are position independent shared objects that use the server's
+# symbols, so the server exports them.
+MODEXT=.so
+MODULE_CFLAGS=-fPIC
+MODULE_LDFLAGS=-shared
+EXPORT_LDFLAGS=-rdynamic
 RM=rm -f
@@ -3,6 +3,8 @@
  *
  * This file contains definitions of utility routines.
  */
+#define _POSIX_C_SOURCE 200809L
+
 #include "utils.h"
 
 #include <assert.h>
@@ -13,18 +15,40 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include "probes.h"
+#include "timing.h"
 
 // The number of bytes to show on a line in print_blob.
 #define BLOB_LINE (16)
 
-void debug(const char *format, ...)
+static uint64_t clock_ns(clockid_t clock)
 {
-	va_list args;
-	va_start(args, format);
+	struct timespec ts;
+	(void)clock_gettime(clock, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
 
-	vprintf(format, args);
+uint64_t monotonic_ns(void)
+{
+	return clock_ns(CLOCK_MONOTONIC);
+}
 
-	va_end(args);
+uint64_t realtime_ns(void)
+{
+	return clock_ns(CLOCK_REALTIME);
+}
+
+FILE *open_file(const char *path)
+{
+	const uint64_t start = monotonic_ns();
+	FILE *f = fopen(path, "r");
+	const int err = errno;
+	const uint64_t open_ns = timing_add(TIMING_FILE, start) - start;
+	PROBE3(file__open, path, f != NULL, open_ns);
+	errno = err;
+	return f;
 }
 
 int load_file(const char *file_name, char *buffer, const size_t buf_len,
@@ -36,31 +60,33 @@ int load_file(const char *file_name, char *buffer, const size_t buf_len,
 	size_t bytes_read;
 	FILE *f;
 
-	f = fopen(file_name, "r");
+	f = open_file(file_name);
 	if (!f) {
-		fprintf(stderr, "Failed to open %s: %d\n", file_name, errno);
+		LOG_ERROR("Failed to open %s: %d", file_name, errno);
 		return errno;
 	}
+	const uint64_t read_start = monotonic_ns();
 	*bytes_loaded = 0;
 	while (!feof(f) && !ferror(f)) {
 		bytes_read = fread(buffer + *bytes_loaded, sizeof(*buffer),
 			buf_len - *bytes_loaded, f);
 		*bytes_loaded += bytes_read;
 	}
+	timing_add(TIMING_FILE, read_start);
 	if (ferror(f)) {
 		result = errno;
-		fprintf(stderr, "Error reading %s: %d.\n", file_name, result);
+		LOG_ERROR("Error reading %s: %d.", file_name, result);
 	}
 	fclose(f);
 	return result;
 }
 
 /*
- * Print blob which is len bytes long. If max_lines is -1, print the entire blob.
- * If max_lines is > 0, print at most that many lines of blob. A "line" contains
- * BLOB_LINE bytes of hex data and character data.
+ * Print blob which is len bytes long to f. If max_lines is -1, print the
+ * entire blob. If max_lines is > 0, print at most that many lines of blob. A
+ * "line" contains BLOB_LINE bytes of hex data and character data.
  */
-void print_blob(const char *blob, const size_t len, int max_lines)
+void fprint_blob(FILE *f, const char *blob, const size_t len, int max_lines)
 {
 	size_t count = 0;
 	unsigned line_offset = 0;
@@ -74,37 +100,42 @@ void print_blob(const char *blob, const size_t len, int max_lines)
 				else
 					max_lines--;
 			}
-			printf("0x%08x: ", line_offset);
+			fprintf(f, "0x%08x: ", line_offset);
 			for (size_t c = 0; c < LEN(line); ++c) {
-				printf("%2.2hhx ", line[c]);
+				fprintf(f, "%2.2hhx ", line[c]);
 			}
 			for (size_t c = 0; c < LEN(line); ++c) {
 				if (isalnum(line[c]) || ispunct(line[c])) {
-					printf("%c", line[c]);
+					fputc(line[c], f);
 				} else {
-					printf(".");
+					fputc('.', f);
 				}
 			}
-			printf("\n");
+			fputc('\n', f);
 			line_offset += LEN(line);
 			count = 0;
 
 		}
 	}
 	if (count > 0) {
-		printf("0x%08x: ", line_offset);
+		fprintf(f, "0x%08x: ", line_offset);
 		for (size_t c = 0; c < count; ++c) {
-			printf("%2.2hhx ", line[c]);
+			fprintf(f, "%2.2hhx ", line[c]);
 		}
 		for (size_t c = 0; c < count; ++c) {
 			if (isalnum(line[c]) || ispunct(line[c])) {
-				printf("%c", line[c]);
+				fputc(line[c], f);
 			} else {
-				printf(".");
+				fputc('.', f);
 			}
 		}
 	}
-	printf("\n");
+	fputc('\n', f);
+}
+
+void print_blob(const char *blob, const size_t len, int max_lines)
+{
+	fprint_blob(stdout, blob, len, max_lines);
 }
 
 
@@ -137,7 +168,7 @@ int print_var_to(char *buf, size_t *buf_len, const size_t buf_cap,
 	va_end(args);
 
 	if (result < 0) {
-		fprintf(stderr, "Failed to pack variable.\n");
+		LOG_ERROR("Failed to pack variable.");
 		return ENOBUFS;
 	}
 	result = 0;
@@ -146,13 +177,12 @@ int print_var_to(char *buf, size_t *buf_len, const size_t buf_cap,
 	var_len = strlen(var_str);
 	buf_space = buf_cap - *buf_len;
 	if (var_len > buf_space) {
-		fprintf(stderr, "Need %lu more bytes in buffer.\n",
-			var_len - buf_space);
+		LOG_ERROR("Need %zu more bytes in buffer.", var_len - buf_space);
 		return ENOBUFS;
 	}
 
 	/* Move the rest of the buffer down and insert the variable. */
-	printf("var_len: %lu var_name_len: %lu *buf_len: %lu.\n", var_len,
+	LOG_DEBUG("var_len: %zu var_name_len: %zu *buf_len: %zu.", var_len,
 		var_name_len, *buf_len);
 	memmove(buf, buf - var_len + var_name_len, *buf_len + var_len);
 	*buf_len += var_len - var_name_len;
@@ -8,6 +8,10 @@
 #define UTILS_H
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "log.h"
 
 #if LINUX
 #include <linux/limits.h>
@@ -29,13 +33,28 @@
 #define LEN(p) (sizeof(p) / sizeof(p[0]))
 #define STRMAX(p) (LEN(p) - 1)
 
-void debug(const char *format, ...);
+// Debug messages go through the logger, release builds compile them out.
+#define DEBUG(...) LOG_DEBUG(__VA_ARGS__)
 
-#ifdef NDEBUG
-#define DEBUG(...) __noop()
-#else
-#define DEBUG(...) debug(__VA_ARGS__)
-#endif
+/*
+ * Returns the monotonic time in nanoseconds, for timing things.
+ */
+uint64_t monotonic_ns(void);
+
+/*
+ * Returns the wall clock time in nanoseconds since the epoch, for timestamps.
+ */
+uint64_t realtime_ns(void);
+
+/*
+ * Open a file for reading. The time it takes is added to the current
+ * request's file phase and the file__open probe fires.
+ *
+ * path - The path to the file to open.
+ *
+ * Returns the opened file, or NULL with errno set if it couldn't be opened.
+ */
+FILE *open_file(const char *path);
 
 /*
  * Load the contents of a file into a buffer.
@@ -58,6 +77,11 @@ int load_file(const char *file_name, char *buffer, const size_t buf_len,
  */
 void print_blob(const char *blob, const size_t len, int max_lines);
 
+/*
+ * Like print_blob, but print to f instead of stdout.
+ */
+void fprint_blob(FILE *f, const char *blob, const size_t len, int max_lines);
+
 /*
  * Print the value of a variable to the buffer.
  *
@@ -0,0 +1,635 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * Defines WebSocket connections.
+ *
+ * The connections are a small table searched by fd; there are never more than
+ * WEBSOCKET_MAX, and they're only looked for when one has something to read.
+ * Neither reads nor writes wait, so a client that sends half a frame or
+ * doesn't read its replies can't hold up the server. A frame is sent straight
+ * away while nothing is queued, and only what the socket didn't take is
+ * copied to the queue.
+ */
+#define _POSIX_C_SOURCE 200809L
+
+#include "websocket.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "log.h"
+#include "utils.h"
+
+// Appended to the client's key to make the one the server answers with.
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+// The length of a key, 16 bytes in base64.
+#define WEBSOCKET_KEY_LEN 24
+// The length of the answer, a SHA-1 in base64.
+#define WEBSOCKET_ACCEPT_LEN 28
+
+enum opcode {
+	OPCODE_CONTINUATION = 0x0,
+	OPCODE_TEXT = 0x1,
+	OPCODE_BINARY = 0x2,
+	OPCODE_CLOSE = 0x8,
+	OPCODE_PING = 0x9,
+	OPCODE_PONG = 0xa
+};
+
+// The status codes a connection is closed with.
+enum close_code {
+	CLOSE_NORMAL = 1000,
+	CLOSE_GOING_AWAY = 1001,
+	CLOSE_PROTOCOL_ERROR = 1002,
+	// Never sent: the connection is gone without a close frame.
+	CLOSE_ABNORMAL = 1006,
+	CLOSE_TOO_BIG = 1009,
+	CLOSE_INTERNAL_ERROR = 1011
+};
+
+/*
+ * A frame read from a client, unmasked.
+ */
+struct frame {
+	int fin;
+	uint8_t opcode;
+	char *payload;
+	size_t len;
+};
+
+static struct websocket *s_sockets[WEBSOCKET_MAX];
+static size_t s_socket_count = 0;
+
+static uint32_t rotate_left(uint32_t x, unsigned n)
+{
+	return (x << n) | (x >> (32 - n));
+}
+
+/*
+ * Hash one 64 byte block into state.
+ */
+static void sha1_block(uint32_t state[5], const unsigned char *block)
+{
+	uint32_t w[80];
+	for (size_t i = 0; i < 16; ++i) {
+		w[i] = ((uint32_t)block[i * 4] << 24) |
+			((uint32_t)block[i * 4 + 1] << 16) |
+			((uint32_t)block[i * 4 + 2] << 8) |
+			(uint32_t)block[i * 4 + 3];
+	}
+	for (size_t i = 16; i < 80; ++i) {
+		w[i] = rotate_left(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16],
+			1);
+	}
+	uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+	uint32_t e = state[4];
+	for (size_t i = 0; i < 80; ++i) {
+		uint32_t f, k;
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+		const uint32_t t = rotate_left(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = rotate_left(b, 30);
+		b = a;
+		a = t;
+	}
+	state[0] += a;
+	state[1] += b;
+	state[2] += c;
+	state[3] += d;
+	state[4] += e;
+}
+
+/*
+ * SHA-1, which is all the handshake needs it for. len is at most 119, so the
+ * message and its padding fit in two blocks.
+ */
+static void sha1(const char *data, size_t len, unsigned char digest[20])
+{
+	uint32_t state[5] = {
+		0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+	};
+	unsigned char blocks[128] = {0};
+	memcpy(blocks, data, len);
+	blocks[len] = 0x80;
+	const size_t total = (len + 9 <= 64) ? 64 : 128;
+	const uint64_t bits = (uint64_t)len * 8;
+	for (size_t i = 0; i < 8; ++i) {
+		blocks[total - 1 - i] = (unsigned char)(bits >> (i * 8));
+	}
+	for (size_t at = 0; at < total; at += 64) {
+		sha1_block(state, blocks + at);
+	}
+	for (size_t i = 0; i < 20; ++i) {
+		digest[i] = (unsigned char)(state[i / 4] >> (24 - (i % 4) * 8));
+	}
+}
+
+/*
+ * Encode len bytes as base64 into out, which has room for the result and a
+ * NUL.
+ */
+static void base64(const unsigned char *in, size_t len, char *out)
+{
+	static const char digits[] =
+		"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz"
+		"0123456789+/";
+	size_t at = 0;
+	for (size_t i = 0; i < len; i += 3) {
+		const uint32_t group = ((uint32_t)in[i] << 16) |
+			((i + 1 < len) ? (uint32_t)in[i + 1] << 8 : 0) |
+			((i + 2 < len) ? (uint32_t)in[i + 2] : 0);
+		out[at++] = digits[(group >> 18) & 0x3f];
+		out[at++] = digits[(group >> 12) & 0x3f];
+		out[at++] = (i + 1 < len) ? digits[(group >> 6) & 0x3f] : '=';
+		out[at++] = (i + 2 < len) ? digits[group & 0x3f] : '=';
+	}
+	out[at] = '\0';
+}
+
+/*
+ * Returns the value of a header, matching its whole name without regard to
+ * case, or NULL if the request doesn't have it.
+ */
+static const struct str *find_header(const struct request *r,
+	const char *name)
+{
+	const size_t len = strlen(name);
+	for (long i = 0; i < r->header_count; ++i) {
+		const struct str *key = &r->headers[i].key;
+		if (((size_t)key->len == len) &&
+			(strncasecmp(key->s, name, len) == 0))
+		{
+			return &r->headers[i].value;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Returns nonzero if a header is a list with token in it, in any case.
+ */
+static int header_has_token(const struct request *r, const char *name,
+	const char *token)
+{
+	const struct str *value = find_header(r, name);
+	if (!value) return 0;
+	const long len = (long)strlen(token);
+	long at = 0;
+	while (at < value->len) {
+		while ((at < value->len) && ((value->s[at] == ' ') ||
+			(value->s[at] == '\t') || (value->s[at] == ',')))
+		{
+			++at;
+		}
+		long end = at;
+		while ((end < value->len) && (value->s[end] != ',')) ++end;
+		long token_end = end;
+		while ((token_end > at) && ((value->s[token_end - 1] == ' ') ||
+			(value->s[token_end - 1] == '\t')))
+		{
+			--token_end;
+		}
+		if ((token_end - at == len) &&
+			(strncasecmp(value->s + at, token, (size_t)len) == 0))
+		{
+			return 1;
+		}
+		at = end;
+	}
+	return 0;
+}
+
+int websocket_is_upgrade(const struct request *r)
+{
+	return r && header_has_token(r, "Upgrade", "websocket");
+}
+
+/*
+ * Returns the connection for an fd, or NULL if it isn't one.
+ */
+static struct websocket *find_socket(int fd)
+{
+	for (size_t i = 0; i < s_socket_count; ++i) {
+		if (s_sockets[i]->fd == fd) return s_sockets[i];
+	}
+	return NULL;
+}
+
+int websocket_owns(int client)
+{
+	return find_socket(client) != NULL;
+}
+
+/*
+ * Send what's queued for a connection, until the client isn't ready for more.
+ *
+ * Returns 0 if it was all sent or the rest has to wait. Otherwise returns an
+ * error code.
+ */
+static int flush_queue(struct websocket *ws)
+{
+	while (ws->out_sent < ws->out_len) {
+		const ssize_t sent = send(ws->fd, ws->out + ws->out_sent,
+			ws->out_len - ws->out_sent, MSG_DONTWAIT);
+		if (sent == -1) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				return 0;
+			}
+			return errno;
+		}
+		ws->out_sent += (size_t)sent;
+	}
+	ws->out_sent = 0;
+	ws->out_len = 0;
+	return 0;
+}
+
+/*
+ * Queue bytes to send after what's already queued.
+ *
+ * Returns 0 if they were queued. Otherwise returns ENOBUFS, there isn't room.
+ */
+static int queue_bytes(struct websocket *ws, const void *data, size_t len)
+{
+	if (ws->out_sent) {
+		memmove(ws->out, ws->out + ws->out_sent,
+			ws->out_len - ws->out_sent);
+		ws->out_len -= ws->out_sent;
+		ws->out_sent = 0;
+	}
+	if (len > sizeof(ws->out) - ws->out_len) return ENOBUFS;
+	memcpy(ws->out + ws->out_len, data, len);
+	ws->out_len += len;
+	return 0;
+}
+
+/*
+ * Send a frame without waiting, queueing what the client isn't ready for.
+ */
+static int send_frame(struct websocket *ws, uint8_t opcode,
+	const char *payload, size_t len)
+{
+	unsigned char header[10];
+	size_t header_len = 2;
+	header[0] = (unsigned char)(0x80 | opcode);
+	if (len < 126) {
+		header[1] = (unsigned char)len;
+	} else if (len <= UINT16_MAX) {
+		header[1] = 126;
+		header[2] = (unsigned char)(len >> 8);
+		header[3] = (unsigned char)len;
+		header_len = 4;
+	} else {
+		header[1] = 127;
+		for (size_t i = 0; i < 8; ++i) {
+			header[9 - i] = (unsigned char)((uint64_t)len >>
+				(i * 8));
+		}
+		header_len = 10;
+	}
+
+	// Anything already queued has to go first.
+	size_t sent = 0;
+	while (ws->out_len == 0) {
+		struct iovec iov[2] = {
+			{header, header_len},
+			{(char*)payload, len}
+		};
+		struct msghdr msg = {0};
+		msg.msg_iov = iov;
+		msg.msg_iovlen = 2;
+		const ssize_t n = sendmsg(ws->fd, &msg, MSG_DONTWAIT);
+		if (n == -1) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) break;
+			return errno;
+		}
+		sent = (size_t)n;
+		break;
+	}
+	if (sent == header_len + len) return 0;
+
+	int err = 0;
+	if (sent < header_len) {
+		err = queue_bytes(ws, header + sent, header_len - sent);
+		sent = header_len;
+	}
+	if (!err) {
+		err = queue_bytes(ws, payload + (sent - header_len),
+			len - (sent - header_len));
+	}
+	if (err == ENOBUFS) {
+		LOG_WARN("WebSocket %d isn't reading its replies.", ws->fd);
+	}
+	return err;
+}
+
+int websocket_send(struct websocket *ws, const char *text, size_t len)
+{
+	if (!ws || (!text && len)) return EINVAL;
+	return send_frame(ws, OPCODE_TEXT, text, len);
+}
+
+/*
+ * Close a connection, telling the client why unless it's already gone, and
+ * forget it.
+ */
+static void close_socket(struct websocket *ws, unsigned code)
+{
+	if (code != CLOSE_ABNORMAL) {
+		const char payload[2] = {(char)(code >> 8), (char)code};
+		(void)send_frame(ws, OPCODE_CLOSE, payload, sizeof(payload));
+	}
+	for (size_t i = 0; i < s_socket_count; ++i) {
+		if (s_sockets[i] == ws) {
+			s_sockets[i] = s_sockets[--s_socket_count];
+			break;
+		}
+	}
+	LOG_DEBUG("Closed WebSocket %d (%u).", ws->fd, code);
+	close(ws->fd);
+	free(ws);
+}
+
+int websocket_accept(int client, const struct request *r,
+	const char *headers, websocket_handler handler, const void *context,
+	size_t context_len)
+{
+	static const struct str http_1_1 = STR("HTTP/1.1");
+	if (!r || !handler || (context_len > WEBSOCKET_CONTEXT_MAX)) {
+		return EINVAL;
+	}
+	const struct str *key = find_header(r, "Sec-WebSocket-Key");
+	const struct str *version = find_header(r, "Sec-WebSocket-Version");
+	if ((r->type != GET) || (str_cmp(&r->format, &http_1_1) != 0) ||
+		!websocket_is_upgrade(r) ||
+		!header_has_token(r, "Connection", "upgrade") || !key ||
+		(key->len != WEBSOCKET_KEY_LEN))
+	{
+		LOG_WARN("Not a WebSocket upgrade this server speaks.");
+		return send_data(client, "HTTP/1.1 400 Bad Request", "", 0);
+	}
+	if (!version || (version->len != 2) ||
+		(memcmp(version->s, "13", 2) != 0))
+	{
+		return send_data(client, "HTTP/1.1 426 Upgrade Required\r\n"
+			"Sec-WebSocket-Version: 13", "", 0);
+	}
+	if (s_socket_count >= WEBSOCKET_MAX) {
+		LOG_WARN("Too many WebSockets to take another.");
+		return send_data(client, "HTTP/1.1 503 Service Unavailable",
+			"", 0);
+	}
+
+	char keyed[WEBSOCKET_KEY_LEN + sizeof(WEBSOCKET_GUID)];
+	memcpy(keyed, key->s, WEBSOCKET_KEY_LEN);
+	memcpy(keyed + WEBSOCKET_KEY_LEN, WEBSOCKET_GUID,
+		sizeof(WEBSOCKET_GUID));
+	unsigned char digest[20];
+	sha1(keyed, STRMAX(keyed), digest);
+	char accept[WEBSOCKET_ACCEPT_LEN + 1];
+	base64(digest, sizeof(digest), accept);
+
+	struct websocket *ws = calloc(1, sizeof(*ws));
+	if (!ws) return ENOMEM;
+	char lines[512];
+	const int len = snprintf(lines, sizeof(lines), "Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\nSec-WebSocket-Accept: %s%s", accept,
+		headers ? headers : "");
+	int err = ((len < 0) || ((size_t)len >= sizeof(lines))) ? ENOBUFS : 0;
+	if (!err) err = send_switching_protocols(client, lines);
+	if (err) {
+		free(ws);
+		return err;
+	}
+	ws->fd = client;
+	ws->handler = handler;
+	ws->last_used = time(NULL);
+	if (context_len) memcpy(ws->context, context, context_len);
+	s_sockets[s_socket_count++] = ws;
+	LOG_DEBUG("Opened WebSocket %d.", client);
+	return 0;
+}
+
+size_t websocket_poll_fds(struct pollfd *fds, size_t cap)
+{
+	size_t count = 0;
+	for (; (count < s_socket_count) && (count < cap); ++count) {
+		const struct websocket *ws = s_sockets[count];
+		const short events = (short)(POLLIN | (ws->out_len ? POLLOUT :
+			0));
+		fds[count] = (struct pollfd){ws->fd, events, 0};
+	}
+	return count;
+}
+
+/*
+ * XOR the payload with the frame's mask. A plain loop, which the compiler
+ * turns into wide XORs.
+ */
+static void unmask(char *payload, size_t len, const char mask[4])
+{
+	for (size_t i = 0; i < len; ++i) payload[i] ^= mask[i & 3];
+}
+
+/*
+ * Parse the frame at the start of buf and unmask its payload in place.
+ *
+ * buf - What has been read of the frame, and maybe more after it.
+ * len - The bytes in buf.
+ * f - Set to the frame.
+ * frame_len - Set to the bytes the whole frame takes.
+ *
+ * Returns 0 if f is set. Otherwise returns EAGAIN if the whole frame hasn't
+ * arrived, EMSGSIZE if it's too big to take, or EPROTO if it isn't allowed.
+ */
+static int parse_frame(char *buf, size_t len, struct frame *f,
+	size_t *frame_len)
+{
+	if (len < 2) return EAGAIN;
+	const unsigned char *bytes = (const unsigned char*)buf;
+	// Nothing's been agreed that would use the reserved bits, and
+	// everything a client sends must be masked.
+	if ((bytes[0] & 0x70) || !(bytes[1] & 0x80)) return EPROTO;
+	f->fin = (bytes[0] & 0x80) != 0;
+	f->opcode = bytes[0] & 0x0f;
+	uint64_t payload_len = bytes[1] & 0x7f;
+	size_t at = 2;
+	if (payload_len == 126) {
+		if (len < 4) return EAGAIN;
+		payload_len = ((uint64_t)bytes[2] << 8) | bytes[3];
+		at = 4;
+	} else if (payload_len == 127) {
+		if (len < 10) return EAGAIN;
+		payload_len = 0;
+		for (size_t i = 2; i < 10; ++i) {
+			payload_len = (payload_len << 8) | bytes[i];
+		}
+		at = 10;
+	}
+	if (f->opcode & 0x8) {
+		// Control frames are short and never in pieces.
+		if (!f->fin || (payload_len > 125)) return EPROTO;
+		if ((f->opcode != OPCODE_CLOSE) && (f->opcode != OPCODE_PING) &&
+			(f->opcode != OPCODE_PONG))
+		{
+			return EPROTO;
+		}
+	} else if (f->opcode > OPCODE_BINARY) {
+		return EPROTO;
+	}
+	if (payload_len > WEBSOCKET_MESSAGE_MAX) return EMSGSIZE;
+	if (len < at + 4 + payload_len) return EAGAIN;
+	f->payload = buf + at + 4;
+	f->len = (size_t)payload_len;
+	unmask(f->payload, f->len, buf + at);
+	*frame_len = at + 4 + f->len;
+	return 0;
+}
+
+/*
+ * Answer a control frame. Returns 0 to keep the connection open, or the code
+ * to close it with.
+ */
+static unsigned control_frame(struct websocket *ws, const struct frame *f)
+{
+	if (f->opcode == OPCODE_PING) {
+		const int err = send_frame(ws, OPCODE_PONG, f->payload,
+			f->len);
+		return err ? CLOSE_INTERNAL_ERROR : 0;
+	}
+	// The client is closing; answering finishes the close handshake.
+	if (f->opcode == OPCODE_CLOSE) return CLOSE_NORMAL;
+	return 0;
+}
+
+/*
+ * Handle every whole frame in the connection's buffer, leaving the pieces of
+ * a message not yet whole and any frame not yet all read. Returns 0 to keep
+ * the connection open, or the code to close it with.
+ */
+static unsigned handle_frames(struct websocket *ws)
+{
+	size_t at = ws->message_len;
+	for (;;) {
+		struct frame f;
+		size_t frame_len = 0;
+		const int err = parse_frame(ws->buf + at, ws->len - at, &f,
+			&frame_len);
+		if (err == EAGAIN) break;
+		if (err) {
+			LOG_WARN("Bad frame from WebSocket %d: %i", ws->fd,
+				err);
+			return (err == EMSGSIZE) ? CLOSE_TOO_BIG :
+				CLOSE_PROTOCOL_ERROR;
+		}
+		at += frame_len;
+		if (f.opcode & 0x8) {
+			const unsigned code = control_frame(ws, &f);
+			if (code) return code;
+			continue;
+		}
+		// A continuation only follows a piece, and a new message only
+		// a whole one.
+		if ((f.opcode == OPCODE_CONTINUATION) != (ws->opcode != 0)) {
+			return CLOSE_PROTOCOL_ERROR;
+		}
+		if (ws->message_len + f.len > WEBSOCKET_MESSAGE_MAX) {
+			return CLOSE_TOO_BIG;
+		}
+		if (!ws->opcode) ws->opcode = f.opcode;
+		// Put the pieces together at the start of the buffer. The
+		// payload is always at or after where it goes.
+		memmove(ws->buf + ws->message_len, f.payload, f.len);
+		ws->message_len += f.len;
+		if (!f.fin) continue;
+		struct str message = {ws->buf, (long)ws->message_len};
+		ws->message_len = 0;
+		ws->opcode = 0;
+		if (ws->handler(ws, &message) != 0) return CLOSE_INTERNAL_ERROR;
+	}
+	// Keep what's left after the message's pieces.
+	memmove(ws->buf + ws->message_len, ws->buf + at, ws->len - at);
+	ws->len = ws->message_len + (ws->len - at);
+	return 0;
+}
+
+/*
+ * Read what the client has sent and handle it. Returns 0 to keep the
+ * connection open, or the code to close it with.
+ */
+static unsigned read_socket(struct websocket *ws)
+{
+	for (;;) {
+		if (ws->len == sizeof(ws->buf)) return CLOSE_TOO_BIG;
+		const ssize_t got = recv(ws->fd, ws->buf + ws->len,
+			sizeof(ws->buf) - ws->len, MSG_DONTWAIT);
+		if (got == -1) {
+			if (errno == EINTR) continue;
+			if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+				return 0;
+			}
+			LOG_WARN("Failed to read WebSocket %d: %i", ws->fd,
+				errno);
+			return CLOSE_ABNORMAL;
+		}
+		// Hung up without closing.
+		if (got == 0) return CLOSE_ABNORMAL;
+		ws->len += (size_t)got;
+		const unsigned code = handle_frames(ws);
+		if (code) return code;
+	}
+}
+
+void websocket_serve(const struct pollfd *fds, size_t count, time_t now)
+{
+	for (size_t i = 0; i < count; ++i) {
+		if (!fds[i].revents) continue;
+		struct websocket *ws = find_socket(fds[i].fd);
+		if (!ws) continue;
+		if (fds[i].revents & POLLOUT) {
+			const int err = flush_queue(ws);
+			if (err) {
+				LOG_WARN("Failed to write WebSocket %d: %i",
+					ws->fd, err);
+				close_socket(ws, CLOSE_ABNORMAL);
+				continue;
+			}
+		}
+		if (!(fds[i].revents & ~POLLOUT)) continue;
+		ws->last_used = now;
+		const unsigned code = read_socket(ws);
+		if (code) close_socket(ws, code);
+	}
+	for (size_t i = s_socket_count; i-- > 0;) {
+		if (now - s_sockets[i]->last_used >= WEBSOCKET_IDLE_S) {
+			close_socket(s_sockets[i], CLOSE_GOING_AWAY);
+		}
+	}
+}
+
+void websocket_close_all(void)
+{
+	while (s_socket_count) {
+		close_socket(s_sockets[s_socket_count - 1], CLOSE_GOING_AWAY);
+	}
+}
@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2023 Joseph M Vrba
+ *
+ * This file declares WebSocket connections (RFC 6455), which let an
+ * application and its page trade small messages over one connection that
+ * stays open, instead of a request and a whole page for each.
+ *
+ * A request asking to upgrade is answered by websocket_accept, which takes
+ * the connection over. The server polls the connections between requests
+ * with websocket_poll_fds and websocket_serve. Each frame is read into its
+ * connection's buffer and unmasked where it is, and the frames of a message
+ * sent in pieces are moved together there, so a message is handed to the
+ * application without being copied.
+ *
+ * Replies are sent without waiting. What a client isn't ready for is queued
+ * in its connection and sent as it reads, so one that stops reading can't
+ * hold up the server.
+ *
+ * Only messages up to WEBSOCKET_MESSAGE_MAX bytes are taken. A client that
+ * sends a bigger one, breaks the protocol, goes quiet for WEBSOCKET_IDLE_S
+ * or leaves WEBSOCKET_QUEUE_MAX bytes of replies unread is disconnected.
+ */
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <poll.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "http.h"
+#include "str.h"
+#include "utils.h"
+
+// The most connections open at once.
+#define WEBSOCKET_MAX 64
+// The longest message taken from a client.
+#define WEBSOCKET_MESSAGE_MAX (4 * KIBIBYTE)
+// Connections that don't send anything for this long are closed.
+#define WEBSOCKET_IDLE_S (30 * 60)
+// The most bytes of replies queued for a client that isn't reading them.
+#define WEBSOCKET_QUEUE_MAX (64 * KIBIBYTE)
+// The room the application has for its own state in each connection.
+#define WEBSOCKET_CONTEXT_MAX 64
+
+struct websocket;
+
+/*
+ * Handles a message from a client.
+ *
+ * ws - The connection the message came on. Replies go with websocket_send.
+ * message - The message, which the handler may change in place. It's only
+ *           valid until the handler returns.
+ *
+ * Returns 0 to keep the connection open. Otherwise returns an error code, and
+ * the connection is closed.
+ */
+typedef int (*websocket_handler)(struct websocket *ws, struct str *message);
+
+/*
+ * A connection.
+ */
+struct websocket {
+	int fd;
+	websocket_handler handler;
+	// When the client last sent anything.
+	time_t last_used;
+	// The opcode of the message whose pieces are being put together, or
+	// 0 if there isn't one.
+	uint8_t opcode;
+	// The pieces of the message put together so far, at the start of buf.
+	size_t message_len;
+	// The bytes in buf, the message's pieces and any frames after them.
+	size_t len;
+	// The frames the client wasn't ready for, from out + out_sent to
+	// out + out_len.
+	size_t out_sent;
+	size_t out_len;
+	// Set by websocket_accept. The application's to use.
+	char context[WEBSOCKET_CONTEXT_MAX];
+	// Room for the longest message, and the header of the frame it's in.
+	char buf[WEBSOCKET_MESSAGE_MAX + 14];
+	char out[WEBSOCKET_QUEUE_MAX];
+};
+
+/*
+ * Returns nonzero if the request asks to upgrade to a WebSocket.
+ */
+int websocket_is_upgrade(const struct request *r);
+
+/*
+ * Answer a request to upgrade and take the connection over. The client is
+ * sent 400 Bad Request if the request isn't a WebSocket upgrade this server
+ * speaks, or 503 Service Unavailable if WEBSOCKET_MAX are already open.
+ *
+ * client - The client asking.
+ * r - The request.
+ * headers - Any more header lines to answer with, each starting with "\r\n",
+ *           or NULL.
+ * handler - Handles the client's messages.
+ * context - Copied to the connection's context.
+ * context_len - The bytes in context, up to WEBSOCKET_CONTEXT_MAX.
+ *
+ * Returns 0 if the connection was taken over. The server mustn't close it;
+ * it's closed when the WebSocket is. Otherwise returns an error code.
+ */
+int websocket_accept(int client, const struct request *r,
+	const char *headers, websocket_handler handler, const void *context,
+	size_t context_len);
+
+/*
+ * Returns nonzero if client was taken over by websocket_accept.
+ */
+int websocket_owns(int client);
+
+/*
+ * Send a text message in a single frame, queueing what the client isn't
+ * ready for.
+ *
+ * Returns 0 if it was sent or queued. Otherwise returns an error code;
+ * ENOBUFS if the queue is full.
+ */
+int websocket_send(struct websocket *ws, const char *text, size_t len);
+
+/*
+ * Fill in the connections to poll for.
+ *
+ * fds - Set to the connections, each polled for POLLIN, and POLLOUT while
+ *       it has frames queued.
+ * cap - The room in fds.
+ *
+ * Returns the number of entries set.
+ */
+size_t websocket_poll_fds(struct pollfd *fds, size_t cap);
+
+/*
+ * Send what's queued for the connections polled that can take it, read and
+ * handle what has arrived on them, and close those that have been idle too
+ * long.
+ *
+ * fds - What websocket_poll_fds set, after poll.
+ * count - The number of entries in fds.
+ * now - The current time.
+ */
+void websocket_serve(const struct pollfd *fds, size_t count, time_t now);
+
+/*
+ * Close every connection, telling the clients the server is going away.
+ */
+void websocket_close_all(void);
+
+#endif // WEBSOCKET_H
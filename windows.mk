@@ -4,6 +4,10 @@ CXXFLAGS=/Od /Zi /W3 /WX
 CFLAGS=/Od /Zi /W3 /WX
 LDFLAGS=
 LDLIBS=
+MODEXT=.dll
+MODULE_CFLAGS=
+MODULE_LDFLAGS=/LD
+EXPORT_LDFLAGS=
 RM=del
 
 .exe.c: